@@ -5,22 +5,83 @@
 #include "bottom_up_parser.h"
 
 #include <iostream>
-#include <map>
+#include <algorithm>
+#include <limits>
+#include <stdint.h>
 
 #include "hg.h"
 #include "array2d.h"
 #include "tdict.h"
+#include "filelib.h"
 #include "verbose.h"
 
 using namespace std;
 
+// The node of each category over each span of the chart, in a single open
+// addressing hash table with linear probing.
+class SpanCatNodeMap {
+ public:
+  explicit SpanCatNodeMap(int width) : width_(width), size_(0) { Resize(64); }
+
+  // the node of category cat spanning i,j, or -1
+  int Find(int i, int j, WordID cat) const {
+    const uint64_t key = Key(i, j, cat);
+    for (size_t b = Bucket(key); ; b = (b + 1) & mask_) {
+      if (keys_[b] == key) return nodes_[b];
+      if (keys_[b] == kEMPTY) return -1;
+    }
+  }
+
+  void Insert(int i, int j, WordID cat, int node) {
+    if (2 * (size_ + 1) > keys_.size()) Resize(2 * keys_.size());
+    Put(Key(i, j, cat), node);
+    ++size_;
+  }
+
+ private:
+  static const uint64_t kEMPTY = ~static_cast<uint64_t>(0);
+
+  uint64_t Key(int i, int j, WordID cat) const {
+    return (static_cast<uint64_t>(i * width_ + j) << 32) | static_cast<uint32_t>(cat);
+  }
+  size_t Bucket(uint64_t key) const {
+    return static_cast<size_t>((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask_;
+  }
+  void Put(uint64_t key, int node) {
+    size_t b = Bucket(key);
+    while (keys_[b] != kEMPTY) b = (b + 1) & mask_;
+    keys_[b] = key;
+    nodes_[b] = node;
+  }
+  void Resize(size_t buckets) {
+    vector<uint64_t> keys(buckets, kEMPTY);
+    vector<int> nodes(buckets);
+    keys.swap(keys_);
+    nodes.swap(nodes_);
+    mask_ = buckets - 1;
+    for (int b = 0; b < keys.size(); ++b)
+      if (keys[b] != kEMPTY) Put(keys[b], nodes[b]);
+  }
+
+  const int width_;
+  size_t size_;
+  size_t mask_;
+  vector<uint64_t> keys_;
+  vector<int> nodes_;
+};
+
+const uint64_t SpanCatNodeMap::kEMPTY;
+
 class ActiveChart;
 class PassiveChart {
  public:
+  // weights and pruning are NULL for an exhaustive parse
   PassiveChart(const string& goal,
                const vector<GrammarPtr>& grammars,
                const Lattice& input,
-               Hypergraph* forest);
+               Hypergraph* forest,
+               const vector<double>* weights = NULL,
+               const CellPruning* pruning = NULL);
   ~PassiveChart();
 
   inline const vector<int>& operator()(int i, int j) const { return chart_(i,j); }
@@ -44,23 +105,54 @@ class PassiveChart {
 
   void ApplyUnaryRules(const int i, const int j);
 
+  // when pruning, rules found for a cell are collected as candidates and
+  // only the best ones become edges
+  struct Candidate {
+    Candidate(const TRulePtr& r, const Hypergraph::TailNodeVector& t, float lc, double s) :
+      rule(r), tail(t), lattice_cost(lc), score(s) {}
+    TRulePtr rule;
+    Hypergraph::TailNodeVector tail;
+    float lattice_cost;
+    double score;
+  };
+  struct CandidateBetter {
+    bool operator()(const Candidate* a, const Candidate* b) const {
+      return a->rule->GetLHS() < b->rule->GetLHS() ||
+          (a->rule->GetLHS() == b->rule->GetLHS() && a->score > b->score);
+    }
+  };
+
+  double EdgeScore(const TRulePtr& r,
+                   const Hypergraph::TailNodeVector& ant_nodes,
+                   const float lattice_cost) const;
+  void ApplyBestCandidates(const int i, const int j);
+
   const vector<GrammarPtr>& grammars_;
   const Lattice& input_;
   Hypergraph* forest_;
   Array2D<vector<int> > chart_;   // chart_(i,j) is the list of nodes derived spanning i,j
-  typedef map<int, int> Cat2NodeMap;
-  Array2D<Cat2NodeMap> nodemap_;
+  SpanCatNodeMap nodemap_;
   vector<ActiveChart*> act_chart_;
   const WordID goal_cat_;    // category that is being searched for at [0,n]
   TRulePtr goal_rule_;
   int goal_idx_;             // index of goal node, if found
   const int lc_fid_;
 
-  static WordID kGOAL;       // [Goal]
-};
+  const vector<double>* weights_;
+  const CellPruning* pruning_;
+  vector<double> node_scores_;  // best inside score of each node (pruning only)
+  vector<Candidate> candidates_;
+  Array2D<bool> closed_;        // closed_(i,j) if no constituent may span i,j
 
-WordID PassiveChart::kGOAL = 0;
+  const WordID kGOAL;        // [Goal]
+};
 
+// Active items are small PODs in a flat vector per cell.  Instead of a copy
+// of its antecedents, an item refers to the last link of a chain in tails_,
+// so items extended from the same item share their tail prefix; the tail is
+// only built when rules are applied.  Once a cell is complete, its items are
+// grouped by grammar state, so that each GrammarIter is extended once per
+// symbol for all items of the group.
 class ActiveChart {
  public:
   ActiveChart(const Hypergraph* hg, const PassiveChart& psv_chart) :
@@ -68,50 +160,48 @@ class ActiveChart {
     act_chart_(psv_chart.size(), psv_chart.size()), psv_chart_(psv_chart) {}
 
   struct ActiveItem {
-    ActiveItem(const GrammarIter* g, const Hypergraph::TailNodeVector& a, float lcost) :
-      gptr_(g), ant_nodes_(a), lattice_cost(lcost) {}
-    explicit ActiveItem(const GrammarIter* g) :
-      gptr_(g), ant_nodes_(), lattice_cost(0.0) {}
-
-    void ExtendTerminal(int symbol, float src_cost, vector<ActiveItem>* out_cell) const {
-      const GrammarIter* ni = gptr_->Extend(symbol);
-      if (ni) {
-        out_cell->push_back(ActiveItem(ni, ant_nodes_, lattice_cost + src_cost));
-      }
-    }
-    void ExtendNonTerminal(const Hypergraph* hg, int node_index, vector<ActiveItem>* out_cell) const {
-      int symbol = hg->nodes_[node_index].cat_;
-      const GrammarIter* ni = gptr_->Extend(symbol);
-      if (!ni) return;
-      Hypergraph::TailNodeVector na(ant_nodes_.size() + 1);
-      for (int i = 0; i < ant_nodes_.size(); ++i)
-        na[i] = ant_nodes_[i];
-      na[ant_nodes_.size()] = node_index;
-      out_cell->push_back(ActiveItem(ni, na, lattice_cost));
-    }
-
+    ActiveItem(const GrammarIter* g, int t, float lcost) :
+      gptr_(g), tail_(t), lattice_cost(lcost) {}
     const GrammarIter* gptr_;
-    Hypergraph::TailNodeVector ant_nodes_;
+    int tail_;           // last link of the antecedents in tails_, -1 if none
     float lattice_cost;  // TODO? use SparseVector<double>
   };
 
   inline const vector<ActiveItem>& operator()(int i, int j) const { return act_chart_(i,j); }
+
+  void GetTail(const ActiveItem& item, Hypergraph::TailNodeVector* tail) const {
+    int n = 0;
+    for (int t = item.tail_; t >= 0; t = tails_[t].prev) ++n;
+    tail->resize(n);
+    for (int t = item.tail_; t >= 0; t = tails_[t].prev)
+      (*tail)[--n] = tails_[t].node;
+  }
+
   void SeedActiveChart(const Grammar& g) {
     int size = act_chart_.width();
     for (int i = 0; i < size; ++i)
       if (g.HasRuleForSpan(i,i,0))
-        act_chart_(i,i).push_back(ActiveItem(g.GetRoot()));
+        act_chart_(i,i).push_back(ActiveItem(g.GetRoot(), -1, 0.0));
   }
 
   void ExtendActiveItems(int i, int k, int j) {
     //cerr << "  LOOK(" << i << "," << k << ") for completed items in (" << k << "," << j << ")\n";
+    const vector<int>& idxs = psv_chart_(k, j);
+    if (idxs.empty()) return;
     vector<ActiveItem>& cell = act_chart_(i,j);
     const vector<ActiveItem>& icell = act_chart_(i,k);
-    const vector<int>& idxs = psv_chart_(k, j);
-    //if (!idxs.empty()) { cerr << "FOUND IN (" << k << "," << j << ")\n"; }
-    for (vector<ActiveItem>::const_iterator di = icell.begin(); di != icell.end(); ++di) {
+    for (int b = 0, e = 0; b < icell.size(); b = e) {
+      const GrammarIter* g = icell[b].gptr_;
+      for (e = b + 1; e < icell.size() && icell[e].gptr_ == g; ++e);
+      // a cell holds one node per category
       for (vector<int>::const_iterator ni = idxs.begin(); ni != idxs.end(); ++ni) {
-         di->ExtendNonTerminal(hg_, *ni, &cell);
+        const GrammarIter* next = g->Extend(hg_->nodes_[*ni].cat_);
+        if (!next) continue;
+        for (int a = b; a < e; ++a) {
+          const TailLink link = { *ni, icell[a].tail_ };
+          tails_.push_back(link);
+          cell.push_back(ActiveItem(next, tails_.size() - 1, icell[a].lattice_cost));
+        }
       }
     }
   }
@@ -122,41 +212,105 @@ class ActiveChart {
       ExtendActiveItems(i, k, j);
 
     const vector<LatticeArc>& out_arcs = input[j-1];
+    const vector<ActiveItem>& ec = act_chart_(i, j-1);
     for (vector<LatticeArc>::const_iterator ai = out_arcs.begin();
          ai != out_arcs.end(); ++ai) {
       const WordID& f = ai->label;
       const double& c = ai->cost;
       const int& len = ai->dist2next;
       //VLOG(1) << "F: " << TD::Convert(f) << endl;
-      const vector<ActiveItem>& ec = act_chart_(i, j-1);
-      for (vector<ActiveItem>::const_iterator di = ec.begin(); di != ec.end(); ++di)
-        di->ExtendTerminal(f, c, &act_chart_(i, j + len - 1));
+      vector<ActiveItem>& out_cell = act_chart_(i, j + len - 1);
+      for (int b = 0, e = 0; b < ec.size(); b = e) {
+        const GrammarIter* g = ec[b].gptr_;
+        for (e = b + 1; e < ec.size() && ec[e].gptr_ == g; ++e);
+        const GrammarIter* next = g->Extend(f);
+        if (!next) continue;
+        for (int a = b; a < e; ++a)
+          out_cell.push_back(ActiveItem(next, ec[a].tail_, ec[a].lattice_cost + c));
+      }
     }
   }
 
+  // called when no more items will be added to cell i,j: reorders its items
+  // so that those with the same grammar state are adjacent, keeping the
+  // order in which the states first occur
+  void CompleteCell(int i, int j) {
+    vector<ActiveItem>& cell = act_chart_(i,j);
+    if (cell.size() < 3) return;
+    // number the states with an open addressing table of state indices
+    size_t buckets = 16;
+    while (buckets < 2 * cell.size()) buckets *= 2;
+    const size_t mask = buckets - 1;
+    buckets_.assign(buckets, -1);
+    states_.clear();
+    starts_.clear();
+    ids_.resize(cell.size());
+    for (int a = 0; a < cell.size(); ++a) {
+      const GrammarIter* g = cell[a].gptr_;
+      size_t b = static_cast<size_t>(((reinterpret_cast<uintptr_t>(g) >> 3) * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+      while (buckets_[b] >= 0 && states_[buckets_[b]] != g) b = (b + 1) & mask;
+      if (buckets_[b] < 0) {
+        buckets_[b] = states_.size();
+        states_.push_back(g);
+        starts_.push_back(0);
+      }
+      ++starts_[buckets_[b]];
+      ids_[a] = buckets_[b];
+    }
+    if (states_.size() == cell.size()) return;
+    for (int g = 0, start = 0; g < starts_.size(); ++g) {
+      const int n = starts_[g];
+      starts_[g] = start;
+      start += n;
+    }
+    sorted_.resize(cell.size(), cell[0]);
+    for (int a = 0; a < cell.size(); ++a)
+      sorted_[starts_[ids_[a]]++] = cell[a];
+    cell.swap(sorted_);
+  }
+
  private:
+  struct TailLink {
+    int node;  // antecedent node
+    int prev;  // link of the preceding antecedent, -1 if none
+  };
+
   const Hypergraph* hg_;
   Array2D<vector<ActiveItem> > act_chart_;
   const PassiveChart& psv_chart_;
+  vector<TailLink> tails_;
+  // scratch space of CompleteCell
+  vector<int> buckets_;
+  vector<const GrammarIter*> states_;
+  vector<int> ids_;
+  vector<int> starts_;
+  vector<ActiveItem> sorted_;
 };
 
 PassiveChart::PassiveChart(const string& goal,
                            const vector<GrammarPtr>& grammars,
                            const Lattice& input,
-                           Hypergraph* forest) :
+                           Hypergraph* forest,
+                           const vector<double>* weights,
+                           const CellPruning* pruning) :
     grammars_(grammars),
     input_(input),
     forest_(forest),
     chart_(input.size()+1, input.size()+1),
-    nodemap_(input.size()+1, input.size()+1),
+    nodemap_(input.size()+1),
     goal_cat_(TD::Convert(goal) * -1),
     goal_rule_(new TRule("[Goal] ||| [" + goal + ",1] ||| [" + goal + ",1]")),
     goal_idx_(-1),
-    lc_fid_(FD::Convert("LatticeCost")) {
+    lc_fid_(FD::Convert("LatticeCost")),
+    weights_(weights),
+    pruning_(pruning),
+    closed_(input.size()+1, input.size()+1),
+    kGOAL(TD::Convert("Goal") * -1) {
+  if (pruning_ && pruning_->closing_model)
+    pruning_->closing_model->CloseCells(input, &closed_);
   act_chart_.resize(grammars_.size());
   for (int i = 0; i < grammars_.size(); ++i)
     act_chart_[i] = new ActiveChart(forest, *this);
-  if (!kGOAL) kGOAL = TD::Convert("Goal") * -1;
   if (!SILENT) cerr << "  Goal category: [" << goal << ']' << endl;
 }
 
@@ -173,13 +327,12 @@ void PassiveChart::ApplyRule(const int i,
   new_edge->feature_values_ = r->GetFeatureValues();
   if (lattice_cost && lc_fid_)
     new_edge->feature_values_.set_value(lc_fid_, lattice_cost);
-  Cat2NodeMap& c2n = nodemap_(i,j);
   const bool is_goal = (r->GetLHS() == kGOAL);
-  const Cat2NodeMap::iterator ni = c2n.find(r->GetLHS());
+  const int node_id = nodemap_.Find(i, j, r->GetLHS());
   Hypergraph::Node* node = NULL;
-  if (ni == c2n.end()) {
+  if (node_id < 0) {
     node = forest_->AddNode(r->GetLHS());
-    c2n[r->GetLHS()] = node->id_;
+    nodemap_.Insert(i, j, r->GetLHS(), node->id_);
     if (is_goal) {
       assert(goal_idx_ == -1);
       goal_idx_ = node->id_;
@@ -187,9 +340,46 @@ void PassiveChart::ApplyRule(const int i,
       chart_(i,j).push_back(node->id_);
     }
   } else {
-    node = &forest_->nodes_[ni->second];
+    node = &forest_->nodes_[node_id];
   }
   forest_->ConnectEdgeToHeadNode(new_edge, node);
+  if (pruning_) {
+    const double score = EdgeScore(r, ant_nodes, lattice_cost);
+    if (node->id_ >= node_scores_.size())
+      node_scores_.resize(node->id_ + 1, -numeric_limits<double>::infinity());
+    if (score > node_scores_[node->id_]) node_scores_[node->id_] = score;
+  }
+}
+
+double PassiveChart::EdgeScore(const TRulePtr& r,
+                               const Hypergraph::TailNodeVector& ant_nodes,
+                               const float lattice_cost) const {
+  double score = r->GetFeatureValues().dot(*weights_);
+  if (lattice_cost && lc_fid_ < weights_->size())
+    score += lattice_cost * (*weights_)[lc_fid_];
+  for (int k = 0; k < ant_nodes.size(); ++k)
+    score += node_scores_[ant_nodes[k]];
+  return score;
+}
+
+void PassiveChart::ApplyBestCandidates(const int i, const int j) {
+  vector<const Candidate*> sorted(candidates_.size());
+  for (int k = 0; k < candidates_.size(); ++k)
+    sorted[k] = &candidates_[k];
+  sort(sorted.begin(), sorted.end(), CandidateBetter());
+  for (int b = 0; b < sorted.size();) {
+    const WordID lhs = sorted[b]->rule->GetLHS();
+    const double best = sorted[b]->score;
+    int e = b;
+    for (; e < sorted.size() && sorted[e]->rule->GetLHS() == lhs; ++e) {
+      const Candidate& c = *sorted[e];
+      if (pruning_->limit > 0 && e - b >= pruning_->limit) continue;
+      if (pruning_->beam > 0 && c.score < best - pruning_->beam) continue;
+      ApplyRule(i, j, c.rule, c.tail, c.lattice_cost);
+    }
+    b = e;
+  }
+  candidates_.clear();
 }
 
 void PassiveChart::ApplyRules(const int i,
@@ -198,6 +388,13 @@ void PassiveChart::ApplyRules(const int i,
                        const Hypergraph::TailNodeVector& tail,
                        const float lattice_cost) {
   const int n = rules->GetNumRules();
+  if (pruning_) {
+    for (int k = 0; k < n; ++k) {
+      const TRulePtr r = rules->GetIthRule(k);
+      candidates_.push_back(Candidate(r, tail, lattice_cost, EdgeScore(r, tail, lattice_cost)));
+    }
+    return;
+  }
   for (int k = 0; k < n; ++k)
     ApplyRule(i, j, rules->GetIthRule(k), tail, lattice_cost);
 }
@@ -228,6 +425,7 @@ bool PassiveChart::Parse() {
     act_chart_[gi]->SeedActiveChart(*grammars_[gi]);
 
   if (!SILENT) cerr << "    ";
+  Hypergraph::TailNodeVector tail;
   for (int l=1; l<input_.size()+1; ++l) {
     if (!SILENT) cerr << '.';
     for (int i=0; i<input_.size() + 1 - l; ++i) {
@@ -236,24 +434,31 @@ bool PassiveChart::Parse() {
         const Grammar& g = *grammars_[gi];
         if (g.HasRuleForSpan(i, j, input_.Distance(i, j))) {
           act_chart_[gi]->AdvanceDotsForAllItemsInCell(i, j, input_);
+          if (closed_(i,j)) continue;
 
           const vector<ActiveChart::ActiveItem>& cell = (*act_chart_[gi])(i,j);
           for (vector<ActiveChart::ActiveItem>::const_iterator ai = cell.begin();
                ai != cell.end(); ++ai) {
             const RuleBin* rules = (ai->gptr_->GetRules());
             if (!rules) continue;
-            ApplyRules(i, j, rules, ai->ant_nodes_, ai->lattice_cost);
+            act_chart_[gi]->GetTail(*ai, &tail);
+            ApplyRules(i, j, rules, tail, ai->lattice_cost);
           }
         }
       }
-      ApplyUnaryRules(i,j);
+      if (!closed_(i,j)) {
+        if (pruning_) ApplyBestCandidates(i, j);
+        ApplyUnaryRules(i,j);
 
-      for (int gi = 0; gi < grammars_.size(); ++gi) {
-        const Grammar& g = *grammars_[gi];
+        for (int gi = 0; gi < grammars_.size(); ++gi) {
+          const Grammar& g = *grammars_[gi];
           // deal with non-terminals that were just proved
           if (g.HasRuleForSpan(i, j, input_.Distance(i,j)))
             act_chart_[gi]->ExtendActiveItems(i, i, j);
+        }
       }
+      for (int gi = 0; gi < grammars_.size(); ++gi)
+        act_chart_[gi]->CompleteCell(i, j);
     }
     const vector<int>& dh = chart_(0, input_.size());
     for (int di = 0; di < dh.size(); ++di) {
@@ -288,3 +493,57 @@ bool ExhaustiveBottomUpParser::Parse(const Lattice& input,
   const bool result = chart.Parse();
   return result;
 }
+
+PrunedBottomUpParser::PrunedBottomUpParser(
+    const string& goal_sym,
+    const vector<GrammarPtr>& grammars,
+    const vector<double>& weights,
+    const CellPruning& pruning) :
+  goal_sym_(goal_sym),
+  grammars_(grammars),
+  weights_(weights),
+  pruning_(pruning) {}
+
+bool PrunedBottomUpParser::Parse(const Lattice& input,
+                                 Hypergraph* forest) const {
+  PassiveChart chart(goal_sym_, grammars_, input, forest, &weights_, &pruning_);
+  return chart.Parse();
+}
+
+CellClosingModel::CellClosingModel(const string& file) : warned_(false) {
+  ReadFile rf(file);
+  istream& in = *rf.stream();
+  string word;
+  float b, e;
+  while (in >> word >> b >> e)
+    scores_[TD::Convert(word)] = make_pair(b, e);
+  if (!in.eof()) {
+    cerr << "Bad cell closing model in " << file << endl;
+    abort();
+  }
+  if (!SILENT) cerr << "Read cell closing scores for " << scores_.size() << " words from " << file << endl;
+}
+
+void CellClosingModel::CloseCells(const Lattice& input, Array2D<bool>* closed) const {
+  const int n = input.size();
+  closed->resize(n + 1, n + 1, false);
+  if (!input.IsSentence()) {
+    if (!warned_) {
+      cerr << "Cell closing model ignored: the input is a lattice, not a sentence\n";
+      warned_ = true;
+    }
+    return;
+  }
+  vector<float> begin(n), end(n);
+  for (int k = 0; k < n; ++k) {
+    const tr1::unordered_map<WordID, pair<float, float> >::const_iterator it = scores_.find(input[k][0].label);
+    if (it != scores_.end()) {
+      begin[k] = it->second.first;
+      end[k] = it->second.second;
+    }
+  }
+  for (int i = 1; i < n; ++i)
+    for (int j = i + 2; j <= n; ++j)
+      if (begin[i] + end[j - 1] < 0)
+        (*closed)(i, j) = true;
+}
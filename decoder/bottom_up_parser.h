@@ -3,12 +3,52 @@
 
 #include <vector>
 #include <string>
+#include <tr1/unordered_map>
 
 #include "lattice.h"
 #include "grammar.h"
+#include "array2d.h"
 
 class Hypergraph;
 
+// A cheap source-side classifier that closes chart cells: a span of two or
+// more words that does not start at 0 (where glue rules apply) is closed
+// (no constituent may cover it) if the score of its first word as the
+// beginning of a constituent plus the score of its last word as the end of
+// one is negative.  The model is a text file with lines
+//   word begin_score end_score
+// words that are not listed score 0.  train_cell_closing_model (in extools)
+// estimates one from the word-aligned training corpus: the scores are the
+// log odds that the word begins (ends) a multi-word phrase that is
+// consistent with the alignment, e.g.
+//   the  1.38 -2.71
+//   of  -0.52 -3.05
+//   .   -4.60  0.83
+class CellClosingModel {
+ public:
+  explicit CellClosingModel(const std::string& file);
+  // closed(i,j) is set for the spans [i,j) that are closed; lattices that
+  // are not simple sentences are left open (with a warning, the first time)
+  void CloseCells(const Lattice& input, Array2D<bool>* closed) const;
+
+ private:
+  std::tr1::unordered_map<WordID, std::pair<float, float> > scores_;
+  mutable bool warned_;
+};
+
+// Limits applied to each cell (span) of the chart while parsing.  Edges are
+// scored by the weighted rule features plus the best (Viterbi) inside
+// scores of their tail nodes.
+struct CellPruning {
+  CellPruning() : beam(0), limit(0), closing_model(NULL) {}
+  // of the edges with the same span and head category, keep only those
+  // whose score is within beam of the best (0 for no beam) ...
+  double beam;
+  // ... and at most the limit best ones (0 for no limit)
+  int limit;
+  const CellClosingModel* closing_model;  // may be NULL
+};
+
 class ExhaustiveBottomUpParser {
  public:
   ExhaustiveBottomUpParser(const std::string& goal_sym,
@@ -24,4 +64,24 @@ class ExhaustiveBottomUpParser {
   const std::vector<GrammarPtr> grammars_;
 };
 
+// builds a forest that is pruned cell by cell as the chart is filled, so
+// that spans do not hold more than a few edges
+class PrunedBottomUpParser {
+ public:
+  PrunedBottomUpParser(const std::string& goal_sym,
+                       const std::vector<GrammarPtr>& grammars,
+                       const std::vector<double>& weights,
+                       const CellPruning& pruning);
+
+  // returns true if goal reached spanning the full input
+  bool Parse(const Lattice& input,
+             Hypergraph* forest) const;
+
+ private:
+  const std::string goal_sym_;
+  const std::vector<GrammarPtr> grammars_;
+  const std::vector<double>& weights_;
+  const CellPruning pruning_;
+};
+
 #endif
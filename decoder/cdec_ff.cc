@@ -1,4 +1,5 @@
 #include <boost/shared_ptr.hpp>
+#include <boost/thread/once.hpp>
 
 #include "ff.h"
 #include "ff_spans.h"
@@ -22,13 +23,7 @@
 #include <cdec/ff_glc.h>
 #endif
 
-void register_feature_functions() {
-  static bool registered = false;
-  if (registered) {
-    assert(!"register_feature_functions() called twice!");
-  }
-  registered = true;
-
+static void RegisterFeatureFunctions() {
   //TODO: these are worthless example target FSA ffs.  remove later
   RegisterFsaImpl<SameFirstLetter>(true);
   RegisterFsaImpl<LongerThanPrev>(true);
@@ -73,6 +68,7 @@ void register_feature_functions() {
   ff_registry.Register("InputIndicator", new FFFactory<InputIndicator>);
   ff_registry.Register("LexicalTranslationTrigger", new FFFactory<LexicalTranslationTrigger>);
   ff_registry.Register("WordPairFeatures", new FFFactory<WordPairFeatures>);
+  ff_registry.Register("LexicalTranslationProb", new FFFactory<LexicalTranslationProb>);
   ff_registry.Register("WordSet", new FFFactory<WordSet>);
   ff_registry.Register("Dwarf", new FFFactory<Dwarf>);
 #ifdef HAVE_GLC
@@ -80,3 +76,9 @@ void register_feature_functions() {
 #endif
 }
 
+static boost::once_flag registered = BOOST_ONCE_INIT;
+
+// the registry is filled once, however many threads call this
+void register_feature_functions() {
+  boost::call_once(&RegisterFeatureFunctions, registered);
+}
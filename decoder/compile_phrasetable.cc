@@ -0,0 +1,23 @@
+// compiles a text phrase table into the binary format that cdec maps into
+// memory (see phrasetable_fst.h).  The compiled table can be used wherever
+// the text table was, e.g. as the grammar of formalism=pb or fst.
+//
+//   compile_phrasetable phrase-table.txt[.gz] phrase-table.bin
+
+#include <iostream>
+#include <string>
+
+#include "filelib.h"
+#include "phrasetable_fst.h"
+
+using namespace std;
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    cerr << "Usage: " << argv[0] << " phrase-table.txt[.gz] phrase-table.bin\n";
+    return 1;
+  }
+  ReadFile in(argv[1]);
+  CompilePhrasetable(in.stream(), argv[2]);
+  return 0;
+}
@@ -9,6 +9,8 @@
 #include "weights.h"
 #include "filelib.h"
 #include "fdict.h"
+#include "tdict.h"
+#include "dict_snapshot.h"
 #include "timing_stats.h"
 #include "verbose.h"
 
@@ -31,6 +33,7 @@
 #include "viterbi.h"
 #include "kbest.h"
 #include "inside_outside.h"
+#include "hg_mbr.h"
 #include "exp_semiring.h"
 #include "sentence_metadata.h"
 #include "sampler.h"
@@ -191,6 +194,23 @@ struct DecoderImpl {
   }
   void SetId(int next_sent_id) { sent_id = next_sent_id - 1; }
 
+  // the forests only depend on the weights through their edge probabilities
+  // if no pass prunes, computes a summary feature or uses stateful features
+  bool ReweightableForests() const {
+    if (conf.count("coarse_to_fine_beam_prune") || get_oracle_forest) return false;
+    // the phrase-based stack decoder always prunes with the current weights
+    if (formalism == "pb") return false;
+    // cell pruning prunes the -LM forest while parsing
+    if (conf.count("scfg_cell_beam") || conf.count("scfg_cell_limit") || conf.count("scfg_cell_closing_model"))
+      return false;
+    for (int i = 0; i < rescoring_passes.size(); ++i) {
+      const RescoringPass& rp = rescoring_passes[i];
+      if (rp.beam_prune || rp.density_prune || rp.fid_summary) return false;
+      if (!rp.models->stateless()) return false;
+    }
+    return true;
+  }
+
   void forest_stats(Hypergraph &forest,string name,bool show_tree,bool show_deriv=false) {
     cerr << viterbi_stats(forest,name,true,show_tree,show_deriv);
     cerr << endl;
@@ -317,6 +337,7 @@ struct DecoderImpl {
   bool kbest;
   bool unique_kbest;
   bool get_oracle_forest;
+  shared_ptr<LinearBleuMBR> mbr;
   shared_ptr<WriteFile> extract_file;
   int combine_size;
   int sent_id;
@@ -396,11 +417,16 @@ DecoderImpl::DecoderImpl(po::variables_map& conf, int argc, char** argv, istream
         ("aligner_use_viterbi", "If run in alignment mode, compute the Viterbi (rather than MAP) alignment")
         ("goal",po::value<string>()->default_value("S"),"Goal symbol (SCFG & FST)")
         ("freeze_feature_set,Z", "Freeze feature set after reading feature weights file")
+        ("dictionary_snapshot", po::value<string>(), "Load the feature and word dictionaries from the snapshots FILE.fd and FILE.td (written by --write_dictionary_snapshot) before reading weights or grammars, so that processes share ids without interning every string")
+        ("write_dictionary_snapshot", po::value<string>(), "After initialization (and freezing the feature set), write the feature and word dictionaries to the snapshots FILE.fd and FILE.td")
         ("warn_0_weight","Warn about any feature id that has a 0 weight (this is perfectly safe if you intend 0 weight, though)")
         ("scfg_extra_glue_grammar", po::value<string>(), "Extra glue grammar file (Glue grammars apply when i=0 but have no other span restrictions)")
         ("scfg_no_hiero_glue_grammar,n", "No Hiero glue grammar (nb. by default the SCFG decoder adds Hiero glue rules)")
         ("scfg_default_nt,d",po::value<string>()->default_value("X"),"Default non-terminal symbol in SCFG")
         ("scfg_max_span_limit,S",po::value<int>()->default_value(10),"Maximum non-terminal span limit (except \"glue\" grammar)")
+        ("scfg_cell_beam", po::value<double>(), "Prune the -LM forest while parsing: of the edges of each span and category keep only those within this (log) score of the best, scored by the rule features and the best inside scores of their tails")
+        ("scfg_cell_limit", po::value<int>(), "Prune the -LM forest while parsing: keep at most this many edges per span and category")
+        ("scfg_cell_closing_model", po::value<string>(), "Close the chart cells of multi-word spans whose boundary words score below 0 in this file of 'word begin_score end_score' lines (written by train_cell_closing_model)")
         ("quiet", "Disable verbose output")
         ("show_config", po::bool_switch(&show_config), "show contents of loaded -c config files.")
         ("show_weights", po::bool_switch(&show_weights), "show effective feature weights")
@@ -427,7 +453,14 @@ DecoderImpl::DecoderImpl(po::variables_map& conf, int argc, char** argv, istream
         ("graphviz","Show (constrained) translation forest in GraphViz format")
         ("max_translation_beam,x", po::value<int>(), "Beam approximation to get max translation from the chart")
         ("max_translation_sample,X", po::value<int>(), "Sample the max translation from the chart")
+        ("mbr_consensus", "Output the translation with the highest expected linear BLEU under the forest's n-gram posteriors (hypergraph MBR)")
+        ("mbr_order", po::value<int>()->default_value(4), "(MBR) Longest n-gram used in the linear BLEU gain")
+        ("mbr_precision", po::value<double>()->default_value(0.85), "(MBR) Unigram precision p for the linear BLEU weights")
+        ("mbr_ratio", po::value<double>()->default_value(0.72), "(MBR) Precision decay ratio r for the linear BLEU weights")
+        ("mbr_scale", po::value<double>()->default_value(1.0), "(MBR) Scale the model scores by this before computing n-gram posteriors")
         ("pb_max_distortion,D", po::value<int>()->default_value(4), "Phrase-based decoder: maximum distortion")
+        ("pb_stack_size", po::value<int>()->default_value(100), "Phrase-based decoder: expand at most this many hypotheses of each stack (histogram pruning)")
+        ("pb_beam", po::value<double>(), "Phrase-based decoder: expand only the hypotheses within this (log) score of the best of their stack (threshold pruning)")
         ("cll_gradient,G","Compute conditional log-likelihood gradient and write to STDOUT (src & ref required)")
         ("get_oracle_forest,o", "Calculate rescored hypregraph using approximate BLEU scoring of rules")
         ("feature_expectations","Write feature expectations for all features in chart (**OBJ** will be the partition)")
@@ -552,6 +585,11 @@ DecoderImpl::DecoderImpl(po::variables_map& conf, int argc, char** argv, istream
     exit(1);
   }
 
+  if (conf.count("dictionary_snapshot")) {
+    LoadDictionarySnapshots(str("dictionary_snapshot",conf));
+    if (!SILENT) cerr << "Loaded dictionary snapshots with " << FD::NumFeats() << " features and " << TD::NumWords() << " words\n";
+  }
+
   // load initial feature weights (and possibly freeze feature set)
   if (conf.count("weights")) {
     w_init_weights.InitFromFile(str("weights",conf));
@@ -651,7 +689,7 @@ DecoderImpl::DecoderImpl(po::variables_map& conf, int argc, char** argv, istream
   else if (formalism == "fst")
     translator.reset(new FSTTranslator(conf));
   else if (formalism == "pb")
-    translator.reset(new PhraseBasedTranslator(conf));
+    translator.reset(new PhraseBasedTranslator(conf, rescoring_passes.empty() ? NULL : rescoring_passes.front().models.get()));
   else if (formalism == "csplit")
     translator.reset(new CompoundSplit(conf));
   else if (formalism == "lextrans")
@@ -694,6 +732,11 @@ DecoderImpl::DecoderImpl(po::variables_map& conf, int argc, char** argv, istream
   kbest = conf.count("k_best");
   unique_kbest = conf.count("unique_k_best");
   get_oracle_forest = conf.count("get_oracle_forest");
+  if (conf.count("mbr_consensus"))
+    mbr.reset(new LinearBleuMBR(conf["mbr_order"].as<int>(),
+                                conf["mbr_precision"].as<double>(),
+                                conf["mbr_ratio"].as<double>(),
+                                conf["mbr_scale"].as<double>()));
   oracle.show_derivation=conf.count("show_derivations");
 
 #ifdef FSA_RESCORING
@@ -703,6 +746,10 @@ DecoderImpl::DecoderImpl(po::variables_map& conf, int argc, char** argv, istream
   if (conf.count("extract_rules"))
     extract_file.reset(new WriteFile(str("extract_rules",conf)));
 
+  if (conf.count("write_dictionary_snapshot")) {
+    WriteDictionarySnapshots(str("write_dictionary_snapshot",conf));
+  }
+
   combine_size = conf["combine_size"].as<int>();
   if (combine_size < 1) combine_size = 1;
   sent_id = -1;
@@ -722,6 +769,8 @@ bool Decoder::Decode(const string& input, DecoderObserver* o) {
   return res;
 }
 void Decoder::SetWeights(const vector<double>& weights) { pimpl_->SetWeights(weights); }
+bool Decoder::ReweightableForests() const { return pimpl_->ReweightableForests(); }
+
 void Decoder::SetSupplementalGrammar(const std::string& grammar_string) {
   assert(pimpl_->translator->GetDecoderType() == "SCFG");
   static_cast<SCFGTranslator&>(*pimpl_->translator).SetSupplementalGrammar(grammar_string);
@@ -969,7 +1018,12 @@ bool DecoderImpl::Decode(const string& input, DecoderObserver* o) {
     } else {
       if (!graphviz && !has_ref && !joshua_viz && !SILENT) {
         vector<WordID> trans;
-        ViterbiESentence(forest, &trans);
+        if (mbr) {
+          const double gain = mbr->Decode(forest, &trans);
+          cerr << "  MBR expected linear BLEU gain: " << gain << endl;
+        } else {
+          ViterbiESentence(forest, &trans);
+        }
         cout << TD::GetString(trans) << endl << flush;
       }
       if (joshua_viz) {
@@ -35,6 +35,11 @@ struct DecoderObserver {
   virtual void NotifyDecodingComplete(const SentenceMetadata& smeta);
 };
 
+// Several decoders may decode on different threads (one thread per decoder)
+// once the program has called Dict::EnableLocking.  Decoders in one process
+// share the SCFG grammars and KLanguageModel LMs they read from the same
+// files, so extra decoders cost little memory.  The remote LM
+// (LanguageModel with an lm:// server) aborts if a second decoder loads it.
 struct Decoder {
   Decoder(int argc, char** argv);
   Decoder(std::istream* config_file);
@@ -44,6 +49,11 @@ struct Decoder {
   ~Decoder();
   const boost::program_options::variables_map& GetConf() const { return conf; }
 
+  // true if the forests passed to the observer depend on the weights only
+  // through their edge probabilities (no stateful features, no pruning), so
+  // that they can be kept and reweighted instead of decoding again
+  bool ReweightableForests() const;
+
   // add grammar rules (currently only supported by SCFG decoders)
   // that will be used on subsequent calls to Decode. rules should be in standard
   // text format. This function does NOT read from a file.
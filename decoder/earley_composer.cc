@@ -7,6 +7,7 @@
 #include <tr1/unordered_set>
 
 #include <boost/shared_ptr.hpp>
+#include <boost/thread/once.hpp>
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
 #include "fast_lexical_cast.hpp"
@@ -28,7 +29,6 @@ using namespace std::tr1;
 // A few constants used by the chart parser ///////////////
 static const int kMAX_NODES = 2000000;
 static const string kPHRASE_STRING = "X";
-static bool constants_need_init = true;
 static WordID kUNIQUE_START;
 static WordID kPHRASE;
 static TRulePtr kX1X2;
@@ -36,16 +36,20 @@ static TRulePtr kX1;
 static WordID kEPS;
 static TRulePtr kEPSRule;
 
+static boost::once_flag constants_init = BOOST_ONCE_INIT;
+
+static void InitConstants() {
+  kPHRASE = TD::Convert(kPHRASE_STRING) * -1;
+  kUNIQUE_START = TD::Convert("S") * -1;
+  kX1X2.reset(new TRule("[X] ||| [X,1] [X,2] ||| [X,1] [X,2]"));
+  kX1.reset(new TRule("[X] ||| [X,1] ||| [X,1]"));
+  kEPSRule.reset(new TRule("[X] ||| <eps> ||| <eps>"));
+  kEPS = TD::Convert("<eps>");
+}
+
+// composers may run on several decoding threads
 static void InitializeConstants() {
-  if (constants_need_init) {
-    kPHRASE = TD::Convert(kPHRASE_STRING) * -1;
-    kUNIQUE_START = TD::Convert("S") * -1;
-    kX1X2.reset(new TRule("[X] ||| [X,1] [X,2] ||| [X,1] [X,2]"));
-    kX1.reset(new TRule("[X] ||| [X,1] ||| [X,1]"));
-    kEPSRule.reset(new TRule("[X] ||| <eps> ||| <eps>"));
-    kEPS = TD::Convert("<eps>");
-    constants_need_init = false;
-  }
+  boost::call_once(&InitConstants, constants_init);
 }
 ////////////////////////////////////////////////////////////
 
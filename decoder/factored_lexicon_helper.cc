@@ -8,7 +8,7 @@ using namespace std;
 FactoredLexiconHelper::FactoredLexiconHelper() :
     kNULL(TD::Convert("<eps>")),
     has_src_(false),
-    has_trg_(false) { InitEscape(); }
+    has_trg_(false) {}
 
 FactoredLexiconHelper::FactoredLexiconHelper(const std::string& srcfile, const std::string& trgmapfile) :
     kNULL(TD::Convert("<eps>")),
@@ -49,13 +49,22 @@ FactoredLexiconHelper::FactoredLexiconHelper(const std::string& srcfile, const s
       to = TD::Convert(v[1]);
     }
   }
-  InitEscape();
 }
 
-void FactoredLexiconHelper::InitEscape() {
-  escape_[TD::Convert("=")] = TD::Convert("__EQ");
-  escape_[TD::Convert(";")] = TD::Convert("__SC");
-  escape_[TD::Convert(",")] = TD::Convert("__CO");
+static map<WordID, WordID> MakeEscapes() {
+  map<WordID, WordID> escape;
+  escape[TD::Convert("=")] = TD::Convert("__EQ");
+  escape[TD::Convert(";")] = TD::Convert("__SC");
+  escape[TD::Convert(",")] = TD::Convert("__CO");
+  return escape;
+}
+
+// features may fire on several decoding threads; local statics are
+// initialized once
+WordID FactoredLexiconHelper::Escape(WordID word) {
+  static const map<WordID, WordID> escape(MakeEscapes());
+  const map<WordID, WordID>::const_iterator it = escape.find(word);
+  return it == escape.end() ? word : it->second;
 }
 
 void FactoredLexiconHelper::PrepareForInput(const SentenceMetadata& smeta) {
@@ -28,6 +28,9 @@ class FactoredLexiconHelper {
 
   void PrepareForInput(const SentenceMetadata& smeta);
 
+  // feature names can't contain =, ; or , so words in them are escaped
+  static WordID Escape(WordID word);
+
   inline WordID SourceWordAtPosition(const int i) const {
     if (i < 0) return kNULL;
     assert(i < cur_src_.size());
@@ -45,14 +48,6 @@ class FactoredLexiconHelper {
   }
 
  private:
-  inline WordID Escape(WordID word) const {
-    const std::map<WordID,WordID>::const_iterator it = escape_.find(word);
-    if (it == escape_.end()) return word;
-    return it->second;
-  }
-
-  void InitEscape();
-
   const WordID kNULL;
   bool has_src_;
   bool has_trg_;
@@ -60,7 +55,6 @@ class FactoredLexiconHelper {
   typedef std::map<WordID, WordID> WordWordMap;
   WordWordMap trgmap_;
   std::vector<WordID> cur_src_;
-  std::map<WordID,WordID> escape_;
 };
 
 #endif
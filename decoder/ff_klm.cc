@@ -2,8 +2,12 @@
 
 #include <cstring>
 #include <iostream>
+#include <map>
 
 #include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/weak_ptr.hpp>
 
 #include "filelib.h"
 #include "stringlib.h"
@@ -82,6 +86,35 @@ struct VMapper : public lm::ngram::EnumerateVocab {
   const lm::WordIndex kLM_UNKNOWN_TOKEN;
 };
 
+// KenLM models aren't changed by queries, so the feature functions of all
+// decoders in a process (e.g. one per decoding thread) share the models
+// they load from the same file
+template <class Model>
+struct SharedKLM {
+  explicit SharedKLM(const string& filename) {
+    VMapper vm(&cdec2klm_map);
+    lm::ngram::Config conf;
+    conf.enumerate_vocab = &vm;
+    model.reset(new Model(filename.c_str(), conf));
+  }
+  boost::scoped_ptr<const Model> model;
+  vector<lm::WordIndex> cdec2klm_map;
+};
+
+static boost::mutex shared_klm_mutex;
+
+template <class Model>
+boost::shared_ptr<SharedKLM<Model> > LoadSharedKLM(const string& filename) {
+  boost::mutex::scoped_lock lock(shared_klm_mutex);
+  static map<string, boost::weak_ptr<SharedKLM<Model> > > loaded;
+  boost::shared_ptr<SharedKLM<Model> > lm = loaded[filename].lock();
+  if (!lm) {
+    lm.reset(new SharedKLM<Model>(filename));
+    loaded[filename] = lm;
+  }
+  return lm;
+}
+
 template <class Model>
 class KLanguageModelImpl {
 
@@ -281,14 +314,11 @@ class KLanguageModelImpl {
 
  public:
   KLanguageModelImpl(const string& filename, const string& mapfile, bool explicit_markers) :
+      shared_(LoadSharedKLM<Model>(filename)),
       kCDEC_UNK(TD::Convert("<unk>")) ,
-      add_sos_eos_(!explicit_markers) {
-    {
-      VMapper vm(&cdec2klm_map_);
-      lm::ngram::Config conf;
-      conf.enumerate_vocab = &vm;
-      ngram_ = new Model(filename.c_str(), conf);
-    }
+      ngram_(shared_->model.get()),
+      add_sos_eos_(!explicit_markers),
+      cdec2klm_map_(shared_->cdec2klm_map) {
     order_ = ngram_->Order();
     cerr << "Loaded " << order_ << "-gram KLM from " << filename << " (MapSize=" << cdec2klm_map_.size() << ")\n";
     state_size_ = ngram_->StateSize() + 2 + (order_ - 1) * sizeof(lm::WordIndex);
@@ -349,17 +379,17 @@ class KLanguageModelImpl {
   }
 
   ~KLanguageModelImpl() {
-    delete ngram_;
     delete[] dummy_state_;
   }
 
   int ReserveStateSize() const { return state_size_; }
 
  private:
+  const boost::shared_ptr<SharedKLM<Model> > shared_;
   const WordID kCDEC_UNK;
   lm::WordIndex kSOS_;  // <s> - requires special handling.
   lm::WordIndex kEOS_;  // </s>
-  Model* ngram_;
+  const Model* const ngram_;
   const bool add_sos_eos_; // flag indicating whether the hypergraph produces <s> and </s>
                      // if this is true, FinalTransitionFeatures will "add" <s> and </s>
                      // if false, FinalTransitionFeatures will score anything with the
@@ -373,7 +403,7 @@ class KLanguageModelImpl {
   int unscored_words_offset_;
   char* dummy_state_;
   vector<const void*> dummy_ants_;
-  vector<lm::WordIndex> cdec2klm_map_;
+  const vector<lm::WordIndex>& cdec2klm_map_;
   vector<WordID> word2class_map_;        // if this is a class-based LM, this is the word->class mapping
   TRulePtr dummy_rule_;
 };
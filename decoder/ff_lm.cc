@@ -78,6 +78,7 @@ string LanguageModel::usage(bool param,bool verbose) {
 }
 
 
+#include <boost/atomic.hpp>
 #include <boost/shared_ptr.hpp>
 using namespace boost;
 
@@ -88,7 +89,11 @@ namespace NgramCache {
     Cache() : prob() {}
   };
   static Cache cache_;
-  void Clear() { cache_.tree.clear(); }
+  // only the remote LM fills the cache, so other configurations never write
+  // to it.  It is neither locked nor keyed by server, so at most one remote
+  // LM (one decoder, one decoding thread) may use it at a time.
+  static boost::atomic<int> clients_(0);
+  void Clear() { if (!cache_.tree.empty()) cache_.tree.clear(); }
 }
 
 struct LMClient {
@@ -430,7 +435,13 @@ public:
 
 struct ClientLMI : public LanguageModelImpl {
   ClientLMI(int order,string const& server) : LanguageModelImpl(order), client_(server)
-  {}
+  {
+    if (NgramCache::clients_++) {
+      cerr << "The remote LM can only be used by one decoder per process; don't combine it with several decoding threads or a second remote LM\n";
+      abort();
+    }
+  }
+  virtual ~ClientLMI() { --NgramCache::clients_; }
 
   virtual double WordProb(int word, WordID const* context) {
     return client_.wordProb(word, context);
@@ -118,13 +118,7 @@ void OutputIndicator::FireFeature(WordID trg,
                                  SparseVector<double>* features) const {
   int& fid = fmap_[trg];
   if (!fid) {
-    static map<WordID, WordID> escape;
-    if (escape.empty()) {
-      escape[TD::Convert("=")] = TD::Convert("__EQ");
-      escape[TD::Convert(";")] = TD::Convert("__SC");
-      escape[TD::Convert(",")] = TD::Convert("__CO");
-    }
-    if (escape.count(trg)) trg = escape[trg];
+    trg = FactoredLexiconHelper::Escape(trg);
     ostringstream os;
     os << "T:" << TD::Convert(trg);
     fid = FD::Convert(os.str());
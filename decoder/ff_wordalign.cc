@@ -12,10 +12,12 @@
 #include <boost/tuple/tuple.hpp>
 #include "boost/tuple/tuple_comparison.hpp"
 #include <boost/functional/hash.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include "factored_lexicon_helper.h"
 #include "verbose.h"
 #include "alignment_pharaoh.h"
+#include "mapped_ttable.h"
 #include "stringlib.h"
 #include "sentence_metadata.h"
 #include "hg.h"
@@ -251,6 +253,8 @@ void NewJump::FireFeature(const SentenceMetadata& smeta,
   if (fprev_) get<7>(key) = GetSourceWord(id, prev_src_index);
 
   static std::tr1::unordered_map<NewJumpFeatureKey, int, KeyHash> fids;
+  static boost::mutex fids_mutex;  // features may fire on several threads
+  boost::mutex::scoped_lock lock(fids_mutex);
   int& fid = fids[key];
   if (!fid) {
     ostringstream os;
@@ -547,7 +551,6 @@ void IdentityCycleDetector::TraversalFeaturesImpl(const SentenceMetadata& smeta,
     out_is_identity = false;
     if (edge.rule_->e_[0] == edge.rule_->f_[0]) {
       const WordID word = edge.rule_->e_[0];
-      static map<WordID, bool> big_enough;
       map<WordID,bool>::iterator it = big_enough_.find(word);
       if (it == big_enough_.end()) {
         out_is_identity = big_enough_[word] = strlen(TD::Convert(word)) >= length_min_;
@@ -578,13 +581,7 @@ void InputIndicator::FireFeature(WordID src,
                                  SparseVector<double>* features) const {
   int& fid = fmap_[src];
   if (!fid) {
-    static map<WordID, WordID> escape;
-    if (escape.empty()) {
-      escape[TD::Convert("=")] = TD::Convert("__EQ");
-      escape[TD::Convert(";")] = TD::Convert("__SC");
-      escape[TD::Convert(",")] = TD::Convert("__CO");
-    }
-    if (escape.count(src)) src = escape[src];
+    src = FactoredLexiconHelper::Escape(src);
     ostringstream os;
     os << "S:" << TD::Convert(src);
     fid = FD::Convert(os.str());
@@ -724,6 +721,38 @@ void WordPairFeatures::TraversalFeaturesImpl(const SentenceMetadata& smeta,
   }
 }
 
+LexicalTranslationProb::LexicalTranslationProb(const string& param) {
+  vector<string> argv;
+  const int argc = SplitOnWhitespace(param, &argv);
+  if (argc < 1 || argc > 2) {
+    cerr << "LexicalTranslationProb /path/to/ttable.bin [feature_name]\n";
+    abort();
+  }
+  if (!MappedTTable::IsBinaryTTable(argv[0])) {
+    cerr << "LexicalTranslationProb: " << argv[0] << " is not a binary translation table (see model1 --binary_ttable)\n";
+    abort();
+  }
+  fid_ = FD::Convert(argc > 1 ? argv[1] : "LexicalTranslationProb");
+  ttable_.reset(new MappedTTable(argv[0]));
+  if (!SILENT) { cerr << "LexicalTranslationProb: " << ttable_->size() << " entries\n"; }
+}
+
+void LexicalTranslationProb::TraversalFeaturesImpl(const SentenceMetadata& /* smeta */,
+                                     const Hypergraph::Edge& edge,
+                                     const std::vector<const void*>& /* ant_contexts */,
+                                     SparseVector<double>* features,
+                                     SparseVector<double>* /* estimated_features */,
+                                     void* /* context */) const {
+  if (edge.Arity() == 0) {
+    assert(edge.rule_->EWords() == 1);
+    assert(edge.rule_->FWords() == 1);
+    const WordID trg = edge.rule_->e()[0];
+    const WordID src = edge.rule_->f()[0];
+    // model1 gives pairs it has never seen a probability of 1e-9
+    features->set_value(fid_, ttable_->LogProb(src, trg, log(1e-9)));
+  }
+}
+
 struct PathFertility {
   unsigned char null_fertility;
   unsigned char index_fertility[255];
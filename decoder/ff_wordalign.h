@@ -6,6 +6,7 @@
 #include "factored_lexicon_helper.h"
 
 #include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/multi_array.hpp>
 
 class RelativeSentencePosition : public FeatureFunction {
@@ -220,6 +221,26 @@ class WordPairFeatures : public FeatureFunction {
   std::vector<std::map<WordID, SparseVector<float> > > values_;  // fkeys_index -> e -> value
 };
 
+class MappedTTable;
+
+// log t(trg|src) of the alignment links of a word alignment forest, read
+// from a binary translation table (e.g. written by model1 --binary_ttable)
+class LexicalTranslationProb : public FeatureFunction {
+ public:
+  // param: table.bin [feature name]
+  LexicalTranslationProb(const std::string& param);
+ protected:
+  virtual void TraversalFeaturesImpl(const SentenceMetadata& smeta,
+                                     const Hypergraph::Edge& edge,
+                                     const std::vector<const void*>& ant_contexts,
+                                     SparseVector<double>* features,
+                                     SparseVector<double>* estimated_features,
+                                     void* context) const;
+ private:
+  int fid_;
+  boost::shared_ptr<MappedTTable> ttable_;
+};
+
 // fires when a len(word) >= length_min_ is translated as itself and then a self-transition is made
 class IdentityCycleDetector : public FeatureFunction {
  public:
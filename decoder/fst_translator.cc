@@ -19,7 +19,11 @@ struct FSTTranslatorImpl {
       kGOAL_RULE(new TRule("[Goal] ||| [" + goal_sym + ",1] ||| [1]")),
       kGOAL(TD::Convert("Goal") * -1),
       add_pass_through_rules(conf.count("add_pass_through_rules")) {
-    fst.reset(LoadTextPhrasetable(conf["grammar"].as<vector<string> >()));
+    const vector<string> gfiles = conf["grammar"].as<vector<string> >();
+    if (gfiles.size() == 1 && IsBinaryPhrasetable(gfiles.front()))
+      fst.reset(LoadBinaryPhrasetable(gfiles.front()));
+    else
+      fst.reset(LoadTextPhrasetable(gfiles));
     ec.reset(new EarleyComposer(fst.get()));
   }
 
@@ -67,6 +71,7 @@ struct FSTTranslatorImpl {
     }
     if (add_pass_through_rules)
       fst->ClearPassThroughTranslations();
+    fst->SentenceComplete();
     return composed;
   }
 
@@ -5,6 +5,7 @@
 #include <map>
 
 #include "rule_lexer.h"
+#include "rule_arena.h"
 #include "filelib.h"
 #include "tdict.h"
 
@@ -25,23 +26,29 @@ bool Grammar::HasRuleForSpan(int i, int j, int distance) const {
 
 struct TextRuleBin : public RuleBin {
   int GetNumRules() const {
-    return rules_.size();
+    return rules_.size() + compact_.size();
   }
   TRulePtr GetIthRule(int i) const {
-    return rules_[i];
+    if (i < rules_.size()) return rules_[i];
+    return RuleArena::Get(compact_[i - rules_.size()]);
   }
   void AddRule(TRulePtr t) {
     rules_.push_back(t);
   }
+  void AddRule(const CompactRule* r) {
+    compact_.push_back(r);
+  }
   int Arity() const {
-    return rules_.front()->Arity();
+    return rules_.empty() ? compact_.front()->Arity() : rules_.front()->Arity();
   }
   void Dump() const {
-    for (int i = 0; i < rules_.size(); ++i)
-      cerr << rules_[i]->AsString() << endl;
+    for (int i = 0; i < GetNumRules(); ++i)
+      cerr << GetIthRule(i)->AsString() << endl;
   }
  private:
+  // rules added as TRules come before the rules read into the arena
   vector<TRulePtr> rules_;
+  vector<const CompactRule*> compact_;
 };
 
 struct TextGrammarNode : public GrammarIter {
@@ -67,7 +74,18 @@ struct TextGrammarNode : public GrammarIter {
 };
 
 struct TGImpl {
+  TextRuleBin* GetBin(const vector<WordID>& f) {
+    TextGrammarNode* cur = &root_;
+    for (int i = 0; i < f.size(); ++i)
+      cur = &cur->tree_[f[i]];
+    if (cur->rb_ == NULL)
+      cur->rb_ = new TextRuleBin;
+    return cur->rb_;
+  }
+
   TextGrammarNode root_;
+  RuleArena arena_;
+  TRulePtr pending_;  // the last coarsest rule read, until its finer ones are read
 };
 
 TextGrammar::TextGrammar() : max_span_(10), pimpl_(new TGImpl) {}
@@ -98,26 +116,44 @@ void TextGrammar::AddRule(const TRulePtr& rule, const unsigned int ctf_level, co
     rhs2unaries_[rule->f().front()].push_back(rule);
     unaries_.push_back(rule);
   } else {
-    TextGrammarNode* cur = &pimpl_->root_;
-    for (int i = 0; i < rule->f_.size(); ++i)
-      cur = &cur->tree_[rule->f_[i]];
-    if (cur->rb_ == NULL)
-      cur->rb_ = new TextRuleBin;
-    cur->rb_->AddRule(rule);
+    pimpl_->GetBin(rule->f_)->AddRule(rule);
+  }
+}
+
+// Rules read from a file or stream are copied into the arena, once their
+// finer rules have been read, except for unary rules (GetUnaryRulesForRHS
+// returns them as TRules) and rules that do not fit it.
+void TextGrammar::ReadRuleHelper(const TRulePtr& new_rule, const unsigned int ctf_level, const TRulePtr& coarse_rule, void* extra) {
+  TextGrammar* g = static_cast<TextGrammar*>(extra);
+  if (ctf_level == 0) {
+    g->AddPendingRule();
+    if (!new_rule->IsUnary()) {
+      g->pimpl_->pending_ = new_rule;
+      return;
+    }
   }
+  g->AddRule(new_rule, ctf_level, coarse_rule);
 }
 
-static void AddRuleHelper(const TRulePtr& new_rule, const unsigned int ctf_level, const TRulePtr& coarse_rule, void* extra) {
-  static_cast<TextGrammar*>(extra)->AddRule(new_rule, ctf_level, coarse_rule);
+void TextGrammar::AddPendingRule() {
+  TRulePtr rule;
+  rule.swap(pimpl_->pending_);
+  if (!rule) return;
+  const CompactRule* r = pimpl_->arena_.Add(*rule);
+  if (r)
+    pimpl_->GetBin(rule->f_)->AddRule(r);
+  else
+    AddRule(rule);
 }
 
 void TextGrammar::ReadFromFile(const string& filename) {
-  ReadFile in(filename);
-  ReadFromStream(in.stream());
+  RuleLexer::ReadRules(filename, &ReadRuleHelper, this);
+  AddPendingRule();
 }
 
 void TextGrammar::ReadFromStream(istream* in) {
-  RuleLexer::ReadRules(in, &AddRuleHelper, this);
+  RuleLexer::ReadRules(in, &ReadRuleHelper, this);
+  AddPendingRule();
 }
 
 bool TextGrammar::HasRuleForSpan(int /* i */, int /* j */, int distance) const {
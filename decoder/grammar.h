@@ -76,6 +76,9 @@ struct TextGrammar : public Grammar {
   const std::vector<TRulePtr>& GetUnaryRules(const WordID& cat) const;
 
  private:
+  static void ReadRuleHelper(const TRulePtr& new_rule, const unsigned int ctf_level, const TRulePtr& coarse_rule, void* extra);
+  void AddPendingRule();
+
   int max_span_;
   boost::shared_ptr<TGImpl> pimpl_;
 
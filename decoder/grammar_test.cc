@@ -1,14 +1,17 @@
 #include <cassert>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <vector>
 #include <gtest/gtest.h>
 #include "trule.h"
 #include "tdict.h"
+#include "fdict.h"
 #include "grammar.h"
 #include "bottom_up_parser.h"
 #include "ff.h"
 #include "weights.h"
+#include "parallel_for.h"
 
 using namespace std;
 
@@ -53,6 +56,84 @@ TEST_F(GrammarTest,TestTextGrammarFile) {
   forest.PrintGraphviz();
 }
 
+static const GrammarIter* Extend(const GrammarIter* it, const char* words) {
+  vector<WordID> f;
+  TD::ConvertSentence(words, &f);
+  for (int i = 0; it && i < f.size(); ++i)
+    it = it->Extend(f[i]);
+  return it;
+}
+
+TEST_F(GrammarTest,TestCompactRules) {
+  istringstream in(
+      "[X] ||| a b ||| A B ||| 0.5 1.5 ||| 0-0 1-1\n"
+      " [Y] ||| a b ||| A B ||| 0.25 Foo=2\n"
+      "[X] ||| a b ||| B A ||| Glue=1\n"
+      "[X] ||| a [X,1] ||| [1] A ||| Bar=-3\n"
+      "[X] ||| [X,1] ||| [1]\n");
+  TextGrammar g(&in);
+  EXPECT_EQ(1, g.GetAllUnaryRules().size());
+  const GrammarIter* it = Extend(g.GetRoot(), "a b");
+  ASSERT_TRUE(it && it->GetRules());
+  const RuleBin* rb = it->GetRules();
+  ASSERT_EQ(2, rb->GetNumRules());
+  EXPECT_EQ(0, rb->Arity());
+  TRulePtr r0 = rb->GetIthRule(0);
+  EXPECT_EQ("[X] ||| a b ||| A B ||| PhraseModel_0=0.5 PhraseModel_1=1.5 ||| 0-0 1-1", r0->AsString());
+  ASSERT_TRUE(r0->fine_rules_);
+  ASSERT_EQ(1, r0->fine_rules_->size());
+  EXPECT_EQ("[Y] ||| a b ||| A B ||| PhraseModel_0=0.25 Foo=2", (*r0->fine_rules_)[0]->AsString());
+  EXPECT_FALSE(rb->GetIthRule(1)->fine_rules_);
+  // shared while it is used, built again afterwards
+  EXPECT_EQ(r0.get(), rb->GetIthRule(0).get());
+  const string text = r0->AsString();
+  r0.reset();
+  EXPECT_EQ(text, rb->GetIthRule(0)->AsString());
+
+  it = Extend(g.GetRoot(), "a");
+  ASSERT_TRUE(it);
+  it = it->Extend(TD::Convert("X") * -1);
+  ASSERT_TRUE(it && it->GetRules());
+  EXPECT_EQ(1, it->GetRules()->Arity());
+  EXPECT_EQ("[X] ||| a [X,1] ||| [1] A ||| Bar=-3", it->GetRules()->GetIthRule(0)->AsString());
+}
+
+// rules may be used after their grammar is deleted
+TEST_F(GrammarTest,TestCompactRulesOutliveGrammar) {
+  TRulePtr r;
+  {
+    istringstream in("[X] ||| a ||| A ||| Foo=1\n");
+    TextGrammar g(&in);
+    r = Extend(g.GetRoot(), "a")->GetRules()->GetIthRule(0);
+  }
+  EXPECT_EQ("[X] ||| a ||| A ||| Foo=1", r->AsString());
+}
+
+struct UseRules {
+  UseRules(const RuleBin* rb) : rb_(rb) {}
+  void operator()(unsigned t) const {
+    for (int i = 0; i < 20000; ++i) {
+      TRulePtr r = rb_->GetIthRule((i + t) % rb_->GetNumRules());
+      TRulePtr s = rb_->GetIthRule((i + t) % rb_->GetNumRules());
+      if (r != s || r->e_.size() != 1) abort();
+    }
+  }
+  const RuleBin* rb_;
+};
+
+TEST_F(GrammarTest,TestCompactRulesThreads) {
+  ostringstream os;
+  for (int i = 0; i < 10; ++i)
+    os << "[X] ||| a ||| A" << i << " ||| Foo=" << i << endl;
+  istringstream in(os.str());
+  TextGrammar g(&in);
+  const RuleBin* rb = Extend(g.GetRoot(), "a")->GetRules();
+  ASSERT_EQ(10, rb->GetNumRules());
+  RunThreads(4, UseRules(rb));
+  for (int i = 0; i < 10; ++i)
+    EXPECT_EQ(rb->GetIthRule(i)->GetFeatureValues().value(FD::Convert("Foo")), i);
+}
+
 int main(int argc, char **argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
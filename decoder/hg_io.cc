@@ -2,6 +2,8 @@
 
 #include <sstream>
 #include <iostream>
+#include <stdint.h>
+#include <boost/thread/once.hpp>
 
 #include "fast_lexical_cast.hpp"
 
@@ -254,6 +256,102 @@ bool HypergraphIO::ReadFromJSON(istream* in, Hypergraph* hg) {
   return reader.Parse(in);
 }
 
+template <typename T>
+static inline void WriteBinary(const T& x, ostream* out) {
+  out->write(reinterpret_cast<const char*>(&x), sizeof(T));
+}
+
+template <typename T>
+static inline void ReadBinary(istream* in, T* x) {
+  in->read(reinterpret_cast<char*>(x), sizeof(T));
+}
+
+bool HypergraphIO::WriteToBinary(const Hypergraph& hg, ostream* out) {
+  WriteBinary<int32_t>(hg.nodes_.size(), out);
+  WriteBinary<int32_t>(hg.edges_.size(), out);
+  for (int i = 0; i < hg.nodes_.size(); ++i) {
+    const Hypergraph::Node& node = hg.nodes_[i];
+    WriteBinary<int32_t>(node.cat_, out);
+    WriteBinary<int32_t>(node.in_edges_.size(), out);
+    for (int j = 0; j < node.in_edges_.size(); ++j)
+      WriteBinary<int32_t>(node.in_edges_[j], out);
+  }
+  for (int i = 0; i < hg.edges_.size(); ++i) {
+    const Hypergraph::Edge& edge = hg.edges_[i];
+    WriteBinary<int32_t>(edge.head_node_, out);
+    WriteBinary<int16_t>(edge.i_, out);
+    WriteBinary<int16_t>(edge.j_, out);
+    WriteBinary<int16_t>(edge.prev_i_, out);
+    WriteBinary<int16_t>(edge.prev_j_, out);
+    WriteBinary<int32_t>(edge.tail_nodes_.size(), out);
+    for (int k = 0; k < edge.tail_nodes_.size(); ++k)
+      WriteBinary<int32_t>(edge.tail_nodes_[k], out);
+    WriteBinary<int32_t>(edge.feature_values_.size(), out);
+    for (SparseVector<double>::const_iterator it = edge.feature_values_.begin(); it != edge.feature_values_.end(); ++it) {
+      WriteBinary<int32_t>(it->first, out);
+      WriteBinary<double>(it->second, out);
+    }
+  }
+  return out->good();
+}
+
+bool HypergraphIO::ReadFromBinary(istream* in, Hypergraph* hg) {
+  hg->clear();
+  int32_t num_nodes = 0, num_edges = 0, n = 0, x = 0;
+  ReadBinary(in, &num_nodes);
+  ReadBinary(in, &num_edges);
+  if (!*in || num_nodes < 0 || num_edges < 0) return false;
+  vector<vector<int> > in_edges(num_nodes);
+  for (int i = 0; i < num_nodes; ++i) {
+    ReadBinary(in, &x);
+    hg->AddNode(x);
+    ReadBinary(in, &n);
+    if (!*in || n < 0) return false;
+    in_edges[i].resize(n);
+    for (int j = 0; j < n; ++j) {
+      ReadBinary(in, &x);
+      if (x < 0 || x >= num_edges) return false;
+      in_edges[i][j] = x;
+    }
+    if (!*in) return false;
+  }
+  Hypergraph::TailNodeVector tail;
+  const TRulePtr no_rule;
+  for (int i = 0; i < num_edges; ++i) {
+    int32_t head;
+    int16_t span[4];
+    ReadBinary(in, &head);
+    for (int k = 0; k < 4; ++k) ReadBinary(in, &span[k]);
+    ReadBinary(in, &n);
+    if (!*in || head < 0 || head >= num_nodes || n < 0) return false;
+    tail.resize(n);
+    for (int k = 0; k < n; ++k) {
+      ReadBinary(in, &x);
+      if (x < 0 || x >= num_nodes) return false;
+      tail[k] = x;
+    }
+    Hypergraph::Edge* edge = hg->AddEdge(no_rule, tail);
+    edge->head_node_ = head;
+    edge->i_ = span[0];
+    edge->j_ = span[1];
+    edge->prev_i_ = span[2];
+    edge->prev_j_ = span[3];
+    ReadBinary(in, &n);
+    if (!*in || n < 0) return false;
+    for (int k = 0; k < n; ++k) {
+      double val;
+      ReadBinary(in, &x);
+      ReadBinary(in, &val);
+      edge->feature_values_.set_value(x, val);
+    }
+    if (!*in) return false;
+  }
+  for (int i = 0; i < num_nodes; ++i)
+    for (int j = 0; j < in_edges[i].size(); ++j)
+      hg->nodes_[i].in_edges_.push_back(in_edges[i][j]);
+  return true;
+}
+
 static void WriteRule(const TRule& r, ostream* out) {
   if (!r.lhs_) { (*out) << "[X] ||| "; }
   JSONParser::WriteEscapedString(r.AsString(), out);
@@ -344,14 +442,16 @@ bool HypergraphIO::WriteToJSON(const Hypergraph& hg, bool remove_rules, ostream*
   return true;
 }
 
-bool needs_escape[128];
-void InitEscapes() {
+static bool needs_escape[128];
+static boost::once_flag escapes_init = BOOST_ONCE_INIT;
+static void InitEscapes() {
   memset(needs_escape, false, 128);
   needs_escape[static_cast<size_t>('\'')] = true;
   needs_escape[static_cast<size_t>('\\')] = true;
 }
 
 string HypergraphIO::Escape(const string& s) {
+  boost::call_once(&InitEscapes, escapes_init);
   size_t len = s.size();
   for (int i = 0; i < s.size(); ++i) {
     unsigned char c = s[i];
@@ -371,8 +471,8 @@ string HypergraphIO::Escape(const string& s) {
 }
 
 string HypergraphIO::AsPLF(const Hypergraph& hg, bool include_global_parentheses) {
-  static bool first = true;
-  if (first) { InitEscapes(); first = false; }
+  // forests may be written on several decoding threads
+  boost::call_once(&InitEscapes, escapes_init);
   if (hg.nodes_.empty()) return "()";
   ostringstream os;
   if (include_global_parentheses) os << '(';
@@ -21,6 +21,13 @@ struct HypergraphIO {
   // (so it only contains structure and feature information)
   static bool WriteToJSON(const Hypergraph& hg, bool remove_rules, std::ostream* out);
 
+  // compact binary form with only the structure, spans and feature values of
+  // a hypergraph (no rules), e.g. for caching forests between training
+  // iterations.  Feature ids are written as numbers, so a file can only be
+  // read by the process that wrote it.
+  static bool WriteToBinary(const Hypergraph& hg, std::ostream* out);
+  static bool ReadFromBinary(std::istream* in, Hypergraph* out);
+
   static void WriteAsCFG(const Hypergraph& hg);
 
   // serialization utils
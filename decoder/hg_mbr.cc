@@ -0,0 +1,177 @@
+#include "hg_mbr.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "hg.h"
+#include "trule.h"
+#include "viterbi.h"
+
+using namespace std;
+
+namespace {
+
+const int kRULE = -1;  // word comes from the rule itself
+const int kGAP = -2;   // elided middle of a long antecedent
+
+// the n-grams created by each edge of a forest.  Every node is represented
+// by the boundary words of its Viterbi derivation: the whole yield if it is
+// no longer than 2(order-1) words, otherwise the first and last order-1
+// words with a gap in between.
+class EdgeNGrams {
+ public:
+  EdgeNGrams(const Hypergraph& hg, int order) : order_(order), bounds_(hg.nodes_.size()) {
+    const int keep = order - 1;
+    vector<prob_t> vit(hg.nodes_.size());
+    for (int i = 0; i < hg.nodes_.size(); ++i) {
+      const Hypergraph::Node& node = hg.nodes_[i];
+      if (node.in_edges_.empty()) { vit[i] = prob_t::One(); continue; }
+      int best = -1;
+      for (int j = 0; j < node.in_edges_.size(); ++j) {
+        const Hypergraph::Edge& edge = hg.edges_[node.in_edges_[j]];
+        prob_t p = edge.edge_prob_;
+        for (int k = 0; k < edge.tail_nodes_.size(); ++k)
+          p *= vit[edge.tail_nodes_[k]];
+        if (best < 0 || vit[i] < p) {
+          vit[i] = p;
+          best = node.in_edges_[j];
+        }
+      }
+      Expand(hg.edges_[best]);
+      vector<WordID>& b = bounds_[i];
+      if (words_.size() <= 2 * keep) {  // also means no antecedent was long
+        b = words_;
+      } else {
+        // the first and last order-1 positions never fall in a gap
+        b.assign(words_.begin(), words_.begin() + keep);
+        b.push_back(0);
+        b.insert(b.end(), words_.end() - keep, words_.end());
+      }
+    }
+  }
+
+  // calls f(ngram, n) for every n-gram created by edge, i.e. every n-gram in
+  // its target string that does not lie within a single antecedent, and
+  // returns the number of words contributed by the rule itself
+  template <class F>
+  int ForEach(const Hypergraph::Edge& edge, F& f) {
+    Expand(edge);
+    int rule_words = 0;
+    const int len = words_.size();
+    for (int j = 0; j < len; ++j) {
+      if (owner_[j] == kRULE) ++rule_words;
+      if (owner_[j] == kGAP) continue;
+      bool within_ant = owner_[j] >= 0;
+      for (int n = 1; n <= order_ && j + n <= len; ++n) {
+        const int o = owner_[j + n - 1];
+        if (o == kGAP) break;
+        if (o != owner_[j]) within_ant = false;
+        if (within_ant) continue;
+        f(&words_[j], n);
+      }
+    }
+    return rule_words;
+  }
+
+ private:
+  // sets words_ to the target side of edge with the antecedents replaced by
+  // their boundary words
+  void Expand(const Hypergraph::Edge& edge) {
+    words_.clear();
+    owner_.clear();
+    const vector<WordID>& e = edge.rule_->e();
+    for (int i = 0; i < e.size(); ++i) {
+      if (e[i] < 1) {
+        const int ant = -e[i];
+        const vector<WordID>& b = bounds_[edge.tail_nodes_[ant]];
+        const bool is_long = b.size() > 2 * (order_ - 1);
+        for (int k = 0; k < b.size(); ++k) {
+          words_.push_back(b[k]);
+          owner_.push_back(is_long && k == order_ - 1 ? kGAP : ant);
+        }
+      } else {
+        words_.push_back(e[i]);
+        owner_.push_back(kRULE);
+      }
+    }
+  }
+
+  const int order_;
+  vector<vector<WordID> > bounds_;
+  vector<WordID> words_;
+  vector<int> owner_;
+};
+
+struct AccumulateCounts {
+  AccumulateCounts(LinearBleuMBR::NGramCounts* c) : counts(*c) {}
+  void operator()(const WordID* ngram, int n) {
+    key.assign(ngram, ngram + n);
+    counts[key] += post;
+  }
+  LinearBleuMBR::NGramCounts& counts;
+  vector<WordID> key;
+  double post;
+};
+
+void AddExpectedCounts(const Hypergraph& hg, double scale, EdgeNGrams* ngrams, LinearBleuMBR::NGramCounts* counts) {
+  vector<prob_t> posts;
+  const prob_t z = hg.ComputeEdgePosteriors(scale, &posts);
+  AccumulateCounts acc(counts);
+  for (int i = 0; i < hg.edges_.size(); ++i) {
+    acc.post = posts[i] / z;
+    if (acc.post > 0) ngrams->ForEach(hg.edges_[i], acc);
+  }
+}
+
+struct AccumulateGain {
+  AccumulateGain(const LinearBleuMBR::NGramCounts& c, const vector<double>& t) : counts(c), theta(t), gain() {}
+  void operator()(const WordID* ngram, int n) {
+    key.assign(ngram, ngram + n);
+    LinearBleuMBR::NGramCounts::const_iterator it = counts.find(key);
+    // the posterior probability of an n-gram is bounded by its expected count
+    if (it != counts.end()) gain += theta[n] * min(1.0, it->second);
+  }
+  const LinearBleuMBR::NGramCounts& counts;
+  const vector<double>& theta;
+  vector<WordID> key;
+  double gain;
+};
+
+struct EdgeGainWeightFunction {
+  typedef prob_t Weight;
+  explicit EdgeGainWeightFunction(const vector<double>& g) : gain(g) {}
+  prob_t operator()(const Hypergraph::Edge& e) const { return prob_t::exp(gain[e.id_]); }
+  const vector<double>& gain;
+};
+
+}
+
+LinearBleuMBR::LinearBleuMBR(int order, double precision, double ratio, double scale) :
+    order_(order), scale_(scale), theta_(order + 1) {
+  assert(order > 0);
+  theta_[0] = -1;
+  for (int n = 1; n <= order; ++n)
+    theta_[n] = 1.0 / (4.0 * precision * pow(ratio, n - 1));
+}
+
+void LinearBleuMBR::ExpectedNGramCounts(const Hypergraph& hg, NGramCounts* counts) const {
+  counts->clear();
+  if (hg.edges_.empty()) return;
+  EdgeNGrams ngrams(hg, order_);
+  AddExpectedCounts(hg, scale_, &ngrams, counts);
+}
+
+double LinearBleuMBR::Decode(const Hypergraph& hg, vector<WordID>* result) const {
+  result->clear();
+  if (hg.edges_.empty()) return 0;
+  EdgeNGrams ngrams(hg, order_);
+  NGramCounts counts;
+  AddExpectedCounts(hg, scale_, &ngrams, &counts);
+  vector<double> gain(hg.edges_.size());
+  for (int i = 0; i < hg.edges_.size(); ++i) {
+    AccumulateGain acc(counts, theta_);
+    const int rule_words = ngrams.ForEach(hg.edges_[i], acc);
+    gain[i] = acc.gain + theta_[0] * rule_words;
+  }
+  return log(Viterbi(hg, result, ESentenceTraversal(), EdgeGainWeightFunction(gain)));
+}
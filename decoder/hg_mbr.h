@@ -0,0 +1,46 @@
+#ifndef _HG_MBR_H_
+#define _HG_MBR_H_
+
+#include <vector>
+#include <tr1/unordered_map>
+#include <boost/functional/hash.hpp>
+
+#include "wordid.h"
+
+class Hypergraph;
+
+// Minimum Bayes risk (consensus) decoding of a translation forest under the
+// linear approximation to BLEU of Tromble et al. (2008).  Expected n-gram
+// counts are computed from the edge posteriors (inside-outside) and the gain
+// is then maximized with a Viterbi pass over the same forest, so the cost is
+// linear in the size of the forest rather than quadratic in the size of a
+// k-best list (see Kumar et al., 2009 and DeNero et al., 2009).
+//
+// N-grams that cross a constituent boundary are read off the boundary words
+// of the antecedent node's Viterbi derivation.  This is exact when the nodes
+// of the forest have been split by a language model of at least the MBR
+// order, and an approximation otherwise.
+class LinearBleuMBR {
+ public:
+  typedef std::tr1::unordered_map<std::vector<WordID>, double, boost::hash<std::vector<WordID> > > NGramCounts;
+
+  // order is the longest n-gram used.  precision and ratio are the unigram
+  // precision p and the precision decay r that set the linear BLEU weights
+  // theta_0 = -1 and theta_n = 1 / (4 p r^(n-1)).  Posteriors are computed
+  // with edge weights raised to the power scale.
+  explicit LinearBleuMBR(int order = 4, double precision = 0.85, double ratio = 0.72, double scale = 1.0);
+
+  // expected count of every n-gram (n <= order) in the forest
+  void ExpectedNGramCounts(const Hypergraph& hg, NGramCounts* counts) const;
+
+  // sets result to the translation in hg with the highest expected linear
+  // BLEU gain and returns the gain
+  double Decode(const Hypergraph& hg, std::vector<WordID>* result) const;
+
+ private:
+  const int order_;
+  const double scale_;
+  std::vector<double> theta_;  // theta_[0] is the per word penalty
+};
+
+#endif
@@ -8,6 +8,7 @@
 #include "viterbi.h"
 #include "kbest.h"
 #include "inside_outside.h"
+#include "hg_mbr.h"
 
 #include "hg_test.h"
 
@@ -386,6 +387,29 @@ TEST_F(HGTest, TestGenericKBest) {
   }
 }
 
+TEST_F(HGTest, TestLinearBleuMBR) {
+  Hypergraph hg;
+  CreateHG_int(&hg);
+  SparseVector<double> wts;
+  wts.set_value(FD::Convert("f1"), 1.0);
+  hg.Reweight(wts);
+  // the leaves are equally likely and 'a [1]' is preferred to '[1] b'
+  const double p = exp(0.3) / (exp(0.3) + exp(0.2));
+  LinearBleuMBR mbr(2);
+  LinearBleuMBR::NGramCounts counts;
+  mbr.ExpectedNGramCounts(hg, &counts);
+  vector<WordID> a(1, TD::Convert("a"));
+  vector<WordID> b(1, TD::Convert("b"));
+  EXPECT_FLOAT_EQ(0.5 + p, counts[a]);
+  EXPECT_FLOAT_EQ(1.5 - p, counts[b]);
+  vector<WordID> trans;
+  LinearBleuMBR unigram_mbr(1);
+  const double gain = unigram_mbr.Decode(hg, &trans);
+  EXPECT_EQ("a a", TD::GetString(trans));
+  // E[count(a)] > 1, but its posterior is capped at 1
+  EXPECT_FLOAT_EQ(-2 + 2 * 1.0 / (4 * 0.85), gain);
+}
+
 TEST_F(HGTest, TestReadWriteHG) {
   Hypergraph hg,hg2;
   CreateHG(&hg);
@@ -400,6 +424,38 @@ TEST_F(HGTest, TestReadWriteHG) {
   EXPECT_EQ(hg2.edges_.back().prev_i_, 99);
 }
 
+TEST_F(HGTest, TestReadWriteBinaryHG) {
+  Hypergraph hg,hg2;
+  CreateHG(&hg);
+  hg.edges_.front().j_ = 23;
+  ostringstream os;
+  EXPECT_TRUE(HypergraphIO::WriteToBinary(hg, &os));
+  istringstream is(os.str());
+  EXPECT_TRUE(HypergraphIO::ReadFromBinary(&is, &hg2));
+  EXPECT_EQ(hg2.NumberOfPaths(), hg.NumberOfPaths());
+  EXPECT_EQ(hg2.edges_.front().j_, 23);
+  SparseVector<double> wts;
+  wts.set_value(FD::Convert("f1"), 0.4);
+  wts.set_value(FD::Convert("f2"), 1.0);
+  hg.Reweight(wts);
+  hg2.Reweight(wts);
+  SparseVector<prob_t> exp1, exp2;
+  const prob_t z1 = InsideOutside<prob_t, EdgeProb, SparseVector<prob_t>, EdgeFeaturesAndProbWeightFunction>(hg, &exp1);
+  const prob_t z2 = InsideOutside<prob_t, EdgeProb, SparseVector<prob_t>, EdgeFeaturesAndProbWeightFunction>(hg2, &exp2);
+  EXPECT_FLOAT_EQ(log(z1), log(z2));
+  EXPECT_TRUE(exp1 == exp2);
+  istringstream truncated(os.str().substr(0, os.str().size() - 5));
+  EXPECT_FALSE(HypergraphIO::ReadFromBinary(&truncated, &hg2));
+  // negative node and edge counts
+  for (int c = 0; c < 2; ++c) {
+    string corrupt = os.str();
+    const int32_t negative = -1;
+    corrupt.replace(c * sizeof(int32_t), sizeof(int32_t), reinterpret_cast<const char*>(&negative), sizeof(int32_t));
+    istringstream in(corrupt);
+    EXPECT_FALSE(HypergraphIO::ReadFromBinary(&in, &hg2));
+  }
+}
+
 int main(int argc, char **argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
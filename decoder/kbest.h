@@ -3,29 +3,134 @@
 
 #include <vector>
 #include <utility>
+#include <new>
 #include <tr1/unordered_set>
 
 #include <boost/shared_ptr.hpp>
+#include <boost/functional/hash.hpp>
 
 #include "wordid.h"
 #include "hg.h"
+#include "viterbi.h"
 
 namespace KBest {
+  // filters are called with the hash of each candidate's yield (see
+  // YieldHash) and return true if the candidate should be discarded
+
   // default, don't filter any derivations from the k-best list
   template<typename Dummy>
   struct NoFilter {
-    bool operator()(const Dummy&) {
+    static const bool kUsesYieldHash = false;
+    bool operator()(size_t) {
       return false;
     }
   };
 
-  // optional, filter unique yield strings
+  // optional, filter unique yield strings.  Yields are compared by their
+  // 64-bit hashes only, so a (very unlikely) collision drops a hypothesis
   struct FilterUnique {
-    std::tr1::unordered_set<std::vector<WordID>, boost::hash<std::vector<WordID> > > unique;
+    static const bool kUsesYieldHash = true;
+    std::tr1::unordered_set<size_t> unique;
+
+    bool operator()(size_t yield_hash) {
+      return !unique.insert(yield_hash).second;
+    }
+  };
+
+  // computes the hash of a derivation's yield.  The generic version hashes
+  // the yield after it has been built by the traversal
+  template<typename Traversal>
+  struct YieldHash {
+    static const bool kIncremental = false;
+    template<typename T>
+    size_t operator()(const T& yield) const {
+      return boost::hash<T>()(yield);
+    }
+    // not called, since kIncremental is false
+    template<typename Derivation>
+    void operator()(const Hypergraph::Edge&,
+                    const std::vector<const Derivation*>&,
+                    size_t*,
+                    size_t*) const {}
+  };
+
+  // target strings are hashed incrementally, using a polynomial hash that is
+  // computed from the rule and the hashes of the antecedents' yields, so
+  // that duplicates can be filtered before their yield is built
+  template<>
+  struct YieldHash<ESentenceTraversal> {
+    static const bool kIncremental = true;
+    static const size_t kBASE = 1099511628211ul;
+    size_t operator()(const std::vector<WordID>& yield) const {
+      size_t h = 0;
+      for (std::vector<WordID>::const_iterator i = yield.begin(); i != yield.end(); ++i)
+        h = h * kBASE + static_cast<size_t>(*i);
+      return h;
+    }
+    // sets *hash to the hash of the yield and *pow to kBASE^(yield length)
+    template<typename Derivation>
+    void operator()(const Hypergraph::Edge& edge,
+                    const std::vector<const Derivation*>& ants,
+                    size_t* hash,
+                    size_t* pow) const {
+      size_t h = 0;
+      size_t p = 1;
+      const std::vector<WordID>& e = edge.rule_->e();
+      for (std::vector<WordID>::const_iterator i = e.begin(); i != e.end(); ++i) {
+        if (*i < 1) {
+          const Derivation& ant = *ants[-*i];
+          h = h * ant.yield_pow + ant.yield_hash;
+          p *= ant.yield_pow;
+        } else {
+          h = h * kBASE + static_cast<size_t>(*i);
+          p *= kBASE;
+        }
+      }
+      *hash = h;
+      *pow = p;
+    }
+  };
+
+  // derivations are allocated in fixed-size chunks that are never moved, so
+  // handles (indices) and pointers to them stay valid until the arena is
+  // destroyed, which frees everything at once
+  template<typename D>
+  class DerivationArena {
+   public:
+    typedef unsigned Handle;
+
+    DerivationArena() : size_() {}
+    ~DerivationArena() {
+      for (Handle i = 0; i < size_; ++i)
+        (*this)[i].~D();
+      for (int i = 0; i < chunks_.size(); ++i)
+        ::operator delete(chunks_[i]);
+    }
 
-    bool operator()(const std::vector<WordID>& yield) {
-      return !unique.insert(yield).second;
+    Handle Add(const D& d) {
+      if (size_ == (chunks_.size() << kCHUNK_BITS))
+        chunks_.push_back(static_cast<D*>(::operator new(sizeof(D) << kCHUNK_BITS)));
+      new (&(*this)[size_]) D(d);
+      return size_++;
     }
+
+    // removes the most recently added derivation
+    void PopBack() {
+      --size_;
+      (*this)[size_].~D();
+    }
+
+    D& operator[](Handle h) { return chunks_[h >> kCHUNK_BITS][h & kCHUNK_MASK]; }
+    const D& operator[](Handle h) const { return chunks_[h >> kCHUNK_BITS][h & kCHUNK_MASK]; }
+
+   private:
+    DerivationArena(const DerivationArena&);
+    void operator=(const DerivationArena&);
+
+    static const unsigned kCHUNK_BITS = 8;
+    static const unsigned kCHUNK_MASK = (1u << kCHUNK_BITS) - 1;
+    std::vector<D*> chunks_;
+    Handle size_;
   };
 
   // utility class to lazily create the k-best derivations from a forest, uses
@@ -40,42 +145,46 @@ namespace KBest {
                      const size_t k,
                      const Traversal& tf = Traversal(),
                      const WeightFunction& wf = WeightFunction()) :
-      traverse(tf), w(wf), g(hg), nds(g.nodes_.size()), k_prime(k) {}
-
-    ~KBestDerivations() {
-      for (int i = 0; i < freelist.size(); ++i)
-        delete freelist[i];
-    }
+      traverse(tf), w(wf), yield_hash(), g(hg), nds(g.nodes_.size()), k_prime(k),
+      unique(10, DerivationUniquenessHash(&arena), DerivationUniquenessEquals(&arena)) {}
 
     struct Derivation {
       Derivation(const Hypergraph::Edge& e,
                  const SmallVectorInt& jv,
-                 const WeightType& w,
-                 const SparseVector<double>& f) :
+                 const WeightType& w) :
         edge(&e),
         j(jv),
         score(w),
-        feature_values(f) {}
-
-      // dummy constructor, just for query
-      Derivation(const Hypergraph::Edge& e,
-                 const SmallVectorInt& jv) : edge(&e), j(jv) {}
+        yield_hash(),
+        yield_pow(1) {}
 
+      // yield and feature_values are only computed when the derivation is
+      // added to its node's k-best list (candidates that are never popped
+      // from the heap, or are filtered, don't pay for them)
       T yield;
       const Hypergraph::Edge* const edge;
       const SmallVectorInt j;
       const WeightType score;
-      const SparseVector<double> feature_values;
+      SparseVector<double> feature_values;
+      size_t yield_hash;  // only set if the filter uses yield hashes
+      size_t yield_pow;   // (used by incremental yield hashes)
     };
+    typedef DerivationArena<Derivation> Arena;
+    typedef typename Arena::Handle DerivationHandle;
+
     struct HeapCompare {
-      bool operator()(const Derivation* a, const Derivation* b) const {
-        return a->score < b->score;
+      explicit HeapCompare(const Arena* a) : arena(*a) {}
+      bool operator()(DerivationHandle a, DerivationHandle b) const {
+        return arena[a].score < arena[b].score;
       }
+      const Arena& arena;
     };
     struct DerivationCompare {
-      bool operator()(const Derivation* a, const Derivation* b) const {
-        return a->score > b->score;
+      explicit DerivationCompare(const Arena* a) : arena(*a) {}
+      bool operator()(DerivationHandle a, DerivationHandle b) const {
+        return arena[a].score > arena[b].score;
       }
+      const Arena& arena;
     };
 
     struct EdgeHandle {
@@ -87,7 +196,7 @@ namespace KBest {
     };
 
     EdgeHandle operator()(int t,int taili,EdgeHandle const& parent) const {
-      return EdgeHandle(nds[t].D[parent.d->j[taili]]);
+      return EdgeHandle(&arena[nds[t].D[parent.d->j[taili]]]);
     }
 
     std::string derivation_tree(Derivation const& d,bool indent=true,int show_mask=Hypergraph::SPAN|Hypergraph::RULE,int maxdepth=0x7FFFFFFF,int depth=0) const {
@@ -95,29 +204,35 @@ namespace KBest {
     }
 
     struct DerivationUniquenessHash {
-      size_t operator()(const Derivation* d) const {
+      explicit DerivationUniquenessHash(const Arena* a) : arena(a) {}
+      size_t operator()(DerivationHandle h) const {
+        const Derivation* d = &(*arena)[h];
         size_t x = 5381;
         x = ((x << 5) + x) ^ d->edge->id_;
         for (int i = 0; i < d->j.size(); ++i)
           x = ((x << 5) + x) ^ d->j[i];
         return x;
       }
+      const Arena* arena;
     };
     struct DerivationUniquenessEquals {
-      bool operator()(const Derivation* a, const Derivation* b) const {
+      explicit DerivationUniquenessEquals(const Arena* a) : arena(a) {}
+      bool operator()(DerivationHandle ha, DerivationHandle hb) const {
+        const Derivation* a = &(*arena)[ha];
+        const Derivation* b = &(*arena)[hb];
         return (a->edge == b->edge) && (a->j == b->j);
       }
+      const Arena* arena;
     };
-    typedef std::vector<Derivation*> CandidateHeap;
-    typedef std::vector<Derivation*> DerivationList;
+    typedef std::vector<DerivationHandle> CandidateHeap;
+    typedef std::vector<DerivationHandle> DerivationList;
     typedef std::tr1::unordered_set<
-       const Derivation*, DerivationUniquenessHash, DerivationUniquenessEquals> UniqueDerivationSet;
+       DerivationHandle, DerivationUniquenessHash, DerivationUniquenessEquals> UniqueDerivationSet;
 
     struct NodeDerivationState {
       CandidateHeap cand;
       DerivationList D;
       DerivationFilter filter;
-      UniqueDerivationSet ds;
       explicit NodeDerivationState(const DerivationFilter& f = DerivationFilter()) : filter(f) {}
     };
 
@@ -129,46 +244,73 @@ namespace KBest {
       bool add_next = true;
       while (D.size() <= k) {
         if (add_next && D.size() > 0) {
-          const Derivation* d = D.back();
-          LazyNext(d, &cand, &s.ds);
+          const DerivationHandle d = D.back();
+          LazyNext(d, &cand);
         }
         add_next = false;
 
         if (cand.size() > 0) {
-          std::pop_heap(cand.begin(), cand.end(), HeapCompare());
-          Derivation* d = cand.back();
+          std::pop_heap(cand.begin(), cand.end(), HeapCompare(&arena));
+          const DerivationHandle h = cand.back();
           cand.pop_back();
-          std::vector<const T*> ants(d->edge->Arity());
+          Derivation* d = &arena[h];
+          std::vector<const Derivation*> ants(d->edge->Arity());
           for (int j = 0; j < ants.size(); ++j)
-            ants[j] = &LazyKthBest(d->edge->tail_nodes_[j], d->j[j])->yield;
-          traverse(*d->edge, ants, &d->yield);
-          if (!filter(d->yield)) {
-            D.push_back(d);
+            ants[j] = LazyKthBest(d->edge->tail_nodes_[j], d->j[j]);
+          bool keep = true;
+          if (DerivationFilter::kUsesYieldHash) {
+            if (YieldHash<Traversal>::kIncremental) {
+              yield_hash(*d->edge, ants, &d->yield_hash, &d->yield_pow);
+              keep = !filter(d->yield_hash);
+              if (keep) Materialize(ants, d);
+            } else {
+              Materialize(ants, d);
+              d->yield_hash = HashYield(d->yield);
+              keep = !filter(d->yield_hash);
+            }
+          } else {
+            Materialize(ants, d);
+          }
+          if (keep) {
+            D.push_back(h);
             add_next = true;
           }
         } else {
           break;
         }
       }
-      if (k < D.size()) return D[k]; else return NULL;
+      if (k < D.size()) return &arena[D[k]]; else return NULL;
     }
 
   private:
-    // creates a derivation object with all fields set but the yield
-    // the yield is computed in LazyKthBest before the derivation is added to D
-    // returns NULL if j refers to derivation numbers larger than the
+    // builds the yield and feature vector of d from those of its antecedents
+    void Materialize(const std::vector<const Derivation*>& ants, Derivation* d) {
+      std::vector<const T*> ant_yields(ants.size());
+      d->feature_values = d->edge->feature_values_;
+      for (int i = 0; i < ants.size(); ++i) {
+        ant_yields[i] = &ants[i]->yield;
+        d->feature_values += ants[i]->feature_values;
+      }
+      traverse(*d->edge, ant_yields, &d->yield);
+    }
+
+    size_t HashYield(const T& yield) const {
+      return YieldHash<Traversal>()(yield);
+    }
+
+    // creates a derivation with all fields set but the yield and features,
+    // which are computed in LazyKthBest when the derivation is added to D.
+    // returns false if j refers to derivation numbers larger than the
     // antecedent structure define
-    Derivation* CreateDerivation(const Hypergraph::Edge& e, const SmallVectorInt& j) {
+    bool CreateDerivation(const Hypergraph::Edge& e, const SmallVectorInt& j, DerivationHandle* h) {
       WeightType score = w(e);
-      SparseVector<double> feats = e.feature_values_;
       for (int i = 0; i < e.Arity(); ++i) {
         const Derivation* ant = LazyKthBest(e.tail_nodes_[i], j[i]);
-        if (!ant) { return NULL; }
+        if (!ant) { return false; }
         score *= ant->score;
-        feats += ant->feature_values;
       }
-      freelist.push_back(new Derivation(e, j, score, feats));
-      return freelist.back();
+      *h = arena.Add(Derivation(e, j, score));
+      return true;
     }
 
     NodeDerivationState& GetCandidates(int v) {
@@ -176,37 +318,42 @@ namespace KBest {
       if (!s.D.empty() || !s.cand.empty()) return s;
 
       const Hypergraph::Node& node = g.nodes_[v];
+      s.cand.reserve(node.in_edges_.size());
       for (int i = 0; i < node.in_edges_.size(); ++i) {
         const Hypergraph::Edge& edge = g.edges_[node.in_edges_[i]];
         SmallVectorInt jv(edge.Arity(), 0);
-        Derivation* d = CreateDerivation(edge, jv);
-        assert(d);
+        DerivationHandle d;
+        const bool created = CreateDerivation(edge, jv, &d);
+        assert(created);
         s.cand.push_back(d);
       }
 
       const int effective_k = std::min(k_prime, s.cand.size());
       const typename CandidateHeap::iterator kth = s.cand.begin() + effective_k;
-      std::nth_element(s.cand.begin(), kth, s.cand.end(), DerivationCompare());
+      std::nth_element(s.cand.begin(), kth, s.cand.end(), DerivationCompare(&arena));
       s.cand.resize(effective_k);
-      std::make_heap(s.cand.begin(), s.cand.end(), HeapCompare());
+      std::make_heap(s.cand.begin(), s.cand.end(), HeapCompare(&arena));
 
       return s;
     }
 
-    void LazyNext(const Derivation* d, CandidateHeap* cand, UniqueDerivationSet* ds) {
-      for (int i = 0; i < d->j.size(); ++i) {
+    void LazyNext(const DerivationHandle dh, CandidateHeap* cand) {
+      for (int i = 0; i < arena[dh].j.size(); ++i) {
+        const Derivation* d = &arena[dh];
         SmallVectorInt j = d->j;
         ++j[i];
         const Derivation* ant = LazyKthBest(d->edge->tail_nodes_[i], j[i]);
         if (ant) {
-          Derivation query_unique(*d->edge, j);
-          if (ds->count(&query_unique) == 0) {
-            Derivation* new_d = CreateDerivation(*d->edge, j);
-            if (new_d) {
+          // the other antecedents are already in their k-best lists, so
+          // creating the derivation doesn't add anything else to the arena
+          // and it can simply be popped again if it is a duplicate
+          DerivationHandle new_d;
+          if (CreateDerivation(*arena[dh].edge, j, &new_d)) {
+            if (unique.insert(new_d).second) {
               cand->push_back(new_d);
-              std::push_heap(cand->begin(), cand->end(), HeapCompare());
-              bool inserted = ds->insert(new_d).second;  // insert into uniqueness set
-              assert(inserted);
+              std::push_heap(cand->begin(), cand->end(), HeapCompare(&arena));
+            } else {
+              arena.PopBack();
             }
           }
         }
@@ -215,10 +362,12 @@ namespace KBest {
 
     const Traversal traverse;
     const WeightFunction w;
+    const YieldHash<Traversal> yield_hash;
     const Hypergraph& g;
+    Arena arena;
     std::vector<NodeDerivationState> nds;
-    std::vector<Derivation*> freelist;
     const size_t k_prime;
+    UniqueDerivationSet unique;  // (edge, j) of the candidates created by LazyNext
   };
 }
 
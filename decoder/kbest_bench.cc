@@ -0,0 +1,84 @@
+// times lazy k-best extraction (plain and unique) on the forests in
+// test_data, for k = 100, 1000 and 10000
+//
+//   kbest_bench [forest.json.gz ...]
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+
+#include "filelib.h"
+#include "fdict.h"
+#include "hg.h"
+#include "hg_io.h"
+#include "kbest.h"
+#include "viterbi.h"
+
+using namespace std;
+
+static double Now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+template <typename Filter>
+static void Run(const Hypergraph& hg, const int k, int* n, unsigned long* words) {
+  KBest::KBestDerivations<vector<WordID>, ESentenceTraversal, Filter> kbest(hg, k);
+  *n = 0;
+  *words = 0;
+  for (int i = 0; i < k; ++i) {
+    const typename KBest::KBestDerivations<vector<WordID>, ESentenceTraversal, Filter>::Derivation* d =
+      kbest.LazyKthBest(hg.nodes_.size() - 1, i);
+    if (!d) break;
+    ++*n;
+    *words += d->yield.size();
+  }
+}
+
+template <typename Filter>
+static void Time(const string& name, const Hypergraph& hg, const int k, const char* type) {
+  int n;
+  unsigned long words;
+  int reps = 0;
+  const double start = Now();
+  double elapsed = 0;
+  // repeat short runs so that the timings are not dominated by clock resolution
+  do {
+    Run<Filter>(hg, k, &n, &words);
+    ++reps;
+    elapsed = Now() - start;
+  } while (elapsed < 0.5);
+  const double per = elapsed / reps;
+  cout << name << '\t' << type << "\tk=" << k << "\tderivations=" << n
+       << "\tsec=" << per << "\tderiv/sec=" << (per > 0 ? n / per : 0)
+       << "\tavg_len=" << (n ? static_cast<double>(words) / n : 0) << endl;
+}
+
+int main(int argc, char** argv) {
+  vector<string> files;
+  for (int i = 1; i < argc; ++i) files.push_back(argv[i]);
+  if (files.empty()) {
+    files.push_back("test_data/small.json.gz");
+    files.push_back("test_data/perro.json.gz");
+    files.push_back("test_data/urdu.json.gz");
+  }
+  const int ks[] = { 100, 1000, 10000 };
+  for (int f = 0; f < files.size(); ++f) {
+    Hypergraph hg;
+    {
+      ReadFile rf(files[f]);
+      HypergraphIO::ReadFromJSON(rf.stream(), &hg);
+    }
+    // every feature gets weight 1
+    vector<double> w(FD::NumFeats(), 1.0);
+    hg.Reweight(w);
+    cerr << files[f] << ": " << hg.nodes_.size() << " nodes, " << hg.edges_.size() << " edges\n";
+    for (int i = 0; i < 3; ++i) {
+      Time<KBest::NoFilter<vector<WordID> > >(files[f], hg, ks[i], "all");
+      Time<KBest::FilterUnique>(files[f], hg, ks[i], "unique");
+    }
+  }
+  return 0;
+}
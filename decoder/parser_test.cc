@@ -1,12 +1,14 @@
 #include <cassert>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <vector>
 #include <gtest/gtest.h>
 #include "hg.h"
 #include "trule.h"
 #include "bottom_up_parser.h"
 #include "tdict.h"
+#include "fdict.h"
 
 using namespace std;
 
@@ -29,6 +31,35 @@ TEST_F(ChartTest,LanguageModel) {
   parser.Parse(lattice, &forest);
 }
 
+TEST_F(ChartTest,CellPruning) {
+  Lattice lattice(2);
+  lattice[0].push_back(LatticeArc(TD::Convert("ein"), 0.0, 1));
+  lattice[1].push_back(LatticeArc(TD::Convert("haus"), 0.0, 1));
+  istringstream in("[X] ||| ein ||| a ||| F=1\n"
+                   "[X] ||| ein ||| one ||| F=0.5\n"
+                   "[X] ||| haus ||| house ||| F=1\n"
+                   "[X] ||| haus ||| home ||| F=0.2\n"
+                   "[X] ||| [X,1] [X,2] ||| [1] [2] ||| F=0\n"
+                   "[X] ||| ein haus ||| a house ||| F=1.5\n");
+  vector<GrammarPtr> grammars(1, GrammarPtr(new TextGrammar(&in)));
+  vector<double> weights(FD::Convert("F") + 1);
+  weights[FD::Convert("F")] = 1;
+  Hypergraph exhaustive;
+  EXPECT_TRUE(ExhaustiveBottomUpParser("X", grammars).Parse(lattice, &exhaustive));
+  EXPECT_EQ(7, exhaustive.edges_.size());
+  // only the best edge of each span remains
+  CellPruning pruning;
+  pruning.limit = 1;
+  Hypergraph pruned;
+  EXPECT_TRUE(PrunedBottomUpParser("X", grammars, weights, pruning).Parse(lattice, &pruned));
+  EXPECT_EQ(4, pruned.edges_.size());
+  // [X,1] [X,2] (score 2) is better than ein haus (1.5)
+  const Hypergraph::Node& goal = pruned.nodes_.back();
+  const Hypergraph::Node& top = pruned.nodes_[pruned.edges_[goal.in_edges_[0]].tail_nodes_[0]];
+  ASSERT_EQ(1, top.in_edges_.size());
+  EXPECT_EQ(2, pruned.edges_[top.in_edges_[0]].rule_->Arity());
+}
+
 int main(int argc, char **argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
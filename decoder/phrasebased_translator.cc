@@ -1,16 +1,18 @@
 #include "phrasebased_translator.h"
 
-#include <queue>
+#include <deque>
 #include <iostream>
-#include <tr1/unordered_map>
+#include <algorithm>
+#include <limits>
+#include <cmath>
 #include <tr1/unordered_set>
 
-#include <boost/tuple/tuple.hpp>
 #include <boost/functional/hash.hpp>
 
 #include "sentence_metadata.h"
 #include "tdict.h"
 #include "hg.h"
+#include "ff.h"
 #include "filelib.h"
 #include "lattice.h"
 #include "phrasetable_fst.h"
@@ -18,87 +20,305 @@
 
 using namespace std;
 using namespace std::tr1;
-using namespace boost::tuples;
-
-struct Coverage : public vector<bool> {
-  explicit Coverage(int n, bool v = false) : vector<bool>(n, v), first_gap() {}
-  void Cover(int i, int j) {
-    vector<bool>::iterator it = this->begin() + i;
-    vector<bool>::iterator end = this->begin() + j;
-    while (it != end)
-      *it++ = true;
-    if (first_gap == i) {
-      first_gap = j;
-      it = end;
-      while (*it && it != this->end()) {
-        ++it;
-        ++first_gap;
-      }
-    }
+
+// a translation of the source span [i,j)
+struct PhraseOption {
+  PhraseOption(int _i, int _j, const TRulePtr& r) : i(_i), j(_j), rule(r), node(-1) {}
+  int i;
+  int j;
+  TRulePtr rule;
+  FFState state;    // of the models after the target phrase
+  double score;     // log score of the phrase, including the models applied to it
+  double estimate;  // log estimate of the model scores that depend on its context
+  int node;         // in the forest, -1 until needed
+};
+
+struct Hypothesis;
+// a way to reach a hypothesis: by translating option after prev
+struct HypothesisArc {
+  HypothesisArc(Hypothesis* p, int o) : prev(p), option(o) {}
+  Hypothesis* prev;
+  int option;
+};
+
+struct Hypothesis {
+  Hypothesis() : covered(), inside(), estimate(), future(), node(-1) {}
+  double Score() const { return inside + estimate + future; }
+  Coverage coverage;
+  int covered;       // number of covered positions, the index of its stack
+  FFState state;
+  double inside;     // log score of the best translation of the covered words
+  double estimate;   // log estimate of the model scores that depend on context
+  double future;     // log estimate of the score of the uncovered words
+  vector<HypothesisArc> arcs;  // the best first, then the recombined ones
+  int node;          // in the forest, -1 until needed
+};
+
+// hypotheses are recombined if they cover the same words and the models are
+// in the same state
+struct HypothesisHash {
+  size_t operator()(const Hypothesis* h) const {
+    size_t seed = h->coverage.Hash();
+    boost::hash_combine(seed, boost::hash_range(h->state.begin(), h->state.end()));
+    return seed;
   }
-  bool Collides(int i, int j) const {
-    vector<bool>::const_iterator it = this->begin() + i;
-    vector<bool>::const_iterator end = this->begin() + j;
-    while (it != end)
-      if (*it++) return true;
-    return false;
+};
+struct HypothesisEqual {
+  bool operator()(const Hypothesis* a, const Hypothesis* b) const {
+    return a->coverage == b->coverage && a->state == b->state;
   }
-  int GetFirstGap() const { return first_gap; }
- private:
-  int first_gap;
 };
-struct CoverageHash {
-  size_t operator()(const Coverage& cov) const {
-    return hasher_(static_cast<const vector<bool>&>(cov));
+struct ScoreGreater {
+  bool operator()(const Hypothesis* a, const Hypothesis* b) const {
+    return a->Score() > b->Score();
   }
- private:
-  boost::hash<vector<bool> > hasher_;
 };
-ostream& operator<<(ostream& os, const Coverage& cov) {
-  os << '[';
-  for (int i = 0; i < cov.size(); ++i)
-    os << (cov[i] ? '*' : '.');
-  return os << " gap=" << cov.GetFirstGap() << ']';
-}
-
-typedef unordered_map<Coverage, int, CoverageHash> CoverageNodeMap;
-typedef unordered_set<Coverage, CoverageHash> UniqueCoverageSet;
 
 struct PhraseBasedTranslatorImpl {
-  PhraseBasedTranslatorImpl(const boost::program_options::variables_map& conf) :
+  PhraseBasedTranslatorImpl(const boost::program_options::variables_map& conf, ModelSet* models) :
       add_pass_through_rules(conf.count("add_pass_through_rules")),
       max_distortion(conf["pb_max_distortion"].as<int>()),
+      stack_size(conf["pb_stack_size"].as<int>()),
+      beam(conf.count("pb_beam") ? conf["pb_beam"].as<double>() : 0.0),
+      models_(models),
       kCONCAT_RULE(new TRule("[X] ||| [X,1] [X,2] ||| [X,1] [X,2]", true)),
-      kNT_TYPE(TD::Convert("X") * -1) {
+      kGOAL_RULE(new TRule("[Goal] ||| [X,1] ||| [X,1]")),
+      kNT_TYPE(TD::Convert("X") * -1),
+      tail_states_(2) {
     assert(max_distortion >= 0);
+    assert(stack_size > 0);
     vector<string> gfiles = conf["grammar"].as<vector<string> >();
     assert(gfiles.size() == 1);
-    cerr << "Reading phrasetable from " << gfiles.front() << endl;
-    ReadFile in(gfiles.front());
-    fst.reset(LoadTextPhrasetable(in.stream()));
+    fst.reset(LoadPhrasetable(gfiles.front()));
+  }
+
+  // sets the log score of edge, whose tails have tail_states, the log
+  // estimate of its context dependent scores and the state of the models
+  // after it
+  void ScoreEdge(const SentenceMetadata& smeta,
+                 const vector<double>& weights,
+                 const FFStates& tail_states,
+                 Hypergraph::Edge* edge,
+                 FFState* state,
+                 double* score,
+                 double* estimate) const {
+    if (!models_) {
+      *score = edge->feature_values_.dot(weights);
+      *estimate = 0;
+      return;
+    }
+    prob_t est;
+    models_->AddFeaturesToEdge(smeta, scratch_, tail_states, edge, state, &est);
+    *score = log(edge->edge_prob_);
+    *estimate = log(est);
+  }
+
+  // finds the translations of all source spans and scores them
+  void CollectOptions(const Lattice& lattice, int i, int j, const FSTNode* q,
+                      const SentenceMetadata& smeta, const vector<double>& weights) {
+    if (q->HasData()) {
+      const vector<TRulePtr>& phrases = q->GetTranslations()->GetRules();
+      for (int k = 0; k < phrases.size(); ++k) {
+        options_.push_back(PhraseOption(i, j, phrases[k]));
+        PhraseOption& o = options_.back();
+        Hypergraph::Edge edge;
+        edge.rule_ = o.rule;
+        edge.feature_values_ = o.rule->scores_;
+        edge.i_ = i;
+        edge.j_ = j;
+        ScoreEdge(smeta, weights, FFStates(), &edge, &o.state, &o.score, &o.estimate);
+      }
+    }
+    if (j == lattice.size()) return;
+    const vector<LatticeArc>& arcs = lattice[j];
+    for (int l = 0; l < arcs.size(); ++l) {
+      const FSTNode* next = q->Extend(arcs[l].label);
+      if (next) CollectOptions(lattice, i, j + arcs[l].dist2next, next, smeta, weights);
+      // TODO handle lattice edge features
+    }
+  }
+
+  // future_(i,j) is the best score of translating [i,j) in any order
+  void ComputeFutureCosts(int n) {
+    future_ = Array2D<double>(n + 1, n + 1, -numeric_limits<double>::infinity());
+    for (int k = 0; k < options_.size(); ++k) {
+      const PhraseOption& o = options_[k];
+      future_(o.i, o.j) = max(future_(o.i, o.j), o.score + o.estimate);
+    }
+    for (int l = 2; l <= n; ++l)
+      for (int i = 0; i + l <= n; ++i)
+        for (int k = i + 1; k < i + l; ++k)
+          future_(i, i + l) = max(future_(i, i + l), future_(i, k) + future_(k, i + l));
+  }
+
+  double FutureCost(const Coverage& coverage, int n) const {
+    double cost = 0;
+    for (int i = coverage.FirstGap(n); i < n;) {
+      int j = i + 1;
+      while (j < n && !coverage.IsCovered(j)) ++j;
+      cost += future_(i, j);
+      for (i = j; i < n && coverage.IsCovered(i); ++i);
+    }
+    return cost;
+  }
+
+  // adds the translation of option k after h to the stack it belongs to
+  void Extend(Hypothesis& h, int k, int n,
+              const SentenceMetadata& smeta, const vector<double>& weights) {
+    const PhraseOption& o = options_[k];
+    Hypothesis cand;
+    cand.coverage = h.coverage;
+    cand.coverage.Cover(o.i, o.j);
+    cand.covered = h.covered + o.j - o.i;
+    cand.future = FutureCost(cand.coverage, n);
+    if (cand.future == -numeric_limits<double>::infinity()) return;  // a gap can't be translated
+    if (h.covered == 0) {
+      cand.state = o.state;
+      cand.inside = o.score;
+      cand.estimate = o.estimate;
+    } else {
+      Hypergraph::Edge edge;
+      edge.rule_ = kCONCAT_RULE;
+      edge.tail_nodes_.resize(2);
+      edge.tail_nodes_[0] = 0;
+      edge.tail_nodes_[1] = 1;
+      tail_states_[0] = h.state;
+      tail_states_[1] = o.state;
+      double score;
+      ScoreEdge(smeta, weights, tail_states_, &edge, &cand.state, &score, &cand.estimate);
+      cand.inside = h.inside + o.score + score;
+    }
+    if (cand.covered == n && models_) {
+      // the final features replace the estimate
+      Hypergraph::Edge edge;
+      edge.rule_ = kGOAL_RULE;
+      models_->AddFinalFeatures(cand.state, &edge, smeta);
+      cand.estimate = log(edge.edge_prob_);
+    }
+    cand.arcs.push_back(HypothesisArc(&h, k));
+    Stack& stack = stacks_[cand.covered];
+    const Stack::iterator it = stack.find(&cand);
+    if (it != stack.end()) {
+      Hypothesis& prev = **it;
+      if (cand.inside > prev.inside) {
+        prev.inside = cand.inside;
+        prev.arcs.insert(prev.arcs.begin(), cand.arcs.front());
+      } else {
+        prev.arcs.push_back(cand.arcs.front());
+      }
+      return;
+    }
+    hyps_.push_back(cand);
+    stack.insert(&hyps_.back());
   }
 
-  struct State {
-    State(const Coverage& c, int _i, int _j, const FSTNode* q) :
-      coverage(c), i(_i), j(_j), fst(q) {}
-    Coverage coverage;
-    int i;
-    int j;
-    const FSTNode* fst;
-  };
-
-  // we keep track of unique coverages that have been extended since it's
-  // possible to "extend" the same coverage twice, e.g. translate "a b c"
-  // with phrases "a" "b" "a b" and "c".  There are two ways to cover "a b"
-  void EnqueuePossibleContinuations(const Coverage& coverage, queue<State>* q, UniqueCoverageSet* ucs) {
-    if (ucs->insert(coverage).second) {
-      const int gap = coverage.GetFirstGap();
-      const int end = min(static_cast<int>(coverage.size()), gap + max_distortion + 1);
-      for (int i = gap; i < end; ++i)
-        if (!coverage[i]) q->push(State(coverage, i, i, fst.get()));
+  // the hypotheses of a stack that survive histogram and threshold pruning,
+  // best first
+  void Prune(const int c, vector<Hypothesis*>* kept) const {
+    kept->assign(stacks_[c].begin(), stacks_[c].end());
+    stable_sort(kept->begin(), kept->end(), ScoreGreater());
+    if (kept->size() > stack_size) kept->resize(stack_size);
+    if (beam > 0 && !kept->empty()) {
+      const double threshold = kept->front()->Score() - beam;
+      int k = 1;
+      while (k < kept->size() && (*kept)[k]->Score() >= threshold) ++k;
+      kept->resize(k);
     }
   }
 
+  int OptionNode(int k, Hypergraph* hg) {
+    PhraseOption& o = options_[k];
+    if (o.node < 0) {
+      Hypergraph::Edge* edge = hg->AddEdge(o.rule, Hypergraph::TailNodeVector());
+      edge->feature_values_ = o.rule->scores_;
+      edge->i_ = o.i;
+      edge->j_ = o.j;
+      o.node = hg->AddNode(kNT_TYPE)->id_;
+      hg->ConnectEdgeToHeadNode(edge->id_, o.node);
+    }
+    return o.node;
+  }
+
+  // adds the node of h and the edges of its arcs to the forest
+  int HypothesisNode(Hypothesis& h, Hypergraph* hg) {
+    if (h.node >= 0) return h.node;
+    vector<int> edges;
+    for (int a = 0; a < h.arcs.size(); ++a) {
+      const HypothesisArc& arc = h.arcs[a];
+      if (arc.prev->covered == 0) {  // left edge
+        const PhraseOption& o = options_[arc.option];
+        Hypergraph::Edge* edge = hg->AddEdge(o.rule, Hypergraph::TailNodeVector());
+        edge->feature_values_ = o.rule->scores_;
+        edge->i_ = o.i;
+        edge->j_ = o.j;
+        edges.push_back(edge->id_);
+      } else {
+        Hypergraph::TailNodeVector tail(2, HypothesisNode(*arc.prev, hg));
+        tail[1] = OptionNode(arc.option, hg);
+        edges.push_back(hg->AddEdge(kCONCAT_RULE, tail)->id_);
+      }
+    }
+    const int node = hg->AddNode(kNT_TYPE)->id_;
+    for (int e = 0; e < edges.size(); ++e)
+      hg->ConnectEdgeToHeadNode(edges[e], node);
+    h.node = node;
+    return node;
+  }
+
+  // beam search through stacks of hypotheses covering the same number of
+  // source positions.  The -LM forest is the graph of the expanded
+  // hypotheses that reach the goal.
+  bool Search(const Lattice& lattice,
+              const SentenceMetadata& smeta,
+              const vector<double>& weights,
+              Hypergraph* minus_lm_forest) {
+    const int n = lattice.size();
+    for (int i = 0; i < n; ++i)
+      CollectOptions(lattice, i, i, fst.get(), smeta, weights);
+    vector<vector<int> > starting(n);  // the options of each start position
+    for (int k = 0; k < options_.size(); ++k)
+      starting[options_[k].i].push_back(k);
+    ComputeFutureCosts(n);
+
+    stacks_.resize(n + 1);
+    hyps_.push_back(Hypothesis());
+    stacks_[0].insert(&hyps_.back());
+    vector<Hypothesis*> kept;
+    for (int c = 0; c < n; ++c) {
+      Prune(c, &kept);
+      for (int h = 0; h < kept.size(); ++h) {
+        Hypothesis& hyp = *kept[h];
+        const int gap = hyp.coverage.FirstGap(n);
+        const int end = min(n, gap + max_distortion + 1);
+        for (int i = gap; i < end; ++i) {
+          if (hyp.coverage.IsCovered(i)) continue;
+          for (int s = 0; s < starting[i].size(); ++s) {
+            const PhraseOption& o = options_[starting[i][s]];
+            if (!hyp.coverage.Collides(o.i, o.j))
+              Extend(hyp, starting[i][s], n, smeta, weights);
+          }
+        }
+      }
+    }
+    Prune(n, &kept);
+    if (kept.empty() || n == 0) return false;
+
+    minus_lm_forest->ReserveNodes(hyps_.size() + options_.size() + 1, hyps_.size() * 2 + options_.size());
+    Hypergraph::TailNodeVector tail(1);
+    vector<int> edges;
+    for (int h = 0; h < kept.size(); ++h) {
+      tail[0] = HypothesisNode(*kept[h], minus_lm_forest);
+      edges.push_back(minus_lm_forest->AddEdge(kGOAL_RULE, tail)->id_);
+    }
+    const int goal = minus_lm_forest->AddNode(TD::Convert("Goal") * -1)->id_;
+    for (int e = 0; e < edges.size(); ++e)
+      minus_lm_forest->ConnectEdgeToHeadNode(edges[e], goal);
+    // they are almost topo, but not quite always
+    minus_lm_forest->TopologicallySortNodesAndEdges(goal);
+    minus_lm_forest->Reweight(weights);
+    return true;
+  }
+
   bool Translate(const std::string& input,
                  SentenceMetadata* smeta,
                  const std::vector<double>& weights,
@@ -106,8 +326,10 @@ struct PhraseBasedTranslatorImpl {
     Lattice lattice;
     LatticeTools::ConvertTextOrPLF(input, &lattice);
     smeta->SetSourceLength(lattice.size());
-    size_t est_nodes = lattice.size() * lattice.size() * (1 << max_distortion);
-    minus_lm_forest->ReserveNodes(est_nodes, est_nodes * 100);
+    if (lattice.size() > Coverage::kMAX_LENGTH) {
+      cerr << "  Phrase-based decoder: input is longer than " << Coverage::kMAX_LENGTH << " positions\n";
+      return false;
+    }
     if (add_pass_through_rules) {
       SparseVector<double> feats;
       feats.set_value(FD::Convert("PassThrough"), 1);
@@ -119,84 +341,39 @@ struct PhraseBasedTranslatorImpl {
         }
       }
     }
-    CoverageNodeMap c;
-    queue<State> q;
-    UniqueCoverageSet ucs;
-    const Coverage empty_cov(lattice.size(), false);
-    const Coverage goal_cov(lattice.size(), true);
-    EnqueuePossibleContinuations(empty_cov, &q, &ucs);
-    c[empty_cov] = 0;   // have to handle the left edge specially
-    while(!q.empty()) {
-      const State s = q.front();
-      q.pop();
-      // cerr << "(" << s.i << "," << s.j << " ptr=" << s.fst << ") cov=" << s.coverage << endl;
-      const vector<LatticeArc>& arcs = lattice[s.j];
-      if (s.fst->HasData()) {
-        Coverage new_cov = s.coverage;
-        new_cov.Cover(s.i, s.j);
-        EnqueuePossibleContinuations(new_cov, &q, &ucs);
-        const vector<TRulePtr>& phrases = s.fst->GetTranslations()->GetRules();
-        const int phrase_head_index = minus_lm_forest->AddNode(kNT_TYPE)->id_;
-        for (int i = 0; i < phrases.size(); ++i) {
-          Hypergraph::Edge* edge = minus_lm_forest->AddEdge(phrases[i], Hypergraph::TailNodeVector());
-          edge->feature_values_ = edge->rule_->scores_;
-          edge->i_ = s.i;
-          edge->j_ = s.j;
-          minus_lm_forest->ConnectEdgeToHeadNode(edge->id_, phrase_head_index);
-        }
-        CoverageNodeMap::iterator cit = c.find(s.coverage);
-        assert(cit != c.end());
-        const int tail_node_plus1 = cit->second;
-        if (tail_node_plus1 == 0) {  // left edge
-          c[new_cov] = phrase_head_index + 1;
-        } else { // not left edge
-          int& head_node_plus1 = c[new_cov];
-          if (!head_node_plus1)
-            head_node_plus1 = minus_lm_forest->AddNode(kNT_TYPE)->id_ + 1;
-          Hypergraph::TailNodeVector tail(2, tail_node_plus1 - 1);
-          tail[1] = phrase_head_index;
-          const int concat_edge = minus_lm_forest->AddEdge(kCONCAT_RULE, tail)->id_;
-          minus_lm_forest->ConnectEdgeToHeadNode(concat_edge, head_node_plus1 - 1);
-        }
-      }
-      if (s.j == lattice.size()) continue;
-      for (int l = 0; l < arcs.size(); ++l) {
-        const LatticeArc& arc = arcs[l];
-
-        const FSTNode* next_fst_state = s.fst->Extend(arc.label);
-        const int next_j = s.j + arc.dist2next;
-        if (next_fst_state &&
-            !s.coverage.Collides(s.i, next_j)) {
-          q.push(State(s.coverage, s.i, next_j, next_fst_state));
-        }
-      }
-    }
+    if (models_) models_->PrepareForInput(*smeta);
+    const bool found = Search(lattice, *smeta, weights, minus_lm_forest);
+    options_.clear();
+    stacks_.clear();
+    hyps_.clear();
     if (add_pass_through_rules)
       fst->ClearPassThroughTranslations();
-    int pregoal_plus1 = c[goal_cov];
-    if (pregoal_plus1 > 0) {
-      TRulePtr kGOAL_RULE(new TRule("[Goal] ||| [X,1] ||| [X,1]"));
-      int goal = minus_lm_forest->AddNode(TD::Convert("Goal") * -1)->id_;
-      int gedge = minus_lm_forest->AddEdge(kGOAL_RULE, Hypergraph::TailNodeVector(1, pregoal_plus1 - 1))->id_;
-      minus_lm_forest->ConnectEdgeToHeadNode(gedge, goal);
-      // they are almost topo, but not quite always
-      minus_lm_forest->TopologicallySortNodesAndEdges(goal);
-      minus_lm_forest->Reweight(weights);
-      return true;
-    } else {
-      return false;  // composition failed
-    }
+    fst->SentenceComplete();
+    return found;
   }
 
   const bool add_pass_through_rules;
   const int max_distortion;
+  const int stack_size;
+  const double beam;
+  ModelSet* models_;  // scores hypotheses in the search, may be NULL
   const TRulePtr kCONCAT_RULE;
+  const TRulePtr kGOAL_RULE;
   const WordID kNT_TYPE;
   boost::shared_ptr<FSTNode> fst;
+
+  typedef unordered_set<Hypothesis*, HypothesisHash, HypothesisEqual> Stack;
+  vector<PhraseOption> options_;
+  Array2D<double> future_;
+  vector<Stack> stacks_;
+  deque<Hypothesis> hyps_;
+  FFStates tail_states_;
+  Hypergraph scratch_;  // for ModelSet::AddFeaturesToEdge, which doesn't look at it
 };
 
-PhraseBasedTranslator::PhraseBasedTranslator(const boost::program_options::variables_map& conf) :
-  pimpl_(new PhraseBasedTranslatorImpl(conf)) {}
+PhraseBasedTranslator::PhraseBasedTranslator(const boost::program_options::variables_map& conf,
+                                             ModelSet* models) :
+  pimpl_(new PhraseBasedTranslatorImpl(conf, models)) {}
 
 bool PhraseBasedTranslator::TranslateImpl(const std::string& input,
                                       SentenceMetadata* smeta,
@@ -1,12 +1,57 @@
 #ifndef _PHRASEBASED_TRANSLATOR_H_
 #define _PHRASEBASED_TRANSLATOR_H_
 
+#include <algorithm>
+#include <cstring>
+#include <stdint.h>
+#include <boost/functional/hash.hpp>
+
 #include "translator.h"
 
+// the source positions covered by a phrase-based hypothesis, in a bit set of
+// fixed width
+struct Coverage {
+  enum { kMAX_LENGTH = 256, kWORDS = kMAX_LENGTH / 64 };
+  Coverage() { memset(bits, 0, sizeof(bits)); }
+  bool IsCovered(int i) const { return (bits[i >> 6] >> (i & 63)) & 1; }
+  void Cover(int i, int j) {
+    for (int w = i >> 6; w <= (j - 1) >> 6; ++w)
+      bits[w] |= Mask(w, i, j);
+  }
+  bool Collides(int i, int j) const {
+    for (int w = i >> 6; w <= (j - 1) >> 6; ++w)
+      if (bits[w] & Mask(w, i, j)) return true;
+    return false;
+  }
+  // the first uncovered position, n if all of 0..n-1 are covered
+  int FirstGap(int n) const {
+    for (int w = 0; w < kWORDS; ++w)
+      if (~bits[w]) return std::min(n, w * 64 + __builtin_ctzll(~bits[w]));
+    return n;
+  }
+  bool operator==(const Coverage& o) const { return memcmp(bits, o.bits, sizeof(bits)) == 0; }
+  size_t Hash() const { return boost::hash_range(bits, bits + kWORDS); }
+
+  uint64_t bits[kWORDS];
+
+ private:
+  // the positions of [i,j) that are in word w
+  static uint64_t Mask(int w, int i, int j) {
+    const int lo = std::max(i - w * 64, 0);
+    const int hi = std::min(j - w * 64, 64);
+    const uint64_t below_hi = hi == 64 ? ~static_cast<uint64_t>(0) : (static_cast<uint64_t>(1) << hi) - 1;
+    return below_hi & ~((static_cast<uint64_t>(1) << lo) - 1);
+  }
+};
+
+class ModelSet;
 class PhraseBasedTranslatorImpl;
 class PhraseBasedTranslator : public Translator {
  public:
-  PhraseBasedTranslator(const boost::program_options::variables_map& conf);
+  // models (may be NULL) score the hypotheses during the search: they
+  // should be those of the first rescoring pass
+  PhraseBasedTranslator(const boost::program_options::variables_map& conf,
+                        ModelSet* models = NULL);
   bool TranslateImpl(const std::string& input,
                  SentenceMetadata* smeta,
                  const std::vector<double>& weights,
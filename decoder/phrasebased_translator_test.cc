@@ -0,0 +1,230 @@
+#include "phrasebased_translator.h"
+
+#include <gtest/gtest.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include "sentence_metadata.h"
+#include "hg.h"
+#include "viterbi.h"
+#include "tdict.h"
+#include "fdict.h"
+#include "trule.h"
+#include "temp_file_test.h"
+
+using namespace std;
+namespace po = boost::program_options;
+
+TEST(CoverageTest, AcrossWords) {
+  Coverage c;
+  EXPECT_EQ(0, c.FirstGap(200));
+  c.Cover(0, 60);
+  EXPECT_EQ(60, c.FirstGap(200));
+  // a span that crosses bit 64
+  EXPECT_FALSE(c.Collides(60, 70));
+  EXPECT_TRUE(c.Collides(59, 70));
+  c.Cover(62, 66);
+  EXPECT_TRUE(c.IsCovered(62));
+  EXPECT_TRUE(c.IsCovered(63));
+  EXPECT_TRUE(c.IsCovered(64));
+  EXPECT_TRUE(c.IsCovered(65));
+  EXPECT_FALSE(c.IsCovered(66));
+  EXPECT_FALSE(c.IsCovered(61));
+  EXPECT_TRUE(c.Collides(63, 64));
+  EXPECT_TRUE(c.Collides(64, 65));
+  EXPECT_TRUE(c.Collides(61, 63));
+  EXPECT_TRUE(c.Collides(65, 130));
+  EXPECT_FALSE(c.Collides(66, 130));
+  EXPECT_FALSE(c.Collides(60, 62));
+  EXPECT_EQ(60, c.FirstGap(200));
+  c.Cover(60, 62);
+  EXPECT_EQ(66, c.FirstGap(200));
+  c.Cover(66, 128);
+  EXPECT_EQ(128, c.FirstGap(200));
+  EXPECT_EQ(100, c.FirstGap(100));
+  // a span of a whole word and parts of its neighbours
+  c.Cover(129, 200);
+  EXPECT_EQ(128, c.FirstGap(200));
+  EXPECT_TRUE(c.Collides(128, 130));
+  EXPECT_FALSE(c.Collides(128, 129));
+  c.Cover(128, 129);
+  EXPECT_EQ(200, c.FirstGap(200));
+  EXPECT_TRUE(c.IsCovered(191));
+  EXPECT_TRUE(c.IsCovered(192));
+  EXPECT_FALSE(c.IsCovered(200));
+
+  Coverage d;
+  d.Cover(63, 65);
+  Coverage e;
+  e.Cover(63, 64);
+  EXPECT_FALSE(d == e);
+  e.Cover(64, 65);
+  EXPECT_TRUE(d == e);
+  EXPECT_EQ(d.Hash(), e.Hash());
+}
+
+// every word has a translation, so that every gap can be translated
+static const char* kTABLE =
+  "a ||| A ||| EGivenF=-0.5\n"
+  "a ||| AA ||| EGivenF=-1.25\n"
+  "b ||| B ||| EGivenF=-0.75\n"
+  "c ||| C ||| EGivenF=-2\n"
+  "c ||| CC ||| EGivenF=-0.375\n"
+  "d ||| D ||| EGivenF=-1\n"
+  "e ||| E ||| EGivenF=-0.625\n"
+  "a b ||| AB ||| EGivenF=-0.875\n"
+  "b c ||| BC ||| EGivenF=-1.5\n"
+  "c d e ||| CDE ||| EGivenF=-1.0625\n"
+  "d e ||| ED ||| EGivenF=-0.4375\n";
+
+struct Option {
+  int i, j;
+  string e;
+  double score;
+};
+
+class PhraseBasedTranslatorTest : public TempFileTest {
+ protected:
+  virtual void SetUp() {
+    ASSERT_NO_FATAL_FAILURE(TempFileTest::SetUp());
+    ofstream out(file_.c_str());
+    out << kTABLE;
+  }
+
+  static void Set(const string& name, const boost::any& value, po::variables_map* conf) {
+    conf->insert(make_pair(name, po::variable_value(value, false)));
+  }
+
+  // the options of the input, from the table
+  static void Options(const vector<string>& input, vector<Option>* options) {
+    istringstream in(kTABLE);
+    string line;
+    while (getline(in, line)) {
+      boost::scoped_ptr<TRule> r(TRule::CreateRulePhrasetable(line));
+      const string f = TD::GetString(r->f_);
+      for (int i = 0; i < input.size(); ++i) {
+        string phrase;
+        for (int j = i + 1; j <= input.size(); ++j) {
+          phrase += (j > i + 1 ? " " : "") + input[j - 1];
+          if (phrase != f) continue;
+          Option o;
+          o.i = i;
+          o.j = j;
+          o.e = TD::GetString(r->e_);
+          o.score = r->scores_.value(FD::Convert("EGivenF"));
+          options->push_back(o);
+        }
+      }
+    }
+  }
+
+  // enumerates every derivation the decoder may build: sequences of options
+  // that cover the input, each starting at most max_distortion positions
+  // after the first uncovered one.  Without models the order of the phrases
+  // doesn't change the score, so several translations may be best; the
+  // scores are sums of binary fractions, so ties are exact.
+  static void Exhaustive(const vector<Option>& options, int n, int max_distortion,
+                         vector<bool>* covered, const string& e, double score,
+                         int* derivations, double* best, set<string>* best_e) {
+    int gap = 0;
+    while (gap < n && (*covered)[gap]) ++gap;
+    if (gap == n) {
+      ++*derivations;
+      if (score > *best) {
+        *best = score;
+        best_e->clear();
+      }
+      if (score == *best) best_e->insert(e);
+      return;
+    }
+    for (int k = 0; k < options.size(); ++k) {
+      const Option& o = options[k];
+      if (o.i > gap + max_distortion) continue;
+      bool free = true;
+      for (int i = o.i; i < o.j; ++i) free = free && !(*covered)[i];
+      if (!free) continue;
+      for (int i = o.i; i < o.j; ++i) (*covered)[i] = true;
+      Exhaustive(options, n, max_distortion, covered, e.empty() ? o.e : e + " " + o.e,
+                 score + o.score, derivations, best, best_e);
+      for (int i = o.i; i < o.j; ++i) (*covered)[i] = false;
+    }
+  }
+
+  // the number of derivations in the forest
+  static double CountDerivations(const Hypergraph& hg) {
+    vector<double> count(hg.nodes_.size());
+    for (int n = 0; n < hg.nodes_.size(); ++n) {
+      const Hypergraph::Node& node = hg.nodes_[n];
+      for (int e = 0; e < node.in_edges_.size(); ++e) {
+        const Hypergraph::Edge& edge = hg.edges_[node.in_edges_[e]];
+        double c = 1;
+        for (int t = 0; t < edge.tail_nodes_.size(); ++t)
+          c *= count[edge.tail_nodes_[t]];
+        count[n] += c;
+      }
+    }
+    return count.back();
+  }
+
+  void CompareWithExhaustive(const string& sentence, int max_distortion) {
+    po::variables_map conf;
+    Set("grammar", vector<string>(1, file_), &conf);
+    Set("pb_max_distortion", max_distortion, &conf);
+    Set("pb_stack_size", 1000000, &conf);
+    PhraseBasedTranslator translator(conf);
+    const int fid = FD::Convert("EGivenF");
+    vector<double> weights(FD::NumFeats());
+    weights[fid] = 1;
+    Hypergraph forest;
+    SentenceMetadata smeta(0, Lattice());
+    translator.ProcessMarkupHints(map<string, string>());
+    ASSERT_TRUE(translator.Translate(sentence, &smeta, weights, &forest));
+    translator.SentenceComplete();
+
+    vector<string> input;
+    istringstream is(sentence);
+    string w;
+    while (is >> w) input.push_back(w);
+    vector<Option> options;
+    Options(input, &options);
+    vector<bool> covered(input.size());
+    int derivations = 0;
+    double best = -1e100;
+    set<string> best_e;
+    Exhaustive(options, input.size(), max_distortion, &covered, "", 0, &derivations, &best, &best_e);
+
+    vector<WordID> viterbi;
+    const prob_t score = ViterbiESentence(forest, &viterbi);
+    EXPECT_TRUE(best_e.count(TD::GetString(viterbi))) << TD::GetString(viterbi);
+    EXPECT_NEAR(best, log(score), 1e-9);
+    EXPECT_EQ(derivations, CountDerivations(forest));
+  }
+};
+
+TEST_F(PhraseBasedTranslatorTest, Monotone) {
+  CompareWithExhaustive("a b c d e", 0);
+}
+
+TEST_F(PhraseBasedTranslatorTest, LimitedDistortion) {
+  CompareWithExhaustive("a b c d e", 2);
+  CompareWithExhaustive("e d c b a", 2);
+}
+
+TEST_F(PhraseBasedTranslatorTest, UnlimitedDistortion) {
+  CompareWithExhaustive("a b c d e", 5);
+  CompareWithExhaustive("c d e a b c", 6);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -1,13 +1,22 @@
 #include "phrasetable_fst.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <map>
+#include <stdint.h>
 
 #include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include "filelib.h"
+#include "mapped_file.h"
 #include "tdict.h"
+#include "fdict.h"
 
 using boost::shared_ptr;
 using namespace std;
@@ -62,7 +71,10 @@ void TextFSTNode::AddPhrase(const string& phrase) {
   vector<WordID> words;
   TRulePtr rule(TRule::CreateRulePhrasetable(phrase));
   if (!rule) {
+    // decoders on several threads may load phrase tables
+    static boost::mutex err_mutex;
     static int err = 0;
+    boost::mutex::scoped_lock lock(err_mutex);
     ++err;
     if (err > 2) { cerr << "TOO MANY PHRASETABLE ERRORS\n"; exit(1); }
     return;
@@ -134,8 +146,461 @@ FSTNode* LoadTextPhrasetable(const vector<string>& filenames) {
   return fst;
 }
 
-FSTNode* LoadBinaryPhrasetable(const string& fname_prefix) {
-  (void) fname_prefix;
-  assert(!"not implemented yet");
+namespace {
+
+const char kMAGIC[] = "CDECPHR1";
+const size_t kMAGIC_SIZE = MappedFile::kMAGIC_SIZE;
+const int kHEADER_WORDS = 9;
+const size_t kHEADER_SIZE = kMAGIC_SIZE + kHEADER_WORDS * sizeof(uint64_t);
+const int kUNKNOWN = -2;  // TD id that hasn't been looked up yet
+
+template <typename T>
+void WriteArray(const vector<T>& v, ostream* out) {
+  if (!v.empty())
+    out->write(reinterpret_cast<const char*>(&v[0]), v.size() * sizeof(T));
+}
+
+template <typename T>
+const T* MapArray(const char** p, uint64_t n) {
+  const T* a = reinterpret_cast<const T*>(*p);
+  *p += n * sizeof(T);
+  return a;
+}
+
+// a rule of the text phrase table being compiled; the fields point into
+// the pools of CompilePhrasetable
+struct CompiledRule {
+  uint64_t src;
+  uint64_t trg;
+  uint64_t feat;
+  uint64_t align;
+  uint32_t src_len;
+  uint32_t trg_len;
+  uint32_t feat_len;
+  uint32_t align_len;
+};
+
+// orders rules by their (numbered) source phrases
+struct SourceLess {
+  SourceLess(const vector<uint32_t>* s, const vector<CompiledRule>* r) : src(s), rules(r) {}
+  bool operator()(uint64_t a, uint64_t b) const {
+    const CompiledRule& x = (*rules)[a];
+    const CompiledRule& y = (*rules)[b];
+    return lexicographical_compare(src->begin() + x.src, src->begin() + x.src + x.src_len,
+                                   src->begin() + y.src, src->begin() + y.src + y.src_len);
+  }
+  const vector<uint32_t>* src;
+  const vector<CompiledRule>* rules;
+};
+
+}
+
+// a compiled phrase table, mapped into memory
+class MappedPhrasetable {
+ public:
+  explicit MappedPhrasetable(const string& file);
+  ~MappedPhrasetable();
+
+  // the child of node labeled with w, or -1
+  int64_t Child(uint32_t node, WordID w) const {
+    const int l = Local(w);
+    if (l < 0) return -1;
+    file_.CheckRange(first_child_[node], first_child_[node + 1], num_nodes_, "first_child");
+    const uint32_t* b = label_ + first_child_[node];
+    const uint32_t* e = label_ + first_child_[node + 1];
+    const uint32_t* it = lower_bound(b, e, static_cast<uint32_t>(l));
+    if (it == e || *it != static_cast<uint32_t>(l)) return -1;
+    return it - label_;
+  }
+  bool HasChildren(uint32_t node) const { return first_child_[node + 1] > first_child_[node]; }
+  bool HasRules(uint32_t node) const { return first_rule_[node + 1] > first_rule_[node]; }
+
+  // appends the rules of node, whose source phrase is f, to rules
+  void GetRules(uint32_t node, const vector<WordID>& f, vector<TRulePtr>* rules) const;
+
+ private:
+  MappedPhrasetable(const MappedPhrasetable&);
+  void operator=(const MappedPhrasetable&);
+
+  int Local(WordID w) const;
+  WordID Global(uint32_t l) const;
+
+  const MappedFile file_;
+  uint64_t num_nodes_;
+  uint64_t num_rules_;
+  uint64_t num_targets_;
+  uint64_t num_values_;
+  uint64_t num_points_;
+  uint64_t num_words_;
+  const uint64_t* word_start_;
+  const uint64_t* first_rule_;
+  const uint64_t* first_target_;
+  const uint64_t* first_feature_;
+  const uint64_t* first_alignment_;
+  const uint32_t* first_child_;
+  const uint32_t* label_;
+  const uint32_t* target_;
+  const uint32_t* feature_;
+  const float* value_;
+  const uint16_t* alignment_;
+  const char* words_;
+  const WordID lhs_;
+  vector<int> fids_;               // feature number -> FD id
+  mutable vector<int> local_;      // TD id -> word number, -1 if not in the table
+  mutable vector<WordID> global_;  // word number -> TD id, 0 if not looked up yet
+};
+
+MappedPhrasetable::MappedPhrasetable(const string& file) :
+    file_(file, kMAGIC, kHEADER_SIZE, "compiled phrase table"), lhs_(TD::Convert("X") * -1) {
+  const char* p = file_.data();
+  uint64_t header[kHEADER_WORDS];
+  memcpy(header, p + kMAGIC_SIZE, sizeof(header));
+  num_nodes_ = header[0];
+  num_rules_ = header[1];
+  num_targets_ = header[2];
+  num_values_ = header[3];
+  num_points_ = header[4];
+  num_words_ = header[5];
+  const uint64_t word_bytes = header[6];
+  const uint64_t num_features = header[7];
+  const uint64_t feature_bytes = header[8];
+  file_.CheckSize(kHEADER_SIZE +
+      (num_words_ + 1 + num_features + 1 + num_nodes_ + 1 + 3 * (num_rules_ + 1)) * sizeof(uint64_t) +
+      (2 * num_nodes_ + 1 + num_targets_ + num_values_) * sizeof(uint32_t) +
+      num_values_ * sizeof(float) + 2 * num_points_ * sizeof(uint16_t) + word_bytes + feature_bytes);
+  if (num_nodes_ == 0) file_.Corrupt("header");  // there is always a root
+  p += kHEADER_SIZE;
+  word_start_ = MapArray<uint64_t>(&p, num_words_ + 1);
+  const uint64_t* feature_start = MapArray<uint64_t>(&p, num_features + 1);
+  first_rule_ = MapArray<uint64_t>(&p, num_nodes_ + 1);
+  first_target_ = MapArray<uint64_t>(&p, num_rules_ + 1);
+  first_feature_ = MapArray<uint64_t>(&p, num_rules_ + 1);
+  first_alignment_ = MapArray<uint64_t>(&p, num_rules_ + 1);
+  first_child_ = MapArray<uint32_t>(&p, num_nodes_ + 1);
+  label_ = MapArray<uint32_t>(&p, num_nodes_);
+  target_ = MapArray<uint32_t>(&p, num_targets_);
+  feature_ = MapArray<uint32_t>(&p, num_values_);
+  value_ = MapArray<float>(&p, num_values_);
+  alignment_ = MapArray<uint16_t>(&p, 2 * num_points_);
+  words_ = MapArray<char>(&p, word_bytes);
+  // the word and feature lists are checked here; the node and rule arrays
+  // can be as large as the table, so their ranges are checked as the
+  // nodes are built
+  file_.CheckStrings(word_start_, num_words_, words_, word_bytes, "word_start");
+  file_.CheckStrings(feature_start, num_features, p, feature_bytes, "feature_start");
+  fids_.resize(num_features);
+  for (int i = 0; i < num_features; ++i)
+    fids_[i] = FD::Convert(p + feature_start[i]);
+  global_.resize(num_words_);
+  cerr << "Mapped " << num_rules_ << " rules (" << num_nodes_ << " source prefixes) from " << file << endl;
+}
+
+MappedPhrasetable::~MappedPhrasetable() {}
+
+int MappedPhrasetable::Local(WordID w) const {
+  if (w < 0) return -1;
+  if (w >= local_.size()) local_.resize(w + 1, kUNKNOWN);
+  int& l = local_[w];
+  if (l == kUNKNOWN) {
+    const char* word = TD::Convert(w);
+    l = -1;
+    uint64_t lo = 0, hi = num_words_;
+    while (lo < hi) {
+      const uint64_t mid = lo + (hi - lo) / 2;
+      const int c = strcmp(words_ + word_start_[mid], word);
+      if (c == 0) { l = mid; break; }
+      if (c < 0) lo = mid + 1; else hi = mid;
+    }
+  }
+  return l;
+}
+
+WordID MappedPhrasetable::Global(uint32_t l) const {
+  WordID& w = global_[l];
+  if (!w) w = TD::Convert(words_ + word_start_[l]);
+  return w;
+}
+
+void MappedPhrasetable::GetRules(uint32_t node, const vector<WordID>& f, vector<TRulePtr>* rules) const {
+  file_.CheckRange(first_rule_[node], first_rule_[node + 1], num_rules_, "first_rule");
+  for (uint64_t r = first_rule_[node]; r < first_rule_[node + 1]; ++r) {
+    file_.CheckRange(first_target_[r], first_target_[r + 1], num_targets_, "first_target");
+    file_.CheckRange(first_feature_[r], first_feature_[r + 1], num_values_, "first_feature");
+    file_.CheckRange(first_alignment_[r], first_alignment_[r + 1], num_points_, "first_alignment");
+    TRule* rule = new TRule;
+    rule->lhs_ = lhs_;
+    rule->f_ = f;
+    rule->e_.resize(first_target_[r + 1] - first_target_[r]);
+    for (int i = 0; i < rule->e_.size(); ++i) {
+      const uint32_t t = target_[first_target_[r] + i];
+      if (t >= num_words_) file_.Corrupt("target");
+      rule->e_[i] = Global(t);
+    }
+    for (uint64_t k = first_feature_[r]; k < first_feature_[r + 1]; ++k) {
+      if (feature_[k] >= fids_.size()) file_.Corrupt("feature");
+      rule->scores_.set_value(fids_[feature_[k]], value_[k]);
+    }
+    for (uint64_t k = first_alignment_[r]; k < first_alignment_[r + 1]; ++k)
+      rule->a_.push_back(AlignmentPoint(alignment_[2 * k], alignment_[2 * k + 1]));
+    rule->arity_ = 0;
+    rules->push_back(TRulePtr(rule));
+  }
+}
+
+// a state of a compiled phrase table.  States are built when they are first
+// reached and owned by their predecessor, so clearing the successors of q_0
+// frees all states built for a sentence.
+class MappedFSTNode : public FSTNode {
+ public:
+  // q_0
+  explicit MappedFSTNode(const shared_ptr<MappedPhrasetable>& table) :
+      table_(table.get()), node_(0), owner_(table) {}
+  // node is -1 for the state of a pass-through translation of a word that
+  // doesn't start a phrase
+  MappedFSTNode(const MappedPhrasetable* table, int64_t node, const vector<WordID>& f) :
+      table_(table), node_(node), f_(f) {}
+
+  const TargetPhraseSet* GetTranslations() const {
+    if (!data_ && HasData()) {
+      TextTargetPhraseSet* tps = new TextTargetPhraseSet;
+      data_.reset(tps);
+      vector<TRulePtr> rules;
+      if (node_ >= 0) table_->GetRules(node_, f_, &rules);
+      if (passthrough_) rules.push_back(passthrough_);
+      for (int i = 0; i < rules.size(); ++i)
+        tps->AddRule(rules[i]);
+    }
+    return data_.get();
+  }
+  bool HasData() const { return (node_ >= 0 && table_->HasRules(node_)) || passthrough_; }
+  bool HasOutgoingNonEpsilonEdges() const {
+    return (node_ >= 0 && table_->HasChildren(node_)) || !next_.empty();
+  }
+  const FSTNode* Extend(const WordID& t) const { return Next(t, false); }
+
+  void AddPassThroughTranslation(const WordID& w, const SparseVector<double>& feats) {
+    MappedFSTNode* next = Next(w, true);
+    // as in the text phrase table, the rule is only added if the word has
+    // no translation of its own
+    if (!next->HasData()) {
+      TRule* rule = new TRule;
+      rule->e_.resize(1, w);
+      rule->f_.resize(1, w);
+      rule->lhs_ = TD::Convert("___PHRASE") * -1;
+      rule->scores_ = feats;
+      rule->arity_ = 0;
+      next->passthrough_.reset(rule);
+    }
+  }
+  void ClearPassThroughTranslations() { next_.clear(); }
+  void SentenceComplete() { next_.clear(); }
+
+ private:
+  MappedFSTNode* Next(WordID t, bool create) const {
+    map<WordID, shared_ptr<MappedFSTNode> >::iterator it = next_.find(t);
+    if (it != next_.end()) return it->second.get();
+    const int64_t n = node_ >= 0 ? table_->Child(node_, t) : -1;
+    if (n < 0 && !create) return NULL;
+    vector<WordID> f(f_);
+    f.push_back(t);
+    MappedFSTNode* next = new MappedFSTNode(table_, n, f);
+    next_[t].reset(next);
+    return next;
+  }
+
+  const MappedPhrasetable* table_;
+  const int64_t node_;
+  const vector<WordID> f_;  // source phrase
+  TRulePtr passthrough_;
+  mutable shared_ptr<TargetPhraseSet> data_;
+  mutable map<WordID, shared_ptr<MappedFSTNode> > next_;
+  shared_ptr<MappedPhrasetable> owner_;  // set in q_0 only
+};
+
+FSTNode* LoadBinaryPhrasetable(const string& file) {
+  shared_ptr<MappedPhrasetable> table(new MappedPhrasetable(file));
+  return new MappedFSTNode(table);
 }
 
+void CompilePhrasetable(istream* in, const string& file) {
+  // read the rules into pools of TD ids, FD ids, values and alignments
+  vector<CompiledRule> rules;
+  vector<uint32_t> src, trg, feat;
+  vector<float> value;
+  vector<uint16_t> align;
+  vector<WordID> td_words;
+  vector<int> fd_features;
+  vector<bool> seen_word, seen_feature;
+  int lc = 0;
+  int err = 0;
+  bool flag = false;
+  string line;
+  while (getline(*in, line)) {
+    if (line.empty()) continue;
+    ++lc;
+    TRulePtr rule(TRule::CreateRulePhrasetable(line));
+    if (!rule) {
+      ++err;
+      if (err > 2) { cerr << "TOO MANY PHRASETABLE ERRORS\n"; exit(1); }
+      continue;
+    }
+    CompiledRule r;
+    r.src = src.size();
+    r.trg = trg.size();
+    r.feat = feat.size();
+    r.align = align.size() / 2;
+    r.src_len = rule->f_.size();
+    r.trg_len = rule->e_.size();
+    r.align_len = rule->a_.size();
+    src.insert(src.end(), rule->f_.begin(), rule->f_.end());
+    trg.insert(trg.end(), rule->e_.begin(), rule->e_.end());
+    for (SparseVector<double>::const_iterator it = rule->scores_.begin(); it != rule->scores_.end(); ++it) {
+      feat.push_back(it->first);
+      value.push_back(it->second);
+      if (it->first >= seen_feature.size()) seen_feature.resize(it->first + 1);
+      if (!seen_feature[it->first]) {
+        seen_feature[it->first] = true;
+        fd_features.push_back(it->first);
+      }
+    }
+    r.feat_len = feat.size() - r.feat;
+    for (int i = 0; i < rule->a_.size(); ++i) {
+      align.push_back(rule->a_[i].s_);
+      align.push_back(rule->a_[i].t_);
+    }
+    rules.push_back(r);
+    if (lc % 10000 == 0) { flag = true; cerr << '.' << flush; }
+    if (lc % 500000 == 0) { flag = false; cerr << " [" << lc << ']' << endl << flush; }
+  }
+  if (flag) cerr << endl;
+  cerr << "Read " << rules.size() << " rules\n";
+
+  // number words and features in sorted order
+  for (int k = 0; k < 2; ++k) {
+    const vector<uint32_t>& pool = k ? trg : src;
+    for (int i = 0; i < pool.size(); ++i) {
+      if (pool[i] >= seen_word.size()) seen_word.resize(pool[i] + 1);
+      if (!seen_word[pool[i]]) {
+        seen_word[pool[i]] = true;
+        td_words.push_back(pool[i]);
+      }
+    }
+  }
+  vector<string> words(td_words.size());
+  for (int i = 0; i < td_words.size(); ++i) words[i] = TD::Convert(td_words[i]);
+  sort(words.begin(), words.end());
+  vector<uint32_t> word_number(seen_word.size());
+  for (int i = 0; i < td_words.size(); ++i)
+    word_number[td_words[i]] = lower_bound(words.begin(), words.end(), string(TD::Convert(td_words[i]))) - words.begin();
+  for (int i = 0; i < src.size(); ++i) src[i] = word_number[src[i]];
+  for (int i = 0; i < trg.size(); ++i) trg[i] = word_number[trg[i]];
+  vector<uint64_t> word_start(1, 0);
+  for (int i = 0; i < words.size(); ++i)
+    word_start.push_back(word_start.back() + words[i].size() + 1);
+  vector<string> features(fd_features.size());
+  for (int i = 0; i < fd_features.size(); ++i) features[i] = FD::Convert(fd_features[i]);
+  sort(features.begin(), features.end());
+  vector<uint32_t> feature_number(seen_feature.size());
+  for (int i = 0; i < fd_features.size(); ++i)
+    feature_number[fd_features[i]] = lower_bound(features.begin(), features.end(), FD::Convert(fd_features[i])) - features.begin();
+  for (int i = 0; i < feat.size(); ++i) feat[i] = feature_number[feat[i]];
+  vector<uint64_t> feature_start(1, 0);
+  for (int i = 0; i < features.size(); ++i)
+    feature_start.push_back(feature_start.back() + features[i].size() + 1);
+
+  // build the trie breadth first.  The rules whose source phrases start
+  // with the phrase of a node at depth d are a range of the sorted rules;
+  // the rules of the phrase itself (of length d) come first in that range.
+  vector<uint64_t> sorted(rules.size());
+  for (int i = 0; i < rules.size(); ++i) sorted[i] = i;
+  stable_sort(sorted.begin(), sorted.end(), SourceLess(&src, &rules));
+  vector<pair<uint64_t, uint64_t> > ranges(1, make_pair(0, static_cast<uint64_t>(sorted.size())));
+  vector<uint32_t> label(1, 0);
+  vector<uint32_t> first_child;
+  vector<uint64_t> first_rule(1, 0);
+  vector<uint64_t> order;  // rules in the order of their nodes
+  order.reserve(rules.size());
+  uint32_t depth = 0;
+  for (uint64_t n = 0, depth_end = 1; n < ranges.size(); ++n) {
+    if (n == depth_end) { ++depth; depth_end = ranges.size(); }
+    first_child.push_back(ranges.size());
+    uint64_t i = ranges[n].first;
+    const uint64_t end = ranges[n].second;
+    while (i < end && rules[sorted[i]].src_len == depth) order.push_back(sorted[i++]);
+    first_rule.push_back(order.size());
+    while (i < end) {
+      const uint32_t w = src[rules[sorted[i]].src + depth];
+      uint64_t j = i + 1;
+      while (j < end && src[rules[sorted[j]].src + depth] == w) ++j;
+      ranges.push_back(make_pair(i, j));
+      label.push_back(w);
+      i = j;
+    }
+  }
+  first_child.push_back(ranges.size());
+  if (ranges.size() > 0xffffffffULL) {
+    cerr << "Too many source phrase prefixes: " << ranges.size() << endl;
+    abort();
+  }
+
+  // lay out the rules in the order of their nodes
+  vector<uint32_t> target, feature;
+  vector<float> values;
+  vector<uint16_t> alignment;
+  vector<uint64_t> first_target(1, 0), first_feature(1, 0), first_alignment(1, 0);
+  target.reserve(trg.size());
+  feature.reserve(feat.size());
+  values.reserve(value.size());
+  alignment.reserve(align.size());
+  for (uint64_t k = 0; k < order.size(); ++k) {
+    const CompiledRule& r = rules[order[k]];
+    target.insert(target.end(), trg.begin() + r.trg, trg.begin() + r.trg + r.trg_len);
+    feature.insert(feature.end(), feat.begin() + r.feat, feat.begin() + r.feat + r.feat_len);
+    values.insert(values.end(), value.begin() + r.feat, value.begin() + r.feat + r.feat_len);
+    alignment.insert(alignment.end(), align.begin() + 2 * r.align, align.begin() + 2 * (r.align + r.align_len));
+    first_target.push_back(target.size());
+    first_feature.push_back(feature.size());
+    first_alignment.push_back(alignment.size() / 2);
+  }
+
+  ofstream out(file.c_str(), ios::binary);
+  const uint64_t header[kHEADER_WORDS] = {
+    ranges.size(), order.size(), target.size(), values.size(), alignment.size() / 2,
+    words.size(), word_start.back(), features.size(), feature_start.back() };
+  out.write(kMAGIC, kMAGIC_SIZE);
+  out.write(reinterpret_cast<const char*>(header), sizeof(header));
+  WriteArray(word_start, &out);
+  WriteArray(feature_start, &out);
+  WriteArray(first_rule, &out);
+  WriteArray(first_target, &out);
+  WriteArray(first_feature, &out);
+  WriteArray(first_alignment, &out);
+  WriteArray(first_child, &out);
+  WriteArray(label, &out);
+  WriteArray(target, &out);
+  WriteArray(feature, &out);
+  WriteArray(values, &out);
+  WriteArray(alignment, &out);
+  for (int i = 0; i < words.size(); ++i)
+    out.write(words[i].c_str(), words[i].size() + 1);
+  for (int i = 0; i < features.size(); ++i)
+    out.write(features[i].c_str(), features[i].size() + 1);
+  out.close();
+  if (!out) {
+    cerr << "Failed to write " << file << endl;
+    abort();
+  }
+  cerr << "Wrote " << order.size() << " rules (" << ranges.size() << " source prefixes) to " << file << endl;
+}
+
+bool IsBinaryPhrasetable(const string& file) {
+  return MappedFile::FileHasMagic(file, kMAGIC);
+}
+
+FSTNode* LoadPhrasetable(const string& file) {
+  if (IsBinaryPhrasetable(file))
+    return LoadBinaryPhrasetable(file);
+  ReadFile rf(file);
+  cerr << "Reading phrase from " << file << endl;
+  return LoadTextPhrasetable(rf.stream());
+}
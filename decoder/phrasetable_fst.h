@@ -24,11 +24,58 @@ class FSTNode {
   // these should only be called on q_0:
   virtual void AddPassThroughTranslation(const WordID& w, const SparseVector<double>& feats) = 0;
   virtual void ClearPassThroughTranslations() = 0;
+  // called after each sentence; nodes reached from q_0 may be freed
+  virtual void SentenceComplete() {}
 };
 
 // attn caller: you own the memory
 FSTNode* LoadTextPhrasetable(const std::vector<std::string>& filenames);
 FSTNode* LoadTextPhrasetable(std::istream* in);
-FSTNode* LoadBinaryPhrasetable(const std::string& fname_prefix);
+
+// A compiled phrase table is a binary file that is mapped into memory, so
+// loading it does no per-phrase work and it is shared between processes
+// through the page cache.  The source phrases are stored in a trie of
+// sorted arrays, and the target phrases, features and alignments of all
+// rules in contiguous arrays.  Nodes of the FST (and the rules of their
+// phrases) are only built when they are reached and are freed by
+// SentenceComplete().  Feature values are stored as floats.
+//
+// File layout (native byte order, every array aligned to its type):
+//   "CDECPHR1" uint64(#nodes) uint64(#rules) uint64(#target words)
+//              uint64(#feature values) uint64(#alignment points)
+//              uint64(#words) uint64(#bytes of words)
+//              uint64(#features) uint64(#bytes of feature names)
+//   uint64 word_start[#words + 1]      offset of each word in the word area
+//   uint64 feature_start[#features + 1]
+//   uint64 first_rule[#nodes + 1]      the rules of the source phrase of
+//                                      node n are first_rule[n] ... first_rule[n+1]-1
+//   uint64 first_target[#rules + 1]    and likewise the target words,
+//   uint64 first_feature[#rules + 1]   features and alignment points of
+//   uint64 first_alignment[#rules + 1] each rule
+//   uint32 first_child[#nodes + 1]     nodes are numbered breadth first, so
+//                                      the children of node n are
+//                                      first_child[n] ... first_child[n+1]-1
+//   uint32 label[#nodes]               the source word leading to each node;
+//                                      children are sorted by it
+//   uint32 target[#target words]
+//   uint32 feature[#feature values]
+//   float  value[#feature values]
+//   uint16 alignment[2 * #alignment points]  source, target position
+//   char   words[#bytes]               sorted by strcmp, each terminated by a 0
+//   char   feature_names[#bytes]       each terminated by a 0
+// Words are numbered by their position in the sorted word list; TD ids are
+// mapped to these numbers on first use by binary search in the word list.
+
+// attn caller: you own the memory; aborts if file is not a compiled table
+FSTNode* LoadBinaryPhrasetable(const std::string& file);
+
+// compiles the text phrase table in into file
+void CompilePhrasetable(std::istream* in, const std::string& file);
+
+// true if file starts with the magic number of a compiled phrase table
+bool IsBinaryPhrasetable(const std::string& file);
+
+// the phrase table in file, which may be compiled or text
+FSTNode* LoadPhrasetable(const std::string& file);
 
 #endif
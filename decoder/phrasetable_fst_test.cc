@@ -0,0 +1,112 @@
+#include "phrasetable_fst.h"
+
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <boost/scoped_ptr.hpp>
+#include "tdict.h"
+#include "fdict.h"
+#include "temp_file_test.h"
+
+using namespace std;
+
+static const char* kTABLE =
+  "ein ||| a ||| EGivenF=-0.5 FGivenE=-1\n"
+  "ein ||| one ||| EGivenF=-1.5 ||| 0-0\n"
+  "ein haus ||| a house ||| EGivenF=-0.25 LexProb=-2 ||| 0-0 1-1\n"
+  "haus ||| house ||| EGivenF=-0.125\n"
+  "\n"
+  "haus ist ||| house is ||| EGivenF=-3\n"
+  "ein kleines haus ||| a small house ||| EGivenF=-0.75\n"
+  "klein ||| small ||| FGivenE=-2\n";
+
+class PhrasetableFSTTest : public TempFileTest {
+ protected:
+  virtual void SetUp() {
+    ASSERT_NO_FATAL_FAILURE(TempFileTest::SetUp());
+    istringstream in(kTABLE);
+    CompilePhrasetable(&in, file_);
+  }
+
+  // the rules of the source phrase f in fst, or NULL
+  static const vector<TRulePtr>* Rules(const FSTNode* fst, const string& f) {
+    vector<WordID> words;
+    TD::ConvertSentence(f, &words);
+    for (int i = 0; i < words.size() && fst; ++i)
+      fst = fst->Extend(words[i]);
+    if (!fst || !fst->HasData()) return NULL;
+    return &fst->GetTranslations()->GetRules();
+  }
+};
+
+TEST_F(PhrasetableFSTTest,SameAsText) {
+  EXPECT_TRUE(IsBinaryPhrasetable(file_));
+  istringstream in(kTABLE);
+  boost::scoped_ptr<FSTNode> text(LoadTextPhrasetable(&in));
+  boost::scoped_ptr<FSTNode> binary(LoadBinaryPhrasetable(file_));
+  const char* phrases[] = { "ein", "ein haus", "haus", "haus ist", "ein kleines haus", "klein" };
+  for (int p = 0; p < 6; ++p) {
+    const vector<TRulePtr>* t = Rules(text.get(), phrases[p]);
+    const vector<TRulePtr>* b = Rules(binary.get(), phrases[p]);
+    ASSERT_TRUE(t && b) << phrases[p];
+    ASSERT_EQ(t->size(), b->size());
+    for (int i = 0; i < t->size(); ++i) {
+      const TRule& x = *(*t)[i];
+      const TRule& y = *(*b)[i];
+      EXPECT_EQ(x.lhs_, y.lhs_);
+      EXPECT_EQ(x.f_, y.f_);
+      EXPECT_EQ(x.e_, y.e_);
+      EXPECT_EQ(x.Arity(), y.Arity());
+      EXPECT_EQ(x.scores_.size(), y.scores_.size());
+      for (SparseVector<double>::const_iterator it = x.scores_.begin(); it != x.scores_.end(); ++it)
+        EXPECT_FLOAT_EQ(it->second, y.scores_.value(it->first));
+      ASSERT_EQ(x.a_.size(), y.a_.size());
+      for (int k = 0; k < x.a_.size(); ++k) {
+        EXPECT_EQ(x.a_[k].s_, y.a_[k].s_);
+        EXPECT_EQ(x.a_[k].t_, y.a_[k].t_);
+      }
+    }
+  }
+  // prefixes without rules of their own
+  EXPECT_TRUE(Rules(binary.get(), "ein kleines") == NULL);
+  EXPECT_TRUE(binary->Extend(TD::Convert("ein"))->Extend(TD::Convert("kleines")) != NULL);
+  EXPECT_TRUE(Rules(binary.get(), "kleines") == NULL);
+  EXPECT_TRUE(Rules(binary.get(), "unbekannt") == NULL);
+  EXPECT_TRUE(binary->HasOutgoingNonEpsilonEdges());
+  EXPECT_FALSE(binary->Extend(TD::Convert("klein"))->HasOutgoingNonEpsilonEdges());
+}
+
+TEST_F(PhrasetableFSTTest,PassThrough) {
+  boost::scoped_ptr<FSTNode> fst(LoadPhrasetable(file_));
+  SparseVector<double> feats;
+  feats.set_value(FD::Convert("PassThrough"), 1);
+  fst->AddPassThroughTranslation(TD::Convert("unbekannt"), feats);
+  fst->AddPassThroughTranslation(TD::Convert("kleines"), feats);
+  fst->AddPassThroughTranslation(TD::Convert("haus"), feats);
+  const vector<TRulePtr>* r = Rules(fst.get(), "unbekannt");
+  ASSERT_TRUE(r != NULL);
+  ASSERT_EQ(1, r->size());
+  EXPECT_EQ("unbekannt", TD::GetString((*r)[0]->e_));
+  // a word that starts a phrase but has no translation of its own gets
+  // the pass-through rule and keeps its successors
+  r = Rules(fst.get(), "kleines");
+  ASSERT_TRUE(r != NULL);
+  EXPECT_EQ(1, r->size());
+  EXPECT_TRUE(Rules(fst.get(), "kleines haus") == NULL);
+  // words with translations don't
+  r = Rules(fst.get(), "haus");
+  ASSERT_TRUE(r != NULL);
+  EXPECT_EQ(1, r->size());
+  EXPECT_EQ("house", TD::GetString((*r)[0]->e_));
+  fst->ClearPassThroughTranslations();
+  EXPECT_TRUE(Rules(fst.get(), "unbekannt") == NULL);
+  EXPECT_TRUE(Rules(fst.get(), "kleines") == NULL);
+  EXPECT_TRUE(Rules(fst.get(), "ein kleines haus") != NULL);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,170 @@
+#include "rule_arena.h"
+
+#include <cstring>
+#include <boost/thread/mutex.hpp>
+
+using namespace std;
+
+namespace {
+
+const size_t kBLOCK_SIZE = 1 << 20;
+const size_t kMAX_SIZE = 65535;
+
+// the slot of a compact rule (CompactRule::rule) and the TRule's cached_ are
+// changed together under the lock of the slot; the locks are shared by
+// slots so that threads rarely wait for each other
+const int kNUM_LOCKS = 64;
+boost::mutex locks[kNUM_LOCKS];
+
+boost::mutex& SlotLock(TRule* const* slot) {
+  return locks[(reinterpret_cast<size_t>(slot) >> 5) % kNUM_LOCKS];
+}
+
+size_t RecordSize(size_t num_fine, size_t num_feats, size_t f_size, size_t e_size, size_t num_als) {
+  const size_t size = sizeof(CompactRule) + num_fine * sizeof(CompactRule*) +
+      num_feats * (sizeof(double) + sizeof(int)) + (f_size + e_size) * sizeof(WordID) +
+      num_als * sizeof(AlignmentPoint);
+  return (size + 7) & ~size_t(7);
+}
+
+size_t RecordSize(const CompactRule& r) {
+  return RecordSize(r.num_fine, r.num_feats, r.f_size, r.e_size, r.num_als);
+}
+
+}
+
+void UncacheRule(TRule* r) {
+  // the arena may let go of it (and be deleted) until the lock is taken
+  TRule** slot = r->cached_.load(boost::memory_order_relaxed);
+  if (!slot) return;
+  boost::mutex::scoped_lock lock(SlotLock(slot));
+  if (r->cached_.load(boost::memory_order_relaxed) == slot) {
+    *slot = NULL;
+    r->cached_.store(NULL, boost::memory_order_relaxed);
+  }
+}
+
+RuleArena::RuleArena() {}
+
+RuleArena::~RuleArena() {
+  // rules that are still used outlive the arena
+  for (int i = 0; i < blocks_.size(); ++i) {
+    for (size_t pos = 0; pos < blocks_[i].second;) {
+      const CompactRule& r = *reinterpret_cast<const CompactRule*>(blocks_[i].first + pos);
+      {
+        boost::mutex::scoped_lock lock(SlotLock(&r.rule));
+        if (r.rule) r.rule->cached_.store(NULL, boost::memory_order_relaxed);
+      }
+      pos += RecordSize(r);
+    }
+    delete[] blocks_[i].first;
+  }
+}
+
+bool RuleArena::Fits(const TRule& rule) {
+  if (rule.f_.size() > kMAX_SIZE || rule.e_.size() > kMAX_SIZE || rule.a_.size() > kMAX_SIZE ||
+      rule.scores_.size() > kMAX_SIZE)
+    return false;
+  if (!rule.fine_rules_) return true;
+  if (rule.fine_rules_->size() > kMAX_SIZE) return false;
+  for (int i = 0; i < rule.fine_rules_->size(); ++i)
+    if (!Fits(*(*rule.fine_rules_)[i])) return false;
+  return true;
+}
+
+size_t RuleArena::Size(const TRule& rule) {
+  return RecordSize(rule.fine_rules_ ? rule.fine_rules_->size() : 0, rule.scores_.size(),
+                    rule.f_.size(), rule.e_.size(), rule.a_.size());
+}
+
+char* RuleArena::Allocate(size_t size) {
+  if (blocks_.empty() || blocks_.back().second + size > kBLOCK_SIZE) {
+    // a record larger than a block gets one of its own, which is full
+    blocks_.push_back(make_pair(new char[max(size, kBLOCK_SIZE)], size_t(0)));
+  }
+  char* p = blocks_.back().first + blocks_.back().second;
+  blocks_.back().second += size;
+  return p;
+}
+
+const CompactRule* RuleArena::Add(const TRule& rule) {
+  if (!Fits(rule)) return NULL;
+  const int num_fine = rule.fine_rules_ ? rule.fine_rules_->size() : 0;
+  vector<const CompactRule*> fine(num_fine);
+  for (int i = 0; i < num_fine; ++i)
+    fine[i] = Add(*(*rule.fine_rules_)[i]);
+
+  CompactRule* r = reinterpret_cast<CompactRule*>(Allocate(Size(rule)));
+  r->rule = NULL;
+  r->lhs = rule.lhs_;
+  r->f_size = rule.f_.size();
+  r->e_size = rule.e_.size();
+  r->num_feats = rule.scores_.size();
+  r->num_als = rule.a_.size();
+  r->num_fine = num_fine;
+  r->arity = rule.arity_;
+  if (num_fine) memcpy(const_cast<const CompactRule**>(r->fine()), &fine[0], num_fine * sizeof(CompactRule*));
+  // in the order scores_ keeps them, which Build restores
+  double* vals = const_cast<double*>(r->feat_vals());
+  int* ids = const_cast<int*>(r->feat_ids());
+  for (SparseVector<double>::const_iterator it = rule.scores_.begin(); it != rule.scores_.end(); ++it) {
+    *ids++ = it->first;
+    *vals++ = it->second;
+  }
+  copy(rule.f_.begin(), rule.f_.end(), const_cast<WordID*>(r->f()));
+  copy(rule.e_.begin(), rule.e_.end(), const_cast<WordID*>(r->e()));
+  copy(rule.a_.begin(), rule.a_.end(), const_cast<AlignmentPoint*>(r->als()));
+  return r;
+}
+
+TRulePtr RuleArena::Build(const CompactRule* r) {
+  TRulePtr rule(new TRule);
+  rule->lhs_ = r->lhs;
+  rule->f_.assign(r->f(), r->f() + r->f_size);
+  rule->e_.assign(r->e(), r->e() + r->e_size);
+  rule->a_.assign(r->als(), r->als() + r->num_als);
+  for (int i = 0; i < r->num_feats; ++i)
+    rule->scores_.set_value(r->feat_ids()[i], r->feat_vals()[i]);
+  rule->arity_ = r->arity;
+  if (r->num_fine) {
+    rule->fine_rules_.reset(new vector<TRulePtr>(r->num_fine));
+    for (int i = 0; i < r->num_fine; ++i)
+      (*rule->fine_rules_)[i] = Get(r->fine()[i]);
+  }
+  return rule;
+}
+
+TRulePtr RuleArena::Get(const CompactRule* r) {
+  boost::mutex& m = SlotLock(&r->rule);
+  {
+    boost::mutex::scoped_lock lock(m);
+    if (TRule* cached = r->rule) {
+      // unless its last user is deleting it
+      int refs = cached->refs_.load(boost::memory_order_relaxed);
+      while (refs > 0)
+        if (cached->refs_.compare_exchange_weak(refs, refs + 1, boost::memory_order_relaxed))
+          return TRulePtr(cached, false);
+    }
+  }
+  // built without the lock, as building takes the locks of the finer rules
+  // and a rule that is not used after all has to be deleted without it
+  TRulePtr built = Build(r);
+  TRulePtr shared;
+  {
+    boost::mutex::scoped_lock lock(m);
+    if (TRule* cached = r->rule) {
+      int refs = cached->refs_.load(boost::memory_order_relaxed);
+      while (refs > 0 && !shared)
+        if (cached->refs_.compare_exchange_weak(refs, refs + 1, boost::memory_order_relaxed))
+          shared = TRulePtr(cached, false);
+      // its last user will find that the slot holds another rule
+      if (!shared) cached->cached_.store(NULL, boost::memory_order_relaxed);
+    }
+    if (!shared) {
+      shared = built;
+      r->rule = built.get();
+      built->cached_.store(&r->rule, boost::memory_order_relaxed);
+    }
+  }
+  return shared;
+}
@@ -0,0 +1,60 @@
+#ifndef _RULE_ARENA_H_
+#define _RULE_ARENA_H_
+
+// Compact, read-only copies of the rules of a grammar.  A CompactRule is a
+// single record in large blocks owned by the arena: its finer (coarse-to-fine)
+// rules, feature values, feature ids, source and target sides and alignment
+// points are arrays that follow it, sized exactly, with no per-rule
+// allocation or reference count.  A rule takes about half the memory of a
+// TRule, whose scores_ alone keep room for 7 features.
+//
+// The parser and the hypergraph still use TRules, so Get builds one when a
+// rule is used.  The TRule is kept in its record while any TRulePtr to it
+// exists, so every edge (in any thread) that uses the rule shares it, and it
+// is deleted with the last of them.
+
+#include <vector>
+#include "trule.h"
+
+struct CompactRule {
+  int Arity() const { return arity; }
+
+  // the arrays after the record
+  const CompactRule* const* fine() const { return reinterpret_cast<const CompactRule* const*>(this + 1); }
+  const double* feat_vals() const { return reinterpret_cast<const double*>(fine() + num_fine); }
+  const int* feat_ids() const { return reinterpret_cast<const int*>(feat_vals() + num_feats); }
+  const WordID* f() const { return feat_ids() + num_feats; }
+  const WordID* e() const { return f() + f_size; }
+  const AlignmentPoint* als() const { return reinterpret_cast<const AlignmentPoint*>(e() + e_size); }
+
+  mutable TRule* rule;  // the TRule built from it while one is used, else NULL
+  WordID lhs;
+  unsigned short f_size, e_size, num_feats, num_als, num_fine;
+  char arity;
+};
+
+class RuleArena {
+ public:
+  RuleArena();
+  ~RuleArena();
+
+  // copies rule and its finer rules into the arena, or returns NULL if any
+  // of them has more than 65535 symbols, features or alignment points
+  const CompactRule* Add(const TRule& rule);
+
+  // the TRule of r, shared with the other users of r
+  static TRulePtr Get(const CompactRule* r);
+
+ private:
+  RuleArena(const RuleArena&);
+  void operator=(const RuleArena&);
+
+  static bool Fits(const TRule& rule);
+  static size_t Size(const TRule& rule);
+  static TRulePtr Build(const CompactRule* r);
+  char* Allocate(size_t size);
+
+  std::vector<std::pair<char*, size_t> > blocks_;  // and the bytes used
+};
+
+#endif
@@ -0,0 +1,707 @@
+#include "rule_lexer.h"
+
+#include <string>
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <cstdlib>
+#include <cassert>
+#include <stack>
+#include <vector>
+#include <stdint.h>
+#include <boost/thread/thread.hpp>
+#include "klm/util/string_piece.hh"
+#include "tdict.h"
+#include "fdict.h"
+#include "trule.h"
+#include "verbose.h"
+#include "filelib.h"
+#include "mapped_file.h"
+#include "parallel_for.h"
+
+// A hand-written lexer for the rule format that used to be read by a flex
+// scanner.  Tokens are recognized exactly as the flex scanner did, which
+// picked the longest match and, among matches of the same length, the rule
+// listed first.
+//
+// The input is read in windows of whole lines: a plain grammar file is
+// mapped into memory and used in place, other input is read into large
+// buffers.  Each window is cut into chunks at line boundaries, and worker
+// threads tokenize the chunks into Lines that hold the symbols and feature
+// names as StringPieces into the window, and the feature values already
+// parsed; TD and FD are not used.  The calling thread then interns the
+// symbols and names, builds the rules and runs the callback line by line in
+// file order (as the coarse-to-fine projections need), while the workers
+// tokenize the next window.  A syntax error found while tokenizing is
+// reported when the calling thread reaches its line, after the checks of
+// everything before it on the line, so the messages are the same as when
+// a line was parsed in one go.
+
+using namespace std;
+
+namespace {
+
+// bytes read or mapped at a time per tokenizing thread, and the smallest
+// chunk worth a thread of its own
+const size_t kWINDOW_SIZE = 1 << 20;
+const size_t kMIN_CHUNK_SIZE = 256 << 10;
+
+inline bool IsBlank(char c) { return c == ' ' || c == '\t'; }
+inline bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+
+// characters of a nonterminal category
+inline bool IsNTChar(char c) {
+  return c != '\t' && c != ' ' && c != '[' && c != ']' && c != ',' && c != '\n';
+}
+
+// length of the match of [\-+]?[0-9]+(\.[0-9]*([eE][-+]*[0-9]+)?)?|inf|[\-+]inf
+// at p, 0 if there is none
+size_t MatchReal(const char* p, const char* end) {
+  const char* q = p;
+  if (q < end && (*q == '-' || *q == '+')) ++q;
+  if (end - q >= 3 && q[0] == 'i' && q[1] == 'n' && q[2] == 'f') return q + 3 - p;
+  const char* digits = q;
+  while (q < end && IsDigit(*q)) ++q;
+  if (q == digits) return 0;
+  if (q == end || *q != '.') return q - p;
+  ++q;
+  while (q < end && IsDigit(*q)) ++q;
+  if (q < end && (*q == 'e' || *q == 'E')) {
+    const char* e = q + 1;
+    while (e < end && (*e == '-' || *e == '+')) ++e;
+    const char* exp_digits = e;
+    while (e < end && IsDigit(*e)) ++e;
+    if (e > exp_digits) q = e;
+  }
+  return q - p;
+}
+
+// the value strtod gives for a token matched by MatchReal.  Numbers whose
+// digits fit into 53 bits and whose decimal exponent is small are exact
+// products or quotients of two doubles, which is the correctly rounded
+// result; all others are left to strtod.
+double ParseReal(const char* p, size_t len) {
+  static const double kPOW10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+      1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19,
+      1e20, 1e21, 1e22 };
+  const char* q = p;
+  const char* end = p + len;
+  bool neg = false;
+  if (*q == '-' || *q == '+') neg = (*q++ == '-');
+  uint64_t m = 0;
+  int num_digits = 0;
+  int exp10 = 0;
+  bool fast = *q != 'i';
+  for (; fast && q < end && IsDigit(*q); ++q) {
+    m = m * 10 + (*q - '0');
+    if (m && ++num_digits > 15) fast = false;
+  }
+  if (fast && q < end && *q == '.') {
+    for (++q; fast && q < end && IsDigit(*q); ++q) {
+      m = m * 10 + (*q - '0');
+      --exp10;
+      if (m && ++num_digits > 15) fast = false;
+    }
+  }
+  if (fast && q < end) {  // exponent
+    ++q;
+    bool exp_neg = false;
+    if (q < end && (*q == '-' || *q == '+')) exp_neg = (*q++ == '-');
+    int e = 0;
+    for (; fast && q < end; ++q) {
+      if (!IsDigit(*q) || e > 1000) fast = false;  // e.g. 1.0e+-5
+      else e = e * 10 + (*q - '0');
+    }
+    exp10 += exp_neg ? -e : e;
+  }
+  if (fast && exp10 >= -22 && exp10 <= 22) {
+    double v = static_cast<double>(m);
+    v = exp10 < 0 ? v / kPOW10[-exp10] : v * kPOW10[exp10];
+    return neg ? -v : v;
+  }
+  char buf[64];
+  if (len < sizeof(buf)) {
+    memcpy(buf, p, len);
+    buf[len] = 0;
+    return strtod(buf, NULL);
+  }
+  return strtod(string(p, len).c_str(), NULL);
+}
+
+// the names of unnamed features: PhraseModel_0, PhraseModel_1, ...
+vector<int> MakePhraseFeatureNames() {
+  vector<int> fnames(100);
+  for (int i = 0; i < fnames.size(); ++i) {
+    ostringstream os;
+    os << "PhraseModel_" << i;
+    fnames[i] = FD::Convert(os.str());
+  }
+  return fnames;
+}
+
+// rules may be read on several threads; local statics are initialized once
+const vector<int>& PhraseFeatureNames() {
+  static const vector<int> fnames(MakePhraseFeatureNames());
+  return fnames;
+}
+
+
+// a token of the source or target side: a terminal (index 0), a source
+// nonterminal without an index (index -1), or an indexed nonterminal, whose
+// category is empty for target tokens like [1]
+struct Symbol {
+  Symbol(const char* p, size_t len, int i) : text(p, len), index(i) {}
+  StringPiece text;
+  int index;
+};
+
+// a feature value and its name, which is empty for unnamed features
+struct Feature {
+  Feature(const char* p, size_t len, double v) : name(p, len), value(v) {}
+  StringPiece name;
+  double value;
+};
+
+// a tokenized line; its symbols, features and alignment points follow those
+// of the previous line in the arrays of its chunk
+struct Line {
+  Line() : blank(), ctf_level(), src_end(), trg_end(), feat_end(), al_end() {}
+  bool blank;
+  unsigned ctf_level;
+  StringPiece lhs;
+  size_t src_end, trg_end, feat_end, al_end;
+};
+
+// the syntax error that ends the last line of a chunk
+struct LexError {
+  LexError() : what(), c(), expected(), got() {}
+  const char* what;  // the part of the rule, NULL for misordered source indices
+  int c;             // the unexpected character, -1 for the end of the line
+  int expected, got;
+};
+
+// consecutive whole lines of the input and their tokens
+struct Chunk {
+  void Reset(const char* b, const char* e) {
+    begin = b;
+    end = e;
+    lines.clear();
+    src.clear();
+    trg.clear();
+    feats.clear();
+    als.clear();
+    has_error = false;
+  }
+  const char* begin;
+  const char* end;
+  vector<Line> lines;
+  vector<Symbol> src, trg;
+  vector<Feature> feats;
+  vector<AlignmentPoint> als;
+  bool has_error;
+  LexError error;
+};
+
+// length of \[{NT}\] at p, 0 if it does not match
+size_t MatchNT(const char* p, const char* end) {
+  if (p == end || *p != '[') return 0;
+  const char* q = p + 1;
+  while (q < end && IsNTChar(*q)) ++q;
+  if (q == p + 1 || q == end || *q != ']') return 0;
+  return q + 1 - p;
+}
+
+// [1-9][0-9]? spanning [p, end)
+bool MatchIndex(const char* p, const char* end, int* index) {
+  if (end - p == 1 && *p >= '1' && *p <= '9') {
+    *index = *p - '0';
+    return true;
+  }
+  if (end - p == 2 && *p >= '1' && *p <= '9' && IsDigit(p[1])) {
+    *index = 10 * (*p - '0') + (p[1] - '0');
+    return true;
+  }
+  return false;
+}
+
+// for a token that is exactly \[{NT},[1-9][0-9]?\], sets the length of
+// the category and the index
+bool MatchIndexedNT(const char* p, const char* end, size_t* cat_len, int* index) {
+  const size_t len = end - p;
+  if (len < 5 || p[0] != '[' || end[-1] != ']') return false;
+  const char* q = p + 1;
+  while (q < end && IsNTChar(*q)) ++q;
+  if (q == p + 1 || *q != ',') return false;
+  *cat_len = q - p - 1;
+  return MatchIndex(q + 1, end - 1, index);
+}
+
+bool IsSeparator(const char* p, const char* end) {
+  return end - p == 3 && p[0] == '|' && p[1] == '|' && p[2] == '|';
+}
+
+// tokenizes the lines of a chunk; safe to run on any thread
+class Tokenizer {
+ public:
+  explicit Tokenizer(Chunk* c) : c_(c) {}
+
+  void Tokenize() {
+    const char* p = c_->begin;
+    while (p < c_->end) {
+      const char* nl = static_cast<const char*>(memchr(p, '\n', c_->end - p));
+      if (!nl) nl = c_->end;
+      if (!TokenizeLine(p, nl)) return;
+      p = nl + 1;
+    }
+  }
+
+ private:
+  // ends the current line and the chunk; returns false
+  bool Error(const char* what, const char* p, const char* end) {
+    EndLine();
+    c_->has_error = true;
+    c_->error.what = what;
+    c_->error.c = p < end ? static_cast<unsigned char>(*p) : -1;
+    return false;
+  }
+
+  bool EndLine() {
+    Line& l = c_->lines.back();
+    l.src_end = c_->src.size();
+    l.trg_end = c_->trg.size();
+    l.feat_end = c_->feats.size();
+    l.al_end = c_->als.size();
+    return true;
+  }
+
+  // [p, end) is a line without its newline; returns false on an error
+  bool TokenizeLine(const char* p, const char* end) {
+    c_->lines.push_back(Line());
+    Line& l = c_->lines.back();
+    while (p < end && IsBlank(*p)) { ++p; ++l.ctf_level; }
+    if (p == end) {
+      l.blank = true;
+      return EndLine();
+    }
+
+    // LHS
+    size_t len = MatchNT(p, end);
+    if (!len) return Error("LHS", p, end);
+    l.lhs = StringPiece(p + 1, len - 2);
+    p += len;
+    while (p < end && IsBlank(*p)) ++p;
+    if (!(end - p >= 3 && p[0] == '|' && p[1] == '|' && p[2] == '|')) return Error("LHS", p, end);
+    p += 3;
+
+    // source side: a token is a nonterminal or the separator only if it
+    // matches as a whole, otherwise it is a terminal
+    int src_arity = 0;
+    bool done = false;
+    while (!done) {
+      while (p < end && IsBlank(*p)) ++p;
+      if (p == end) return Error("source", p, end);
+      const char* t = p;
+      while (p < end && !IsBlank(*p)) ++p;
+      size_t cat_len;
+      int index;
+      if (IsSeparator(t, p)) {
+        done = true;
+      } else if (MatchNT(t, p) == p - t) {
+        c_->src.push_back(Symbol(t + 1, p - t - 2, -1));
+        ++src_arity;
+      } else if (MatchIndexedNT(t, p, &cat_len, &index)) {
+        if ((src_arity+1) != index) {
+          Error(NULL, p, end);
+          c_->error.expected = src_arity;
+          c_->error.got = index;
+          return false;
+        }
+        c_->src.push_back(Symbol(t + 1, cat_len, index));
+        ++src_arity;
+      } else {
+        c_->src.push_back(Symbol(t, p - t, 0));
+      }
+    }
+
+    // target side
+    done = false;
+    while (!done) {
+      while (p < end && IsBlank(*p)) ++p;
+      if (p == end) break;
+      const char* t = p;
+      while (p < end && !IsBlank(*p)) ++p;
+      size_t cat_len;
+      int index;
+      if (IsSeparator(t, p)) {
+        done = true;
+      } else if (MatchIndexedNT(t, p, &cat_len, &index)) {
+        c_->trg.push_back(Symbol(t + 1, cat_len, index));
+      } else if (p - t >= 3 && *t == '[' && p[-1] == ']' && MatchIndex(t + 1, p - 1, &index)) {
+        c_->trg.push_back(Symbol(t, 0, index));
+      } else {
+        c_->trg.push_back(Symbol(t, p - t, 0));
+      }
+    }
+
+    // features: name=value or (unnamed) value, separated by blanks or ;
+    while (done && p < end) {
+      if (IsBlank(*p) || *p == ';') { ++p; continue; }
+      const char* name_end = p;
+      while (name_end < end && !IsBlank(*name_end) && *name_end != '=' && *name_end != ';') ++name_end;
+      const size_t named_len = (name_end > p && name_end < end && *name_end == '=') ? name_end + 1 - p : 0;
+      const size_t sep_len = (end - p >= 3 && p[0] == '|' && p[1] == '|' && p[2] == '|') ? 3 : 0;
+      const size_t real_len = MatchReal(p, end);
+      if (named_len && named_len >= sep_len && named_len >= real_len) {
+        const char* name = p;
+        p += named_len;
+        const size_t val_len = MatchReal(p, end);
+        // the name is checked before a missing value is reported
+        c_->feats.push_back(Feature(name, named_len - 1, val_len ? ParseReal(p, val_len) : 0.0));
+        if (!val_len) return Error("feature value", p, end);
+        p += val_len;
+      } else if (sep_len && sep_len >= real_len) {
+        p += 3;
+        break;
+      } else if (real_len) {
+        c_->feats.push_back(Feature(p, 0, ParseReal(p, real_len)));
+        p += real_len;
+      } else {
+        return Error("features", p, end);
+      }
+    }
+
+    // alignment points
+    while (p < end) {
+      if (IsBlank(*p)) { ++p; continue; }
+      int a = 0, b = 0;
+      const char* q = p;
+      while (q < end && IsDigit(*q)) a = a * 10 + (*q++ - '0');
+      if (q == p || q == end || *q != '-') return Error("alignment", p, end);
+      const char* r = ++q;
+      while (q < end && IsDigit(*q)) b = b * 10 + (*q++ - '0');
+      if (q == r) return Error("alignment", p, end);
+      c_->als.push_back(AlignmentPoint(a, b));
+      p = q;
+    }
+    return EndLine();
+  }
+
+  Chunk* const c_;
+};
+
+// a window of whole lines of the input, cut into chunks
+struct Window {
+  Window() : num_chunks() {}
+
+  // cuts [begin, end) into at most max_chunks chunks that end with a line
+  void Cut(const char* begin, const char* end, unsigned max_chunks) {
+    size_t n = (end - begin) / kMIN_CHUNK_SIZE + 1;
+    if (n > max_chunks) n = max_chunks;
+    if (chunks.size() < n) chunks.resize(n);
+    num_chunks = 0;
+    for (const char* p = begin; p < end; ++num_chunks) {
+      const char* e = end;
+      if (num_chunks + 1 < n) {
+        e = p + (end - p) / (n - num_chunks);
+        e = static_cast<const char*>(memchr(e, '\n', end - e));
+        e = e ? e + 1 : end;
+      }
+      chunks[num_chunks].Reset(p, e);
+      p = e;
+    }
+  }
+
+  vector<char> buf;  // the lines, unless the input is mapped
+  vector<Chunk> chunks;
+  unsigned num_chunks;
+};
+
+class Lexer {
+ public:
+  Lexer(RuleLexer::RuleCallback func, void* extra, unsigned threads) :
+      phrase_fnames_(PhraseFeatureNames()), rule_callback_(func), extra_(extra),
+      threads_(threads), line_(), num_rules_(), ctf_level_() {}
+
+  void Read(istream* in) {
+    Window windows[2];
+    Window* prev = NULL;
+    size_t tail = 0;  // bytes of the incomplete last line of prev
+    // start small, as a stream often holds a few rules only
+    size_t size = kMIN_CHUNK_SIZE;
+    for (int w = 0; ; w = 1 - w) {
+      vector<char>& buf = windows[w].buf;
+      buf.resize(tail + size);
+      size = min(2 * size, threads_ * kWINDOW_SIZE);
+      if (tail) memcpy(&buf[0], &prev->buf[prev->buf.size() - tail], tail);
+      size_t filled = tail;
+      size_t lines = 0;  // bytes up to the last newline read
+      bool eof = false;
+      while (!lines && !eof) {
+        if (filled == buf.size()) buf.resize(2 * buf.size());
+        const size_t n = in->read(&buf[filled], buf.size() - filled).gcount();
+        eof = (n == 0);
+        for (size_t i = filled + n; i > filled; --i)
+          if (buf[i - 1] == '\n') { lines = i; break; }
+        filled += n;
+      }
+      if (eof) lines = filled;
+      tail = filled - lines;
+      buf.resize(filled);
+      if (lines == 0) break;
+      Next(&windows[w], &buf[0], &buf[0] + lines, prev);
+      prev = &windows[w];
+    }
+    if (prev) Parse(*prev);
+  }
+
+  void Read(const char* data, size_t size) {
+    Window windows[2];
+    Window* prev = NULL;
+    const char* end = data + size;
+    for (int w = 0; data < end; w = 1 - w) {
+      const char* e = end;
+      const size_t size = threads_ * kWINDOW_SIZE;
+      if (static_cast<size_t>(end - data) > size) {
+        e = static_cast<const char*>(memchr(data + size, '\n', end - data - size));
+        e = e ? e + 1 : end;
+      }
+      Next(&windows[w], data, e, prev);
+      prev = &windows[w];
+      data = e;
+    }
+    if (prev) Parse(*prev);
+  }
+
+ private:
+  // thread 0 parses the previous window (if there is one) while the other
+  // threads tokenize the chunks of the next
+  struct Step {
+    Step(Lexer* l, Window* n, const Window* p) : lexer(l), next(n), prev(p) {}
+    void operator()(unsigned t) const {
+      if (!prev)
+        Tokenizer(&next->chunks[t]).Tokenize();
+      else if (t == 0)
+        lexer->Parse(*prev);
+      else
+        Tokenizer(&next->chunks[t - 1]).Tokenize();
+    }
+    Lexer* lexer;
+    Window* next;
+    const Window* prev;
+  };
+
+  // tokenizes the lines [begin, end) into next and parses prev
+  void Next(Window* next, const char* begin, const char* end, const Window* prev) {
+    next->Cut(begin, end, threads_);
+    RunThreads(next->num_chunks + (prev ? 1 : 0), Step(this, next, prev));
+  }
+
+  void Parse(const Window& w) {
+    for (unsigned i = 0; i < w.num_chunks; ++i) {
+      const Chunk& c = w.chunks[i];
+      size_t src = 0, trg = 0, feat = 0, al = 0;
+      for (size_t j = 0; j < c.lines.size(); ++j) {
+        const Line& l = c.lines[j];
+        ParseLine(c, l, src, trg, feat, al, c.has_error && j + 1 == c.lines.size());
+        src = l.src_end;
+        trg = l.trg_end;
+        feat = l.feat_end;
+        al = l.al_end;
+      }
+    }
+  }
+
+  void Error(const LexError& e) {
+    if (!e.what) {
+      cerr << "Src indices must go in order: expected " << e.expected << " but got " << e.got << endl;
+      abort();
+    }
+    cerr << "Line " << line_ << ": unexpected input in " << e.what << ": ";
+    if (e.c >= 0) cerr << static_cast<char>(e.c); else cerr << "end of line";
+    cerr << endl;
+    abort();
+  }
+
+  WordID ConvertNT(const StringPiece& cat) {
+    token_.assign(cat.data(), cat.size());
+    return -TD::Convert(token_);
+  }
+
+  void SanityCheckTrgSymbol(WordID nt, int index) {
+    if (src_nts_[index-1] != nt) {
+      cerr << "Target symbol with index " << index << " is of type " << TD::Convert(nt*-1)
+           << " but corresponding source is of type "
+           << TD::Convert(src_nts_[index-1] * -1) << endl;
+      abort();
+    }
+  }
+
+  void SanityCheckTrgIndex(int index) {
+    if (index > src_nts_.size()) {
+      cerr << "Target index " << index << " exceeds source arity " << src_nts_.size() << endl;
+      abort();
+    }
+    char& flag = nt_sanity_[index - 1];
+    if (flag) {
+      cerr << "Target index " << index << " used multiple times!" << endl;
+      abort();
+    }
+    flag = 1;
+  }
+
+  void CheckAndUpdateCTFStack(const TRulePtr& rp) {
+    if (ctf_level_ > ctf_rule_stack_.size()){
+      cerr << "Found rule at projection level " << ctf_level_ << " but previous rule was at level "
+           << ctf_rule_stack_.size()-1 << " (cannot exceed previous level by more than one; line " << line_ << ")" << endl;
+      abort();
+    }
+    while (ctf_rule_stack_.size() > ctf_level_)
+      ctf_rule_stack_.pop();
+    // ensure that rule has the same signature as parent (coarse) rule.  Rules may *only*
+    // differ by the rhs nonterminals, not terminals or permutation of nonterminals.
+    if (ctf_rule_stack_.size() > 0) {
+      TRulePtr& coarse_rp = ctf_rule_stack_.top();
+      if (rp->f_.size() != coarse_rp->f_.size() || rp->e_ != coarse_rp->e_) {
+        cerr << "Rule " << (rp->AsString()) << " is not a projection of " <<
+          (coarse_rp->AsString()) << endl;
+        abort();
+      }
+      for (int i=0; i<rp->f_.size(); ++i) {
+        if (((rp->f_[i]<0) != (coarse_rp->f_[i]<0)) ||
+            ((rp->f_[i]>0) && (rp->f_[i] != coarse_rp->f_[i]))) {
+          cerr << "Rule " << (rp->AsString()) << " is not a projection of " <<
+            (coarse_rp->AsString()) << endl;
+          abort();
+        }
+      }
+    }
+  }
+
+  // interns the tokens of a line, which start at the given positions of the
+  // chunk's arrays, and passes its rule to the callback
+  void ParseLine(const Chunk& c, const Line& l, size_t src, size_t trg, size_t feat, size_t al,
+                 bool error) {
+    ++line_;
+    if (l.blank) {  // blank lines are echoed, as flex did with unmatched input
+      cout << '\n';
+      return;
+    }
+    ctf_level_ = l.ctf_level;
+    if (l.lhs.data() == NULL) Error(c.error);
+    const WordID lhs = ConvertNT(l.lhs);
+
+    src_.clear();
+    src_nts_.clear();
+    trg_.clear();
+    feat_ids_.clear();
+    feat_vals_.clear();
+
+    for (; src < l.src_end; ++src) {
+      const Symbol& s = c.src[src];
+      if (s.index) {
+        src_nts_.push_back(ConvertNT(s.text));
+        src_.push_back(src_nts_.back());
+      } else {
+        token_.assign(s.text.data(), s.text.size());
+        src_.push_back(TD::Convert(token_));
+      }
+    }
+    nt_sanity_.assign(src_nts_.size(), 0);
+
+    int trg_arity = 0;
+    for (; trg < l.trg_end; ++trg) {
+      const Symbol& s = c.trg[trg];
+      if (s.index) {
+        ++trg_arity;
+        SanityCheckTrgIndex(s.index);
+        if (s.text.size()) SanityCheckTrgSymbol(ConvertNT(s.text), s.index);
+        trg_.push_back(1 - s.index);
+      } else {
+        token_.assign(s.text.data(), s.text.size());
+        trg_.push_back(TD::Convert(token_));
+      }
+    }
+
+    for (; feat < l.feat_end; ++feat) {
+      const Feature& f = c.feats[feat];
+      if (f.name.size()) {
+        token_.assign(f.name.data(), f.name.size());
+        const int fid = FD::Convert(token_);
+        if (fid < 1) {
+          cerr << "\nUNWEIGHED FEATURE " << token_ << endl;
+          abort();
+        }
+        feat_ids_.push_back(fid);
+      } else {
+        if (feat_ids_.size() >= phrase_fnames_.size()) {
+          cerr << "Line " << line_ << ": too many unnamed features\n";
+          abort();
+        }
+        feat_ids_.push_back(phrase_fnames_[feat_ids_.size()]);
+      }
+      feat_vals_.push_back(f.value);
+    }
+    if (error) Error(c.error);
+
+    if (src_nts_.size() != trg_arity) {
+      cerr << "Line " << line_ << ": LHS and RHS arity mismatch!\n";
+      abort();
+    }
+    TRulePtr rp(new TRule(lhs, src_.empty() ? NULL : &src_[0], src_.size(), trg_.empty() ? NULL : &trg_[0], trg_.size(),
+                          feat_ids_.empty() ? NULL : &feat_ids_[0], feat_vals_.empty() ? NULL : &feat_vals_[0], feat_ids_.size(),
+                          src_nts_.size(), al == l.al_end ? NULL : &c.als[al], l.al_end - al));
+    CheckAndUpdateCTFStack(rp);
+    TRulePtr coarse_rp = ((ctf_level_ == 0) ? TRulePtr() : ctf_rule_stack_.top());
+    rule_callback_(rp, ctf_level_, coarse_rp, extra_);
+    ctf_rule_stack_.push(rp);
+    num_rules_++;
+    if (!SILENT) {
+      if (num_rules_ %   50000 == 0) { cerr << '.' << flush; }
+      if (num_rules_ % 2000000 == 0) { cerr << " [" << num_rules_ << "]\n"; }
+    }
+  }
+
+  const vector<int>& phrase_fnames_;
+
+  const RuleLexer::RuleCallback rule_callback_;
+  void* const extra_;
+  const size_t threads_;
+  int line_;
+  int num_rules_;
+  unsigned int ctf_level_;
+  stack<TRulePtr> ctf_rule_stack_;
+
+  string token_;
+  vector<WordID> src_;
+  vector<WordID> src_nts_;
+  vector<WordID> trg_;
+  vector<char> nt_sanity_;
+  vector<int> feat_ids_;
+  vector<double> feat_vals_;
+};
+
+unsigned TokenizingThreads(unsigned threads) {
+  if (threads) return threads;
+  static const unsigned cores = boost::thread::hardware_concurrency();
+  return min(max(cores, 1u), 8u);
+}
+
+}
+
+void RuleLexer::ReadRules(std::istream* in, RuleLexer::RuleCallback func, void* extra, unsigned threads) {
+  Lexer lexer(func, extra, TokenizingThreads(threads));
+  lexer.Read(in);
+}
+
+void RuleLexer::ReadRules(const std::string& file, RuleLexer::RuleCallback func, void* extra, unsigned threads) {
+  Lexer lexer(func, extra, TokenizingThreads(threads));
+  // ReadFile reports missing files and decompresses
+  const bool gz = file.size() > 3 && file.compare(file.size() - 3, 3, ".gz") == 0;
+  if (file == "-" || gz || !FileExists(file)) {
+    ReadFile rf(file);
+    lexer.Read(rf.stream());
+  } else {
+    MappedFile mapped(file);
+    lexer.Read(mapped.data(), mapped.size());
+  }
+}
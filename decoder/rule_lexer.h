@@ -2,12 +2,17 @@
 #define _RULE_LEXER_H_
 
 #include <iostream>
+#include <string>
 
 #include "trule.h"
 
 struct RuleLexer {
   typedef void (*RuleCallback)(const TRulePtr& new_rule, const unsigned int ctf_level, const TRulePtr& coarse_rule, void* extra);
-  static void ReadRules(std::istream* in, RuleCallback func, void* extra);
+  // the rules are tokenized by up to threads threads (0: one per core, at
+  // most 8), but func is always called on the calling thread, in file order
+  static void ReadRules(std::istream* in, RuleCallback func, void* extra, unsigned threads = 0);
+  // reads a plain file in place from memory; "-" and .gz files are streamed
+  static void ReadRules(const std::string& file, RuleCallback func, void* extra, unsigned threads = 0);
 };
 
 #endif
@@ -5,9 +5,12 @@
 #include "hash.h"
 #include "translator.h"
 #include <algorithm>
+#include <map>
 #include <vector>
 #include <boost/foreach.hpp>
 #include <boost/functional/hash.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/weak_ptr.hpp>
 #include "hg.h"
 #include "grammar.h"
 #include "bottom_up_parser.h"
@@ -20,26 +23,53 @@
 #define reverse_foreach BOOST_REVERSE_FOREACH
 
 using namespace std;
-static bool usingSentenceGrammar = false;
 static bool printGrammarsUsed = false;
 
+namespace {
+// Grammars aren't changed once they are read, so the translators of all
+// decoders in a process (e.g. one per decoding thread) share the grammars
+// they read from the same file.
+boost::mutex grammars_mutex;
+map<pair<string, int>, boost::weak_ptr<Grammar> > grammars_read;
+
+GrammarPtr ReadSharedGrammar(const string& file, int max_span) {
+  boost::mutex::scoped_lock lock(grammars_mutex);
+  boost::weak_ptr<Grammar>& shared = grammars_read[make_pair(file, max_span)];
+  GrammarPtr g = shared.lock();
+  if (!g) {
+    if (!SILENT) cerr << "Reading SCFG grammar from " << file << endl;
+    TextGrammar* tg = new TextGrammar(file);
+    tg->SetMaxSpan(max_span);
+    tg->SetGrammarName(file);
+    g.reset(tg);
+    shared = g;
+  } else if (!SILENT) {
+    cerr << "Sharing SCFG grammar " << file << endl;
+  }
+  return g;
+}
+}
+
 struct SCFGTranslatorImpl {
   SCFGTranslatorImpl(const boost::program_options::variables_map& conf) :
       max_span_limit(conf["scfg_max_span_limit"].as<int>()),
       add_pass_through_rules(conf.count("add_pass_through_rules")),
       goal(conf["goal"].as<string>()),
       default_nt(conf["scfg_default_nt"].as<string>()),
-      use_ctf_(conf.count("coarse_to_fine_beam_prune"))
+      use_ctf_(conf.count("coarse_to_fine_beam_prune")),
+      use_cell_pruning_(conf.count("scfg_cell_beam") || conf.count("scfg_cell_limit") || conf.count("scfg_cell_closing_model")),
+      using_sentence_grammar_(false)
   {
+    if (conf.count("scfg_cell_beam")) cell_pruning_.beam = conf["scfg_cell_beam"].as<double>();
+    if (conf.count("scfg_cell_limit")) cell_pruning_.limit = conf["scfg_cell_limit"].as<int>();
+    if (conf.count("scfg_cell_closing_model")) {
+      closing_model_.reset(new CellClosingModel(conf["scfg_cell_closing_model"].as<string>()));
+      cell_pruning_.closing_model = closing_model_.get();
+    }
     if(conf.count("grammar")){
       vector<string> gfiles = conf["grammar"].as<vector<string> >();
-      for (int i = 0; i < gfiles.size(); ++i) {
-        if (!SILENT) cerr << "Reading SCFG grammar from " << gfiles[i] << endl;
-        TextGrammar* g = new TextGrammar(gfiles[i]);
-        g->SetMaxSpan(max_span_limit);
-        g->SetGrammarName(gfiles[i]);
-        grammars.push_back(GrammarPtr(g));
-      }
+      for (int i = 0; i < gfiles.size(); ++i)
+        grammars.push_back(ReadSharedGrammar(gfiles[i], max_span_limit));
       if (!SILENT) cerr << endl;
     }
     if (conf.count("scfg_extra_glue_grammar")) {
@@ -84,6 +114,9 @@ struct SCFGTranslatorImpl {
   const string goal;
   const string default_nt;
   const bool use_ctf_;
+  const bool use_cell_pruning_;
+  CellPruning cell_pruning_;
+  boost::shared_ptr<CellClosingModel> closing_model_;
   double ctf_alpha_;
   double ctf_wide_alpha_;
   int ctf_num_widenings_;
@@ -92,6 +125,7 @@ struct SCFGTranslatorImpl {
   unsigned int ctf_iterations_;
   vector<GrammarPtr> grammars;
   GrammarPtr sup_grammar_;
+  bool using_sentence_grammar_;  // the last grammar is the sentence's
 
   struct Equals { Equals(const GrammarPtr& v) : v_(v) {}
                   bool operator()(const GrammarPtr& x) const { return x == v_; } const GrammarPtr& v_; };
@@ -122,8 +156,20 @@ struct SCFGTranslatorImpl {
         cerr << "Using grammar::" << glist[gi]->GetGrammarName() << endl;
     }
     if (!SILENT) cerr << "First pass parse... " << endl;
-    ExhaustiveBottomUpParser parser(goal, glist);
-    if (!parser.Parse(lattice, forest)){
+    bool parsed = false;
+    if (use_cell_pruning_) {
+      PrunedBottomUpParser parser(goal, glist, weights, cell_pruning_);
+      parsed = parser.Parse(lattice, forest);
+      if (!parsed) {
+        if (!SILENT) cerr << "  pruned parse failed, parsing exhaustively." << endl;
+        forest->clear();
+      }
+    }
+    if (!parsed) {
+      ExhaustiveBottomUpParser parser(goal, glist);
+      parsed = parser.Parse(lattice, forest);
+    }
+    if (!parsed){
       if (!SILENT) cerr << "  parse failed." << endl;
       return false;
     } else {
@@ -288,11 +334,11 @@ void SCFGTranslator::ProcessMarkupHintsImpl(const map<string, string>& kv) {
 
 
   if (it == kv.end()) {
-    usingSentenceGrammar= false;
+    pimpl_->using_sentence_grammar_ = false;
     return;
   }
   //Create sentence specific grammar from specified file name and load grammar into list of grammars
-  usingSentenceGrammar = true;
+  pimpl_->using_sentence_grammar_ = true;
   TextGrammar* sentGrammar = new TextGrammar(it->second);
   sentGrammar->SetMaxSpan(pimpl_->max_span_limit);
   sentGrammar->SetGrammarName(it->second);
@@ -306,7 +352,7 @@ void SCFGTranslator::SetSupplementalGrammar(const std::string& grammar) {
 
 void SCFGTranslator::SentenceCompleteImpl() {
 
-  if(usingSentenceGrammar)      // Drop the last sentence grammar from the list of grammars
+  if(pimpl_->using_sentence_grammar_)      // Drop the last sentence grammar from the list of grammars
     {
       pimpl_->grammars.pop_back();
     }
@@ -6,12 +6,20 @@
 #include <cassert>
 #include <iostream>
 #include <boost/shared_ptr.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/atomic.hpp>
 
 #include "sparse_vector.h"
 #include "wordid.h"
 
+// rules keep their own (thread safe) reference count, so a TRulePtr is a
+// single pointer and a rule takes one allocation rather than two
 class TRule;
-typedef boost::shared_ptr<TRule> TRulePtr;
+typedef boost::intrusive_ptr<TRule> TRulePtr;
+void intrusive_ptr_add_ref(TRule* r);
+void intrusive_ptr_release(TRule* r);
+// forgets a rule that a RuleArena built, before it is deleted (rule_arena.cc)
+void UncacheRule(TRule* r);
 
 struct AlignmentPoint {
   AlignmentPoint() : s_(), t_() {}
@@ -30,25 +38,42 @@ inline std::ostream& operator<<(std::ostream& os, const AlignmentPoint& p) {
 // Translation rule
 class TRule {
  public:
-  TRule() : lhs_(0), prev_i(-1), prev_j(-1) { }
+  TRule() : lhs_(0), prev_i(-1), prev_j(-1), refs_(0), cached_(NULL) { }
   TRule(WordID lhs, const WordID* src, int src_size, const WordID* trg, int trg_size, const int* feat_ids, const double* feat_vals, int feat_size, int arity, const AlignmentPoint* als, int alsnum) :
-      e_(trg, trg + trg_size), f_(src, src + src_size), lhs_(lhs), arity_(arity), prev_i(-1), prev_j(-1),
-      a_(als, als + alsnum) {
+      e_(trg, trg + trg_size), f_(src, src + src_size), a_(als, als + alsnum), lhs_(lhs), prev_i(-1), prev_j(-1),
+      arity_(arity), refs_(0), cached_(NULL) {
     for (int i = 0; i < feat_size; ++i)
       scores_.set_value(feat_ids[i], feat_vals[i]);
   }
 
   bool IsGoal() const;
 
-  explicit TRule(const std::vector<WordID>& e) : e_(e), lhs_(0), prev_i(-1), prev_j(-1) {}
+  explicit TRule(const std::vector<WordID>& e) : e_(e), lhs_(0), prev_i(-1), prev_j(-1), refs_(0), cached_(NULL) {}
   TRule(const std::vector<WordID>& e, const std::vector<WordID>& f, const WordID& lhs) :
-    e_(e), f_(f), lhs_(lhs), prev_i(-1), prev_j(-1) {}
+    e_(e), f_(f), lhs_(lhs), prev_i(-1), prev_j(-1), refs_(0), cached_(NULL) {}
 
   TRule(const TRule& other) :
-    e_(other.e_), f_(other.f_), lhs_(other.lhs_), scores_(other.scores_), arity_(other.arity_), prev_i(-1), prev_j(-1), a_(other.a_) {}
+    e_(other.e_), f_(other.f_), a_(other.a_), scores_(other.scores_), lhs_(other.lhs_), prev_i(-1), prev_j(-1), arity_(other.arity_), refs_(0), cached_(NULL) {}
+
+  // like the copy constructor, copies the rule but not the number of
+  // references to it, its parse state, its coarse-to-fine links or the
+  // compact rule it was built from
+  TRule& operator=(const TRule& other) {
+    e_ = other.e_;
+    f_ = other.f_;
+    a_ = other.a_;
+    scores_ = other.scores_;
+    parent_rule_.reset();
+    fine_rules_.reset();
+    lhs_ = other.lhs_;
+    prev_i = -1;
+    prev_j = -1;
+    arity_ = other.arity_;
+    return *this;
+  }
 
   // if mono or strict is true, then lexer won't be used, and //FIXME: > 9 variables won't work
-  explicit TRule(const std::string& text, bool strict = false, bool mono = false) : prev_i(-1), prev_j(-1) {
+  explicit TRule(const std::string& text, bool strict = false, bool mono = false) : prev_i(-1), prev_j(-1), refs_(0), cached_(NULL) {
     ReadFromString(text, strict, mono);
   }
 
@@ -136,30 +161,57 @@ class TRule {
   WordID GetLHS() const { return lhs_; }
   void ComputeArity();
 
+  // the pointer-sized members come first and the small fields are kept
+  // together after them
+
   // 0 = first variable, -1 = second variable, -2 = third ..., i.e. tail_nodes_[-w] if w<=0, TD::Convert(w) otherwise
   std::vector<WordID> e_;
   // < 0: *-1 = encoding of category of variable
   std::vector<WordID> f_;
-  WordID lhs_;
+  std::vector<AlignmentPoint> a_;  // alignment points, may be empty
   SparseVector<double> scores_;
 
-  char arity_;
-
   // these attributes are application-specific and should probably be refactored
   TRulePtr parent_rule_;  // usually NULL, except when doing constrained decoding
 
+  // only for coarse-to-fine decoding
+  boost::shared_ptr<std::vector<TRulePtr> > fine_rules_;
+
+  WordID lhs_;
+
   // this is only used when doing synchronous parsing
   short int prev_i;
   short int prev_j;
 
-  std::vector<AlignmentPoint> a_;  // alignment points, may be empty
-
-  // only for coarse-to-fine decoding
-  boost::shared_ptr<std::vector<TRulePtr> > fine_rules_;
+  char arity_;
 
  private:
-  TRule(const WordID& src, const WordID& trg) : e_(1, trg), f_(1, src), lhs_(), arity_(), prev_i(), prev_j() {}
+  friend void intrusive_ptr_add_ref(TRule* r);
+  friend void intrusive_ptr_release(TRule* r);
+  friend void UncacheRule(TRule* r);
+  friend class RuleArena;
+
+  TRule(const WordID& src, const WordID& trg) : e_(1, trg), f_(1, src), lhs_(), prev_i(), prev_j(), arity_(), refs_(0), cached_(NULL) {}
   bool SanityCheck() const;
+
+  boost::atomic<int> refs_;
+  // where a RuleArena keeps the rule while it is used, if it was built there
+  boost::atomic<TRule**> cached_;
 };
 
+// the usual Boost.Atomic reference counting: taking a reference needs no
+// ordering, and the thread that drops the last one must see every write the
+// other owners made before it deletes the rule
+inline void intrusive_ptr_add_ref(TRule* r) {
+  r->refs_.fetch_add(1, boost::memory_order_relaxed);
+}
+
+inline void intrusive_ptr_release(TRule* r) {
+  if (r->refs_.fetch_sub(1, boost::memory_order_release) == 1) {
+    boost::atomic_thread_fence(boost::memory_order_acquire);
+    if (r->cached_.load(boost::memory_order_relaxed)) UncacheRule(r);
+    delete r;
+  }
+}
+
 #endif
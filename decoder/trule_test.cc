@@ -3,7 +3,12 @@
 #include <gtest/gtest.h>
 #include <cassert>
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include "tdict.h"
+#include "fdict.h"
+#include "rule_lexer.h"
+#include "temp_file_test.h"
 
 using namespace std;
 
@@ -58,6 +63,88 @@ TEST_F(TRuleTest,TestRuleR) {
   EXPECT_EQ(t6.e_[3], 0);
 }
 
+static void AddRule(const TRulePtr& rule, const unsigned int ctf_level, const TRulePtr&, void* extra) {
+  static_cast<vector<pair<TRulePtr, unsigned> >*>(extra)->push_back(make_pair(rule, ctf_level));
+}
+
+TEST_F(TRuleTest,TestRuleLexer) {
+  const char* rules[] = {
+    "[X] ||| ob [X,1] [X,2] sah . ||| whether [X,1] saw [X,2] . ||| 0.99",
+    "[X] ||| den [X,1] sah [X,2] . ||| [X,2] saw the [X,1] . ||| 0.12321 0.23232 -1.5e-3",
+    "[S] ||| [S,1] [X,2] ||| [1] [2] ||| Glue=1",
+    "[X] ||| a|||b [Y,1] ||| [1] c ||| EGivenF=0.1234567890123456789 FGivenE=3.0e+40",
+    "[X] ||| gato ||| cat ||| PhraseModel_0=-23.2;Foo=1 Bar=12",
+  };
+  const int n = sizeof(rules) / sizeof(rules[0]);
+  string text;
+  for (int i = 0; i < n; ++i) text += string(rules[i]) + "\n";
+  text += " [X] ||| gato ||| cat ||| Foo=2 ||| 0-0\n\n[X] ||| el ||| the ||| Foo=-inf";
+  istringstream in(text);
+  vector<pair<TRulePtr, unsigned> > read;
+  RuleLexer::ReadRules(&in, &AddRule, &read);
+  ASSERT_EQ(n + 2, read.size());
+  for (int i = 0; i < n; ++i) {
+    TRule r(rules[i]);
+    EXPECT_EQ(0, read[i].second);
+    EXPECT_EQ(r.lhs_, read[i].first->lhs_);
+    EXPECT_EQ(r.f_, read[i].first->f_);
+    EXPECT_EQ(r.e_, read[i].first->e_);
+    EXPECT_EQ(r.Arity(), read[i].first->Arity());
+    EXPECT_TRUE(r.scores_ == read[i].first->scores_);
+  }
+  EXPECT_EQ(1, read[n].second);
+  ASSERT_EQ(1, read[n].first->als().size());
+  EXPECT_EQ(0, read[n].first->als()[0].s_);
+  EXPECT_TRUE(read[n + 1].first->scores_.value(FD::Convert("Foo")) < -1e300);
+}
+
+class RuleLexerFileTest : public TempFileTest {};
+
+struct ReadRule {
+  string rule;
+  unsigned ctf_level;
+  string coarse;
+};
+
+static void AddReadRule(const TRulePtr& rule, const unsigned int ctf_level, const TRulePtr& coarse, void* extra) {
+  ReadRule r;
+  r.rule = rule->AsString();
+  r.ctf_level = ctf_level;
+  if (coarse) r.coarse = coarse->AsString();
+  static_cast<vector<ReadRule>*>(extra)->push_back(r);
+}
+
+// a grammar of several windows, read in chunks on several threads, gives
+// the rules of a single-threaded read in the same order
+TEST_F(RuleLexerFileTest,TestThreadsKeepOrder) {
+  ostringstream os;
+  const int n = 40000;
+  for (int i = 0; i < n; ++i) {
+    os << "[X] ||| w" << i << " [X,1] v" << i % 97 << " ||| u" << i << " [1] ||| PhraseModel_0=" << i * 0.5 << " 1.25 ||| 0-0\n";
+    os << " [Y] ||| w" << i << " [Y,1] v" << i % 97 << " ||| u" << i << " [1] ||| -" << i << "\n";
+    if (i % 3 == 0)
+      os << "  [Z] ||| w" << i << " [Z,1] v" << i % 97 << " ||| u" << i << " [1]\n";
+  }
+  const string text = os.str();
+  {
+    ofstream out(file_.c_str());
+    out << text;
+  }
+  istringstream in(text);
+  vector<ReadRule> streamed, mapped;
+  RuleLexer::ReadRules(&in, &AddReadRule, &streamed, 1);
+  RuleLexer::ReadRules(file_, &AddReadRule, &mapped, 3);
+  ASSERT_EQ(n * 2 + (n + 2) / 3, streamed.size());
+  ASSERT_EQ(streamed.size(), mapped.size());
+  for (int i = 0; i < streamed.size(); ++i) {
+    EXPECT_EQ(streamed[i].rule, mapped[i].rule);
+    EXPECT_EQ(streamed[i].ctf_level, mapped[i].ctf_level);
+    EXPECT_EQ(streamed[i].coarse, mapped[i].coarse);
+  }
+  EXPECT_EQ(2, mapped[2].ctf_level);
+  EXPECT_EQ(mapped[1].rule, mapped[2].coarse);
+}
+
 int main(int argc, char** argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -0,0 +1,421 @@
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <deque>
+#include <utility>
+#include <unistd.h>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/program_options.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include "sentence_pair.h"
+#include "extract.h"
+#include "tdict.h"
+#include "fdict.h"
+#include "filelib.h"
+#include "striped_grammar.h"
+#include "rule_sorter.h"
+#include "parallel_for.h"
+
+// Extracts a grammar from a word-aligned parallel corpus on a single machine
+// and writes it in the striped grammar format with the CFE, CF and CE counts,
+// i.e. it replaces
+//   extractor -d X -b | sort | mr_stripe_rule_reduce -p -b | sort | mr_stripe_rule_reduce
+// Rules are extracted by several threads, each counting them in its own
+// RuleSorters, and everything is sorted on disk within a memory budget:
+//   1. the rules are counted twice, keyed by their source sides (F) and by
+//      their target sides (E), and written to sorted runs
+//   2. the F runs are merged to total the counts and compute CF, while the E
+//      runs are merged to compute CE; both are written to runs keyed by the
+//      source side
+//   3. these runs are merged, joining the CE counts to the rules, and the
+//      rules of each source side are written as one line
+// The rules and counts are those of the pipeline.  The alignments may not
+// be: the pipeline keeps an alignment that depends on the order the
+// occurrences were seen in (the extractor replaces it by longer ones while
+// the count is below 7, mr_stripe_rule_reduce keeps the first non-empty
+// one), while here the longest one, and of those the smallest, is kept, so
+// that the output does not depend on the threads or the memory budget.
+
+using namespace std;
+namespace po = boost::program_options;
+
+static const size_t MAX_LINE_LENGTH = 100000;
+static const size_t kBATCH_SIZE = 200;
+static const size_t kMAX_FAN_IN = 128;
+
+void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
+  po::options_description opts("Configuration options");
+  opts.add_options()
+        ("input,i", po::value<string>()->default_value("-"), "Input file")
+        ("output,o", po::value<string>()->default_value("-"), "Write the striped grammar to this file")
+        ("default_category,d", po::value<string>(), "Default span type (use X for 'Hiero')")
+        ("loose", "Use loose phrase extraction heuristic for base phrases")
+        ("max_base_phrase_size,L", po::value<int>()->default_value(10), "Maximum starting phrase size")
+        ("max_syms,l", po::value<int>()->default_value(5), "Maximum number of symbols in final phrase size")
+        ("max_vars,v", po::value<int>()->default_value(2), "Maximum number of nonterminal variables in final phrase size")
+        ("permit_adjacent_nonterminals,A", "Permit adjacent nonterminals in source side of rules")
+        ("no_required_aligned_terminal,n", "Do not require an aligned terminal")
+        ("threads,j", po::value<unsigned>()->default_value(1u), "Number of threads extracting rules")
+        ("memory,M", po::value<size_t>()->default_value(2048), "Approximate memory (in MB) used for counting rules before they are sorted on disk")
+        ("temp_dir,T", po::value<string>()->default_value("."), "Directory for the temporary sorted runs")
+        ("silent", "Write nothing to stderr except errors")
+        ("help,h", "Print this help message and exit");
+  po::options_description dcmdline_options;
+  dcmdline_options.add(opts);
+
+  po::store(parse_command_line(argc, argv, dcmdline_options), *conf);
+  po::notify(*conf);
+
+  if (conf->count("help")) {
+    cerr << "\nUsage: extract_grammar [-options]\n";
+    cerr << dcmdline_options << endl;
+    exit(1);
+  }
+  if ((*conf)["threads"].as<unsigned>() == 0) {
+    cerr << "--threads must be at least 1\n";
+    exit(1);
+  }
+}
+
+typedef vector<AnnotatedParallelSentence> SentenceBatch;
+
+// batches of sentences passed from the thread reading the corpus (which is
+// the only one creating TD ids) to the threads extracting rules
+class BatchQueue {
+ public:
+  explicit BatchQueue(size_t max_size) : max_size_(max_size), done_(false) {}
+
+  void Push(const boost::shared_ptr<SentenceBatch>& batch) {
+    boost::mutex::scoped_lock lock(mutex_);
+    while (queue_.size() >= max_size_) not_full_.wait(lock);
+    queue_.push_back(batch);
+    not_empty_.notify_one();
+  }
+
+  // returns NULL once Done has been called and the queue is empty
+  boost::shared_ptr<SentenceBatch> Pop() {
+    boost::mutex::scoped_lock lock(mutex_);
+    while (queue_.empty() && !done_) not_empty_.wait(lock);
+    boost::shared_ptr<SentenceBatch> batch;
+    if (queue_.empty()) return batch;
+    batch = queue_.front();
+    queue_.pop_front();
+    not_full_.notify_one();
+    return batch;
+  }
+
+  void Done() {
+    boost::mutex::scoped_lock lock(mutex_);
+    done_ = true;
+    not_empty_.notify_all();
+  }
+
+ private:
+  const size_t max_size_;
+  bool done_;
+  deque<boost::shared_ptr<SentenceBatch> > queue_;
+  boost::mutex mutex_;
+  boost::condition_variable not_empty_;
+  boost::condition_variable not_full_;
+};
+
+// counts each rule keyed by [lhs rhs_f] with value rhs_e in f_counts and
+// keyed by [lhs rhs_e] with value rhs_f in e_counts
+struct SortingRuleObserver : public Extract::RuleObserver {
+  SortingRuleObserver(RuleSorter* f, RuleSorter* e) : f_counts(f), e_counts(e) {}
+
+ protected:
+  virtual void CountRuleImpl(WordID lhs,
+                             const vector<WordID>& rhs_f,
+                             const vector<WordID>& rhs_e,
+                             const vector<pair<short,short> >& fe_terminal_alignments) {
+    rule.Clear();
+    rule.stats.counts[RuleCounts::kJOINT] = 1;
+    rule.key.push_back(lhs);
+    rule.key.insert(rule.key.end(), rhs_f.begin(), rhs_f.end());
+    rule.val = rhs_e;
+    rule.stats.aligns = fe_terminal_alignments;
+    f_counts->Add(rule);
+    rule.key.resize(1);
+    rule.key.insert(rule.key.end(), rhs_e.begin(), rhs_e.end());
+    rule.val = rhs_f;
+    rule.stats.aligns.clear();
+    e_counts->Add(rule);
+  }
+
+ private:
+  RuleSorter* f_counts;
+  RuleSorter* e_counts;
+  CountedRule rule;
+};
+
+struct ExtractionOptions {
+  WordID default_cat;
+  int max_base_phrase_size;
+  int max_syms;
+  int max_vars;
+  bool loose_phrases;
+  bool permit_adjacent_nonterminals;
+  bool require_aligned_terminal;
+};
+
+struct ExtractionWorker {
+  ExtractionWorker(BatchQueue* q, const ExtractionOptions* o, RuleSorter* f, RuleSorter* e) :
+      queue(q), opts(o), f_counts(f), e_counts(e) {}
+  void operator()() {
+    SortingRuleObserver observer(f_counts, e_counts);
+    vector<ParallelSpan> phrases;
+    vector<WordID> no_cats;
+    boost::shared_ptr<SentenceBatch> batch;
+    while ((batch = queue->Pop())) {
+      for (int i = 0; i < batch->size(); ++i) {
+        const AnnotatedParallelSentence& sentence = (*batch)[i];
+        phrases.clear();
+        Extract::ExtractBasePhrases(opts->max_base_phrase_size, sentence, &phrases);
+        if (opts->loose_phrases)
+          Extract::LoosenPhraseBounds(sentence, opts->max_base_phrase_size, &phrases);
+        if (phrases.empty()) continue;
+        Extract::AnnotatePhrasesWithCategoryTypes(opts->default_cat, sentence.span_types, &phrases);
+        Extract::ExtractConsistentRules(sentence, phrases, opts->max_vars, opts->max_syms,
+                                        opts->permit_adjacent_nonterminals,
+                                        opts->require_aligned_terminal, &observer, &no_cats);
+      }
+    }
+    f_counts->Flush();
+    e_counts->Flush();
+  }
+  BatchQueue* queue;
+  const ExtractionOptions* opts;
+  RuleSorter* f_counts;
+  RuleSorter* e_counts;
+};
+
+// reads the sentence pairs into the queue in batches
+void ReadBatches(const string& input, bool silent, BatchQueue* queue) {
+  ReadFile rf(input);
+  istream& in = *rf.stream();
+  char* buf = new char[MAX_LINE_LENGTH];
+  boost::shared_ptr<SentenceBatch> batch(new SentenceBatch);
+  int line = 0;
+  while(in) {
+    ++line;
+    in.getline(buf, MAX_LINE_LENGTH);
+    if (buf[0] == 0) continue;
+    if (!silent) {
+      if (line % 200 == 0) cerr << '.';
+      if (line % 8000 == 0) cerr << " [" << line << "]\n" << flush;
+    }
+    batch->resize(batch->size() + 1);
+    batch->back().ParseInputLine(buf);
+    if (batch->size() == kBATCH_SIZE) {
+      queue->Push(batch);
+      batch.reset(new SentenceBatch);
+    }
+  }
+  delete[] buf;
+  if (!batch->empty()) queue->Push(batch);
+  queue->Done();
+}
+
+// thread 0 reads the input, and thread t > 0 extracts rules from it into
+// the sorters f_counts[t-1] and e_counts[t-1]
+struct ExtractionStage {
+  ExtractionStage(const string& i, bool s, BatchQueue* q, const ExtractionOptions* o,
+                  const vector<boost::shared_ptr<RuleSorter> >& f,
+                  const vector<boost::shared_ptr<RuleSorter> >& e) :
+      input(i), silent(s), queue(q), opts(o), f_counts(f), e_counts(e) {}
+  void operator()(unsigned t) const {
+    if (t == 0)
+      ReadBatches(input, silent, queue);
+    else
+      ExtractionWorker(queue, opts, f_counts[t - 1].get(), e_counts[t - 1].get())();
+  }
+  const string& input;
+  const bool silent;
+  BatchQueue* queue;
+  const ExtractionOptions* opts;
+  const vector<boost::shared_ptr<RuleSorter> >& f_counts;
+  const vector<boost::shared_ptr<RuleSorter> >& e_counts;
+};
+
+// reads the merged rules of some runs one group of rules with the same key
+// at a time
+class KeyGroupReader {
+ public:
+  explicit KeyGroupReader(const vector<string>& runs) : merger_(runs) {
+    more_ = merger_.Next(&next_);
+  }
+
+  bool Next(vector<CountedRule>* group) {
+    group->clear();
+    if (!more_) return false;
+    do {
+      group->push_back(next_);
+      more_ = merger_.Next(&next_);
+    } while (more_ && next_.key == group->front().key);
+    return true;
+  }
+
+ private:
+  RuleMerger merger_;
+  CountedRule next_;
+  bool more_;
+};
+
+// sets the marginal count (CF or CE) of a group of rules with the same key
+void SetMarginal(int marginal, vector<CountedRule>* group) {
+  float total = 0;
+  for (int i = 0; i < group->size(); ++i)
+    total += (*group)[i].stats.counts[RuleCounts::kJOINT];
+  for (int i = 0; i < group->size(); ++i)
+    (*group)[i].stats.counts[marginal] = total;
+}
+
+// merges the F-keyed runs, computes CF and adds the rules to out
+struct FMarginalWorker {
+  FMarginalWorker(const vector<string>* r, RuleSorter* o) : runs(r), out(o) {}
+  void operator()() {
+    KeyGroupReader reader(*runs);
+    vector<CountedRule> group;
+    while (reader.Next(&group)) {
+      SetMarginal(RuleCounts::kF_MARGINAL, &group);
+      for (int i = 0; i < group.size(); ++i) out->Add(group[i]);
+    }
+    out->Flush();
+  }
+  const vector<string>* runs;
+  RuleSorter* out;
+};
+
+// merges the E-keyed runs, computes CE and adds only CE to out, keyed by
+// [lhs rhs_f] with value rhs_e
+struct EMarginalWorker {
+  EMarginalWorker(const vector<string>* r, RuleSorter* o) : runs(r), out(o) {}
+  void operator()() {
+    KeyGroupReader reader(*runs);
+    vector<CountedRule> group;
+    CountedRule inv;
+    while (reader.Next(&group)) {
+      SetMarginal(RuleCounts::kE_MARGINAL, &group);
+      for (int i = 0; i < group.size(); ++i) {
+        const CountedRule& r = group[i];
+        inv.Clear();
+        inv.key.push_back(r.key[0]);
+        inv.key.insert(inv.key.end(), r.val.begin(), r.val.end());
+        inv.val.assign(r.key.begin() + 1, r.key.end());
+        inv.stats.counts[RuleCounts::kE_MARGINAL] = r.stats.counts[RuleCounts::kE_MARGINAL];
+        out->Add(inv);
+      }
+    }
+    out->Flush();
+  }
+  const vector<string>* runs;
+  RuleSorter* out;
+};
+
+// writes [lhs] ||| rhs_f, naming the nonterminals [CAT,1], [CAT,2], ...
+void WriteSourceSide(const vector<WordID>& key, ostream* os) {
+  (*os) << '[' << TD::Convert(-key[0]) << "] |||";
+  int nt = 1;
+  for (int i = 1; i < key.size(); ++i) {
+    if (key[i] < 0)
+      (*os) << " [" << TD::Convert(-key[i]) << ',' << nt++ << ']';
+    else
+      (*os) << ' ' << TD::Convert(key[i]);
+  }
+}
+
+int main(int argc, char** argv) {
+  po::variables_map conf;
+  InitCommandLine(argc, argv, &conf);
+  const int kCFE = FD::Convert("CFE");
+  const int kCF = FD::Convert("CF");
+  const int kCE = FD::Convert("CE");
+
+  ExtractionOptions opts;
+  opts.default_cat = 0;  // 0 means no default- extraction will
+                         // fail if a phrase is extracted without a
+                         // category
+  if (conf.count("default_category")) {
+    string sdefault_cat = conf["default_category"].as<string>();
+    opts.default_cat = -TD::Convert(sdefault_cat);
+    cerr << "Default category: " << sdefault_cat << endl;
+  }
+  opts.max_base_phrase_size = conf["max_base_phrase_size"].as<int>();
+  opts.max_syms = conf["max_syms"].as<int>();
+  opts.max_vars = conf["max_vars"].as<int>();
+  opts.loose_phrases = conf.count("loose") > 0;
+  opts.permit_adjacent_nonterminals = conf.count("permit_adjacent_nonterminals") > 0;
+  opts.require_aligned_terminal = conf.count("no_required_aligned_terminal") == 0;
+  const bool silent = conf.count("silent") > 0;
+  const unsigned num_threads = conf["threads"].as<unsigned>();
+  if (num_threads > 1) Dict::EnableLocking();
+  const size_t memory = conf["memory"].as<size_t>() << 20;
+  ostringstream tmp;
+  tmp << conf["temp_dir"].as<string>() << "/extract_grammar." << getpid();
+  const string tmp_prefix = tmp.str();
+
+  // 1. extract and count the rules
+  vector<boost::shared_ptr<RuleSorter> > f_counts, e_counts;
+  for (unsigned t = 0; t < num_threads; ++t) {
+    const string n = boost::lexical_cast<string>(t);
+    f_counts.push_back(boost::shared_ptr<RuleSorter>(new RuleSorter(tmp_prefix + ".f" + n, memory / (2 * num_threads))));
+    e_counts.push_back(boost::shared_ptr<RuleSorter>(new RuleSorter(tmp_prefix + ".e" + n, memory / (2 * num_threads))));
+  }
+  {
+    BatchQueue queue(2 * num_threads);
+    RunThreads(num_threads + 1, ExtractionStage(conf["input"].as<string>(), silent, &queue, &opts, f_counts, e_counts));
+    if (!silent) cerr << endl;
+  }
+
+  // 2. total the counts and compute the marginals
+  RuleSorter f_runs(tmp_prefix + ".f", memory), e_runs(tmp_prefix + ".e", memory);
+  for (unsigned t = 0; t < num_threads; ++t) {
+    f_runs.TakeRuns(f_counts[t].get());
+    e_runs.TakeRuns(e_counts[t].get());
+  }
+  if (!silent) cerr << "Merging " << f_runs.runs().size() << " + " << e_runs.runs().size() << " runs\n";
+  RuleSorter with_cf(tmp_prefix + ".cf", memory / 2), with_ce(tmp_prefix + ".ce", memory / 2);
+  {
+    FMarginalWorker fw(&f_runs.Finish(kMAX_FAN_IN), &with_cf);
+    EMarginalWorker ew(&e_runs.Finish(kMAX_FAN_IN), &with_ce);
+    if (num_threads > 1) {
+      boost::thread f_thread(fw);
+      ew();
+      f_thread.join();
+    } else {
+      fw();
+      ew();
+    }
+  }
+
+  // 3. join CE to the rules and write them
+  with_cf.TakeRuns(&with_ce);
+  KeyGroupReader reader(with_cf.Finish(kMAX_FAN_IN));
+  WriteFile wf(conf["output"].as<string>());
+  ostream& out = *wf.stream();
+  vector<CountedRule> group;
+  RuleStatistics stats;
+  while (reader.Next(&group)) {
+    WriteSourceSide(group[0].key, &out);
+    out << '\t';
+    for (int i = 0; i < group.size(); ++i) {
+      const RuleCounts& c = group[i].stats;
+      stats.counts.clear();
+      stats.counts.set_value(kCFE, c.counts[RuleCounts::kJOINT]);
+      stats.counts.set_value(kCF, c.counts[RuleCounts::kF_MARGINAL]);
+      stats.counts.set_value(kCE, c.counts[RuleCounts::kE_MARGINAL]);
+      stats.aligns = c.aligns;
+      if (i) out << " ||| ";
+      WriteAnonymous(group[i].val, &out);
+      out << " ||| " << stats;
+    }
+    out << endl;
+  }
+  return 0;
+}
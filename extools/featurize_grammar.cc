@@ -18,6 +18,7 @@
 #include "tdict.h"
 #include "filelib.h"
 #include "striped_grammar.h"
+#include "parallel_for.h"
 
 #include <boost/tuple/tuple.hpp>
 #include <boost/shared_ptr.hpp>
@@ -92,13 +93,18 @@ ostream& operator<<(ostream& o, RuleTuple const& r) {
   return o;
 }
 
+// Counts are collected in a hash table.  Once all of them are known, Freeze
+// moves them into flat arrays searched with an open addressing hash table,
+// which is faster to search and may be read by several threads at once.
 template <typename Key>
 struct FreqCount {
-  //typedef unordered_map<Key, int, boost::hash<Key> > Counts;
-  typedef map<Key, int> Counts;
+  typedef unordered_map<Key, int, boost::hash<Key> > Counts;
   Counts counts;
 
+  FreqCount() : frozen_(false) {}
+
   int inc(const Key& r, int c=1) {
+    assert(!frozen_);
     pair<typename Counts::iterator,bool> itb
       = counts.insert(make_pair(r,c));
     if (!itb.second)
@@ -107,19 +113,59 @@ struct FreqCount {
   }
 
   int inc_if_exists(const Key& r, int c=1) {
+    assert(!frozen_);
     typename Counts::iterator it = counts.find(r);
-    if (it != counts.end())
-      it->second += c;
+    if (it == counts.end()) return 0;
+    it->second += c;
     return it->second;
   }
 
   int count(const Key& r) const {
+    if (frozen_) {
+      const size_t h = hasher_(r);
+      for (size_t i = h & mask_; slots_[i]; i = (i + 1) & mask_) {
+        const int k = slots_[i] - 1;
+        if (hashes_[k] == h && keys_[k] == r) return values_[k];
+      }
+      return 0;
+    }
     typename Counts::const_iterator it = counts.find(r);
     if (it == counts.end()) return 0;
     return it->second;
   }
 
   int operator()(const Key& r) const { return count(r); }
+
+  void Freeze() {
+    if (frozen_) return;
+    size_t size = 2;
+    while (size < 2 * counts.size()) size <<= 1;
+    mask_ = size - 1;
+    slots_.assign(size, 0);
+    keys_.reserve(counts.size());
+    hashes_.reserve(counts.size());
+    values_.reserve(counts.size());
+    for (typename Counts::const_iterator it = counts.begin(); it != counts.end(); ++it) {
+      const size_t h = hasher_(it->first);
+      size_t i = h & mask_;
+      while (slots_[i]) i = (i + 1) & mask_;
+      keys_.push_back(it->first);
+      hashes_.push_back(h);
+      values_.push_back(it->second);
+      slots_[i] = keys_.size();
+    }
+    Counts().swap(counts);
+    frozen_ = true;
+  }
+
+ private:
+  bool frozen_;
+  boost::hash<Key> hasher_;
+  size_t mask_;
+  vector<unsigned> slots_;  // 1 + index into keys_, 0 if empty
+  vector<Key> keys_;
+  vector<size_t> hashes_;
+  vector<int> values_;
 };
 typedef FreqCount<RuleTuple> RuleFreqCount;
 
@@ -184,6 +230,7 @@ void InitCommandLine(const FERegistry& r, int argc, char** argv, po::variables_m
         ("list_features,L", "List extractable features")
         ("feature,f", po::value<vector<string> >()->composing(), feats.str().c_str())
         ("aligned_corpus,c", po::value<string>(), "Aligned corpus (single line format)")
+        ("threads,j", po::value<unsigned>()->default_value(1u), "Number of threads observing rules and computing features")
         ("help,h", "Print this help message and exit");
   po::options_description clo("Command line options");
   po::options_description dcmdline_options;
@@ -197,47 +244,9 @@ void InitCommandLine(const FERegistry& r, int argc, char** argv, po::variables_m
     cerr << dcmdline_options << endl;
     exit(1);
   }
-}
-
-static const bool DEBUG = false;
-
-void LexTranslationTable::createTTable(const char* buf){
-  AnnotatedParallelSentence sent;
-  sent.ParseInputLine(buf);
-
-  //iterate over the alignment to compute aligned words
-
-  for(int i =0;i<sent.aligned.width();i++)
-    {
-      for (int j=0;j<sent.aligned.height();j++)
-        {
-          if (DEBUG) cerr << sent.aligned(i,j) << " ";
-          if( sent.aligned(i,j))
-            {
-              if (DEBUG) cerr << TD::Convert(sent.f[i])  << " aligned to " << TD::Convert(sent.e[j]);
-              ++word_translation[pair<WordID,WordID> (sent.f[i], sent.e[j])];
-              ++total_foreign[sent.f[i]];
-              ++total_english[sent.e[j]];
-            }
-        }
-      if (DEBUG)  cerr << endl;
-    }
-  if (DEBUG) cerr << endl;
-
-  const WordID NULL_ = TD::Convert("NULL");
-  //handle unaligned words - align them to null
-  for (int j =0; j < sent.e_len; j++) {
-    if (sent.e_aligned[j]) continue;
-    ++word_translation[pair<WordID,WordID> (NULL_, sent.e[j])];
-    ++total_foreign[NULL_];
-    ++total_english[sent.e[j]];
-  }
-
-  for (int i =0; i < sent.f_len; i++) {
-    if (sent.f_aligned[i]) continue;
-    ++word_translation[pair<WordID,WordID> (sent.f[i], NULL_)];
-    ++total_english[NULL_];
-    ++total_foreign[sent.f[i]];
+  if ((*conf)["threads"].as<unsigned>() == 0) {
+    cerr << "--threads must be at least 1\n";
+    exit(1);
   }
 }
 
@@ -263,6 +272,10 @@ struct FeatureExtractor {
                                      const vector<WordID>& /* trg */,
                                      const RuleStatistics& /* info */) {}
 
+  // called once all rules have been observed, after which ExtractFeatures
+  // may be called from several threads at once
+  virtual void Freeze() {}
+
   // compute features, a unique lhs-src-trg tuple will be seen exactly once
   virtual void ExtractFeatures(const WordID lhs,
                                const vector<WordID>& src,
@@ -342,6 +355,12 @@ struct XFeatures: public FeatureExtractor {
     target_counts.inc_if_exists(r.target(), count);
   }
 
+  virtual void Freeze() {
+    rule_counts.Freeze();
+    source_counts.Freeze();
+    target_counts.Freeze();
+  }
+
   virtual void ExtractFeatures(const WordID /*lhs*/,
                                const vector<WordID>& src,
                                const vector<WordID>& trg,
@@ -413,6 +432,12 @@ struct LabelledRuleConditionals: public FeatureExtractor {
     target_counts.inc_if_exists(r.target(), info.counts.get(kCFE));
   }
 
+  virtual void Freeze() {
+    rule_counts.Freeze();
+    source_counts.Freeze();
+    target_counts.Freeze();
+  }
+
   virtual void ExtractFeatures(const WordID lhs,
                                const vector<WordID>& src,
                                const vector<WordID>& trg,
@@ -442,6 +467,8 @@ struct LHSProb: public FeatureExtractor {
     lhs_counts.inc(lhs, count);
   }
 
+  virtual void Freeze() { lhs_counts.Freeze(); }
+
   virtual void ExtractFeatures(const WordID lhs,
                                const vector<WordID>& /*src*/,
                                const vector<WordID>& /*trg*/,
@@ -469,6 +496,8 @@ struct GenerativeProb: public FeatureExtractor {
                                      const RuleStatistics& info)
   { lhs_counts.inc(lhs, info.counts.get(kCFE)); }
 
+  virtual void Freeze() { lhs_counts.Freeze(); }
+
   virtual void ExtractFeatures(const WordID lhs,
                                const vector<WordID>& /*src*/,
                                const vector<WordID>& /*trg*/,
@@ -506,6 +535,11 @@ struct LabellingShape: public FeatureExtractor {
     source_counts.inc_if_exists(r.source(), info.counts.get(kCFE));
   }
 
+  virtual void Freeze() {
+    rule_counts.Freeze();
+    source_counts.Freeze();
+  }
+
   virtual void ExtractFeatures(const WordID /*lhs*/,
                                const vector<WordID>& src,
                                const vector<WordID>& trg,
@@ -547,6 +581,7 @@ struct LexProbExtractor : public FeatureExtractor {
       table.createTTable(buf);
     }
     delete[] buf;
+    NULL_ = TD::Convert("NULL");
   }
 
   virtual void ExtractFeatures(const WordID /*lhs*/,
@@ -554,130 +589,157 @@ struct LexProbExtractor : public FeatureExtractor {
                                const vector<WordID>& trg,
                                const RuleStatistics& info,
                                SparseVector<float>* result) const {
-    map <WordID, pair<int, float> > foreign_aligned;
-    map <WordID, pair<int, float> > english_aligned;
-
-    //Loop over all the alignment points to compute lexical translation probability
-    const vector< pair<short,short> >& al = info.aligns;
-    vector< pair<short,short> >::const_iterator ita;
-    for (ita = al.begin(); ita != al.end(); ++ita) {
-            if (DEBUG) {
-              cerr << "\nA:" << ita->first << "," << ita->second << "::";
-              cerr <<  TD::Convert(src[ita->first]) << "-" << TD::Convert(trg[ita->second]);
-            }
-
-            //Lookup this alignment probability in the table
-            int temp = table.word_translation[pair<WordID,WordID> (src[ita->first],trg[ita->second])];
-            float f2e=0, e2f=0;
-            if ( table.total_foreign[src[ita->first]] != 0)
-              f2e = (float) temp / table.total_foreign[src[ita->first]];
-            if ( table.total_english[trg[ita->second]] !=0 )
-              e2f = (float) temp / table.total_english[trg[ita->second]];
-            if (DEBUG) printf (" %d %E %E\n", temp, f2e, e2f);
-
-            //local counts to keep track of which things haven't been aligned, to later compute their null alignment
-            if (foreign_aligned.count(src[ita->first])) {
-              foreign_aligned[ src[ita->first] ].first++;
-              foreign_aligned[ src[ita->first] ].second += e2f;
-            } else {
-              foreign_aligned[ src[ita->first] ] = pair<int,float> (1,e2f);
-            }
-
-            if (english_aligned.count( trg[ ita->second] )) {
-               english_aligned[ trg[ ita->second] ].first++;
-               english_aligned[ trg[ ita->second] ].second += f2e;
-            } else {
-               english_aligned[ trg[ ita->second] ] = pair<int,float> (1,f2e);
-            }
-          }
-
-          float final_lex_f2e=1, final_lex_e2f=1;
-          static const WordID NULL_ = TD::Convert("NULL");
-
-          //compute lexical weight P(F|E) and include unaligned foreign words
-           for(int i=0;i<src.size(); i++) {
-               if (!table.total_foreign.count(src[i])) continue;      //if we dont have it in the translation table, we won't know its lexical weight
-
-               if (foreign_aligned.count(src[i]))
-                 {
-                   pair<int, float> temp_lex_prob = foreign_aligned[src[i]];
-                   final_lex_e2f *= temp_lex_prob.second / temp_lex_prob.first;
-                 }
-               else //dealing with null alignment
-                 {
-                   int temp_count = table.word_translation[pair<WordID,WordID> (src[i],NULL_)];
-                   float temp_e2f = (float) temp_count / table.total_english[NULL_];
-                   final_lex_e2f *= temp_e2f;
-                 }
-
-             }
-
-           //compute P(E|F) unaligned english words
-           for(int j=0; j< trg.size(); j++) {
-               if (!table.total_english.count(trg[j])) continue;
-
-               if (english_aligned.count(trg[j]))
-                 {
-                   pair<int, float> temp_lex_prob = english_aligned[trg[j]];
-                   final_lex_f2e *= temp_lex_prob.second / temp_lex_prob.first;
-                 }
-               else //dealing with null
-                 {
-                   int temp_count = table.word_translation[pair<WordID,WordID> (NULL_,trg[j])];
-                   float temp_f2e = (float) temp_count / table.total_foreign[NULL_];
-                   final_lex_f2e *= temp_f2e;
-                 }
-           }
-     result->set_value(e2f_, safenlog(final_lex_e2f));
-     result->set_value(f2e_, safenlog(final_lex_f2e));
+    float final_lex_e2f, final_lex_f2e;
+    table.LexicalWeights(src, trg, info.aligns, NULL_, &final_lex_e2f, &final_lex_f2e);
+    result->set_value(e2f_, safenlog(final_lex_e2f));
+    result->set_value(f2e_, safenlog(final_lex_f2e));
   }
   const int e2f_, f2e_;
-  mutable LexTranslationTable table;
+  WordID NULL_;
+  LexTranslationTable table;
 };
 
-struct Featurizer {
-  Featurizer(const vector<boost::shared_ptr<FeatureExtractor> >& ex) : extractors(ex) {
-  }
-  void Callback1(WordID lhs, const vector<WordID>& src, const ID2RuleStatistics& trgs) {
-    for (ID2RuleStatistics::const_iterator it = trgs.begin(); it != trgs.end(); ++it) {
-      for (int i = 0; i < extractors.size(); ++i)
+// a source side with all its target sides, in the order they were read
+struct RuleGroup {
+  typedef vector<pair<vector<WordID>, RuleStatistics> > Targets;
+  WordID lhs;
+  vector<WordID> src;
+  Targets trgs;
+};
+typedef vector<RuleGroup> RuleGroupBatch;
+
+enum FeaturizerPass { OBSERVE_FILTERED, OBSERVE_UNFILTERED, EXTRACT_FEATURES };
+
+// passes rules to every step-th extractor starting with first
+template <typename TargetIterator>
+void ObserveRules(FeaturizerPass pass, const vector<boost::shared_ptr<FeatureExtractor> >& extractors,
+                  int first, int step, WordID lhs, const vector<WordID>& src,
+                  TargetIterator begin, TargetIterator end) {
+  for (TargetIterator it = begin; it != end; ++it) {
+    for (int i = first; i < extractors.size(); i += step) {
+      if (pass == OBSERVE_FILTERED)
         extractors[i]->ObserveFilteredRule(lhs, src, it->first);
+      else
+        extractors[i]->ObserveUnfilteredRule(lhs, src, it->first, it->second);
     }
   }
-  void Callback2(WordID lhs, const vector<WordID>& src, const ID2RuleStatistics& trgs) {
-    for (ID2RuleStatistics::const_iterator it = trgs.begin(); it != trgs.end(); ++it) {
-      for (int i = 0; i < extractors.size(); ++i)
-        extractors[i]->ObserveUnfilteredRule(lhs, src, it->first, it->second);
+}
+
+template <typename TargetIterator>
+void ExtractFeatures(const vector<boost::shared_ptr<FeatureExtractor> >& extractors,
+                     WordID lhs, const vector<WordID>& src,
+                     TargetIterator begin, TargetIterator end, ostream* out) {
+  for (TargetIterator it = begin; it != end; ++it) {
+    SparseVector<float> feats;
+    for (int i = 0; i < extractors.size(); ++i)
+      extractors[i]->ExtractFeatures(lhs, src, it->first, it->second, &feats);
+    (*out) << '[' << TD::Convert(-lhs) << "] ||| ";
+    WriteNamed(src, out);
+    (*out) << " ||| ";
+    WriteAnonymous(it->first, out);
+    (*out) << " ||| ";
+    print(*out,feats,"=");
+    (*out) << endl;
+  }
+}
+
+// processes a batch of rules with n threads.  When observing rules each
+// thread runs a subset of the extractors over the whole batch, so each
+// extractor is only used by one thread; when extracting features thread t
+// writes the featurized rules of the t-th slice of the batch to outputs[t].
+struct BatchWorker {
+  BatchWorker(FeaturizerPass p, const RuleGroupBatch& b, unsigned threads,
+              const vector<boost::shared_ptr<FeatureExtractor> >& e,
+              const vector<boost::shared_ptr<ostringstream> >& o) :
+      pass(p), batch(b), n(threads), extractors(e), outputs(o) {}
+  void operator()(unsigned t) const {
+    if (pass == EXTRACT_FEATURES) {
+      for (int j = batch.size() * t / n; j < batch.size() * (t + 1) / n; ++j) {
+        const RuleGroup& g = batch[j];
+        ExtractFeatures(extractors, g.lhs, g.src, g.trgs.begin(), g.trgs.end(), outputs[t].get());
+      }
+    } else {
+      for (int j = 0; j < batch.size(); ++j) {
+        const RuleGroup& g = batch[j];
+        ObserveRules(pass, extractors, t, n, g.lhs, g.src, g.trgs.begin(), g.trgs.end());
+      }
     }
   }
-  void Callback3(WordID lhs, const vector<WordID>& src, const ID2RuleStatistics& trgs) {
-    for (ID2RuleStatistics::const_iterator it = trgs.begin(); it != trgs.end(); ++it) {
-      SparseVector<float> feats;
-      for (int i = 0; i < extractors.size(); ++i)
-        extractors[i]->ExtractFeatures(lhs, src, it->first, it->second, &feats);
-      cout << '[' << TD::Convert(-lhs) << "] ||| ";
-      WriteNamed(src, &cout);
-      cout << " ||| ";
-      WriteAnonymous(it->first, &cout);
-      cout << " ||| ";
-      print(cout,feats,"=");
-      cout << endl;
+  const FeaturizerPass pass;
+  const RuleGroupBatch& batch;
+  const unsigned n;
+  const vector<boost::shared_ptr<FeatureExtractor> >& extractors;
+  const vector<boost::shared_ptr<ostringstream> >& outputs;
+};
+
+// With more than one thread, rules are read in batches, and each batch is
+// processed by the worker threads (see BatchWorker).  The slices of
+// featurized rules are written in order, so the output does not depend on
+// the number of threads.  Only the thread reading the grammars creates TD
+// ids; the workers only look them up.
+class Featurizer {
+ public:
+  Featurizer(const vector<boost::shared_ptr<FeatureExtractor> >& ex, unsigned threads) :
+      extractors(ex), num_threads(threads), pass(OBSERVE_FILTERED) {
+    for (unsigned t = 0; t < num_threads; ++t)
+      outputs.push_back(boost::shared_ptr<ostringstream>(new ostringstream));
+  }
+
+  void Begin(FeaturizerPass p) { pass = p; }
+
+  void Add(WordID lhs, const vector<WordID>& src, const ID2RuleStatistics& trgs) {
+    if (num_threads == 1) {
+      // no need to copy the rules
+      if (pass == EXTRACT_FEATURES)
+        ExtractFeatures(extractors, lhs, src, trgs.begin(), trgs.end(), &cout);
+      else
+        ObserveRules(pass, extractors, 0, 1, lhs, src, trgs.begin(), trgs.end());
+      return;
     }
+    batch.resize(batch.size() + 1);
+    RuleGroup& g = batch.back();
+    g.lhs = lhs;
+    g.src = src;
+    g.trgs.assign(trgs.begin(), trgs.end());
+    if (batch.size() == kBATCH_SIZE) Process();
+  }
+
+  // processes the rest of the grammar
+  void End() {
+    Process();
+    if (pass == OBSERVE_UNFILTERED)
+      for (int i = 0; i < extractors.size(); ++i)
+        extractors[i]->Freeze();
   }
+
  private:
+  static const size_t kBATCH_SIZE = 2000;
+
+  // processes the batch and writes its rules
+  void Process() {
+    if (batch.empty()) return;
+    if (pass == EXTRACT_FEATURES) {
+      RunThreads(num_threads, BatchWorker(pass, batch, num_threads, extractors, outputs));
+      for (unsigned t = 0; t < num_threads; ++t) {
+        cout << outputs[t]->str();
+        outputs[t]->str("");
+      }
+    } else {
+      const unsigned n = min<unsigned>(num_threads, extractors.size());
+      RunThreads(n, BatchWorker(pass, batch, n, extractors, outputs));
+    }
+    batch.clear();
+  }
+
   vector<boost::shared_ptr<FeatureExtractor> > extractors;
+  const unsigned num_threads;
+  FeaturizerPass pass;
+  RuleGroupBatch batch;
+  vector<boost::shared_ptr<ostringstream> > outputs;
 };
 
-void cb1(WordID lhs, const vector<WordID>& src_rhs, const ID2RuleStatistics& rules, void* extra) {
-  static_cast<Featurizer*>(extra)->Callback1(lhs, src_rhs, rules);
-}
-
-void cb2(WordID lhs, const vector<WordID>& src_rhs, const ID2RuleStatistics& rules, void* extra) {
-  static_cast<Featurizer*>(extra)->Callback2(lhs, src_rhs, rules);
-}
-
-void cb3(WordID lhs, const vector<WordID>& src_rhs, const ID2RuleStatistics& rules, void* extra) {
-  static_cast<Featurizer*>(extra)->Callback3(lhs, src_rhs, rules);
+void cb(WordID lhs, const vector<WordID>& src_rhs, const ID2RuleStatistics& rules, void* extra) {
+  static_cast<Featurizer*>(extra)->Add(lhs, src_rhs, rules);
 }
 
 int main(int argc, char** argv){
@@ -699,17 +761,24 @@ int main(int argc, char** argv){
   vector<boost::shared_ptr<FeatureExtractor> > extractors(feats.size());
   for (int i = 0; i < feats.size(); ++i)
     extractors[i] = reg.Create(feats[i]);
-  Featurizer fizer(extractors);
+  if (conf["threads"].as<unsigned>() > 1) Dict::EnableLocking();
+  Featurizer fizer(extractors, conf["threads"].as<unsigned>());
 
   cerr << "Reading filtered grammar to detect keys..." << endl;
-  StripedGrammarLexer::ReadStripedGrammar(fg1.stream(), cb1, &fizer);
+  fizer.Begin(OBSERVE_FILTERED);
+  StripedGrammarLexer::ReadStripedGrammar(fg1.stream(), cb, &fizer);
+  fizer.End();
 
   cerr << "Reading unfiltered grammar..." << endl;
-  StripedGrammarLexer::ReadStripedGrammar(&cin, cb2, &fizer);
+  fizer.Begin(OBSERVE_UNFILTERED);
+  StripedGrammarLexer::ReadStripedGrammar(&cin, cb, &fizer);
+  fizer.End();
 
   ReadFile fg2(conf["filtered_grammar"].as<string>());
   cerr << "Reading filtered grammar and adding features..." << endl;
-  StripedGrammarLexer::ReadStripedGrammar(fg2.stream(), cb3, &fizer);
+  fizer.Begin(EXTRACT_FEATURES);
+  StripedGrammarLexer::ReadStripedGrammar(fg2.stream(), cb, &fizer);
+  fizer.End();
 
   return 0;
 }
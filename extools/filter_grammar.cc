@@ -2,23 +2,19 @@
  * Filter a grammar in striped format
  */
 #include <iostream>
+#include <sstream>
 #include <string>
-#include <map>
 #include <vector>
 #include <utility>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <tr1/unordered_map>
 
-#include "suffix_tree.h"
-#include "sparse_vector.h"
-#include "sentence_pair.h"
-#include "extract.h"
-#include "fdict.h"
-#include "tdict.h"
 #include "filelib.h"
-#include "striped_grammar.h"
+#include "parallel_for.h"
 
 #include <boost/shared_ptr.hpp>
-#include <boost/functional/hash.hpp>
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
 
@@ -26,13 +22,13 @@ using namespace std;
 using namespace std::tr1;
 namespace po = boost::program_options;
 
-static const size_t MAX_LINE_LENGTH = 64000000;
-
 void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   po::options_description opts("Configuration options");
   opts.add_options()
         ("test_set,t", po::value<string>(), "Filter for this test set")
         ("top_e_given_f,n", po::value<size_t>()->default_value(30), "Keep top N rules, according to p(e|f). 0 for all")
+        ("max_phrase_length,L", po::value<int>()->default_value(0), "Only index test set phrases up to this length; rules with longer source phrases are dropped. 0 for no limit")
+        ("threads,j", po::value<unsigned>()->default_value(1u), "Number of threads filtering the grammar")
         ("help,h", "Print this help message and exit");
   po::options_description clo("Command line options");
   po::options_description dcmdline_options;
@@ -46,90 +42,267 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
     cerr << dcmdline_options << endl;
     exit(1);
   }
+  if ((*conf)["threads"].as<unsigned>() == 0) {
+    cerr << "--threads must be at least 1\n";
+    exit(1);
+  }
 }
 
-struct SourceFilter {
-  // return true to keep the rule, otherwise false
-  virtual bool Matches(const vector<WordID>& key) const = 0;
-  virtual ~SourceFilter() {}
-};
+inline bool IsWhitespace(char c) { return c == ' ' || c == '\t'; }
+
+// [X] and [X,1] are nonterminals
+inline bool IsNonterminal(const char* w, size_t len) {
+  return len > 2 && w[0] == '[' && w[len - 1] == ']';
+}
 
-struct DumbSuffixTreeFilter : SourceFilter {
-  DumbSuffixTreeFilter(const string& corpus) {
-    cerr << "Build suffix tree from test set in " << corpus << endl;
-    assert(FileExists(corpus));
+// A trie of all phrases of the test set (the prefixes of its suffixes) in
+// flat arrays.  Nodes are numbered breadth first, so the children of node n
+// are the nodes first_child_[n] ... first_child_[n+1]-1, sorted by word, and
+// are found by binary search.  Words are numbered in the order they first
+// occur in the test set and the grammar is matched against these numbers,
+// so filtering needs no TD ids.
+class TestSetTrie {
+ public:
+  TestSetTrie(const string& corpus, int max_len) {
+    cerr << "Build phrase trie from test set in " << corpus << endl;
     ReadFile rfts(corpus);
     istream& testSet = *rfts.stream();
-    char* buf = new char[MAX_LINE_LENGTH];
-    AnnotatedParallelSentence sent;
-
-    /* process the data set to build suffix tree
-     */
-    while(!testSet.eof()) {
-      testSet.getline(buf, MAX_LINE_LENGTH);
-      if (buf[0] == 0) continue;
-
-      //hack to read in the test set using AnnotatedParallelSentence
-      strcat(buf," ||| fake ||| 0-0");
-      sent.ParseInputLine(buf);
-
-      //add each successive suffix to the tree
-      for(int i=0; i<sent.f_len; i++)
-        root.InsertPath(sent.f, i, sent.f_len - 1);
+    vector<int> text;  // the sentences, each followed by 0
+    string line, word;
+    while(getline(testSet, line)) {
+      istringstream is(line);
+      bool empty = true;
+      while (is >> word) {
+        int& id = vocab_[word];
+        if (!id) id = vocab_.size();
+        text.push_back(id);
+        empty = false;
+      }
+      if (!empty) text.push_back(0);
     }
-    delete[] buf;
-  }
-  virtual bool Matches(const vector<WordID>& src_rhs) const {
-    const Node<int>* curnode = &root;
-    for(int i=0; i < src_rhs.size(); i++) {
-      if (src_rhs[i] <= 0) {
-        curnode = &root;
-      } else if (curnode) {
-        curnode = curnode->Extend(src_rhs[i]);
-        if (!curnode) return false;
+    vector<int> suffixes;
+    for (int i = 0; i < text.size(); ++i)
+      if (text[i]) suffixes.push_back(i);
+    sort(suffixes.begin(), suffixes.end(), SuffixLess(&text));
+
+    // every node covers the range [first, second) of the sorted suffixes
+    // that start with its phrase
+    vector<pair<int, int> > ranges(1, make_pair(0, static_cast<int>(suffixes.size())));
+    word_.push_back(0);
+    for (int n = 0, depth_end = 1, depth = 0; n < ranges.size(); ++n) {
+      if (n == depth_end) { ++depth; depth_end = ranges.size(); }
+      first_child_.push_back(ranges.size());
+      if (max_len > 0 && depth == max_len) continue;
+      const pair<int, int> r = ranges[n];
+      for (int i = r.first; i < r.second;) {
+        const int w = text[suffixes[i] + depth];
+        int j = i + 1;
+        while (j < r.second && text[suffixes[j] + depth] == w) ++j;
+        if (w) {
+          ranges.push_back(make_pair(i, j));
+          word_.push_back(w);
+        }
+        i = j;
       }
     }
-    return true;
+    first_child_.push_back(ranges.size());
+    cerr << "  " << vocab_.size() << " words, " << word_.size() << " nodes\n";
+  }
+
+  // number of a test set word, 0 if it does not occur in the test set
+  int Word(const string& w) const {
+    unordered_map<string, int>::const_iterator it = vocab_.find(w);
+    return it == vocab_.end() ? 0 : it->second;
   }
-  Node<int> root;
+
+  static const int kROOT = 0;
+
+  // the node for the phrase of node extended by word, or -1
+  int Extend(int node, int word) const {
+    const int* b = &word_[0] + first_child_[node];
+    const int* e = &word_[0] + first_child_[node + 1];
+    const int* it = lower_bound(b, e, word);
+    if (it == e || *it != word) return -1;
+    return it - &word_[0];
+  }
+
+ private:
+  // orders sentence suffixes, which end at the first 0
+  struct SuffixLess {
+    explicit SuffixLess(const vector<int>* t) : text(t) {}
+    bool operator()(int a, int b) const {
+      const vector<int>& t = *text;
+      while (t[a] && t[a] == t[b]) { ++a; ++b; }
+      return t[a] < t[b];
+    }
+    const vector<int>* text;
+  };
+
+  unordered_map<string, int> vocab_;
+  vector<int> word_;         // the word leading to each node
+  vector<int> first_child_;  // has one entry more than there are nodes
 };
 
-boost::shared_ptr<SourceFilter> filter;
-multimap<float, ID2RuleStatistics::const_iterator> options;
-int kCOUNT;
-int max_options;
+// true if each sequence of terminals of the source side in
+// key = "[LHS] ||| src" occurs in the test set
+bool Matches(const TestSetTrie& trie, const char* key, const char* key_end, string* tmp) {
+  const char* p = strstr(key, "|||");
+  if (!p || p >= key_end) return false;
+  p += 3;
+  int node = TestSetTrie::kROOT;
+  while (true) {
+    while (p < key_end && IsWhitespace(*p)) ++p;
+    if (p == key_end) return true;
+    const char* w = p;
+    while (p < key_end && !IsWhitespace(*p)) ++p;
+    if (IsNonterminal(w, p - w)) {
+      node = TestSetTrie::kROOT;
+    } else {
+      tmp->assign(w, p - w);
+      const int word = trie.Word(*tmp);
+      if (!word) return false;
+      node = trie.Extend(node, word);
+      if (node < 0) return false;
+    }
+  }
+}
 
-void cb(WordID lhs, const vector<WordID>& src_rhs, const ID2RuleStatistics& rules, void*) {
-  options.clear();
-  if (!filter || filter->Matches(src_rhs)) {
-    for (ID2RuleStatistics::const_iterator it = rules.begin(); it != rules.end(); ++it) {
-      options.insert(make_pair(-it->second.counts.get(kCOUNT), it));
+// one target side of a rule and its statistics: "trg ||| CFE=2 ..."
+struct RuleOption {
+  float count;
+  int order;
+  const char* begin;
+  const char* end;
+  bool operator<(const RuleOption& o) const {
+    return count > o.count || (count == o.count && order < o.order);
+  }
+};
+
+// writes the key and the (at most max_options) options with the highest
+// CFE of a matching grammar line
+void FilterLine(const TestSetTrie& trie, const string& line, size_t max_options,
+                vector<RuleOption>* options, string* tmp, ostream* out) {
+  const char* b = line.c_str();
+  const char* e = b + line.size();
+  const char* tab = static_cast<const char*>(memchr(b, '\t', line.size()));
+  if (!tab) {
+    cerr << "Malformed grammar line: " << line << endl;
+    abort();
+  }
+  if (!Matches(trie, b, tab, tmp)) return;
+  options->clear();
+  const char* p = tab + 1;
+  while (p < e) {
+    RuleOption o;
+    o.order = options->size();
+    o.begin = p;
+    const char* div = strstr(p, " ||| ");  // ends the target side
+    if (!div) {
+      cerr << "Malformed grammar line: " << line << endl;
+      abort();
     }
-    int ocount = 0;
-    cout << '[' << TD::Convert(-lhs) << ']' << " ||| ";
-    WriteNamed(src_rhs, &cout);
-    cout << '\t';
-    bool first = true;
-    for (multimap<float,ID2RuleStatistics::const_iterator>::iterator it = options.begin(); it != options.end(); ++it) {
-      if (first) { first = false; } else { cout << " ||| "; }
-      WriteAnonymous(it->second->first, &cout);
-      cout << " ||| " << it->second->second;
-      ++ocount;
-      if (ocount == max_options) break;
+    const char* stats = div + 5;
+    const char* next = strstr(stats, " ||| ");
+    o.end = next ? next : e;
+    o.count = 0;
+    for (const char* f = stats; f < o.end; ++f) {
+      if ((f == stats || *(f - 1) == ' ') && strncmp(f, "CFE=", 4) == 0) {
+        o.count = strtod(f + 4, NULL);
+        break;
+      }
     }
-    cout << endl;
+    options->push_back(o);
+    p = next ? next + 5 : e;
   }
+  size_t n = options->size();
+  if (max_options && max_options < n) {
+    partial_sort(options->begin(), options->begin() + max_options, options->end());
+    n = max_options;
+  } else {
+    sort(options->begin(), options->end());
+  }
+  out->write(b, tab - b);
+  (*out) << '\t';
+  for (int i = 0; i < n; ++i) {
+    if (i) (*out) << " ||| ";
+    out->write((*options)[i].begin, (*options)[i].end - (*options)[i].begin);
+  }
+  (*out) << '\n';
 }
 
+// reads the next batch of lines into reading (setting more to false at
+// the end of the input) on thread 0 while thread t > 0 filters slice t-1
+// of processing into outputs[t-1]
+struct FilterStep {
+  FilterStep(const TestSetTrie& tr, size_t m, istream* i, vector<string>* r, bool* mo,
+             const vector<string>& p, const vector<boost::shared_ptr<ostringstream> >& o) :
+      trie(tr), max_options(m), in(i), reading(r), more(mo), processing(p), outputs(o) {}
+  void operator()(unsigned t) const {
+    if (t == 0) {
+      ReadBatch();
+      return;
+    }
+    const int n = outputs.size();
+    const int begin = processing.size() * (t - 1) / n;
+    const int end = processing.size() * t / n;
+    vector<RuleOption> options;
+    string tmp;
+    for (int i = begin; i < end; ++i)
+      FilterLine(trie, processing[i], max_options, &options, &tmp, outputs[t - 1].get());
+  }
+  void ReadBatch() const {
+    static const size_t kBATCH_BYTES = 16 << 20;
+    if (!*more) return;
+    size_t bytes = 0;
+    string line;
+    while (bytes < kBATCH_BYTES && (*more = !getline(*in, line).fail())) {
+      if (line.empty()) continue;
+      bytes += line.size();
+      reading->push_back(string());
+      reading->back().swap(line);
+    }
+  }
+  const TestSetTrie& trie;
+  const size_t max_options;
+  istream* in;
+  vector<string>* reading;
+  bool* more;
+  const vector<string>& processing;
+  const vector<boost::shared_ptr<ostringstream> >& outputs;
+};
+
 int main(int argc, char** argv){
   po::variables_map conf;
   InitCommandLine(argc, argv, &conf);
-  max_options = conf["top_e_given_f"].as<size_t>();;
-  kCOUNT = FD::Convert("CFE");
-  istream& unscored_grammar = cin;
+  const size_t max_options = conf["top_e_given_f"].as<size_t>();
+  const unsigned num_threads = conf["threads"].as<unsigned>();
   cerr << "Loading test set " << conf["test_set"].as<string>() << "...\n";
-  filter.reset(new DumbSuffixTreeFilter(conf["test_set"].as<string>()));
+  const TestSetTrie trie(conf["test_set"].as<string>(), conf["max_phrase_length"].as<int>());
   cerr << "Filtering...\n";
-  StripedGrammarLexer::ReadStripedGrammar(&unscored_grammar, cb, NULL);
-}
+  istream& unscored_grammar = cin;
+  if (num_threads == 1) {
+    vector<RuleOption> options;
+    string line, tmp;
+    while (getline(unscored_grammar, line))
+      if (!line.empty()) FilterLine(trie, line, max_options, &options, &tmp, &cout);
+    return 0;
+  }
 
+  // while a batch of lines is read, each thread filters a slice of the
+  // previous one, and the slices are written in order
+  vector<string> reading, processing;
+  vector<boost::shared_ptr<ostringstream> > outputs;
+  for (unsigned t = 0; t < num_threads; ++t)
+    outputs.push_back(boost::shared_ptr<ostringstream>(new ostringstream));
+  bool more = true;
+  do {
+    reading.clear();
+    RunThreads(num_threads + 1, FilterStep(trie, max_options, &unscored_grammar, &reading, &more, processing, outputs));
+    for (unsigned t = 0; t < num_threads; ++t) {
+      cout << outputs[t]->str();
+      outputs[t]->str("");
+    }
+    processing.swap(reading);
+  } while (!processing.empty());
+  return 0;
+}
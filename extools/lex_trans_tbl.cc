@@ -0,0 +1,98 @@
+#include "lex_trans_tbl.h"
+
+#include <map>
+
+#include "sentence_pair.h"
+#include "tdict.h"
+
+using namespace std;
+
+void LexTranslationTable::createTTable(const char* buf){
+  AnnotatedParallelSentence sent;
+  sent.ParseInputLine(buf);
+
+  //iterate over the alignment to compute aligned words
+
+  for(int i =0;i<sent.aligned.width();i++)
+    {
+      for (int j=0;j<sent.aligned.height();j++)
+        {
+          if( sent.aligned(i,j))
+            {
+              ++word_translation[pair<WordID,WordID> (sent.f[i], sent.e[j])];
+              ++total_foreign[sent.f[i]];
+              ++total_english[sent.e[j]];
+            }
+        }
+    }
+
+  const WordID NULL_ = TD::Convert("NULL");
+  //handle unaligned words - align them to null
+  for (int j =0; j < sent.e_len; j++) {
+    if (sent.e_aligned[j]) continue;
+    ++word_translation[pair<WordID,WordID> (NULL_, sent.e[j])];
+    ++total_foreign[NULL_];
+    ++total_english[sent.e[j]];
+  }
+
+  for (int i =0; i < sent.f_len; i++) {
+    if (sent.f_aligned[i]) continue;
+    ++word_translation[pair<WordID,WordID> (sent.f[i], NULL_)];
+    ++total_english[NULL_];
+    ++total_foreign[sent.f[i]];
+  }
+}
+
+void LexTranslationTable::LexicalWeights(const vector<WordID>& src,
+                                         const vector<WordID>& trg,
+                                         const vector<pair<short,short> >& aligns,
+                                         WordID null_word,
+                                         float* e2f,
+                                         float* f2e) const {
+  map <WordID, pair<int, float> > foreign_aligned;
+  map <WordID, pair<int, float> > english_aligned;
+
+  //Loop over all the alignment points to compute lexical translation probability
+  for (vector< pair<short,short> >::const_iterator ita = aligns.begin(); ita != aligns.end(); ++ita) {
+    //Lookup this alignment probability in the table
+    const int temp = Count(src[ita->first], trg[ita->second]);
+    float pf2e=0, pe2f=0;
+    const int total_f = TotalForeign(src[ita->first]);
+    if (total_f != 0)
+      pf2e = (float) temp / total_f;
+    const int total_e = TotalEnglish(trg[ita->second]);
+    if (total_e != 0)
+      pe2f = (float) temp / total_e;
+
+    //local counts to keep track of which things haven't been aligned, to later compute their null alignment
+    pair<int, float>& fa = foreign_aligned[src[ita->first]];
+    fa.first++;
+    fa.second += pe2f;
+
+    pair<int, float>& ea = english_aligned[trg[ita->second]];
+    ea.first++;
+    ea.second += pf2e;
+  }
+
+  *e2f = 1;
+  *f2e = 1;
+
+  //compute lexical weight P(F|E) and include unaligned foreign words
+  for (int i = 0; i < src.size(); i++) {
+    map <WordID, pair<int, float> >::const_iterator it = foreign_aligned.find(src[i]);
+    if (it != foreign_aligned.end())
+      *e2f *= it->second.second / it->second.first;
+    else if (total_foreign.count(src[i])) //dealing with null alignment
+      *e2f *= (float) Count(src[i], null_word) / TotalEnglish(null_word);
+    //if we dont have it in the translation table, we won't know its lexical weight
+  }
+
+  //compute P(E|F) unaligned english words
+  for (int j = 0; j < trg.size(); j++) {
+    map <WordID, pair<int, float> >::const_iterator it = english_aligned.find(trg[j]);
+    if (it != english_aligned.end())
+      *f2e *= it->second.second / it->second.first;
+    else if (total_english.count(trg[j])) //dealing with null
+      *f2e *= (float) Count(null_word, trg[j]) / TotalForeign(null_word);
+  }
+}
@@ -9,17 +9,50 @@
 #define LEX_TRANS_TBL_H_
 
 #include "wordid.h"
-#include <map>
+#include <utility>
+#include <vector>
+#include <tr1/unordered_map>
+#include <boost/functional/hash.hpp>
 
 class LexTranslationTable
 {
  public:
+  typedef std::tr1::unordered_map<std::pair<WordID,WordID>, int, boost::hash<std::pair<WordID,WordID> > > PairCounts;
+  typedef std::tr1::unordered_map<WordID, int> Counts;
 
-  std::map < std::pair<WordID,WordID>,int > word_translation;
-  std::map <WordID, int> total_foreign;
-  std::map <WordID, int> total_english;
+  PairCounts word_translation;
+  Counts total_foreign;
+  Counts total_english;
   void createTTable(const char* buf);
-  
+
+  // lookups that, unlike operator[], do not add entries and so may be used
+  // from several threads at once
+  int Count(WordID f, WordID e) const {
+    PairCounts::const_iterator it = word_translation.find(std::make_pair(f, e));
+    return it == word_translation.end() ? 0 : it->second;
+  }
+  int TotalForeign(WordID f) const { return Get(total_foreign, f); }
+  int TotalEnglish(WordID e) const { return Get(total_english, e); }
+
+  // the lexical weights P(f|e) (e2f) and P(e|f) (f2e) of a rule with the
+  // given alignment points between its terminals; unaligned words are
+  // scored by their alignment to null_word if they are in the table, and
+  // ignored otherwise.  Pairs missing from the table count 0 and are not
+  // added to it, so the weights of a rule don't depend on the rules
+  // scored before it.
+  void LexicalWeights(const std::vector<WordID>& src,
+                      const std::vector<WordID>& trg,
+                      const std::vector<std::pair<short,short> >& aligns,
+                      WordID null_word,
+                      float* e2f,
+                      float* f2e) const;
+
+ private:
+  static int Get(const Counts& c, WordID w) {
+    Counts::const_iterator it = c.find(w);
+    return it == c.end() ? 0 : it->second;
+  }
+
 };
 
 #endif /* LEX_TRANS_TBL_H_ */
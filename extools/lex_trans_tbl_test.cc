@@ -0,0 +1,85 @@
+#include "lex_trans_tbl.h"
+
+#include <gtest/gtest.h>
+#include <utility>
+#include <vector>
+
+#include "tdict.h"
+
+using namespace std;
+
+class LexTranslationTableTest : public testing::Test {
+ protected:
+  virtual void SetUp() {
+    table.createTTable("das haus ||| the house ||| 0-0 1-1");
+    table.createTTable("das buch ||| the book ||| 0-0");
+    null_word = TD::Convert("NULL");
+  }
+
+  // the weights of a rule whose i-th source word is aligned to its i-th
+  // target word for i < aligned
+  void Weights(const string& f, const string& e, int aligned, float* e2f, float* f2e) {
+    vector<WordID> src, trg;
+    TD::ConvertSentence(f, &src);
+    TD::ConvertSentence(e, &trg);
+    vector<pair<short,short> > al;
+    for (int i = 0; i < aligned; ++i) al.push_back(make_pair(i, i));
+    table.LexicalWeights(src, trg, al, null_word, e2f, f2e);
+  }
+
+  LexTranslationTable table;
+  WordID null_word;
+};
+
+TEST_F(LexTranslationTableTest, Counts) {
+  EXPECT_EQ(2, table.Count(TD::Convert("das"), TD::Convert("the")));
+  EXPECT_EQ(1, table.Count(TD::Convert("buch"), null_word));
+  EXPECT_EQ(1, table.Count(null_word, TD::Convert("book")));
+  EXPECT_EQ(2, table.TotalForeign(TD::Convert("das")));
+  EXPECT_EQ(1, table.TotalEnglish(null_word));
+}
+
+TEST_F(LexTranslationTableTest, AlignedWords) {
+  float e2f, f2e;
+  Weights("das haus", "the house", 2, &e2f, &f2e);
+  EXPECT_FLOAT_EQ(1, e2f);
+  EXPECT_FLOAT_EQ(1, f2e);
+  Weights("haus", "the", 1, &e2f, &f2e);
+  EXPECT_FLOAT_EQ(0, e2f);
+  EXPECT_FLOAT_EQ(0, f2e);
+}
+
+TEST_F(LexTranslationTableTest, UnalignedWords) {
+  float e2f, f2e;
+  // buch and book were seen unaligned, haus was not
+  Weights("das buch", "the book", 1, &e2f, &f2e);
+  EXPECT_FLOAT_EQ(1, e2f);
+  EXPECT_FLOAT_EQ(1, f2e);
+  Weights("das haus", "the", 1, &e2f, &f2e);
+  EXPECT_FLOAT_EQ(0, e2f);
+  EXPECT_FLOAT_EQ(1, f2e);
+}
+
+// looking up pairs that are not in the table must not add them, so that
+// an aligned unknown word doesn't make it known to later rules
+TEST_F(LexTranslationTableTest, MissingPair) {
+  const size_t pairs = table.word_translation.size();
+  const size_t foreign = table.total_foreign.size();
+  const size_t english = table.total_english.size();
+  float e2f, f2e;
+  Weights("klein", "small", 1, &e2f, &f2e);
+  EXPECT_FLOAT_EQ(0, e2f);
+  EXPECT_FLOAT_EQ(0, f2e);
+  EXPECT_EQ(pairs, table.word_translation.size());
+  EXPECT_EQ(foreign, table.total_foreign.size());
+  EXPECT_EQ(english, table.total_english.size());
+  // unaligned unknown words are still ignored
+  Weights("das klein", "the small", 1, &e2f, &f2e);
+  EXPECT_FLOAT_EQ(1, e2f);
+  EXPECT_FLOAT_EQ(1, f2e);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,229 @@
+#include "rule_sorter.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <stdint.h>
+
+#include "varint.h"
+
+using namespace std;
+using namespace std::tr1;
+
+namespace {
+
+// rough number of bytes a table entry takes besides its words and alignment
+// points: the hash node, the vectors and the allocator's bookkeeping
+const size_t kENTRY_OVERHEAD = 160;
+
+// nonterminals are negative, and shifting a negative int left is undefined
+inline size_t ZigZag(WordID x) {
+  return (static_cast<uint32_t>(x) << 1) ^ static_cast<uint32_t>(x >> 31);
+}
+
+inline WordID UnZigZag(size_t x) {
+  return static_cast<WordID>((x >> 1) ^ -(x & 1));
+}
+
+// orders reader indices so that the heap has the smallest rule on top
+struct HeadGreater {
+  explicit HeadGreater(const vector<CountedRule>* h) : heads(h) {}
+  bool operator()(int a, int b) const { return (*heads)[b] < (*heads)[a]; }
+  const vector<CountedRule>* heads;
+};
+
+template <typename Entry>
+struct EntryLess {
+  bool operator()(const Entry* a, const Entry* b) const {
+    return a->first.first < b->first.first ||
+        (a->first.first == b->first.first && a->first.second < b->first.second);
+  }
+};
+
+}
+
+void RuleCounts::Combine(const RuleCounts& other) {
+  for (int i = 0; i < kNUM_COUNTS; ++i) counts[i] += other.counts[i];
+  if (other.aligns.size() > aligns.size() ||
+      (other.aligns.size() == aligns.size() && other.aligns < aligns))
+    aligns = other.aligns;
+}
+
+RuleRunWriter::RuleRunWriter(const string& file) : file_(file), out_(file.c_str(), ios::binary) {
+  if (!out_) {
+    perror(file_.c_str());
+    abort();
+  }
+}
+
+void RuleRunWriter::WriteVarint(size_t x) {
+  ::WriteVarint(x, &out_);
+}
+
+void RuleRunWriter::Write(const vector<WordID>& key, const vector<WordID>& val, const RuleCounts& stats) {
+  WriteVarint(key.size());
+  for (int i = 0; i < key.size(); ++i) WriteVarint(ZigZag(key[i]));
+  WriteVarint(val.size());
+  for (int i = 0; i < val.size(); ++i) WriteVarint(ZigZag(val[i]));
+  out_.write(reinterpret_cast<const char*>(stats.counts), sizeof(stats.counts));
+  WriteVarint(stats.aligns.size());
+  for (int i = 0; i < stats.aligns.size(); ++i) {
+    WriteVarint(stats.aligns[i].first);
+    WriteVarint(stats.aligns[i].second);
+  }
+}
+
+void RuleRunWriter::Close() {
+  out_.close();
+  if (!out_) {
+    cerr << "Failed to write " << file_ << endl;
+    abort();
+  }
+}
+
+RuleRunReader::RuleRunReader(const string& file) : file_(file), in_(file.c_str(), ios::binary) {
+  if (!in_) {
+    perror(file_.c_str());
+    abort();
+  }
+}
+
+bool RuleRunReader::ReadVarint(size_t* x) {
+  const int r = ::ReadVarint(&in_, x);
+  if (r < 0) {
+    cerr << "Malformed rule run " << file_ << endl;
+    abort();
+  }
+  return r > 0;
+}
+
+size_t RuleRunReader::ReadRequiredVarint() {
+  size_t x;
+  if (!ReadVarint(&x)) {
+    cerr << "Truncated rule run " << file_ << endl;
+    abort();
+  }
+  return x;
+}
+
+bool RuleRunReader::Read(CountedRule* r) {
+  size_t n;
+  if (!ReadVarint(&n)) return false;
+  r->key.resize(n);
+  for (int i = 0; i < n; ++i) r->key[i] = UnZigZag(ReadRequiredVarint());
+  r->val.resize(ReadRequiredVarint());
+  for (int i = 0; i < r->val.size(); ++i) r->val[i] = UnZigZag(ReadRequiredVarint());
+  if (!in_.read(reinterpret_cast<char*>(r->stats.counts), sizeof(r->stats.counts))) {
+    cerr << "Truncated rule run " << file_ << endl;
+    abort();
+  }
+  r->stats.aligns.resize(ReadRequiredVarint());
+  for (int i = 0; i < r->stats.aligns.size(); ++i) {
+    r->stats.aligns[i].first = ReadRequiredVarint();
+    r->stats.aligns[i].second = ReadRequiredVarint();
+  }
+  return true;
+}
+
+RuleMerger::RuleMerger(const vector<string>& runs) : heads_(runs.size()) {
+  for (int i = 0; i < runs.size(); ++i) {
+    readers_.push_back(boost::shared_ptr<RuleRunReader>(new RuleRunReader(runs[i])));
+    if (readers_[i]->Read(&heads_[i])) heap_.push_back(i);
+  }
+  make_heap(heap_.begin(), heap_.end(), HeadGreater(&heads_));
+}
+
+bool RuleMerger::Next(CountedRule* r) {
+  if (heap_.empty()) return false;
+  const HeadGreater greater(&heads_);
+  int top = heap_.front();
+  swap(*r, heads_[top]);
+  while (true) {
+    // replace the rule just taken by the next one of the same run
+    pop_heap(heap_.begin(), heap_.end(), greater);
+    if (readers_[top]->Read(&heads_[top]))
+      push_heap(heap_.begin(), heap_.end(), greater);
+    else
+      heap_.pop_back();
+    if (heap_.empty()) break;
+    top = heap_.front();
+    const CountedRule& next = heads_[top];
+    if (next.key != r->key || next.val != r->val) break;
+    r->stats.Combine(next.stats);
+  }
+  return true;
+}
+
+RuleSorter::RuleSorter(const string& prefix, size_t max_bytes) :
+    prefix_(prefix), max_bytes_(max_bytes), bytes_(), next_run_() {}
+
+RuleSorter::~RuleSorter() {
+  for (int i = 0; i < runs_.size(); ++i)
+    remove(runs_[i].c_str());
+}
+
+string RuleSorter::NextRunName() {
+  ostringstream os;
+  os << prefix_ << '.' << next_run_++;
+  return os.str();
+}
+
+void RuleSorter::Add(const CountedRule& r) {
+  const KeyVal kv(r.key, r.val);
+  Table::iterator it = table_.find(kv);
+  if (it == table_.end()) {
+    table_.insert(make_pair(kv, r.stats));
+    bytes_ += kENTRY_OVERHEAD + (r.key.size() + r.val.size()) * sizeof(WordID) +
+        r.stats.aligns.size() * sizeof(pair<short,short>);
+    if (bytes_ > max_bytes_) Flush();
+  } else {
+    it->second.Combine(r.stats);
+  }
+}
+
+void RuleSorter::Flush() {
+  if (table_.empty()) return;
+  vector<Table::value_type*> entries;
+  entries.reserve(table_.size());
+  for (Table::iterator it = table_.begin(); it != table_.end(); ++it)
+    entries.push_back(&*it);
+  sort(entries.begin(), entries.end(), EntryLess<Table::value_type>());
+  runs_.push_back(NextRunName());
+  RuleRunWriter w(runs_.back());
+  for (int i = 0; i < entries.size(); ++i)
+    w.Write(entries[i]->first.first, entries[i]->first.second, entries[i]->second);
+  w.Close();
+  table_.clear();
+  bytes_ = 0;
+}
+
+void RuleSorter::TakeRuns(RuleSorter* other) {
+  runs_.insert(runs_.end(), other->runs_.begin(), other->runs_.end());
+  other->runs_.clear();
+}
+
+const vector<string>& RuleSorter::Finish(size_t max_fan_in) {
+  Flush();
+  while (runs_.size() > max_fan_in) {
+    vector<string> merged;
+    for (int i = 0; i < runs_.size(); i += max_fan_in) {
+      const vector<string> group(runs_.begin() + i, runs_.begin() + min(runs_.size(), i + max_fan_in));
+      if (group.size() == 1) {
+        merged.push_back(group[0]);
+        continue;
+      }
+      merged.push_back(NextRunName());
+      RuleMerger merger(group);
+      RuleRunWriter w(merged.back());
+      CountedRule r;
+      while (merger.Next(&r)) w.Write(r);
+      w.Close();
+      for (int j = 0; j < group.size(); ++j)
+        remove(group[j].c_str());
+    }
+    runs_.swap(merged);
+  }
+  return runs_;
+}
@@ -0,0 +1,132 @@
+#ifndef _RULE_SORTER_H_
+#define _RULE_SORTER_H_
+
+// Sorting and combining of rule counts that do not fit into memory.  Rules
+// are added to a RuleSorter, which combines duplicates in a hash table and,
+// whenever the table grows beyond its memory budget, writes its contents
+// sorted to a binary run file on disk.  RuleMerger then reads any number of
+// runs back in order, combining rules that occur in several runs.
+//
+// Run files are a sequence of records (integers are varints, WordIDs are
+// zig-zag encoded since nonterminals are negative):
+//   #key key[0..#key) #val val[0..#val) float counts[3]
+//   #aligns (f e)[0..#aligns)
+
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <tr1/unordered_map>
+#include <boost/functional/hash.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "wordid.h"
+
+// the counts gathered for a rule
+struct RuleCounts {
+  enum { kJOINT = 0, kF_MARGINAL, kE_MARGINAL, kNUM_COUNTS };
+
+  RuleCounts() { Clear(); }
+  void Clear() {
+    for (int i = 0; i < kNUM_COUNTS; ++i) counts[i] = 0;
+    aligns.clear();
+  }
+  // adds the counts of other; of the two alignments the longer one is kept,
+  // or the lexicographically smaller one if they are as long, so the result
+  // does not depend on the order counts are combined in
+  void Combine(const RuleCounts& other);
+
+  float counts[kNUM_COUNTS];
+  std::vector<std::pair<short,short> > aligns;
+};
+
+struct CountedRule {
+  void Clear() {
+    key.clear();
+    val.clear();
+    stats.Clear();
+  }
+  // rules are ordered by key, then by value
+  bool operator<(const CountedRule& other) const {
+    return key < other.key || (key == other.key && val < other.val);
+  }
+
+  std::vector<WordID> key;
+  std::vector<WordID> val;
+  RuleCounts stats;
+};
+
+class RuleRunWriter {
+ public:
+  explicit RuleRunWriter(const std::string& file);
+  void Write(const std::vector<WordID>& key, const std::vector<WordID>& val, const RuleCounts& stats);
+  void Write(const CountedRule& r) { Write(r.key, r.val, r.stats); }
+  // aborts if anything could not be written
+  void Close();
+
+ private:
+  void WriteVarint(size_t x);
+  const std::string file_;
+  std::ofstream out_;
+};
+
+class RuleRunReader {
+ public:
+  explicit RuleRunReader(const std::string& file);
+  // false at the end of the run
+  bool Read(CountedRule* r);
+
+ private:
+  bool ReadVarint(size_t* x);
+  size_t ReadRequiredVarint();
+  const std::string file_;
+  std::ifstream in_;
+};
+
+// reads several runs and returns their rules in order, combining identical
+// rules into one
+class RuleMerger {
+ public:
+  explicit RuleMerger(const std::vector<std::string>& runs);
+  bool Next(CountedRule* r);
+
+ private:
+  std::vector<boost::shared_ptr<RuleRunReader> > readers_;
+  std::vector<CountedRule> heads_;
+  std::vector<int> heap_;  // indices of the readers that still have rules
+};
+
+class RuleSorter {
+ public:
+  // run files are named prefix.0, prefix.1, ...; the combining table is
+  // written to disk when it takes more than (roughly) max_bytes
+  RuleSorter(const std::string& prefix, size_t max_bytes);
+  // removes the run files
+  ~RuleSorter();
+
+  void Add(const CountedRule& r);
+  // writes whatever is still in memory to a run
+  void Flush();
+  // takes over the runs of other, which will no longer remove them
+  void TakeRuns(RuleSorter* other);
+  // flushes, then merges groups of runs into larger runs until at most
+  // max_fan_in are left, so that a RuleMerger reading them does not keep
+  // too many files open
+  const std::vector<std::string>& Finish(size_t max_fan_in);
+  const std::vector<std::string>& runs() const { return runs_; }
+
+ private:
+  typedef std::pair<std::vector<WordID>, std::vector<WordID> > KeyVal;
+  typedef std::tr1::unordered_map<KeyVal, RuleCounts, boost::hash<KeyVal> > Table;
+
+  std::string NextRunName();
+
+  const std::string prefix_;
+  const size_t max_bytes_;
+  size_t bytes_;
+  int next_run_;
+  Table table_;
+  std::vector<std::string> runs_;
+};
+
+#endif
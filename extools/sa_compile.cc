@@ -0,0 +1,38 @@
+#include <iostream>
+#include <string>
+
+#include <boost/program_options.hpp>
+#include <boost/program_options/variables_map.hpp>
+
+#include "filelib.h"
+#include "suffix_array.h"
+
+using namespace std;
+namespace po = boost::program_options;
+
+void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
+  po::options_description opts("Configuration options");
+  opts.add_options()
+        ("input,i", po::value<string>()->default_value("-"), "Word-aligned parallel corpus (f ||| e ||| alignment)")
+        ("index,x", po::value<string>(), "Write the index to INDEX.sa and INDEX.vocab")
+        ("help,h", "Print this help message and exit");
+  po::options_description dcmdline_options;
+  dcmdline_options.add(opts);
+
+  po::store(parse_command_line(argc, argv, dcmdline_options), *conf);
+  po::notify(*conf);
+
+  if (conf->count("help") || conf->count("index") == 0) {
+    cerr << "\nUsage: sa_compile -x INDEX [-i corpus.f-e.al]\n";
+    cerr << dcmdline_options << endl;
+    exit(1);
+  }
+}
+
+int main(int argc, char** argv) {
+  po::variables_map conf;
+  InitCommandLine(argc, argv, &conf);
+  ReadFile rf(conf["input"].as<string>());
+  SuffixArrayIndex::Compile(rf.stream(), conf["index"].as<string>());
+  return 0;
+}
@@ -0,0 +1,242 @@
+/*
+ * Extract a grammar for each test sentence from samples of the training
+ * sentences that contain its phrases, found with a suffix array index
+ * written by sa_compile.
+ */
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <utility>
+#include <tr1/unordered_map>
+
+#include <boost/functional/hash.hpp>
+#include <boost/program_options.hpp>
+#include <boost/program_options/variables_map.hpp>
+
+#include "sentence_pair.h"
+#include "extract.h"
+#include "suffix_array.h"
+#include "tdict.h"
+#include "filelib.h"
+
+using namespace std;
+using namespace std::tr1;
+namespace po = boost::program_options;
+
+void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
+  po::options_description opts("Configuration options");
+  opts.add_options()
+        ("index,x", po::value<string>(), "Index written by sa_compile (INDEX.sa and INDEX.vocab)")
+        ("input,i", po::value<string>()->default_value("-"), "Test sentences, one per line")
+        ("grammar_dir,g", po::value<string>(), "Write the grammar of sentence N to DIR/grammar.N.gz")
+        ("sample_size,s", po::value<int>()->default_value(100), "Extract from at most this many occurrences of each phrase of a test sentence")
+        ("max_sentences,S", po::value<int>()->default_value(2000), "Extract from at most this many training sentences per test sentence (longer phrases are sampled first)")
+        ("default_category,d", po::value<string>()->default_value("X"), "Category of the extracted rules")
+        ("max_base_phrase_size,L", po::value<int>()->default_value(10), "Maximum starting phrase size")
+        ("max_syms,l", po::value<int>()->default_value(5), "Maximum number of symbols in final phrase size")
+        ("max_vars,v", po::value<int>()->default_value(2), "Maximum number of nonterminal variables in final phrase size")
+        ("permit_adjacent_nonterminals,A", "Permit adjacent nonterminals in source side of rules")
+        ("no_required_aligned_terminal,n", "Do not require an aligned terminal")
+        ("top_e_given_f,t", po::value<int>()->default_value(30), "Keep top N rules for each source side, according to p(e|f). 0 for all")
+        ("help,h", "Print this help message and exit");
+  po::options_description dcmdline_options;
+  dcmdline_options.add(opts);
+
+  po::store(parse_command_line(argc, argv, dcmdline_options), *conf);
+  po::notify(*conf);
+
+  if (conf->count("help") || conf->count("index") == 0 || conf->count("grammar_dir") == 0) {
+    cerr << "\nUsage: sa_extract -x INDEX -g GRAMMAR_DIR [-options] < test.f > test.sgm\n";
+    cerr << "  Writes the test sentences with their grammars marked up for cdec\n";
+    cerr << dcmdline_options << endl;
+    exit(1);
+  }
+}
+
+// how often a rule was extracted from the sampled sentences, and the sums
+// of its lexical weights over those extractions
+struct RuleStats {
+  RuleStats() : count(), lex_e_given_f(), lex_f_given_e() {}
+  int count;
+  double lex_e_given_f;
+  double lex_f_given_e;
+};
+
+typedef unordered_map<vector<WordID>, map<vector<WordID>, RuleStats>, boost::hash<vector<WordID> > > RuleCounts;
+
+// counts the rules that apply to the test sentence
+struct SampledRuleCounter : public Extract::RuleObserver {
+  SampledRuleCounter(const vector<WordID>* sentence, const SuffixArrayIndex* sa, RuleCounts* counts) :
+    sentence_(sentence), sa_(sa), counts_(counts) {}
+ protected:
+  virtual void CountRuleImpl(WordID lhs,
+                             const vector<WordID>& rhs_f,
+                             const vector<WordID>& rhs_e,
+                             const vector<pair<short,short> >& fe_terminal_alignments) {
+    if (!MatchesSentence(rhs_f, *sentence_)) return;
+    key_.resize(1 + rhs_f.size());
+    key_[0] = lhs;
+    copy(rhs_f.begin(), rhs_f.end(), key_.begin() + 1);
+    double e_given_f, f_given_e;
+    LexicalWeights(*sa_, rhs_f, rhs_e, fe_terminal_alignments, &e_given_f, &f_given_e);
+    RuleStats& stats = (*counts_)[key_][rhs_e];
+    ++stats.count;
+    stats.lex_e_given_f += e_given_f;
+    stats.lex_f_given_e += f_given_e;
+  }
+ private:
+  const vector<WordID>* sentence_;
+  const SuffixArrayIndex* sa_;
+  RuleCounts* counts_;
+  vector<WordID> key_;
+};
+
+struct CountGreater {
+  bool operator()(const pair<int, const map<vector<WordID>, RuleStats>::value_type*>& a,
+                  const pair<int, const map<vector<WordID>, RuleStats>::value_type*>& b) const {
+    return a.first > b.first;
+  }
+};
+
+// -log p, capped like featurize_grammar's features
+inline double SafeNegLog(double p) {
+  if (p >= 1) return 0;
+  if (p <= 0) return 100;
+  return min(100.0, -log(p));
+}
+
+// writes the rules with the features EGivenF, LogRuleCount, SingletonRule
+// and the lexical weights LexF2E = -log lex(e|f) and LexE2F = -log lex(f|e),
+// averaged over the extractions of the rule
+void WriteGrammar(const RuleCounts& counts, const int top_e_given_f, ostream* out) {
+  vector<pair<int, const map<vector<WordID>, RuleStats>::value_type*> > options;
+  for (RuleCounts::const_iterator it = counts.begin(); it != counts.end(); ++it) {
+    const vector<WordID>& key = it->first;
+    int total = 0;
+    options.clear();
+    for (map<vector<WordID>, RuleStats>::const_iterator ti = it->second.begin(); ti != it->second.end(); ++ti) {
+      total += ti->second.count;
+      options.push_back(make_pair(ti->second.count, &*ti));
+    }
+    stable_sort(options.begin(), options.end(), CountGreater());
+    if (top_e_given_f > 0 && options.size() > top_e_given_f)
+      options.resize(top_e_given_f);
+    ostringstream src;
+    for (int i = 1, nt = 1; i < key.size(); ++i) {
+      if (i > 1) src << ' ';
+      if (key[i] < 0) src << '[' << TD::Convert(-key[i]) << ',' << nt++ << ']';
+      else src << TD::Convert(key[i]);
+    }
+    for (int o = 0; o < options.size(); ++o) {
+      const vector<WordID>& trg = options[o].second->first;
+      const RuleStats& stats = options[o].second->second;
+      const int count = stats.count;
+      (*out) << '[' << TD::Convert(-key[0]) << "] ||| " << src.str() << " |||";
+      for (int j = 0; j < trg.size(); ++j) {
+        if (trg[j] <= 0) (*out) << " [" << (1 - trg[j]) << ']';
+        else (*out) << ' ' << TD::Convert(trg[j]);
+      }
+      (*out) << " ||| EGivenF=" << (log(total) - log(count)) << " LogRuleCount=" << log(count)
+             << " LexF2E=" << SafeNegLog(stats.lex_e_given_f / count)
+             << " LexE2F=" << SafeNegLog(stats.lex_f_given_e / count);
+      if (count == 1) (*out) << " SingletonRule=1";
+      (*out) << endl;
+    }
+  }
+}
+
+struct Phrase {
+  Phrase(int l, uint64_t a, uint64_t b) : len(l), lo(a), hi(b) {}
+  int len;
+  uint64_t lo, hi;
+  bool operator<(const Phrase& o) const { return len > o.len; }
+};
+
+int main(int argc, char** argv) {
+  po::variables_map conf;
+  InitCommandLine(argc, argv, &conf);
+  const string index = conf["index"].as<string>();
+  // the index uses the ids of its vocabulary, so load it before
+  // converting anything else
+  TD::LoadSnapshot(index + ".vocab");
+  SuffixArrayIndex sa(index + ".sa");
+  cerr << "Loaded index of " << sa.NumSentences() << " sentences\n";
+
+  const WordID default_cat = -TD::Convert(conf["default_category"].as<string>());
+  const string grammar_dir = conf["grammar_dir"].as<string>();
+  const int sample_size = conf["sample_size"].as<int>();
+  const int max_sentences = conf["max_sentences"].as<int>();
+  const int max_base_phrase_size = conf["max_base_phrase_size"].as<int>();
+  const int max_syms = conf["max_syms"].as<int>();
+  const int max_vars = conf["max_vars"].as<int>();
+  const bool permit_adjacent_nonterminals = conf.count("permit_adjacent_nonterminals") > 0;
+  const bool require_aligned_terminal = conf.count("no_required_aligned_terminal") == 0;
+  const int top_e_given_f = conf["top_e_given_f"].as<int>();
+
+  ReadFile rf(conf["input"].as<string>());
+  istream& in = *rf.stream();
+  string line;
+  vector<WordID> sentence;
+  vector<Phrase> phrases;
+  vector<unsigned> sampled;
+  set<unsigned> seen;
+  AnnotatedParallelSentence training;
+  vector<ParallelSpan> base_phrases;
+  vector<WordID> all_cats;
+  RuleCounts counts;
+  int id = 0;
+  for (; getline(in, line); ++id) {
+    TD::ConvertSentence(line, &sentence);
+
+    // find the phrases of the sentence in the index
+    phrases.clear();
+    for (int i = 0; i < sentence.size(); ++i) {
+      uint64_t lo = 0, hi = sa.NumSourceWords();
+      for (int len = 1; len <= max_syms && i + len <= sentence.size(); ++len) {
+        sa.Extend(sentence[i + len - 1], len - 1, &lo, &hi);
+        if (lo == hi) break;
+        phrases.push_back(Phrase(len, lo, hi));
+      }
+    }
+    stable_sort(phrases.begin(), phrases.end());
+
+    // sample training sentences, evenly spaced in each phrase's range
+    sampled.clear();
+    seen.clear();
+    for (int p = 0; p < phrases.size() && sampled.size() < max_sentences; ++p) {
+      const uint64_t n = phrases[p].hi - phrases[p].lo;
+      const uint64_t m = min<uint64_t>(n, sample_size);
+      for (uint64_t k = 0; k < m && sampled.size() < max_sentences; ++k) {
+        const unsigned s = sa.SentenceOf(sa.SuffixPosition(phrases[p].lo + k * n / m));
+        if (seen.insert(s).second) sampled.push_back(s);
+      }
+    }
+
+    counts.clear();
+    SampledRuleCounter counter(&sentence, &sa, &counts);
+    for (int k = 0; k < sampled.size(); ++k) {
+      sa.GetSentence(sampled[k], &training);
+      base_phrases.clear();
+      Extract::ExtractBasePhrases(max_base_phrase_size, training, &base_phrases);
+      if (base_phrases.empty()) continue;
+      Extract::AnnotatePhrasesWithCategoryTypes(default_cat, training.span_types, &base_phrases);
+      Extract::ExtractConsistentRules(training, base_phrases, max_vars, max_syms, permit_adjacent_nonterminals, require_aligned_terminal, &counter, &all_cats);
+    }
+
+    ostringstream grammar;
+    grammar << grammar_dir << "/grammar." << id << ".gz";
+    {
+      WriteFile wf(grammar.str());
+      WriteGrammar(counts, top_e_given_f, wf.stream());
+    }
+    cout << "<seg id=\"" << id << "\" grammar=\"" << grammar.str() << "\"> " << line << " </seg>" << endl;
+    cerr << "Sentence " << id << ": " << phrases.size() << " phrases found, "
+         << sampled.size() << " training sentences sampled, " << counts.size() << " source sides\n";
+  }
+  return 0;
+}
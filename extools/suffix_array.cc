@@ -0,0 +1,285 @@
+#include "suffix_array.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <tr1/unordered_map>
+
+#include "sentence_pair.h"
+#include "tdict.h"
+
+using namespace std;
+using namespace std::tr1;
+
+namespace {
+
+const char kMAGIC[] = "CDECSAX2";
+const size_t kMAGIC_SIZE = MappedFile::kMAGIC_SIZE;
+const size_t kHEADER_SIZE = kMAGIC_SIZE + 7 * sizeof(uint64_t);
+const size_t MAX_LINE_LENGTH = 100000;
+
+inline uint64_t LexKey(WordID f, WordID e) {
+  return static_cast<uint64_t>(f) << 32 | static_cast<uint32_t>(e);
+}
+
+template <typename T>
+void WriteArray(const vector<T>& v, ostream* out) {
+  if (!v.empty()) out->write(reinterpret_cast<const char*>(&v[0]), v.size() * sizeof(T));
+}
+
+// orders positions of f by the words from there to the end of their
+// sentence; the end of a sentence comes before any word
+struct SuffixLess {
+  SuffixLess(const vector<uint32_t>& f, const vector<uint32_t>& end) : f_(f), end_(end) {}
+  bool operator()(uint32_t a, uint32_t b) const {
+    const uint32_t ea = end_[a], eb = end_[b];
+    for (; a < ea && b < eb; ++a, ++b)
+      if (f_[a] != f_[b]) return f_[a] < f_[b];
+    return a == ea && b != eb;
+  }
+  const vector<uint32_t>& f_;
+  const vector<uint32_t>& end_;
+};
+
+typedef unordered_map<uint64_t, uint64_t> LexCounts;
+
+void CountLink(WordID f, WordID e, LexCounts* lex, vector<uint64_t>* f_links, vector<uint64_t>* e_links) {
+  ++(*lex)[LexKey(f, e)];
+  if (f >= f_links->size()) f_links->resize(f + 1);
+  if (e >= e_links->size()) e_links->resize(e + 1);
+  ++(*f_links)[f];
+  ++(*e_links)[e];
+}
+
+}
+
+SuffixArrayIndex::SuffixArrayIndex(const string& file) :
+    file_(file, kMAGIC, kHEADER_SIZE, "suffix array index") {
+  const char* p = file_.data();
+  uint64_t header[7];
+  memcpy(header, p + kMAGIC_SIZE, sizeof(header));
+  num_sentences_ = header[0];
+  num_f_ = header[1];
+  num_e_ = header[2];
+  num_links_ = header[3];
+  num_lex_ = header[4];
+  vocab_size_ = header[5];
+  null_word_ = header[6];
+  file_.CheckSize(kHEADER_SIZE +
+      (3 * (num_sentences_ + 1) + 2 * num_lex_ + 2 * vocab_size_) * sizeof(uint64_t) +
+      (2 * num_f_ + num_e_) * sizeof(uint32_t) + 2 * num_links_ * sizeof(uint16_t));
+  p += kHEADER_SIZE;
+  f_start_ = reinterpret_cast<const uint64_t*>(p);
+  p += (num_sentences_ + 1) * sizeof(uint64_t);
+  e_start_ = reinterpret_cast<const uint64_t*>(p);
+  p += (num_sentences_ + 1) * sizeof(uint64_t);
+  link_start_ = reinterpret_cast<const uint64_t*>(p);
+  p += (num_sentences_ + 1) * sizeof(uint64_t);
+  lex_pair_ = reinterpret_cast<const uint64_t*>(p);
+  p += num_lex_ * sizeof(uint64_t);
+  lex_count_ = reinterpret_cast<const uint64_t*>(p);
+  p += num_lex_ * sizeof(uint64_t);
+  f_links_ = reinterpret_cast<const uint64_t*>(p);
+  p += vocab_size_ * sizeof(uint64_t);
+  e_links_ = reinterpret_cast<const uint64_t*>(p);
+  p += vocab_size_ * sizeof(uint64_t);
+  f_ = reinterpret_cast<const uint32_t*>(p);
+  p += num_f_ * sizeof(uint32_t);
+  e_ = reinterpret_cast<const uint32_t*>(p);
+  p += num_e_ * sizeof(uint32_t);
+  sa_ = reinterpret_cast<const uint32_t*>(p);
+  p += num_f_ * sizeof(uint32_t);
+  link_ = reinterpret_cast<const uint16_t*>(p);
+  // the sentence arrays are as long as the corpus has sentences, so they
+  // are checked here; suffixes and links are checked where they are read
+  file_.CheckOffsets(f_start_, num_sentences_, num_f_, false, "f_start");
+  file_.CheckOffsets(e_start_, num_sentences_, num_e_, false, "e_start");
+  file_.CheckOffsets(link_start_, num_sentences_, num_links_, false, "link_start");
+}
+
+SuffixArrayIndex::~SuffixArrayIndex() {}
+
+unsigned SuffixArrayIndex::SentenceOf(uint64_t pos) const {
+  file_.CheckRange(pos, pos + 1, num_f_, "sa");
+  return upper_bound(f_start_, f_start_ + num_sentences_ + 1, pos) - f_start_ - 1;
+}
+
+WordID SuffixArrayIndex::WordAt(uint64_t pos, int off) const {
+  const uint64_t end = f_start_[SentenceOf(pos) + 1];
+  return pos + off < end ? f_[pos + off] : 0;
+}
+
+void SuffixArrayIndex::Extend(WordID word, int len, uint64_t* lo, uint64_t* hi) const {
+  // the suffixes in [*lo, *hi) agree on their first len words, so they
+  // are sorted by the next one
+  uint64_t a = *lo, b = *hi;
+  while (a < b) {
+    const uint64_t mid = a + (b - a) / 2;
+    if (WordAt(sa_[mid], len) < word) a = mid + 1; else b = mid;
+  }
+  uint64_t c = a;
+  b = *hi;
+  while (c < b) {
+    const uint64_t mid = c + (b - c) / 2;
+    if (WordAt(sa_[mid], len) <= word) c = mid + 1; else b = mid;
+  }
+  *lo = a;
+  *hi = c;
+}
+
+void SuffixArrayIndex::GetSentence(unsigned s, AnnotatedParallelSentence* sentence) const {
+  sentence->f.assign(f_ + f_start_[s], f_ + f_start_[s + 1]);
+  sentence->e.assign(e_ + e_start_[s], e_ + e_start_[s + 1]);
+  sentence->aligned.clear();
+  sentence->f_aligned.clear();
+  sentence->e_aligned.clear();
+  sentence->aligns_by_fword.clear();
+  sentence->span_types.clear();
+  sentence->AllocateForAlignment();
+  for (uint64_t l = link_start_[s]; l < link_start_[s + 1]; ++l) {
+    if (link_[2 * l] >= sentence->f_len || link_[2 * l + 1] >= sentence->e_len) file_.Corrupt("link");
+    sentence->Align(link_[2 * l], link_[2 * l + 1]);
+  }
+}
+
+uint64_t SuffixArrayIndex::LinkCount(WordID f, WordID e) const {
+  if (f < 0 || e < 0) return 0;
+  const uint64_t key = LexKey(f, e);
+  const uint64_t* it = lower_bound(lex_pair_, lex_pair_ + num_lex_, key);
+  return (it == lex_pair_ + num_lex_ || *it != key) ? 0 : lex_count_[it - lex_pair_];
+}
+
+void SuffixArrayIndex::Compile(istream* in, const string& index) {
+  vector<uint64_t> f_start(1, 0), e_start(1, 0), link_start(1, 0);
+  vector<uint32_t> f, e, end;
+  vector<uint16_t> link;
+  // lexical translation counts, with unaligned words linked to NULL
+  const WordID null_word = TD::Convert("NULL");
+  LexCounts lex;
+  vector<uint64_t> f_links, e_links;
+  char* buf = new char[MAX_LINE_LENGTH];
+  AnnotatedParallelSentence sentence;
+  while (*in) {
+    in->getline(buf, MAX_LINE_LENGTH);
+    if (buf[0] == 0) continue;
+    sentence.ParseInputLine(buf);
+    if (sentence.f_len > 0xffff || sentence.e_len > 0xffff) {
+      cerr << "Sentence " << f_start.size() << " is too long, skipping\n";
+      sentence.f.clear();
+      sentence.e.clear();
+    }
+    f.insert(f.end(), sentence.f.begin(), sentence.f.end());
+    e.insert(e.end(), sentence.e.begin(), sentence.e.end());
+    for (int i = 0; i < sentence.f.size(); ++i)
+      for (int j = 0; j < sentence.e.size(); ++j)
+        if (sentence.aligned(i, j)) {
+          link.push_back(i);
+          link.push_back(j);
+          CountLink(sentence.f[i], sentence.e[j], &lex, &f_links, &e_links);
+        }
+    for (int i = 0; i < sentence.f.size(); ++i)
+      if (!sentence.f_aligned[i]) CountLink(sentence.f[i], null_word, &lex, &f_links, &e_links);
+    for (int j = 0; j < sentence.e.size(); ++j)
+      if (!sentence.e_aligned[j]) CountLink(null_word, sentence.e[j], &lex, &f_links, &e_links);
+    f_start.push_back(f.size());
+    e_start.push_back(e.size());
+    link_start.push_back(link.size() / 2);
+    end.resize(f.size(), f.size());
+    if (f_start.size() % 100000 == 1) cerr << "  [" << (f_start.size() - 1) << "]\n";
+  }
+  delete[] buf;
+  if (f.size() > 0xffffffffu) {
+    cerr << "Corpus is too large for 32-bit positions\n";
+    abort();
+  }
+  cerr << "Sorting " << f.size() << " suffixes of " << (f_start.size() - 1) << " sentences\n";
+  vector<uint32_t> sa(f.size());
+  for (uint32_t i = 0; i < sa.size(); ++i) sa[i] = i;
+  sort(sa.begin(), sa.end(), SuffixLess(f, end));
+  end.clear();
+  vector<pair<uint64_t, uint64_t> > sorted_lex(lex.begin(), lex.end());
+  lex.clear();
+  sort(sorted_lex.begin(), sorted_lex.end());
+  vector<uint64_t> lex_pair(sorted_lex.size()), lex_count(sorted_lex.size());
+  for (size_t k = 0; k < sorted_lex.size(); ++k) {
+    lex_pair[k] = sorted_lex[k].first;
+    lex_count[k] = sorted_lex[k].second;
+  }
+  const size_t vocab_size = max(f_links.size(), e_links.size());
+  f_links.resize(vocab_size);
+  e_links.resize(vocab_size);
+
+  const string file = index + ".sa";
+  ofstream out(file.c_str(), ios::binary);
+  const uint64_t header[7] = { f_start.size() - 1, f.size(), e.size(), link.size() / 2,
+                               lex_pair.size(), vocab_size, static_cast<uint64_t>(null_word) };
+  out.write(kMAGIC, kMAGIC_SIZE);
+  out.write(reinterpret_cast<const char*>(header), sizeof(header));
+  WriteArray(f_start, &out);
+  WriteArray(e_start, &out);
+  WriteArray(link_start, &out);
+  WriteArray(lex_pair, &out);
+  WriteArray(lex_count, &out);
+  WriteArray(f_links, &out);
+  WriteArray(e_links, &out);
+  WriteArray(f, &out);
+  WriteArray(e, &out);
+  WriteArray(sa, &out);
+  WriteArray(link, &out);
+  if (!out) {
+    cerr << "Failed to write " << file << endl;
+    abort();
+  }
+  TD::WriteSnapshot(index + ".vocab");
+}
+
+void LexicalWeights(const SuffixArrayIndex& sa,
+                    const vector<WordID>& rhs_f,
+                    const vector<WordID>& rhs_e,
+                    const vector<pair<short,short> >& alignment,
+                    double* e_given_f,
+                    double* f_given_e) {
+  vector<double> e_sum(rhs_e.size()), f_sum(rhs_f.size());
+  vector<int> e_links(rhs_e.size()), f_links(rhs_f.size());
+  for (int k = 0; k < alignment.size(); ++k) {
+    const int i = alignment[k].first;
+    const int j = alignment[k].second;
+    e_sum[j] += sa.EGivenF(rhs_f[i], rhs_e[j]);
+    ++e_links[j];
+    f_sum[i] += sa.FGivenE(rhs_f[i], rhs_e[j]);
+    ++f_links[i];
+  }
+  *e_given_f = 1;
+  for (int j = 0; j < rhs_e.size(); ++j) {
+    if (rhs_e[j] <= 0) continue;  // nonterminal
+    *e_given_f *= e_links[j] ? e_sum[j] / e_links[j] : sa.EGivenF(sa.NullWord(), rhs_e[j]);
+  }
+  *f_given_e = 1;
+  for (int i = 0; i < rhs_f.size(); ++i) {
+    if (rhs_f[i] < 0) continue;  // nonterminal
+    *f_given_e *= f_links[i] ? f_sum[i] / f_links[i] : sa.FGivenE(rhs_f[i], sa.NullWord());
+  }
+}
+
+bool MatchesSentence(const vector<WordID>& rhs_f, const vector<WordID>& sentence) {
+  int pos = 0;
+  int i = 0;
+  while (i < rhs_f.size()) {
+    if (rhs_f[i] < 0) { ++pos; ++i; continue; }
+    int j = i;
+    while (j < rhs_f.size() && rhs_f[j] >= 0) ++j;
+    const int len = j - i;
+    bool found = false;
+    for (; pos + len <= sentence.size(); ++pos)
+      if (equal(rhs_f.begin() + i, rhs_f.begin() + j, sentence.begin() + pos)) {
+        found = true;
+        break;
+      }
+    if (!found) return false;
+    pos += len;
+    i = j;
+  }
+  return pos <= sentence.size();
+}
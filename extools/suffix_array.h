@@ -0,0 +1,123 @@
+#ifndef _SUFFIX_ARRAY_H_
+#define _SUFFIX_ARRAY_H_
+
+// A word-aligned parallel corpus with a suffix array over its source side,
+// compiled by sa_compile and mapped into memory, so that it loads instantly
+// and one copy in the page cache is shared by every process on a host.
+// sa_extract uses it to find the training sentences that contain the
+// phrases of a test sentence and extracts grammars from samples of them,
+// instead of extracting and filtering rules from the whole corpus.
+//
+// Word ids are TD ids: sa_compile writes TD to the dictionary snapshot
+// INDEX.vocab, and readers must load it (TD::LoadSnapshot) before any
+// other word is converted.  The index itself is INDEX.sa:
+//   "CDECSAX2" uint64(#sentences) uint64(#f tokens) uint64(#e tokens)
+//              uint64(#links) uint64(#lexical pairs) uint64(#vocab)
+//              uint64(id of NULL)
+//   uint64 f_start[#sentences + 1]     source words of sentence s are
+//                                      f[f_start[s]] ... f[f_start[s+1]-1]
+//   uint64 e_start[#sentences + 1]     likewise for the target words
+//   uint64 link_start[#sentences + 1]  likewise for the alignment links
+//   uint64 lex_pair[#lexical pairs]    f << 32 | e of the linked word pairs,
+//                                      sorted
+//   uint64 lex_count[#lexical pairs]   how often each pair is linked
+//   uint64 f_links[#vocab]             how often each word is linked as a
+//   uint64 e_links[#vocab]             source and as a target word
+//   uint32 f[#f tokens]
+//   uint32 e[#e tokens]
+//   uint32 sa[#f tokens]               positions in f, sorted by the words
+//                                      from there to the end of the sentence
+//   uint16 link[2 * #links]            (i, j) pairs of aligned positions
+
+#include <string>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+#include "wordid.h"
+#include "mapped_file.h"
+
+class AnnotatedParallelSentence;
+
+class SuffixArrayIndex {
+ public:
+  // maps file (INDEX.sa) into memory; aborts if it is not an index
+  explicit SuffixArrayIndex(const std::string& file);
+  ~SuffixArrayIndex();
+
+  size_t NumSentences() const { return num_sentences_; }
+  size_t NumSourceWords() const { return num_f_; }
+
+  // Narrows the range [*lo, *hi) of suffixes that start with some phrase
+  // of length len to those that continue with word.  Start with
+  // [0, NumSourceWords()) and len = 0.
+  void Extend(WordID word, int len, uint64_t* lo, uint64_t* hi) const;
+  // the position in f of the i-th suffix, and its sentence
+  uint64_t SuffixPosition(uint64_t i) const { return sa_[i]; }
+  unsigned SentenceOf(uint64_t pos) const;
+
+  // fills out sentence s (words and alignment)
+  void GetSentence(unsigned s, AnnotatedParallelSentence* sentence) const;
+
+  // Lexical translation probabilities p(e|f) and p(f|e) of the whole
+  // corpus, computed by Compile as featurize_grammar computes them for
+  // LexProb: unaligned words are linked to NullWord().
+  WordID NullWord() const { return null_word_; }
+  double EGivenF(WordID f, WordID e) const { return Ratio(LinkCount(f, e), f_links_, f); }
+  double FGivenE(WordID f, WordID e) const { return Ratio(LinkCount(f, e), e_links_, e); }
+  // how often f and e are linked
+  uint64_t LinkCount(WordID f, WordID e) const;
+
+  // compiles a corpus of lines in the extractor's format
+  // ("f ||| e ||| alignment") to index.sa and index.vocab
+  static void Compile(std::istream* in, const std::string& index);
+
+ private:
+  SuffixArrayIndex(const SuffixArrayIndex&);
+  void operator=(const SuffixArrayIndex&);
+
+  // the word at offset off of the suffix at pos, or 0 past the sentence end
+  WordID WordAt(uint64_t pos, int off) const;
+  double Ratio(uint64_t count, const uint64_t* totals, WordID w) const {
+    if (w < 0 || w >= vocab_size_ || totals[w] == 0) return 0;
+    return static_cast<double>(count) / totals[w];
+  }
+
+  const MappedFile file_;
+  uint64_t num_sentences_;
+  uint64_t num_f_;
+  uint64_t num_e_;
+  uint64_t num_links_;
+  uint64_t num_lex_;
+  uint64_t vocab_size_;
+  WordID null_word_;
+  const uint64_t* f_start_;
+  const uint64_t* e_start_;
+  const uint64_t* link_start_;
+  const uint64_t* lex_pair_;
+  const uint64_t* lex_count_;
+  const uint64_t* f_links_;
+  const uint64_t* e_links_;
+  const uint32_t* f_;
+  const uint32_t* e_;
+  const uint32_t* sa_;
+  const uint16_t* link_;
+};
+
+// The lexical weights lex(e|f) and lex(f|e) of Koehn et al. (2003) of a
+// rule extracted from the index, given the alignment of its terminals:
+// every word is translated by the average over the words it is aligned
+// to, or by NULL.
+void LexicalWeights(const SuffixArrayIndex& sa,
+                    const std::vector<WordID>& rhs_f,
+                    const std::vector<WordID>& rhs_e,
+                    const std::vector<std::pair<short,short> >& alignment,
+                    double* e_given_f,
+                    double* f_given_e);
+
+// true if the source side of a rule (nonterminals < 0) can apply
+// somewhere in the sentence: the terminal segments occur in order, with
+// at least one word for every nonterminal
+bool MatchesSentence(const std::vector<WordID>& rhs_f, const std::vector<WordID>& sentence);
+
+#endif
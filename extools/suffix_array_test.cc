@@ -0,0 +1,203 @@
+#include "suffix_array.h"
+
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "sentence_pair.h"
+#include "extract.h"
+#include "tdict.h"
+#include "temp_file_test.h"
+
+using namespace std;
+
+static const char* kCORPUS =
+  "das haus ||| the house ||| 0-0 1-1\n"
+  "das kleine haus ||| the small house ||| 0-0 1-1 2-2\n"
+  "ein haus ||| a house ||| 0-0 1-1\n"
+  "\n"
+  "das buch ||| the book ||| 0-0 1-1\n"
+  "ja das haus ||| the house ||| 1-0 2-1\n";
+
+// counts the rules by their source and target sides
+struct RuleCounter : public Extract::RuleObserver {
+ protected:
+  virtual void CountRuleImpl(WordID /*lhs*/,
+                             const vector<WordID>& rhs_f,
+                             const vector<WordID>& rhs_e,
+                             const vector<pair<short,short> >& /*fe_terminal_alignments*/) {
+    ostringstream os;
+    for (int i = 0; i < rhs_f.size(); ++i)
+      os << (i ? " " : "") << (rhs_f[i] < 0 ? "[X]" : TD::Convert(rhs_f[i]));
+    os << " |||";
+    for (int j = 0; j < rhs_e.size(); ++j) {
+      if (rhs_e[j] <= 0) os << " [" << (1 - rhs_e[j]) << ']';
+      else os << ' ' << TD::Convert(rhs_e[j]);
+    }
+    ++counts[os.str()];
+  }
+ public:
+  map<string, int> counts;
+};
+
+class SuffixArrayTest : public TempFileTest {
+ protected:
+  virtual void SetUp() {
+    ASSERT_NO_FATAL_FAILURE(TempFileTest::SetUp());
+    suffixes_.push_back(".sa");
+    suffixes_.push_back(".vocab");
+    istringstream in(kCORPUS);
+    SuffixArrayIndex::Compile(&in, file_);
+  }
+
+  // the sentences containing the phrase f, one entry per occurrence
+  static multiset<unsigned> Find(const SuffixArrayIndex& sa, const string& f) {
+    vector<WordID> words;
+    TD::ConvertSentence(f, &words);
+    uint64_t lo = 0, hi = sa.NumSourceWords();
+    for (int i = 0; i < words.size(); ++i)
+      sa.Extend(words[i], i, &lo, &hi);
+    multiset<unsigned> sentences;
+    for (uint64_t i = lo; i < hi; ++i)
+      sentences.insert(sa.SentenceOf(sa.SuffixPosition(i)));
+    return sentences;
+  }
+};
+
+TEST_F(SuffixArrayTest, Lookup) {
+  // the words were converted by Compile, so the ids already agree with the
+  // index's vocabulary
+  SuffixArrayIndex sa(file_ + ".sa");
+  EXPECT_EQ(5, sa.NumSentences());
+  EXPECT_EQ(12, sa.NumSourceWords());
+  unsigned das[] = { 0, 1, 3, 4 };
+  EXPECT_TRUE(Find(sa, "das") == multiset<unsigned>(das, das + 4));
+  unsigned haus[] = { 0, 1, 2, 4 };
+  EXPECT_TRUE(Find(sa, "haus") == multiset<unsigned>(haus, haus + 4));
+  unsigned das_haus[] = { 0, 4 };
+  EXPECT_TRUE(Find(sa, "das haus") == multiset<unsigned>(das_haus, das_haus + 2));
+  unsigned ja_das_haus[] = { 4 };
+  EXPECT_TRUE(Find(sa, "ja das haus") == multiset<unsigned>(ja_das_haus, ja_das_haus + 1));
+  EXPECT_TRUE(Find(sa, "haus das").empty());
+  EXPECT_TRUE(Find(sa, "das haus ist").empty());
+  EXPECT_TRUE(Find(sa, "unbekannt").empty());
+
+  AnnotatedParallelSentence s;
+  sa.GetSentence(4, &s);
+  EXPECT_EQ("ja das haus", TD::GetString(s.f));
+  EXPECT_EQ("the house", TD::GetString(s.e));
+  EXPECT_EQ(3, s.f_len);
+  EXPECT_EQ(2, s.e_len);
+  EXPECT_FALSE(s.f_aligned[0]);
+  EXPECT_TRUE(s.aligned(1, 0));
+  EXPECT_TRUE(s.aligned(2, 1));
+  EXPECT_FALSE(s.aligned(1, 1));
+}
+
+TEST_F(SuffixArrayTest, ExtractedRuleCounts) {
+  SuffixArrayIndex sa(file_ + ".sa");
+  // extract from the sentences that contain "haus", as sa_extract does
+  const multiset<unsigned> found = Find(sa, "haus");
+  const set<unsigned> sentences(found.begin(), found.end());
+  RuleCounter counter;
+  AnnotatedParallelSentence s;
+  vector<ParallelSpan> phrases;
+  vector<WordID> all_cats;
+  for (set<unsigned>::const_iterator it = sentences.begin(); it != sentences.end(); ++it) {
+    sa.GetSentence(*it, &s);
+    phrases.clear();
+    Extract::ExtractBasePhrases(10, s, &phrases);
+    Extract::AnnotatePhrasesWithCategoryTypes(-TD::Convert("X"), s.span_types, &phrases);
+    Extract::ExtractConsistentRules(s, phrases, 2, 5, false, true, &counter, &all_cats);
+  }
+  EXPECT_EQ(4, counter.counts["haus ||| house"]);
+  EXPECT_EQ(3, counter.counts["das ||| the"]);
+  // base phrases are tight, so "ja das haus" is not extracted
+  EXPECT_EQ(2, counter.counts["das haus ||| the house"]);
+  EXPECT_EQ(0, counter.counts["ja das haus ||| the house"]);
+  // the gap is "kleine" or "kleine haus" in the second sentence
+  EXPECT_EQ(4, counter.counts["das [X] ||| the [1]"]);
+  EXPECT_EQ(1, counter.counts["kleine ||| small"]);
+  EXPECT_EQ(1, counter.counts["ein haus ||| a house"]);
+  EXPECT_EQ(0, counter.counts["buch ||| book"]);
+}
+
+TEST_F(SuffixArrayTest, LexicalWeights) {
+  SuffixArrayIndex sa(file_ + ".sa");
+  const WordID das = TD::Convert("das"), haus = TD::Convert("haus"), ja = TD::Convert("ja");
+  const WordID the = TD::Convert("the"), house = TD::Convert("house");
+  EXPECT_EQ(TD::Convert("NULL"), sa.NullWord());
+  EXPECT_EQ(4, sa.LinkCount(das, the));
+  EXPECT_EQ(0, sa.LinkCount(das, house));
+  EXPECT_EQ(1, sa.LinkCount(ja, sa.NullWord()));
+  EXPECT_DOUBLE_EQ(1.0, sa.EGivenF(das, the));
+  EXPECT_DOUBLE_EQ(1.0, sa.FGivenE(ja, sa.NullWord()));
+  EXPECT_DOUBLE_EQ(0.0, sa.EGivenF(sa.NullWord(), the));  // no unaligned e words
+
+  // "das haus ||| the house" with das also linked to house: house is
+  // translated by the average of p(house|das) = 0 and p(house|haus) = 1
+  vector<WordID> f(2), e(2);
+  f[0] = das; f[1] = haus;
+  e[0] = the; e[1] = house;
+  vector<pair<short,short> > a;
+  a.push_back(make_pair(0, 0));
+  a.push_back(make_pair(0, 1));
+  a.push_back(make_pair(1, 1));
+  double e_given_f, f_given_e;
+  LexicalWeights(sa, f, e, a, &e_given_f, &f_given_e);
+  EXPECT_DOUBLE_EQ(0.5, e_given_f);
+  EXPECT_DOUBLE_EQ(0.5, f_given_e);
+
+  // "ja das [X] ||| the [1]": ja is translated by NULL, the gap is skipped
+  f[0] = ja; f[1] = das; f.push_back(-TD::Convert("X"));
+  e[1] = 0;
+  a.clear();
+  a.push_back(make_pair(1, 0));
+  LexicalWeights(sa, f, e, a, &e_given_f, &f_given_e);
+  EXPECT_DOUBLE_EQ(1.0, e_given_f);
+  EXPECT_DOUBLE_EQ(1.0, f_given_e);
+
+  // an unaligned target word that was never linked to NULL
+  a.clear();
+  LexicalWeights(sa, f, e, a, &e_given_f, &f_given_e);
+  EXPECT_DOUBLE_EQ(0.0, e_given_f);
+}
+
+TEST_F(SuffixArrayTest, MatchesSentence) {
+  vector<WordID> sentence;
+  TD::ConvertSentence("ja das kleine haus", &sentence);
+  const WordID x = -TD::Convert("X");
+  vector<WordID> rule;
+  TD::ConvertSentence("das kleine", &rule);
+  EXPECT_TRUE(MatchesSentence(rule, sentence));
+  TD::ConvertSentence("das haus", &rule);
+  EXPECT_FALSE(MatchesSentence(rule, sentence));
+  TD::ConvertSentence("haus das", &rule);
+  EXPECT_FALSE(MatchesSentence(rule, sentence));
+  // every nonterminal covers at least one word
+  TD::ConvertSentence("das", &rule);
+  rule.push_back(x);
+  rule.push_back(TD::Convert("haus"));
+  EXPECT_TRUE(MatchesSentence(rule, sentence));
+  rule.insert(rule.begin(), x);
+  EXPECT_TRUE(MatchesSentence(rule, sentence));
+  rule.insert(rule.begin(), x);
+  EXPECT_FALSE(MatchesSentence(rule, sentence));
+  TD::ConvertSentence("haus", &rule);
+  rule.push_back(x);
+  EXPECT_FALSE(MatchesSentence(rule, sentence));
+  rule.assign(4, x);
+  EXPECT_TRUE(MatchesSentence(rule, sentence));
+  rule.push_back(x);
+  EXPECT_FALSE(MatchesSentence(rule, sentence));
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
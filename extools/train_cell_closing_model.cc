@@ -0,0 +1,118 @@
+/*
+ * Estimate the cell closing model of the decoder (--scfg_cell_closing_model)
+ * from a word-aligned parallel corpus: for every source word, the log odds
+ * that it begins and that it ends a multi-word phrase that is consistent
+ * with the alignment, i.e. a span that a rule extracted from the corpus
+ * could cover.
+ */
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+#include <boost/program_options/variables_map.hpp>
+
+#include "sentence_pair.h"
+#include "extract.h"
+#include "tdict.h"
+#include "filelib.h"
+
+using namespace std;
+namespace po = boost::program_options;
+
+static const size_t MAX_LINE_LENGTH = 100000;
+
+void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
+  po::options_description opts("Configuration options");
+  opts.add_options()
+        ("input,i", po::value<string>()->default_value("-"), "Word-aligned parallel corpus (f ||| e ||| alignment)")
+        ("max_base_phrase_size,L", po::value<int>()->default_value(10), "Maximum phrase size (use the extractor's)")
+        ("min_count,c", po::value<int>()->default_value(2), "Leave out words seen fewer times (they score 0)")
+        ("bias,b", po::value<double>()->default_value(0.0), "Add this to every score; larger values close fewer cells")
+        ("help,h", "Print this help message and exit");
+  po::options_description dcmdline_options;
+  dcmdline_options.add(opts);
+
+  po::store(parse_command_line(argc, argv, dcmdline_options), *conf);
+  po::notify(*conf);
+
+  if (conf->count("help")) {
+    cerr << "\nUsage: train_cell_closing_model [-options] < corpus.f-e.al > closing_model.txt\n";
+    cerr << dcmdline_options << endl;
+    exit(1);
+  }
+}
+
+// how often a word was seen where a closed cell could begin (end), and how
+// often a consistent phrase began (ended) there
+struct Counts {
+  Counts() : begin_seen(), begin(), end_seen(), end() {}
+  int begin_seen;
+  int begin;
+  int end_seen;
+  int end;
+};
+
+// smoothed log odds of k successes in n trials
+inline double LogOdds(int k, int n) {
+  return log((k + 1.0) / (n - k + 1.0));
+}
+
+int main(int argc, char** argv) {
+  po::variables_map conf;
+  InitCommandLine(argc, argv, &conf);
+  const int max_base_phrase_size = conf["max_base_phrase_size"].as<int>();
+  const int min_count = conf["min_count"].as<int>();
+  const double bias = conf["bias"].as<double>();
+
+  ReadFile rf(conf["input"].as<string>());
+  istream& in = *rf.stream();
+  char* buf = new char[MAX_LINE_LENGTH];
+  AnnotatedParallelSentence sentence;
+  vector<ParallelSpan> phrases;
+  vector<bool> begins, ends;
+  vector<Counts> counts;
+  int lc = 0;
+  while (in) {
+    in.getline(buf, MAX_LINE_LENGTH);
+    if (buf[0] == 0) continue;
+    ++lc;
+    sentence.ParseInputLine(buf);
+    const int n = sentence.f_len;
+    Extract::ExtractBasePhrases(max_base_phrase_size, sentence, &phrases);
+    begins.assign(n, false);
+    ends.assign(n, false);
+    for (int k = 0; k < phrases.size(); ++k) {
+      if (phrases[k].i2 - phrases[k].i1 < 2) continue;
+      begins[phrases[k].i1] = true;
+      ends[phrases[k].i2 - 1] = true;
+    }
+    for (int k = 0; k < n; ++k)
+      if (sentence.f[k] >= counts.size()) counts.resize(sentence.f[k] + 1);
+    // the decoder only closes spans [i,j) with 0 < i and i + 2 <= j
+    for (int k = 1; k + 1 < n; ++k) {
+      Counts& c = counts[sentence.f[k]];
+      ++c.begin_seen;
+      if (begins[k]) ++c.begin;
+    }
+    for (int k = 2; k < n; ++k) {
+      Counts& c = counts[sentence.f[k]];
+      ++c.end_seen;
+      if (ends[k]) ++c.end;
+    }
+    if (lc % 100000 == 0) cerr << "  [" << lc << "]\n";
+  }
+  delete[] buf;
+
+  int words = 0;
+  for (WordID w = 0; w < counts.size(); ++w) {
+    const Counts& c = counts[w];
+    if (c.begin_seen + c.end_seen < min_count) continue;
+    cout << TD::Convert(w) << ' ' << (LogOdds(c.begin, c.begin_seen) + bias)
+         << ' ' << (LogOdds(c.end, c.end_seen) + bias) << '\n';
+    ++words;
+  }
+  cerr << "Wrote cell closing scores for " << words << " words from " << lc << " sentences\n";
+  return 0;
+}
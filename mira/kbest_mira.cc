@@ -7,11 +7,13 @@
 #include "config.h"
 
 #include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
 
 #include "sentence_metadata.h"
 #include "scorer.h"
+#include "hyp_pool.h"
 #include "verbose.h"
 #include "viterbi.h"
 #include "hg.h"
@@ -21,9 +23,11 @@
 #include "decoder.h"
 #include "filelib.h"
 #include "fdict.h"
+#include "dict_snapshot.h"
 #include "weights.h"
 #include "sparse_vector.h"
 #include "sampler.h"
+#include "parallel_for.h"
 
 using namespace std;
 using boost::shared_ptr;
@@ -85,11 +89,15 @@ bool InitCommandLine(int argc, char** argv, po::variables_map* conf) {
         ("mt_metric_scale,s", po::value<double>()->default_value(1.0), "Amount to scale MT loss function by")
         ("k_best_size,k", po::value<int>()->default_value(250), "Size of hypothesis list to search for oracles")
         ("random_seed,S", po::value<uint32_t>(), "Random seed (if not specified, /dev/random will be used)")
+        ("batch_size,b", po::value<int>()->default_value(1), "Decode this many sentences with the same weights before applying their updates (in corpus order)")
+        ("threads,j", po::value<unsigned>()->default_value(1u), "Number of threads decoding (and searching the k-best lists of) the sentences of a batch; they share the grammars and language models")
+        ("hypothesis_pool,P", po::value<string>(), "Directory of binary hypothesis pools (pool.<sent_id>); k-best lists are added to them and good (hope) hypotheses are chosen from the whole pool")
         ("decoder_config,c",po::value<string>(),"Decoder configuration file");
   po::options_description clo("Command line options");
   clo.add_options()
         ("config", po::value<string>(), "Configuration file")
         ("help,h", "Print this help message and exit");
+  AddDictionarySnapshotOption(&clo);
   po::options_description dconfig_options, dcmdline_options;
   dconfig_options.add(opts);
   dcmdline_options.add(opts).add(clo);
@@ -118,18 +126,24 @@ struct HypothesisInfo {
 struct GoodBadOracle {
   shared_ptr<HypothesisInfo> good;
   shared_ptr<HypothesisInfo> bad;
+  shared_ptr<HypothesisInfo> cur_best;  // model best from the latest decode
 };
 
+// may be notified by several decoding threads at once
 struct TrainingObserver : public DecoderObserver {
-  TrainingObserver(const int k, const DocScorer& d, vector<GoodBadOracle>* o) : ds(d), oracles(*o), kbest_size(k) {}
+  TrainingObserver(const int k, const DocScorer& d, vector<GoodBadOracle>* o,
+                   const ScoreType t, const string& pool) :
+    ds(d), oracles(*o), kbest_size(k), type(t), pool_dir(pool), pools(o->size()) {}
   const DocScorer& ds;
   vector<GoodBadOracle>& oracles;
-  shared_ptr<HypothesisInfo> cur_best;
   const int kbest_size;
 
-  const HypothesisInfo& GetCurrentBestHypothesis() const {
-    return *cur_best;
-  }
+  // hypotheses from earlier passes (and runs), loaded on first use and
+  // appended to under pool_mutex
+  const ScoreType type;
+  const string pool_dir;
+  vector<shared_ptr<HypothesisPool> > pools;
+  boost::mutex pool_mutex;
 
   virtual void NotifyTranslationForest(const SentenceMetadata& smeta, Hypergraph* hg) {
     UpdateOracles(smeta.GetSentenceID(), *hg);
@@ -142,16 +156,23 @@ struct TrainingObserver : public DecoderObserver {
     return h;
   }
 
+  // only touches oracles[sent_id], so different sentences may be
+  // processed concurrently
   void UpdateOracles(int sent_id, const Hypergraph& forest) {
     shared_ptr<HypothesisInfo>& cur_good = oracles[sent_id].good;
     shared_ptr<HypothesisInfo>& cur_bad = oracles[sent_id].bad;
+    shared_ptr<HypothesisInfo>& cur_best = oracles[sent_id].cur_best;
     cur_bad.reset();  // TODO get rid of??
+    const bool use_pool = !pool_dir.empty();
     KBest::KBestDerivations<vector<WordID>, ESentenceTraversal> kbest(forest, kbest_size);
+    vector<const KBest::KBestDerivations<vector<WordID>, ESentenceTraversal>::Derivation*> derivs;
+    vector<ScoreP> stats;
     for (int i = 0; i < kbest_size; ++i) {
       const KBest::KBestDerivations<vector<WordID>, ESentenceTraversal>::Derivation* d =
         kbest.LazyKthBest(forest.nodes_.size() - 1, i);
       if (!d) break;
-      float sentscore = ds[sent_id]->ScoreCandidate(d->yield)->ComputeScore();
+      ScoreP score = ds[sent_id]->ScoreCandidate(d->yield);
+      float sentscore = score->ComputeScore();
       if (invert_score) sentscore *= -1.0;
       // cerr << TD::GetString(d->yield) << " ||| " << d->score << " ||| " << sentscore << endl;
       if (i == 0)
@@ -160,11 +181,65 @@ struct TrainingObserver : public DecoderObserver {
         cur_good = MakeHypothesisInfo(d->feature_values, sentscore);
       if (!cur_bad || sentscore < cur_bad->mt_metric)
         cur_bad = MakeHypothesisInfo(d->feature_values, sentscore);
+      if (use_pool) {
+        derivs.push_back(d);
+        stats.push_back(score);
+      }
     }
+    if (use_pool) UpdatePool(sent_id, derivs, stats, &cur_good);
     //cerr << "GOOD: " << cur_good->mt_metric << endl;
     //cerr << " CUR: " << cur_best->mt_metric << endl;
     //cerr << " BAD: " << cur_bad->mt_metric << endl;
   }
+
+  // adds the k-best list to the sentence's pool and lets every pooled
+  // hypothesis compete for cur_good
+  void UpdatePool(int sent_id,
+                  const vector<const KBest::KBestDerivations<vector<WordID>, ESentenceTraversal>::Derivation*>& derivs,
+                  const vector<ScoreP>& stats,
+                  shared_ptr<HypothesisInfo>* cur_good) {
+    shared_ptr<HypothesisPool>& pool = pools[sent_id];
+    {
+      boost::mutex::scoped_lock lock(pool_mutex);
+      if (!pool) {
+        ostringstream os;
+        os << pool_dir << "/pool." << sent_id;
+        pool.reset(new HypothesisPool(os.str(), type));
+      }
+      for (int i = 0; i < derivs.size(); ++i)
+        pool->Add(derivs[i]->yield, derivs[i]->feature_values, stats[i].get());
+    }
+    for (int i = 0; i < pool->size(); ++i) {
+      const PooledHypothesis& h = (*pool)[i];
+      float sentscore = (h.stats ? h.stats : ds[sent_id]->ScoreCandidate(h.words))->ComputeScore();
+      if (invert_score) sentscore *= -1.0;
+      if (!*cur_good || sentscore > (*cur_good)->mt_metric)
+        *cur_good = MakeHypothesisInfo(h.features, sentscore);
+    }
+  }
+};
+
+// decodes the sentences order[begin] ... order[end-1] of a batch, each
+// thread with its own decoder
+struct BatchDecoder {
+  BatchDecoder(const vector<string>& c, const vector<int>& o, TrainingObserver* obs) :
+    corpus(c), order(o), observer(obs), decoders() {}
+
+  void Decode(const vector<shared_ptr<Decoder> >& d, int begin, int end) {
+    decoders = &d;
+    ParallelFor(d.size(), begin, end, *this);
+  }
+
+  void operator()(int i, unsigned t) const {
+    Decoder* decoder = (*decoders)[t].get();
+    decoder->SetId(order[i]);
+    decoder->Decode(corpus[order[i]], observer);  // update oracles
+  }
+
+  const vector<string>& corpus;
+  const vector<int>& order;
+  TrainingObserver* const observer;
+  const vector<shared_ptr<Decoder> >* decoders;
 };
 
 void ReadTrainingCorpus(const string& fname, vector<string>* c) {
@@ -189,6 +264,7 @@ int main(int argc, char** argv) {
 
   po::variables_map conf;
   if (!InitCommandLine(argc, argv, &conf)) return 1;
+  LoadDictionarySnapshots(conf);
 
   if (conf.count("random_seed"))
     rng.reset(new MT19937(conf["random_seed"].as<uint32_t>()));
@@ -215,15 +291,35 @@ int main(int argc, char** argv) {
   SparseVector<double> lambdas;
   weights.InitSparseVector(&lambdas);
 
-  ReadFile ini_rf(conf["decoder_config"].as<string>());
-  Decoder decoder(ini_rf.stream());
   const double max_step_size = conf["max_step_size"].as<double>();
   const double mt_metric_scale = conf["mt_metric_scale"].as<double>();
 
   assert(corpus.size() > 0);
   vector<GoodBadOracle> oracles(corpus.size());
 
-  TrainingObserver observer(conf["k_best_size"].as<int>(), ds, &oracles);
+  const int batch_size = conf["batch_size"].as<int>();
+  unsigned num_threads = conf["threads"].as<unsigned>();
+  if (batch_size < 1 || num_threads < 1) {
+    cerr << "--batch_size and --threads must be at least 1\n";
+    return 1;
+  }
+  if (num_threads > 1 && (type == AER || type == METEOR)) {
+    cerr << "Scoring with " << metric_name << " is not thread safe, using a single thread\n";
+    num_threads = 1;
+  }
+  string pool_dir;
+  if (conf.count("hypothesis_pool")) {
+    pool_dir = conf["hypothesis_pool"].as<string>();
+    MkDirP(pool_dir);
+  }
+  if (num_threads > 1) Dict::EnableLocking();
+  // decoders read from the same configuration share grammars and LMs
+  vector<shared_ptr<Decoder> > decoders;
+  for (unsigned i = 0; i < num_threads; ++i) {
+    ReadFile ini_rf(conf["decoder_config"].as<string>());
+    decoders.push_back(shared_ptr<Decoder>(new Decoder(ini_rf.stream())));
+  }
+  TrainingObserver observer(conf["k_best_size"].as<int>(), ds, &oracles, type, pool_dir);
   int cur_sent = 0;
   int lcount = 0;
   int normalizer = 0;
@@ -239,11 +335,13 @@ int main(int argc, char** argv) {
   string msga = "# MIRA tuned weights AVERAGED";
   vector<int> order;
   RandomPermutation(corpus.size(), &order);
+  BatchDecoder batch(corpus, order, &observer);
   while (lcount <= max_iteration) {
     dense_weights.clear();
     weights.InitFromVector(lambdas);
     weights.InitVector(&dense_weights);
-    decoder.SetWeights(dense_weights);
+    for (int i = 0; i < decoders.size(); ++i)
+      decoders[i]->SetWeights(dense_weights);
     if ((cur_sent * 40 / corpus.size()) > dots) { ++dots; cerr << '.'; }
     if (corpus.size() == cur_sent) {
       cerr << " [AVG METRIC LAST PASS=" << (tot_loss / corpus.size()) << "]\n";
@@ -267,31 +365,37 @@ int main(int argc, char** argv) {
     if (cur_sent == 0) {
       cerr << "PASS " << (lcount / corpus.size() + 1) << endl;
     }
-    decoder.SetId(order[cur_sent]);
-    decoder.Decode(corpus[order[cur_sent]], &observer);  // update oracles
-    const HypothesisInfo& cur_hyp = observer.GetCurrentBestHypothesis();
-    const HypothesisInfo& cur_good = *oracles[order[cur_sent]].good;
-    const HypothesisInfo& cur_bad = *oracles[order[cur_sent]].bad;
-    tot_loss += cur_hyp.mt_metric;
-    if (!ApproxEqual(cur_hyp.mt_metric, cur_good.mt_metric)) {
-      const double loss = cur_bad.features.dot(dense_weights) - cur_good.features.dot(dense_weights) +
-          mt_metric_scale * (cur_good.mt_metric - cur_bad.mt_metric);
-      //cerr << "LOSS: " << loss << endl;
-      if (loss > 0.0) {
-        SparseVector<double> diff = cur_good.features;
-        diff -= cur_bad.features;
-        double step_size = loss / diff.l2norm_sq();
-        //cerr << loss << " " << step_size << " " << diff << endl;
-        if (step_size > max_step_size) step_size = max_step_size;
-        lambdas += (cur_good.features * step_size);
-        lambdas -= (cur_bad.features * step_size);
-        //cerr << "L: " << lambdas << endl;
+    // the sentences of a batch are decoded with the same weights (in
+    // parallel, if requested), their k-best lists are searched for oracles
+    // as they are decoded, and then the updates are applied in corpus order
+    int batch_end = cur_sent + batch_size;
+    if (batch_end > corpus.size()) batch_end = corpus.size();
+    if (batch_end - cur_sent > max_iteration + 1 - lcount) batch_end = cur_sent + max_iteration + 1 - lcount;
+    batch.Decode(decoders, cur_sent, batch_end);
+    for (; cur_sent < batch_end; ++cur_sent) {
+      const HypothesisInfo& cur_hyp = *oracles[order[cur_sent]].cur_best;
+      const HypothesisInfo& cur_good = *oracles[order[cur_sent]].good;
+      const HypothesisInfo& cur_bad = *oracles[order[cur_sent]].bad;
+      tot_loss += cur_hyp.mt_metric;
+      if (!ApproxEqual(cur_hyp.mt_metric, cur_good.mt_metric)) {
+        const double loss = cur_bad.features.dot(lambdas) - cur_good.features.dot(lambdas) +
+            mt_metric_scale * (cur_good.mt_metric - cur_bad.mt_metric);
+        //cerr << "LOSS: " << loss << endl;
+        if (loss > 0.0) {
+          SparseVector<double> diff = cur_good.features;
+          diff -= cur_bad.features;
+          double step_size = loss / diff.l2norm_sq();
+          //cerr << loss << " " << step_size << " " << diff << endl;
+          if (step_size > max_step_size) step_size = max_step_size;
+          lambdas += (cur_good.features * step_size);
+          lambdas -= (cur_bad.features * step_size);
+          //cerr << "L: " << lambdas << endl;
+        }
       }
+      tot += lambdas;
+      ++normalizer;
+      ++lcount;
     }
-    tot += lambdas;
-    ++normalizer;
-    ++lcount;
-    ++cur_sent;
   }
   cerr << endl;
   weights.WriteToFile("weights.mira-final.gz", true, &msg);
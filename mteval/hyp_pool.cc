@@ -0,0 +1,236 @@
+#include "hyp_pool.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include <boost/functional/hash.hpp>
+
+#include "approx_vector.h"
+#include "mapped_file.h"
+#include "tdict.h"
+#include "fdict.h"
+
+using namespace std;
+using namespace std::tr1;
+
+static const char kMAGIC[] = "HYPPOOL1";
+static const size_t kMAGIC_SIZE = MappedFile::kMAGIC_SIZE;
+static const size_t kHEADER_SIZE = kMAGIC_SIZE + sizeof(int32_t);
+static const size_t kRECORD_HEADER_SIZE = 2 * sizeof(int32_t);
+
+static inline int32_t ReadInt(const char* p) {
+  int32_t x;
+  memcpy(&x, p, sizeof(x));
+  return x;
+}
+
+static inline void AppendInt(int32_t x, string* out) {
+  out->append(reinterpret_cast<const char*>(&x), sizeof(x));
+}
+
+static void WriteAll(int fd, const string& buf, const string& file) {
+  const char* p = buf.data();
+  size_t left = buf.size();
+  while (left > 0) {
+    const ssize_t n = write(fd, p, left);
+    if (n < 0) {
+      perror(file.c_str());
+      abort();
+    }
+    p += n;
+    left -= n;
+  }
+}
+
+HypothesisPool::HypothesisPool(const string& file, ScoreType type) :
+    file_(file), type_(type), same_metric_(true), valid_bytes_(), fd_(-1) {
+  Read();
+}
+
+HypothesisPool::~HypothesisPool() {
+  if (fd_ >= 0) close(fd_);
+}
+
+bool HypothesisPool::StoresStats(ScoreType type) {
+  // SER does not implement Score::Encode, AER needs the forest's alignment
+  // and METEOR scores can only be decoded by a running scoring server
+  return type != SER && type != AER && type != METEOR;
+}
+
+size_t HypothesisPool::Hash(const vector<WordID>& words, const SparseVector<double>& features) const {
+  size_t h = boost::hash_range(words.begin(), words.end());
+  boost::hash_combine(h, ApproxVectorHasher()(features));
+  return h;
+}
+
+void HypothesisPool::Corrupt(size_t pos, const char* what) const {
+  cerr << file_ << ": corrupt hypothesis pool, record at offset " << pos << ": " << what << endl;
+  abort();
+}
+
+void HypothesisPool::Read() {
+  if (access(file_.c_str(), F_OK) != 0) return;  // new pool
+  const MappedFile m(file_);
+  const size_t size = m.size();
+  if (size < kHEADER_SIZE) return;  // empty, or killed while writing the header
+  const char* data = m.data();
+  if (!m.HasMagic(kMAGIC)) {
+    cerr << file_ << " is not a hypothesis pool\n";
+    abort();
+  }
+  same_metric_ = (ReadInt(data + kMAGIC_SIZE) == type_);
+  vector<WordID> words;
+  vector<int> feats;
+  size_t pos = kHEADER_SIZE;
+  valid_bytes_ = pos;
+  while (pos + kRECORD_HEADER_SIZE <= size) {
+    const int32_t kind = ReadInt(data + pos);
+    const int32_t len = ReadInt(data + pos + sizeof(int32_t));
+    if (len < 0 || pos + kRECORD_HEADER_SIZE + len > size) break;
+    const char* p = data + pos + kRECORD_HEADER_SIZE;
+    if (kind == 'W') {
+      const WordID w = TD::Convert(string(p, len));
+      local_words_[w] = words.size();
+      words.push_back(w);
+    } else if (kind == 'F') {
+      const int fid = FD::Convert(string(p, len));
+      local_feats_[fid] = feats.size();
+      feats.push_back(fid);
+    } else if (kind == 'H') {
+      static const size_t kHYP_HEADER_SIZE = 3 * sizeof(int32_t);
+      static const size_t kFEAT_SIZE = sizeof(int32_t) + sizeof(double);
+      if (len < kHYP_HEADER_SIZE) Corrupt(pos, "shorter than a hypothesis header");
+      const int32_t num_words = ReadInt(p);
+      const int32_t num_feats = ReadInt(p + sizeof(int32_t));
+      const int32_t stats_size = ReadInt(p + 2 * sizeof(int32_t));
+      if (num_words < 0 || num_feats < 0 || stats_size < 0)
+        Corrupt(pos, "negative number of words, features or statistics bytes");
+      // in 64 bits, so that no count can overflow
+      const uint64_t body = static_cast<uint64_t>(num_words) * sizeof(int32_t)
+                          + static_cast<uint64_t>(num_feats) * kFEAT_SIZE + stats_size;
+      if (kHYP_HEADER_SIZE + body != static_cast<uint64_t>(len))
+        Corrupt(pos, "sizes of the words, features and statistics do not add up to the record size");
+      p += kHYP_HEADER_SIZE;
+      hyps_.push_back(PooledHypothesis());
+      PooledHypothesis& h = hyps_.back();
+      h.words.resize(num_words);
+      for (int i = 0; i < num_words; ++i, p += sizeof(int32_t)) {
+        const int32_t w = ReadInt(p);
+        if (w < 0 || w >= words.size()) Corrupt(pos, "undefined local word id");
+        h.words[i] = words[w];
+      }
+      for (int i = 0; i < num_feats; ++i, p += kFEAT_SIZE) {
+        const int32_t f = ReadInt(p);
+        if (f < 0 || f >= feats.size()) Corrupt(pos, "undefined local feature id");
+        double val;
+        memcpy(&val, p + sizeof(int32_t), sizeof(double));
+        h.features.set_value(feats[f], val);
+      }
+      if (stats_size > 0 && same_metric_)
+        h.stats = SentenceScorer::CreateScoreFromString(type_, string(p, stats_size));
+      index_.insert(make_pair(Hash(h.words, h.features), hyps_.size() - 1));
+    } else {
+      cerr << file_ << ": bad record type " << kind << " at offset " << pos << endl;
+      abort();
+    }
+    pos += kRECORD_HEADER_SIZE + len;
+    valid_bytes_ = pos;
+  }
+  if (valid_bytes_ < size)
+    cerr << file_ << ": ignoring truncated record at offset " << valid_bytes_ << endl;
+}
+
+void HypothesisPool::OpenForAppend() {
+  fd_ = open(file_.c_str(), O_WRONLY | O_CREAT, 0666);
+  if (fd_ < 0) {
+    perror(file_.c_str());
+    abort();
+  }
+  if (valid_bytes_ == 0) {
+    string header(kMAGIC, kMAGIC_SIZE);
+    AppendInt(type_, &header);
+    if (ftruncate(fd_, 0) != 0) { perror(file_.c_str()); abort(); }
+    WriteAll(fd_, header, file_);
+    valid_bytes_ = header.size();
+    same_metric_ = true;
+  } else {
+    // drop a partially written record, if any
+    if (ftruncate(fd_, valid_bytes_) != 0) { perror(file_.c_str()); abort(); }
+    lseek(fd_, valid_bytes_, SEEK_SET);
+  }
+}
+
+void HypothesisPool::Append(char kind, const string& payload) {
+  string rec;
+  rec.reserve(kRECORD_HEADER_SIZE + payload.size());
+  AppendInt(kind, &rec);
+  AppendInt(payload.size(), &rec);
+  rec += payload;
+  WriteAll(fd_, rec, file_);
+  valid_bytes_ += rec.size();
+}
+
+int HypothesisPool::LocalWord(WordID w) {
+  unordered_map<WordID, int>::iterator it = local_words_.find(w);
+  if (it != local_words_.end()) return it->second;
+  const int id = local_words_.size();
+  Append('W', TD::Convert(w));
+  local_words_[w] = id;
+  return id;
+}
+
+int HypothesisPool::LocalFeature(int fid) {
+  unordered_map<int, int>::iterator it = local_feats_.find(fid);
+  if (it != local_feats_.end()) return it->second;
+  const int id = local_feats_.size();
+  Append('F', FD::Convert(fid));
+  local_feats_[fid] = id;
+  return id;
+}
+
+bool HypothesisPool::Contains(const vector<WordID>& words,
+                              const SparseVector<double>& features) const {
+  typedef unordered_multimap<size_t, unsigned>::const_iterator IndexIter;
+  pair<IndexIter, IndexIter> r = index_.equal_range(Hash(words, features));
+  for (; r.first != r.second; ++r.first) {
+    const PooledHypothesis& o = hyps_[r.first->second];
+    if (o.words == words && ApproxVectorEquals()(o.features, features)) return true;
+  }
+  return false;
+}
+
+bool HypothesisPool::Add(const vector<WordID>& words,
+                         const SparseVector<double>& features,
+                         const Score* stats) {
+  if (Contains(words, features)) return false;
+  if (fd_ < 0) OpenForAppend();
+
+  const bool with_stats = stats && same_metric_ && StoresStats(type_);
+  string enc;
+  if (with_stats) stats->Encode(&enc);
+  string payload;
+  AppendInt(words.size(), &payload);
+  AppendInt(features.size(), &payload);
+  AppendInt(enc.size(), &payload);
+  for (int i = 0; i < words.size(); ++i)
+    AppendInt(LocalWord(words[i]), &payload);
+  for (SparseVector<double>::const_iterator it = features.begin(); it != features.end(); ++it) {
+    AppendInt(LocalFeature(it->first), &payload);
+    payload.append(reinterpret_cast<const char*>(&it->second), sizeof(double));
+  }
+  payload += enc;
+  Append('H', payload);
+
+  hyps_.push_back(PooledHypothesis());
+  PooledHypothesis& p = hyps_.back();
+  p.words = words;
+  p.features = features;
+  if (with_stats) p.stats = stats->Clone();
+  index_.insert(make_pair(Hash(words, features), hyps_.size() - 1));
+  return true;
+}
@@ -0,0 +1,84 @@
+#ifndef _HYP_POOL_H_
+#define _HYP_POOL_H_
+
+// A binary, append-only pool of the hypotheses seen for one sentence over
+// the iterations of a tuning run.  Each hypothesis is stored once, together
+// with its feature vector and (when the metric supports it) the sufficient
+// statistics of its score, so later iterations can merge and rescore the
+// pool without re-reading text k-best lists or calling the scorer again.
+//
+// File layout (native byte order):
+//   header := "HYPPOOL1" int32(score type)
+//   record := int32(kind) int32(payload size) payload
+//     kind 'W': payload is a word, which gets the next local word id
+//     kind 'F': payload is a feature name, which gets the next local feature id
+//     kind 'H': int32(#words) int32(#features) int32(stats size)
+//               #words x int32(local word id)
+//               #features x (int32(local feature id) double(value))
+//               stats (Score::Encode of the hypothesis' sufficient statistics)
+// Word and feature names are local to the file so that pools written by
+// different processes can be read by any other.  Files are read with mmap;
+// a truncated trailing record (e.g. from a killed job) is ignored and
+// overwritten by the next append.
+
+#include <string>
+#include <vector>
+#include <tr1/unordered_map>
+
+#include "sparse_vector.h"
+#include "scorer.h"
+#include "wordid.h"
+
+struct PooledHypothesis {
+  std::vector<WordID> words;
+  SparseVector<double> features;
+  ScoreP stats;  // NULL if the pool does not store statistics for this metric
+};
+
+class HypothesisPool {
+ public:
+  // reads file, if it exists.  Statistics stored for a different metric
+  // than type are ignored.
+  HypothesisPool(const std::string& file, ScoreType type);
+  ~HypothesisPool();
+
+  size_t size() const { return hyps_.size(); }
+  const PooledHypothesis& operator[](size_t i) const { return hyps_[i]; }
+
+  // true if a hypothesis with the same words and (approximately, see
+  // approx_vector.h) the same feature values is in the pool
+  bool Contains(const std::vector<WordID>& words,
+                const SparseVector<double>& features) const;
+
+  // appends a hypothesis to the pool (and the file) unless Contains finds
+  // it there already.  stats may be
+  // NULL, in which case no statistics are stored for this hypothesis.
+  // returns true if the hypothesis was added
+  bool Add(const std::vector<WordID>& words,
+           const SparseVector<double>& features,
+           const Score* stats);
+
+  // true if sufficient statistics can be stored for this metric
+  static bool StoresStats(ScoreType type);
+
+ private:
+  void Read();
+  void OpenForAppend();
+  void Corrupt(size_t pos, const char* what) const;  // aborts
+  size_t Hash(const std::vector<WordID>& words, const SparseVector<double>& features) const;
+  int LocalWord(WordID w);
+  int LocalFeature(int fid);
+  void Append(char kind, const std::string& payload);
+
+  const std::string file_;
+  const ScoreType type_;
+  std::vector<PooledHypothesis> hyps_;
+  std::tr1::unordered_multimap<size_t, unsigned> index_;  // hash -> hyps_ index
+  std::tr1::unordered_map<WordID, int> local_words_;
+  std::tr1::unordered_map<int, int> local_feats_;
+  bool same_metric_;    // false if the file stores statistics for another metric
+  size_t valid_bytes_;  // size of the well-formed prefix of the file
+  int fd_;              // -1 until the first Add
+};
+
+#endif
@@ -0,0 +1,122 @@
+#include <cstdio>
+#include <unistd.h>
+#include <gtest/gtest.h>
+
+#include "tdict.h"
+#include "fdict.h"
+#include "hyp_pool.h"
+#include "temp_file_test.h"
+
+using namespace std;
+
+class HypothesisPoolTest : public TempFileTest {
+ protected:
+  virtual void SetUp() {
+    ASSERT_NO_FATAL_FAILURE(TempFileTest::SetUp());
+    unlink(file_.c_str());  // the pools start out without a file
+    vector<vector<WordID> > refs(1);
+    TD::ConvertSentence("the house is small", &refs[0]);
+    scorer = SentenceScorer::CreateSentenceScorer(IBM_BLEU, refs);
+    TD::ConvertSentence("the house is small", &hyp1);
+    TD::ConvertSentence("the small house", &hyp2);
+    f1.set_value(FD::Convert("LanguageModel"), -4.5);
+    f1.set_value(FD::Convert("WordPenalty"), -4);
+    f2.set_value(FD::Convert("LanguageModel"), -6.25);
+    f2.set_value(FD::Convert("PhraseModel_0"), 1.5);
+  }
+
+  ScorerP scorer;
+  vector<WordID> hyp1;
+  vector<WordID> hyp2;
+  SparseVector<double> f1;
+  SparseVector<double> f2;
+};
+
+TEST_F(HypothesisPoolTest, TestEmpty) {
+  HypothesisPool pool(file_, IBM_BLEU);
+  EXPECT_EQ(0, pool.size());
+  EXPECT_NE(0, access(file_.c_str(), F_OK));  // reading doesn't create the file
+}
+
+TEST_F(HypothesisPoolTest, TestAppendAndRead) {
+  {
+    HypothesisPool pool(file_, IBM_BLEU);
+    EXPECT_TRUE(pool.Add(hyp1, f1, scorer->ScoreCandidate(hyp1).get()));
+    EXPECT_TRUE(pool.Add(hyp2, f2, scorer->ScoreCandidate(hyp2).get()));
+    EXPECT_FALSE(pool.Add(hyp1, f1, scorer->ScoreCandidate(hyp1).get()));
+    EXPECT_TRUE(pool.Add(hyp1, f2, NULL));  // same words, different features
+    EXPECT_EQ(3, pool.size());
+  }
+  {
+    HypothesisPool pool(file_, IBM_BLEU);
+    ASSERT_EQ(3, pool.size());
+    EXPECT_EQ(hyp1, pool[0].words);
+    EXPECT_EQ(hyp2, pool[1].words);
+    EXPECT_TRUE(pool[0].features == f1);
+    EXPECT_TRUE(pool[1].features == f2);
+    ASSERT_TRUE(pool[0].stats);
+    EXPECT_FLOAT_EQ(1.0, pool[0].stats->ComputeScore());
+    EXPECT_FLOAT_EQ(scorer->ScoreCandidate(hyp2)->ComputeScore(), pool[1].stats->ComputeScore());
+    EXPECT_FALSE(pool[2].stats);
+    // a later iteration only appends new hypotheses
+    EXPECT_FALSE(pool.Add(hyp2, f2, scorer->ScoreCandidate(hyp2).get()));
+    SparseVector<double> f3 = f2;
+    f3.set_value(FD::Convert("Glue"), 1);
+    EXPECT_TRUE(pool.Add(hyp2, f3, scorer->ScoreCandidate(hyp2).get()));
+  }
+  HypothesisPool pool(file_, IBM_BLEU);
+  EXPECT_EQ(4, pool.size());
+  EXPECT_TRUE(pool[3].stats);
+}
+
+TEST_F(HypothesisPoolTest, TestApproximateDuplicates) {
+  HypothesisPool pool(file_, IBM_BLEU);
+  EXPECT_TRUE(pool.Add(hyp2, f2, NULL));
+  // the same features, inserted in another order, with one value off in its
+  // last digits (as after printing and reading it back) and an explicit 0
+  SparseVector<double> f3;
+  f3.set_value(FD::Convert("Glue"), 0);
+  f3.set_value(FD::Convert("PhraseModel_0"), 1.5000000000001);
+  f3.set_value(FD::Convert("LanguageModel"), -6.25);
+  EXPECT_TRUE(pool.Contains(hyp2, f3));
+  EXPECT_FALSE(pool.Add(hyp2, f3, NULL));
+  f3.set_value(FD::Convert("PhraseModel_0"), 1.501);
+  EXPECT_FALSE(pool.Contains(hyp2, f3));
+}
+
+TEST_F(HypothesisPoolTest, TestOtherMetric) {
+  {
+    HypothesisPool pool(file_, IBM_BLEU);
+    pool.Add(hyp1, f1, scorer->ScoreCandidate(hyp1).get());
+  }
+  HypothesisPool pool(file_, TER);
+  ASSERT_EQ(1, pool.size());
+  EXPECT_FALSE(pool[0].stats);
+  EXPECT_TRUE(pool[0].features == f1);
+}
+
+TEST_F(HypothesisPoolTest, TestTruncated) {
+  {
+    HypothesisPool pool(file_, IBM_BLEU);
+    pool.Add(hyp1, f1, scorer->ScoreCandidate(hyp1).get());
+    pool.Add(hyp2, f2, scorer->ScoreCandidate(hyp2).get());
+  }
+  FILE* f = fopen(file_.c_str(), "rb");
+  fseek(f, 0, SEEK_END);
+  const long size = ftell(f);
+  fclose(f);
+  ASSERT_EQ(0, truncate(file_.c_str(), size - 3));
+  {
+    HypothesisPool pool(file_, IBM_BLEU);
+    EXPECT_EQ(1, pool.size());
+    EXPECT_TRUE(pool.Add(hyp2, f2, scorer->ScoreCandidate(hyp2).get()));
+  }
+  HypothesisPool pool(file_, IBM_BLEU);
+  ASSERT_EQ(2, pool.size());
+  EXPECT_TRUE(pool[1].features == f2);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
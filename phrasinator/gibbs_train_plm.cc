@@ -19,14 +19,14 @@ string Join(char joiner, const vector<int>& phrase) {
   ostringstream os;
   for (int i = 0; i < phrase.size(); ++i) {
     if (i > 0) os << joiner;
-    os << d.Convert(phrase[i]);
+    os << d.CString(phrase[i]);
   }
   return os.str();
 }
 
 ostream& operator<<(ostream& os, const vector<int>& phrase) {
   for (int i = 0; i < phrase.size(); ++i)
-    os << (i == 0 ? "" : " ") << d.Convert(phrase[i]);
+    os << (i == 0 ? "" : " ") << d.CString(phrase[i]);
   return os;
 }
 
@@ -20,7 +20,7 @@ string Join(char joiner, const vector<int>& phrase) {
   ostringstream os;
   for (int i = 0; i < phrase.size(); ++i) {
     if (i > 0) os << joiner;
-    os << d.Convert(phrase[i]);
+    os << d.CString(phrase[i]);
   }
   return os.str();
 }
@@ -36,7 +36,7 @@ void WriteSeg(const vector<int>& line, const vector<BType>& label, const Dict& d
       if (prev) cout << ' ';
       cout << "{{";
       for (int i = prev; i <= cur; ++i)
-        cout << (i == prev ? "" : " ") << d.Convert(line[i]);
+        cout << (i == prev ? "" : " ") << d.CString(line[i]);
       cout << "}}:" << label[cur];
       prev = cur + 1;
     }
@@ -47,7 +47,7 @@ void WriteSeg(const vector<int>& line, const vector<BType>& label, const Dict& d
 
 ostream& operator<<(ostream& os, const vector<int>& phrase) {
   for (int i = 0; i < phrase.size(); ++i)
-    os << (i == 0 ? "" : " ") << d.Convert(phrase[i]);
+    os << (i == 0 ? "" : " ") << d.CString(phrase[i]);
   return os;
 }
 
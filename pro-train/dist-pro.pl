@@ -24,6 +24,7 @@ die "Can't execute $FAST_SCORE" unless -x $FAST_SCORE;
 my $MAPINPUT = "$bin_dir/mr_pro_generate_mapper_input.pl";
 my $MAPPER = "$bin_dir/mr_pro_map";
 my $REDUCER = "$bin_dir/mr_pro_reduce";
+my $LOCALPRO = "$bin_dir/pro_local";
 my $parallelize = "$VEST_DIR/parallelize.pl";
 my $libcall = "$VEST_DIR/libcall.pl";
 my $sentserver = "$VEST_DIR/sentserver";
@@ -55,6 +56,8 @@ my $dir;
 my $iniFile;
 my $weights;
 my $use_make;  # use make to parallelize
+my $pro_threads;  # run the sampler and classifier in one threaded process
+my $binary_pool;  # keep k-best lists as binary hypothesis pools
 my $usefork;
 my $initial_weights;
 my $pass_suffix = '';
@@ -79,6 +82,8 @@ if (GetOptions(
 	"reg=f" => \$reg,
 	"local" => \$run_local,
 	"use-make=i" => \$use_make,
+	"pro-threads=i" => \$pro_threads,
+	"binary-pool" => \$binary_pool,
 	"max-iterations=i" => \$max_iterations,
 	"pmem=s" => \$pmem,
         "cpbin!" => \$cpbin,
@@ -185,7 +190,7 @@ if ($dryrun){
 	} else {
 		-e $dir || mkdir $dir;
 		mkdir "$dir/hgs";
-        modbin("$dir/bin",\$LocalConfig,\$cdec,\$SCORER,\$MAPINPUT,\$MAPPER,\$REDUCER,\$parallelize,\$sentserver,\$sentclient,\$libcall) if $cpbin;
+        modbin("$dir/bin",\$LocalConfig,\$cdec,\$SCORER,\$MAPINPUT,\$MAPPER,\$REDUCER,\$LOCALPRO,\$parallelize,\$sentserver,\$sentclient,\$libcall) if $cpbin;
     mkdir "$dir/scripts";
         my $cmdfile="$dir/rerun-pro.sh";
         open CMD,'>',$cmdfile;
@@ -296,6 +301,17 @@ while (1){
 	$cmd="$MAPINPUT $dir/hgs > $dir/agenda.$im1";
 	print STDERR "COMMAND:\n$cmd\n";
 	check_call($cmd);
+	my $poolflag = $binary_pool ? " -B" : "";
+	if ($pro_threads) {
+		print STDERR "RUNNING IN-PROCESS SAMPLER AND CLASSIFIER WITH $pro_threads THREADS\n";
+		$cmd="$LOCALPRO -j $pro_threads -i $dir/agenda.$im1 -s $srcFile -l $metric $refs_comma_sep -w $inweights -K $dir/kbest$poolflag --sigma_squared $reg";
+		if ($tune_regularizer) {
+			$cmd .= " -T";
+		}
+		$cmd .= " > $dir/weights.$iteration";
+		print STDERR "COMMAND:\n$cmd\n";
+		check_bash_call($cmd);
+	} else {
 	check_call("mkdir -p $dir/splag.$im1");
 	$cmd="split -a 3 -l $lines_per_mapper $dir/agenda.$im1 $dir/splag.$im1/mapinput.";
 	print STDERR "COMMAND:\n$cmd\n";
@@ -326,7 +342,7 @@ while (1){
 		$mapoutput =~ s/mapinput/mapoutput/;
 		push @mapoutputs, "$dir/splag.$im1/$mapoutput";
 		$o2i{"$dir/splag.$im1/$mapoutput"} = "$dir/splag.$im1/$shard";
-		my $script = "$MAPPER -s $srcFile -l $metric $refs_comma_sep -w $inweights -K $dir/kbest < $dir/splag.$im1/$shard > $dir/splag.$im1/$mapoutput";
+		my $script = "$MAPPER -s $srcFile -l $metric $refs_comma_sep -w $inweights -K $dir/kbest$poolflag < $dir/splag.$im1/$shard > $dir/splag.$im1/$mapoutput";
 		if ($run_local) {
 			print STDERR "COMMAND:\n$script\n";
 			check_bash_call($script);
@@ -418,6 +434,7 @@ while (1){
         $cmd .= " > $dir/weights.$iteration";
 	print STDERR "COMMAND:\n$cmd\n";
 	check_bash_call($cmd);
+	}
 	$lastWeightsFile = "$dir/weights.$iteration";
 	if ($tune_regularizer) {
 		open W, "<$lastWeightsFile" or die "Can't read $lastWeightsFile: $!";
@@ -595,6 +612,16 @@ General options:
 		Use make -j <I> to run the optimizer commands (useful on large
 		shared-memory machines where qsub is unavailable).
 
+	--pro-threads <J>
+		Replace the mapper and reducer jobs with a single process that
+		samples training instances with J threads and trains the
+		classifier in memory.
+
+	--binary-pool
+		Keep the hypotheses of earlier iterations in binary pools
+		(with cached metric statistics) instead of gzipped text
+		k-best lists.
+
 	--workdir <dir>
 		Directory for intermediate and output files.  If not specified, the
 		name is derived from the ini filename.  Assuming that the ini
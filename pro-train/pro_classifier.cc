@@ -0,0 +1,200 @@
+#include "pro_classifier.h"
+
+#include <cassert>
+#include <cmath>
+#include <string>
+
+#include "pro_sampler.h"
+#include "fdict.h"
+#include "optimize.h"
+#include "weights.h"
+
+using namespace std;
+
+// since this is a ranking model, there should be equal numbers of
+// positive and negative examples, so the bias should be 0
+static const double MAX_BIAS = 1e-10;
+
+void ReadCorpus(istream* pin, PROCorpus* corpus) {
+  istream& in = *pin;
+  corpus->clear();
+  bool flag = false;
+  int lc = 0;
+  string line;
+  SparseVector<double> x;
+  while(getline(in, line)) {
+    ++lc;
+    if (lc % 1000 == 0) { cerr << '.'; flag = true; }
+    if (lc % 40000 == 0) { cerr << " [" << lc << "]\n"; flag = false; }
+    if (line.empty()) continue;
+    const size_t ks = line.find("\t");
+    assert(string::npos != ks);
+    assert(ks == 1);
+    const bool y = line[0] == '1';
+    x.clear();
+    ParseSparseVector(line, ks + 1, &x);
+    corpus->push_back(make_pair(y, x));
+  }
+  if (flag) cerr << endl;
+}
+
+static void GradAdd(const SparseVector<double>& v, const double scale, vector<double>* acc) {
+  for (SparseVector<double>::const_iterator it = v.begin();
+       it != v.end(); ++it) {
+    (*acc)[it->first] += it->second * scale;
+  }
+}
+
+double TrainingInference(const vector<double>& x,
+                         const PROCorpus& corpus,
+                         vector<double>* g) {
+  double cll = 0;
+  for (int i = 0; i < corpus.size(); ++i) {
+    const double dotprod = corpus[i].second.dot(x) + x[0]; // x[0] is bias
+    double lp_false = dotprod;
+    double lp_true = -dotprod;
+    if (0 < lp_true) {
+      lp_true += log1p(exp(-lp_true));
+      lp_false = log1p(exp(lp_false));
+    } else {
+      lp_true = log1p(exp(lp_true));
+      lp_false += log1p(exp(-lp_false));
+    }
+    lp_true*=-1;
+    lp_false*=-1;
+    if (corpus[i].first) {  // true label
+      cll -= lp_true;
+      if (g) {
+        // g -= corpus[i].second * exp(lp_false);
+        GradAdd(corpus[i].second, -exp(lp_false), g);
+        (*g)[0] -= exp(lp_false); // bias
+      }
+    } else {                  // false label
+      cll -= lp_false;
+      if (g) {
+        // g += corpus[i].second * exp(lp_true);
+        GradAdd(corpus[i].second, exp(lp_true), g);
+        (*g)[0] += exp(lp_true); // bias
+      }
+    }
+  }
+  return cll;
+}
+
+// return held-out log likelihood
+double LearnParameters(const PROCorpus& training,
+                       const PROCorpus& testing,
+                       const double sigsq,
+                       const unsigned memory_buffers,
+                       vector<double>* px) {
+  vector<double>& x = *px;
+  vector<double> vg(FD::NumFeats(), 0.0);
+  bool converged = false;
+  LBFGSOptimizer opt(FD::NumFeats(), memory_buffers);
+  double tppl = 0.0;
+  while(!converged) {
+    fill(vg.begin(), vg.end(), 0.0);
+    double cll = TrainingInference(x, training, &vg);
+    double ppl = cll / log(2);
+    ppl /= training.size();
+    ppl = pow(2.0, ppl);
+
+    // evaluate optional held-out test set
+    if (testing.size()) {
+      tppl = TrainingInference(x, testing) / log(2);
+      tppl /= testing.size();
+      tppl = pow(2.0, tppl);
+    }
+
+    // handle regularizer
+#if 1
+    double norm = 0;
+    for (int i = 1; i < x.size(); ++i) {
+      const double mean_i = 0.0;
+      const double param = (x[i] - mean_i);
+      norm += param * param;
+      vg[i] += param / sigsq;
+    } 
+    const double reg = norm / (2.0 * sigsq);
+#else
+    double reg = 0;
+#endif
+    cll += reg;
+    cerr << cll << " (REG=" << reg << ")\tPPL=" << ppl << "\t TEST_PPL=" << tppl << "\t";
+    try {
+      vector<double> old_x = x;
+      do {
+        opt.Optimize(cll, vg, &x);
+        converged = opt.HasConverged();
+      } while (!converged && x == old_x);
+    } catch (...) {
+      cerr << "Exception caught, assuming convergence is close enough...\n";
+      converged = true;
+    }
+    if (fabs(x[0]) > MAX_BIAS) {
+      cerr << "Biased model learned. Are your training instances wrong?\n";
+      cerr << "  BIAS: " << x[0] << endl;
+    }
+  }
+  return tppl;
+}
+
+double TuneRegularizer(const PROCorpus& training,
+                       const PROCorpus& testing,
+                       const double min_reg,
+                       const double max_reg,
+                       const unsigned memory_buffers,
+                       vector<double>* px,
+                       vector<pair<double,double> >* psp,
+                       vector<double>* psmoothed) {
+  vector<pair<double,double> >& sp = *psp;
+  vector<double>& smoothed = *psmoothed;
+  cerr << "Tuning regularizer..." << endl;
+
+  double sigsq = min_reg;
+  const double steps = 18;
+  double sweep_factor = exp((log(max_reg) - log(min_reg)) / steps);
+  cerr << "SWEEP FACTOR: " << sweep_factor << endl;
+  while(sigsq < max_reg) {
+    const double tppl = LearnParameters(training, testing, sigsq, memory_buffers, px);
+    sp.push_back(make_pair(sigsq, tppl));
+    sigsq *= sweep_factor;
+  }
+  smoothed.resize(sp.size(), 0);
+  smoothed[0] = sp[0].second;
+  smoothed.back() = sp.back().second; 
+  for (int i = 1; i < sp.size()-1; ++i) {
+    double prev = sp[i-1].second;
+    double next = sp[i+1].second;
+    double cur = sp[i].second;
+    smoothed[i] = (prev*0.2) + cur * 0.6 + (0.2*next);
+  }
+  double best_ppl = 9999999;
+  unsigned best_i = 0;
+  for (unsigned i = 0; i < sp.size(); ++i) {
+    if (smoothed[i] < best_ppl) {
+      best_ppl = smoothed[i];
+      best_i = i;
+    }
+  }
+  return sp[best_i].first;
+}
+
+void WriteWeights(const double sigsq,
+                  const double tppl,
+                  const vector<pair<double,double> >& sp,
+                  const vector<double>& smoothed,
+                  const vector<double>& x) {
+  cout.precision(15);
+  cout << "# sigma^2=" << sigsq << "\theld out perplexity=";
+  if (tppl) { cout << tppl << endl; } else { cout << "N/A\n"; }
+  if (sp.size()) {
+    cout << "# Parameter sweep:\n";
+    for (int i = 0; i < sp.size(); ++i) {
+      cout << "# " << sp[i].first << "\t" << sp[i].second << "\t" << smoothed[i] << endl;
+    }
+  }
+  Weights w;
+  w.InitFromVector(x);
+  w.WriteToFile("-");
+}
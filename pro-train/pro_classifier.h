@@ -0,0 +1,49 @@
+#ifndef _PRO_CLASSIFIER_H_
+#define _PRO_CLASSIFIER_H_
+
+// logistic regression over pairwise difference vectors, shared by
+// mr_pro_reduce and pro_local
+
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#include "sparse_vector.h"
+
+typedef std::vector<std::pair<bool, SparseVector<double> > > PROCorpus;
+
+// reads lines of the form y<TAB>feat1=val1 feat2=val2 ...
+void ReadCorpus(std::istream* pin, PROCorpus* corpus);
+
+// returns the negative conditional log likelihood of corpus under x;
+// if g is non-NULL, the gradient is added to it
+double TrainingInference(const std::vector<double>& x,
+                         const PROCorpus& corpus,
+                         std::vector<double>* g = NULL);
+
+// return held-out log likelihood
+double LearnParameters(const PROCorpus& training,
+                       const PROCorpus& testing,
+                       const double sigsq,
+                       const unsigned memory_buffers,
+                       std::vector<double>* px);
+
+// sweeps sigma^2 over [min_reg,max_reg] and returns the value with the
+// best (smoothed) held-out perplexity; the sweep is recorded in sp
+double TuneRegularizer(const PROCorpus& training,
+                       const PROCorpus& testing,
+                       const double min_reg,
+                       const double max_reg,
+                       const unsigned memory_buffers,
+                       std::vector<double>* px,
+                       std::vector<std::pair<double,double> >* sp,
+                       std::vector<double>* smoothed);
+
+// writes the header comments and weights x to STDOUT
+void WriteWeights(const double sigsq,
+                  const double tppl,
+                  const std::vector<std::pair<double,double> >& sp,
+                  const std::vector<double>& smoothed,
+                  const std::vector<double>& x);
+
+#endif
@@ -0,0 +1,310 @@
+#include <sstream>
+#include <iostream>
+#include <fstream>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
+#include <boost/program_options.hpp>
+#include <boost/program_options/variables_map.hpp>
+
+#include "pro_sampler.h"
+#include "pro_classifier.h"
+#include "filelib.h"
+#include "dict.h"
+#include "dict_snapshot.h"
+#include "stringlib.h"
+#include "weights.h"
+#include "scorer.h"
+#include "hg_io.h"
+#include "kbest.h"
+#include "viterbi.h"
+#include "parallel_for.h"
+
+// Runs one PRO iteration (mr_pro_map followed by mr_pro_reduce) in a single
+// process.  Sentences are scored and sampled by a pool of threads, and the
+// sampled difference vectors go straight to the classifier without being
+// written out as text.  The k-best repository has the same layout as the
+// one maintained by mr_pro_map, so the two can be used interchangeably.
+
+using namespace std;
+namespace po = boost::program_options;
+
+void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
+  po::options_description opts("Configuration options");
+  opts.add_options()
+        ("reference,r",po::value<vector<string> >(), "[REQD] Reference translation (tokenized text)")
+        ("weights,w",po::value<string>(), "[REQD] Weights files from current iterations")
+        ("kbest_repository,K",po::value<string>()->default_value("./kbest"),"K-best list repository (directory)")
+        ("binary_pool,B", "Keep the k-best repository as binary hypothesis pools (with cached metric statistics) rather than gzipped text")
+        ("input,i",po::value<string>()->default_value("-"), "Mapper input (path-to-hypergraph sent_id per line, - is STDIN)")
+        ("source,s",po::value<string>()->default_value(""), "Source file (ignored, except for AER)")
+        ("loss_function,l",po::value<string>()->default_value("ibm_bleu"), "Loss function being optimized")
+        ("kbest_size,k",po::value<unsigned>()->default_value(1500u), "Top k-hypotheses to extract")
+        ("candidate_pairs,G", po::value<unsigned>()->default_value(5000u), "Number of pairs to sample per hypothesis (Gamma)")
+        ("best_pairs,X", po::value<unsigned>()->default_value(50u), "Number of pairs, ranked by magnitude of objective delta, to retain (Xi)")
+        ("random_seed,S", po::value<uint32_t>(), "Random seed (if not specified, /dev/random will be used)")
+        ("threads,j", po::value<unsigned>()->default_value(1u), "Number of threads used to extract k-best lists and sample training instances")
+        ("interpolation,p",po::value<double>()->default_value(0.9), "Output weights are p*w + (1-p)*w_prev")
+        ("memory_buffers,m",po::value<unsigned>()->default_value(200), "Number of memory buffers (LBFGS)")
+        ("sigma_squared",po::value<double>()->default_value(0.1), "Sigma squared for Gaussian prior")
+        ("min_reg",po::value<double>()->default_value(1e-8), "When tuning (-T) regularization strength, minimum regularization strenght")
+        ("max_reg",po::value<double>()->default_value(10.0), "When tuning (-T) regularization strength, maximum regularization strenght")
+        ("tune_regularizer,T", "Hold out every third sentence and use it to tune the regularization strength")
+        ("help,h", "Help");
+  AddDictionarySnapshotOption(&opts);
+  po::options_description dcmdline_options;
+  dcmdline_options.add(opts);
+  po::store(parse_command_line(argc, argv, dcmdline_options), *conf);
+  bool flag = false;
+  if (!conf->count("reference")) {
+    cerr << "Please specify one or more references using -r <REF.TXT>\n";
+    flag = true;
+  }
+  if (!conf->count("weights")) {
+    cerr << "Please specify weights using -w <WEIGHTS.TXT>\n";
+    flag = true;
+  }
+  if (flag || conf->count("help")) {
+    cerr << dcmdline_options << endl;
+    exit(1);
+  }
+}
+
+static void ReadContents(const string& file, string* contents) {
+  ReadFile rf(file);
+  ostringstream os;
+  os << rf.stream()->rdbuf();
+  *contents = os.str();
+}
+
+struct SentenceJob {
+  string file;
+  int sent_id;
+  uint32_t seed;
+  vector<TrainingInstance> instances;
+};
+
+// state shared by the sampling threads.  main enables the locking of TD
+// and FD, so any thread may look up words and features (Sample prints them
+// in its diagnostics).  Interning is still done while holding dict_mutex
+// (parsing forests and k-best lists, adding to the pools, writing k-best
+// lists), and forests are parsed in input order, so that word and feature
+// ids (and therefore the output) do not depend on the number of threads;
+// file (de)compression, k-best extraction, scoring and sampling run
+// unlocked.  ParallelFor hands out the jobs in input order, so a thread
+// waiting for its turn to parse never waits for a job nobody has taken.
+struct PROSampler {
+  PROSampler(const DocScorer& d,
+             const vector<double>& w,
+             const string& repo,
+             const unsigned k,
+             const unsigned g,
+             const unsigned x,
+             const ScoreType t,
+             const bool pool,
+             vector<SentenceJob>* j) :
+    ds(d), weights(w), kbest_repo(repo), kbest_size(k), gamma(g), xi(x),
+    type(t), invert_score(t == TER), binary_pool(pool), jobs(*j),
+    next_parse() {}
+
+  // called by ParallelFor
+  void operator()(int i, unsigned /* thread */) const { Process(i, &jobs[i]); }
+
+  void Process(const size_t job_index, SentenceJob* job) const {
+    ostringstream os;
+    if (binary_pool)
+      os << kbest_repo << "/pool." << job->sent_id;
+    else
+      os << kbest_repo << "/kbest." << job->sent_id << ".txt.gz";
+    const string kbest_file = os.str();
+    string hg_data, kbest_data;
+    ReadContents(job->file, &hg_data);
+    // read k-best hypotheses from previous iterations
+    if (!binary_pool && FileExists(kbest_file))
+      ReadContents(kbest_file, &kbest_data);
+
+    Hypergraph hg;
+    vector<HypInfo> J_i;
+    boost::scoped_ptr<HypothesisPool> pool;
+    {
+      boost::mutex::scoped_lock lock(dict_mutex);
+      while (next_parse != job_index)
+        parsed.wait(lock);
+      istringstream hgs(hg_data);
+      HypergraphIO::ReadFromJSON(&hgs, &hg);
+      if (binary_pool) {
+        pool.reset(new HypothesisPool(kbest_file, type));
+      } else {
+        istringstream kbs(kbest_data);
+        ReadKBest(&kbs, &J_i);
+      }
+      ++next_parse;
+      parsed.notify_all();
+    }
+    // extract k-best for this iteration
+    hg.Reweight(weights);
+    KBest::KBestDerivations<vector<WordID>, ESentenceTraversal> kbest(hg, kbest_size);
+
+    vector<HypInfo> cur;
+    for (int i = 0; i < kbest_size; ++i) {
+      const KBest::KBestDerivations<vector<WordID>, ESentenceTraversal>::Derivation* d =
+        kbest.LazyKthBest(hg.nodes_.size() - 1, i);
+      if (!d) break;
+      cur.push_back(HypInfo(d->yield, d->feature_values));
+    }
+    if (binary_pool) {
+      vector<ScoreP> stats;
+      ScoreNewHypotheses(cur, *ds[job->sent_id], *pool, &stats);
+      {
+        boost::mutex::scoped_lock lock(dict_mutex);
+        AddToPool(cur, stats, pool.get());
+      }
+      ReadPool(*pool, &J_i);
+    } else {
+      J_i.insert(J_i.end(), cur.begin(), cur.end());
+      Dedup(&J_i);
+      ostringstream kbo;
+      {
+        boost::mutex::scoped_lock lock(dict_mutex);
+        kbo.precision(10);
+        for (int i = 0; i < J_i.size(); ++i)
+          kbo << TD::GetString(J_i[i].hyp) << endl << J_i[i].x << endl;
+      }
+      WriteFile wf(kbest_file);
+      *wf.stream() << kbo.str();
+    }
+
+    MT19937 rng(job->seed);
+    Sample(gamma, xi, J_i, *ds[job->sent_id], invert_score, &rng, &job->instances);
+  }
+
+  const DocScorer& ds;
+  const vector<double>& weights;
+  const string kbest_repo;
+  const unsigned kbest_size;
+  const unsigned gamma;
+  const unsigned xi;
+  const ScoreType type;
+  const bool invert_score;
+  const bool binary_pool;
+  vector<SentenceJob>& jobs;
+  mutable size_t next_parse;
+  mutable boost::mutex dict_mutex;
+  mutable boost::condition parsed;
+};
+
+static void AddInstances(const vector<TrainingInstance>& v, PROCorpus* corpus) {
+  for (unsigned i = 0; i < v.size(); ++i) {
+    const TrainingInstance& vi = v[i];
+    corpus->push_back(make_pair(vi.y, vi.x));
+    corpus->push_back(make_pair(!vi.y, vi.x * -1.0));
+  }
+}
+
+int main(int argc, char** argv) {
+  po::variables_map conf;
+  InitCommandLine(argc, argv, &conf);
+  LoadDictionarySnapshots(conf);
+  MT19937 rng(conf.count("random_seed") ? conf["random_seed"].as<uint32_t>() : 0u);
+  const string loss_function = conf["loss_function"].as<string>();
+
+  ScoreType type = ScoreTypeFromString(loss_function);
+  DocScorer ds(type, conf["reference"].as<vector<string> >(), conf["source"].as<string>());
+  cerr << "Loaded " << ds.size() << " references for scoring with " << loss_function << endl;
+  unsigned num_threads = conf["threads"].as<unsigned>();
+  if (num_threads == 0) {
+    cerr << "--threads must be at least 1\n";
+    return 1;
+  }
+  if (num_threads > 1 && (type == AER || type == METEOR)) {
+    cerr << "Scoring with " << loss_function << " is not thread safe, using a single thread\n";
+    num_threads = 1;
+  }
+  if (num_threads > 1) Dict::EnableLocking();
+  const bool tune_regularizer = conf.count("tune_regularizer");
+  const double min_reg = conf["min_reg"].as<double>();
+  const double max_reg = conf["max_reg"].as<double>();
+  double sigsq = conf["sigma_squared"].as<double>();
+  assert(sigsq > 0.0);
+  assert(min_reg > 0.0);
+  assert(max_reg > 0.0);
+  assert(max_reg > min_reg);
+  const double psi = conf["interpolation"].as<double>();
+  if (psi < 0.0 || psi > 1.0) {
+    cerr << "Invalid interpolation weight: " << psi << " (must be in [0,1])\n";
+    return 1;
+  }
+  string weightsf = conf["weights"].as<string>();
+  vector<double> weights;
+  SparseVector<double> old_weights;
+  {
+    Weights w;
+    w.InitFromFile(weightsf);
+    w.InitVector(&weights);
+    w.InitSparseVector(&old_weights);
+  }
+  string kbest_repo = conf["kbest_repository"].as<string>();
+  MkDirP(kbest_repo);
+
+  // seeds are drawn in input order so that, given --random_seed, the
+  // training instances do not depend on the number of threads
+  vector<SentenceJob> jobs;
+  {
+    ReadFile in_read(conf["input"].as<string>());
+    istream &in=*in_read.stream();
+    string line;
+    while(getline(in, line)) {
+      if (line.empty()) continue;
+      istringstream is(line);
+      jobs.push_back(SentenceJob());
+      // path-to-file (JSON) sent_id
+      is >> jobs.back().file >> jobs.back().sent_id;
+      jobs.back().seed = static_cast<uint32_t>(rng.next() * 4294967295.0) + 1;
+    }
+  }
+  cerr << "Sampling training instances from " << jobs.size() << " sentences with " << num_threads << " thread(s)\n";
+  PROSampler sampler(ds, weights, kbest_repo,
+                     conf["kbest_size"].as<unsigned>(),
+                     conf["candidate_pairs"].as<unsigned>(),
+                     conf["best_pairs"].as<unsigned>(),
+                     type,
+                     conf.count("binary_pool"),
+                     &jobs);
+  ParallelFor(num_threads, 0, jobs.size(), sampler);
+
+  PROCorpus training, testing;
+  for (unsigned i = 0; i < jobs.size(); ++i) {
+    if (tune_regularizer && i % 3 == 1)
+      AddInstances(jobs[i].instances, &testing);
+    else
+      AddInstances(jobs[i].instances, &training);
+    vector<TrainingInstance>().swap(jobs[i].instances);
+  }
+  if (tune_regularizer && testing.empty()) {
+    cerr << "Not enough training instances for regularization tuning! Rerun without --tune_regularizer\n";
+    return 1;
+  }
+  cerr << "Training instances: " << training.size() << " (held out: " << testing.size() << ")\n";
+
+  cerr << "Number of features: " << FD::NumFeats() << endl;
+  vector<double> x(FD::NumFeats(), 0.0);  // x[0] is bias
+  for (SparseVector<double>::const_iterator it = old_weights.begin();
+       it != old_weights.end(); ++it)
+    x[it->first] = it->second;
+  double tppl = 0.0;
+  vector<pair<double,double> > sp;
+  vector<double> smoothed;
+  if (tune_regularizer)
+    sigsq = TuneRegularizer(training, testing, min_reg, max_reg, conf["memory_buffers"].as<unsigned>(), &x, &sp, &smoothed);
+  cerr << "Learning parameters..." << endl;
+  tppl = LearnParameters(training, testing, sigsq, conf["memory_buffers"].as<unsigned>(), &x);
+
+  cerr << "Interpolating with previous weight vectors..." << endl;
+  for (int i = 1; i < x.size(); ++i)
+    x[i] = (x[i] * psi) + old_weights.get(i) * (1.0 - psi);
+  WriteWeights(sigsq, tppl, sp, smoothed, x);
+  return 0;
+}
@@ -0,0 +1,174 @@
+#include "pro_sampler.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <algorithm>
+#include <iterator>
+#include <tr1/unordered_set>
+
+#include "filelib.h"
+#include "tdict.h"
+#include "fdict.h"
+
+using namespace std;
+
+void WriteKBest(const string& file, const vector<HypInfo>& kbest) {
+  WriteFile wf(file);
+  ostream& out = *wf.stream();
+  out.precision(10);
+  for (int i = 0; i < kbest.size(); ++i) {
+    out << TD::GetString(kbest[i].hyp) << endl;
+    out << kbest[i].x << endl;
+  }
+}
+
+void ParseSparseVector(string& line, size_t cur, SparseVector<double>* out) {
+  SparseVector<double>& x = *out;
+  if (cur >= line.size()) return;  // hypotheses with no features
+  size_t last_start = cur;
+  size_t last_comma = string::npos;
+  while(cur <= line.size()) {
+    if (line[cur] == ' ' || cur == line.size()) {
+      if (!(cur > last_start && last_comma != string::npos && cur > last_comma)) {
+        cerr << "[ERROR] " << line << endl << "  position = " << cur << endl;
+        exit(1);
+      }
+      const int fid = FD::Convert(line.substr(last_start, last_comma - last_start));
+      if (cur < line.size()) line[cur] = 0;
+      const double val = strtod(&line[last_comma + 1], NULL);
+      x.set_value(fid, val);
+
+      last_comma = string::npos;
+      last_start = cur+1;
+    } else {
+      if (line[cur] == '=')
+        last_comma = cur;
+    }
+    ++cur;
+  }
+}
+
+void ReadKBest(istream* pin, vector<HypInfo>* kbest) {
+  istream& in = *pin;
+  string cand;
+  string feats;
+  while(getline(in, cand)) {
+    getline(in, feats);
+    assert(in);
+    kbest->push_back(HypInfo());
+    TD::ConvertSentence(cand, &kbest->back().hyp);
+    ParseSparseVector(feats, 0, &kbest->back().x);
+  }
+}
+
+void ReadKBest(const string& file, vector<HypInfo>* kbest) {
+  //cerr << "Reading from " << file << endl;
+  ReadFile rf(file);
+  ReadKBest(rf.stream(), kbest);
+  //cerr << "  read " << kbest->size() << " hypotheses\n";
+}
+
+void ScoreNewHypotheses(const vector<HypInfo>& kbest,
+                        const SentenceScorer& scorer,
+                        const HypothesisPool& pool,
+                        vector<ScoreP>* stats) {
+  stats->resize(kbest.size());
+  for (int i = 0; i < kbest.size(); ++i)
+    if (!pool.Contains(kbest[i].hyp, kbest[i].x))
+      (*stats)[i] = scorer.ScoreCandidate(kbest[i].hyp);
+}
+
+void AddToPool(const vector<HypInfo>& kbest,
+               const vector<ScoreP>& stats,
+               HypothesisPool* pool) {
+  for (int i = 0; i < kbest.size(); ++i)
+    if (stats[i])
+      pool->Add(kbest[i].hyp, kbest[i].x, stats[i].get());
+}
+
+void ReadPool(const HypothesisPool& pool, vector<HypInfo>* J_i) {
+  J_i->resize(pool.size());
+  for (int i = 0; i < pool.size(); ++i) {
+    HypInfo& h = (*J_i)[i];
+    h.hyp = pool[i].words;
+    h.x = pool[i].features;
+    if (pool[i].stats)
+      h.g_ = pool[i].stats->ComputeScore();
+  }
+}
+
+void Dedup(vector<HypInfo>* h) {
+  // cerr << "Dedup in=" << h->size();
+  tr1::unordered_set<HypInfo, HypInfoHasher, HypInfoCompare> u;
+  while(h->size() > 0) {
+    u.insert(h->back());
+    h->pop_back();
+  }
+  tr1::unordered_set<HypInfo, HypInfoHasher, HypInfoCompare>::iterator it = u.begin();
+  while (it != u.end()) {
+    h->push_back(*it);
+    it = u.erase(it);
+  }
+  //cerr << "  out=" << h->size() << endl;
+}
+
+#ifdef DEBUGGING_PRO
+ostream& operator<<(ostream& os, const TrainingInstance& d) {
+  return os << d.gdiff << " y=" << d.y << "\tA:" << TD::GetString(d.a) << "\n\tB: " << TD::GetString(d.b) << "\n\tX: " << d.x;
+}
+#endif
+
+struct DiffOrder {
+  bool operator()(const TrainingInstance& a, const TrainingInstance& b) const {
+    return a.gdiff > b.gdiff;
+  }
+};
+
+void Sample(const unsigned gamma, const unsigned xi, const vector<HypInfo>& J_i, const SentenceScorer& scorer, const bool invert_score, MT19937* rng, vector<TrainingInstance>* pv) {
+  if (J_i.empty()) return;
+  vector<TrainingInstance> v1, v2;
+  double avg_diff = 0;
+  for (unsigned i = 0; i < gamma; ++i) {
+    const size_t a = rng->inclusive(0, J_i.size() - 1)();
+    const size_t b = rng->inclusive(0, J_i.size() - 1)();
+    if (a == b) continue;
+    double ga = J_i[a].g(scorer);
+    double gb = J_i[b].g(scorer);
+    bool positive = gb < ga;
+    if (invert_score) positive = !positive;
+    const double gdiff = fabs(ga - gb);
+    if (!gdiff) continue;
+    avg_diff += gdiff;
+    SparseVector<double> xdiff = (J_i[a].x - J_i[b].x).erase_zeros();
+    if (xdiff.empty()) {
+      cerr << "Empty diff:\n  " << TD::GetString(J_i[a].hyp) << endl << "x=" << J_i[a].x << endl;
+      cerr << "  " << TD::GetString(J_i[b].hyp) << endl << "x=" << J_i[b].x << endl;
+      continue;
+    }
+    v1.push_back(TrainingInstance(xdiff, positive, gdiff));
+#ifdef DEBUGGING_PRO
+    v1.back().a = J_i[a].hyp;
+    v1.back().b = J_i[b].hyp;
+    cerr << "N: " << v1.back() << endl;
+#endif
+  }
+  avg_diff /= v1.size();
+
+  for (unsigned i = 0; i < v1.size(); ++i) {
+    double p = 1.0 / (1.0 + exp(-avg_diff - v1[i].gdiff));
+    // cerr << "avg_diff=" << avg_diff << "  gdiff=" << v1[i].gdiff << "  p=" << p << endl;
+    if (rng->next() < p) v2.push_back(v1[i]);
+  }
+  vector<TrainingInstance>::iterator mid = (xi < v2.size()) ? v2.begin() + xi : v2.end();
+  partial_sort(v2.begin(), mid, v2.end(), DiffOrder());
+  copy(v2.begin(), mid, back_inserter(*pv));
+#ifdef DEBUGGING_PRO
+  if (v2.size() >= 5) {
+    for (int i =0; i < (mid - v2.begin()); ++i) {
+      cerr << v2[i] << endl;
+    }
+    cerr << pv->back() << endl;
+  }
+#endif
+}
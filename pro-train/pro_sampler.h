@@ -0,0 +1,99 @@
+#ifndef _PRO_SAMPLER_H_
+#define _PRO_SAMPLER_H_
+
+// Pairwise ranking sampler from Figure 4 (Algorithm Sampler) of
+// Hopkins&May (2011), shared by mr_pro_map and pro_local
+
+#include <string>
+#include <vector>
+
+#include <boost/functional/hash.hpp>
+
+#include "sampler.h"
+#include "sparse_vector.h"
+#include "approx_vector.h"
+#include "scorer.h"
+#include "hyp_pool.h"
+#include "wordid.h"
+
+struct HypInfo {
+  HypInfo() : g_(-100.0) {}
+  HypInfo(const std::vector<WordID>& h, const SparseVector<double>& feats) : hyp(h), g_(-100.0), x(feats) {}
+
+  // lazy evaluation
+  double g(const SentenceScorer& scorer) const {
+    if (g_ == -100.0)
+      g_ = scorer.ScoreCandidate(hyp)->ComputeScore();
+    return g_;
+  }
+  std::vector<WordID> hyp;
+  mutable double g_;
+  SparseVector<double> x;
+};
+
+struct HypInfoCompare {
+  bool operator()(const HypInfo& a, const HypInfo& b) const {
+    ApproxVectorEquals comp;
+    return (a.hyp == b.hyp && comp(a.x,b.x));
+  }
+};
+
+struct HypInfoHasher {
+  size_t operator()(const HypInfo& x) const {
+    boost::hash<std::vector<WordID> > hhasher;
+    ApproxVectorHasher vhasher;
+    size_t ha = hhasher(x.hyp);
+    boost::hash_combine(ha, vhasher(x.x));
+    return ha;
+  }
+};
+
+struct TrainingInstance {
+  TrainingInstance(const SparseVector<double>& feats, bool positive, double diff) : x(feats), y(positive), gdiff(diff) {}
+  SparseVector<double> x;
+#undef DEBUGGING_PRO
+#ifdef DEBUGGING_PRO
+  std::vector<WordID> a;
+  std::vector<WordID> b;
+#endif
+  bool y;
+  double gdiff;
+};
+
+// parses feat1=val1 feat2=val2 ... starting at position cur of line
+// (line is modified)
+void ParseSparseVector(std::string& line, size_t cur, SparseVector<double>* out);
+
+// k-best repository files: alternating lines of hypothesis and features
+void WriteKBest(const std::string& file, const std::vector<HypInfo>& kbest);
+void ReadKBest(const std::string& file, std::vector<HypInfo>* kbest);
+void ReadKBest(std::istream* in, std::vector<HypInfo>* kbest);
+
+// binary alternative to the text k-best repository (see hyp_pool.h).
+// ScoreNewHypotheses computes the sufficient statistics of the hypotheses in
+// kbest that are not yet in pool (the others get NULL), AddToPool appends
+// them, and ReadPool copies the pool to J_i, setting the metric score of
+// every hypothesis whose statistics were stored
+void ScoreNewHypotheses(const std::vector<HypInfo>& kbest,
+                        const SentenceScorer& scorer,
+                        const HypothesisPool& pool,
+                        std::vector<ScoreP>* stats);
+void AddToPool(const std::vector<HypInfo>& kbest,
+               const std::vector<ScoreP>& stats,
+               HypothesisPool* pool);
+void ReadPool(const HypothesisPool& pool, std::vector<HypInfo>* J_i);
+
+// remove (approximately) duplicate hypotheses from h
+void Dedup(std::vector<HypInfo>* h);
+
+// draws gamma candidate pairs from J_i and appends the xi pairs with the
+// largest metric difference to pv
+void Sample(const unsigned gamma,
+            const unsigned xi,
+            const std::vector<HypInfo>& J_i,
+            const SentenceScorer& scorer,
+            const bool invert_score,
+            MT19937* rng,
+            std::vector<TrainingInstance>* pv);
+
+#endif
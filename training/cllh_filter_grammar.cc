@@ -81,7 +81,7 @@ struct TrainingObserver : public DecoderObserver {
   virtual void NotifyTranslationForest(const SentenceMetadata& smeta, Hypergraph* hg) {
     assert(state == 1);
     for (int i = 0; i < hg->edges_.size(); ++i) {
-      const TRule* rule = hg->edges_[i].rule_.get();
+      const TRulePtr& rule = hg->edges_[i].rule_;
       if (rule->lhs_ == s_lhs || rule->lhs_ == goal_lhs)  // fragile hack to filter out glue rules
         continue;
       used.insert(rule);
@@ -102,7 +102,8 @@ struct TrainingObserver : public DecoderObserver {
     }
   }
 
-  set<const TRule*> used;
+  // held, as a grammar only keeps the rules it read while they are used
+  set<TRulePtr> used;
 
   const int s_lhs;
   const int goal_lhs;
@@ -124,7 +125,7 @@ void work(const string& fname, int rank, int size, Decoder* decoder) {
   ostringstream og; og << "grammar." << rank << "_of_" << size << ".gz";
   WriteFile fog(og.str());
 
-  set<const TRule*> all_used;
+  set<TRulePtr> all_used;
   TrainingObserver observer;
   for (int i = 0; i < corpus.size(); ++i) {
     const int sent_id = ids[i];
@@ -135,7 +136,7 @@ void work(const string& fname, int rank, int size, Decoder* decoder) {
       // do nothing
     } else {
       (*foc.stream()) << input << endl;
-      for (set<const TRule*>::iterator it = observer.used.begin(); it != observer.used.end(); ++it) {
+      for (set<TRulePtr>::iterator it = observer.used.begin(); it != observer.used.end(); ++it) {
         if (all_used.insert(*it).second)
           (*fog.stream()) << **it << endl;
       }
@@ -1,6 +1,10 @@
 #ifndef _EM_UTILS_H_
 #define _EM_UTILS_H_
 
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
 #include "config.h"
 #ifdef HAVE_BOOST_DIGAMMA
 #include <boost/math/special_functions/digamma.hpp>
@@ -21,4 +25,15 @@ inline double digamma(double x) {
   return result;
 }
 #endif
+// the length of the conditioning part of an EM event feature X_Y, i.e. of
+// X; the events of one multinomial share it.  Aborts for other features.
+inline size_t ConditioningVariableLength(const char* feature) {
+  const char* pos = strrchr(feature, '_');
+  if (!pos || pos == feature || !pos[1]) {
+    std::cerr << "Bad feature for EM adapter: " << feature << std::endl;
+    abort();
+  }
+  return pos - feature;
+}
+
 #endif
@@ -4,10 +4,10 @@
 #include <vector>
 #include <cassert>
 #include <cmath>
-#include <tr1/memory>
 
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
+#include <boost/shared_ptr.hpp>
 
 #include "verbose.h"
 #include "hg.h"
@@ -18,9 +18,12 @@
 #include "filelib.h"
 #include "online_optimizer.h"
 #include "fdict.h"
+#include "dict_snapshot.h"
 #include "weights.h"
 #include "sparse_vector.h"
+#include "mapped_sparse_vector.h"
 #include "sampler.h"
+#include "parallel_for.h"
 
 #ifdef HAVE_MPI
 #include <boost/mpi/timer.hpp>
@@ -29,6 +32,7 @@ namespace mpi = boost::mpi;
 #endif
 
 using namespace std;
+using boost::shared_ptr;
 namespace po = boost::program_options;
 
 struct FComp {
@@ -71,11 +75,14 @@ bool InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   opts.add_options()
         ("input,i",po::value<string>(),"Corpus of source language sentences")
         ("weights,w",po::value<string>(),"Input feature weights file")
-        ("decoder_config,c",po::value<string>(), "cdec.ini file");
+        ("decoder_config,c",po::value<string>(), "cdec.ini file")
+        ("threads,j", po::value<unsigned>()->default_value(1u), "Number of threads decoding the corpus, each with its own decoder sharing grammars and LMs")
+        ("output,o", po::value<string>(), "Write the expectations of this process's shard of the corpus to this file as a binary sparse vector (with .<rank> appended when there are several processes) instead of summing them and printing them");
   po::options_description clo("Command line options");
   clo.add_options()
         ("config", po::value<string>(), "Configuration file")
         ("help,h", "Print this help message and exit");
+  AddDictionarySnapshotOption(&clo);
   po::options_description dconfig_options, dcmdline_options;
   dconfig_options.add(opts);
   dcmdline_options.add(opts).add(clo);
@@ -91,6 +98,10 @@ bool InitCommandLine(int argc, char** argv, po::variables_map* conf) {
     cerr << dcmdline_options << endl;
     return false;
   }
+  if ((*conf)["threads"].as<unsigned>() == 0) {
+    cerr << "--threads must be at least 1\n";
+    return false;
+  }
   return true;
 }
 
@@ -112,6 +123,16 @@ void ReadTrainingCorpus(const string& fname, int rank, int size, vector<string>*
 
 static const double kMINUS_EPSILON = -1e-6;
 
+static void AddExpectations(const Hypergraph& hg, SparseVector<prob_t>* acc) {
+  SparseVector<prob_t> exp;
+  const prob_t z = InsideOutside<prob_t,
+                                 EdgeProb,
+                                 SparseVector<prob_t>,
+                                 EdgeFeaturesAndProbWeightFunction>(hg, &exp);
+  exp /= z;
+  (*acc) += exp;
+}
+
 struct TrainingObserver : public DecoderObserver {
   void Reset() {
     acc_exp.clear();
@@ -127,12 +148,7 @@ struct TrainingObserver : public DecoderObserver {
   virtual void NotifyTranslationForest(const SentenceMetadata& smeta, Hypergraph* hg) {
     assert(state == 1);
     state = 2;
-    const prob_t z = InsideOutside<prob_t,
-                                   EdgeProb,
-                                   SparseVector<prob_t>,
-                                   EdgeFeaturesAndProbWeightFunction>(*hg, &cur_model_exp);
-    cur_model_exp /= z;
-    acc_exp += cur_model_exp;
+    AddExpectations(*hg, &acc_exp);
   }
 
   virtual void NotifyAlignmentForest(const SentenceMetadata& smeta, Hypergraph* hg) {
@@ -157,6 +173,24 @@ struct TrainingObserver : public DecoderObserver {
   int state;
 };
 
+// decodes every num_threads-th sentence, starting with the thread's index,
+// with the thread's own decoder and observer
+struct DecodeWorker {
+  DecodeWorker(const vector<string>& c, const vector<int>& i,
+               const vector<shared_ptr<Decoder> >& d, vector<TrainingObserver>* obs) :
+    corpus(c), ids(i), decoders(d), observers(obs) {}
+  void operator()(unsigned t) const {
+    for (int i = t; i < corpus.size(); i += decoders.size()) {
+      decoders[t]->SetId(ids[i]);
+      decoders[t]->Decode(corpus[i], &(*observers)[t]);
+    }
+  }
+  const vector<string>& corpus;
+  const vector<int>& ids;
+  const vector<shared_ptr<Decoder> >& decoders;
+  vector<TrainingObserver>* observers;
+};
+
 #ifdef HAVE_MPI
 namespace boost { namespace mpi {
   template<>
@@ -181,6 +215,7 @@ int main(int argc, char** argv) {
   po::variables_map conf;
   if (!InitCommandLine(argc, argv, &conf))
     return 1;
+  LoadDictionarySnapshots(conf);
 
   // load initial weights
   Weights weights;
@@ -194,30 +229,46 @@ int main(int argc, char** argv) {
 
   vector<string> cdec_ini;
   ReadConfig(conf["decoder_config"].as<string>(), &cdec_ini);
-  istringstream ini;
-  StoreConfig(cdec_ini, &ini);
-  Decoder decoder(&ini);
-  if (decoder.GetConf()["input"].as<string>() != "-") {
+  // one decoder per thread; decoders read from the same configuration
+  // share their grammars and LMs
+  const unsigned num_threads = conf["threads"].as<unsigned>();
+  if (num_threads > 1) Dict::EnableLocking();
+  vector<shared_ptr<Decoder> > decoders(num_threads);
+  for (unsigned t = 0; t < num_threads; ++t) {
+    istringstream ini;
+    StoreConfig(cdec_ini, &ini);
+    decoders[t].reset(new Decoder(&ini));
+  }
+  if (decoders[0]->GetConf()["input"].as<string>() != "-") {
     cerr << "cdec.ini must not set an input file\n";
     return 1;
   }
 
   SparseVector<double> x;
   weights.InitSparseVector(&x);
-  TrainingObserver observer;
-
   weights.InitFromVector(x);
   vector<double> lambdas;
   weights.InitVector(&lambdas);
-  decoder.SetWeights(lambdas);
-  observer.Reset();
-  for (unsigned i = 0; i < corpus.size(); ++i) {
-    int id = ids[i];
-    decoder.SetId(id);
-    decoder.Decode(corpus[i], &observer);
+  vector<TrainingObserver> observers(num_threads);
+  for (unsigned t = 0; t < num_threads; ++t) {
+    decoders[t]->SetWeights(lambdas);
+    observers[t].Reset();
   }
+  RunThreads(num_threads, DecodeWorker(corpus, ids, decoders, &observers));
+  for (unsigned t = 1; t < num_threads; ++t)
+    observers[0].acc_exp += observers[t].acc_exp;
+  const TrainingObserver& observer = observers[0];
   SparseVector<double> local_exps, exps;
   observer.GetExpectations(&local_exps);
+  if (conf.count("output")) {
+    string file = conf["output"].as<string>();
+    if (size > 1) {
+      ostringstream os; os << file << '.' << rank;
+      file = os.str();
+    }
+    MappedSparseVector::Write(0.0, local_exps, file);
+    return 0;
+  }
 #ifdef HAVE_MPI
   reduce(world, local_exps, exps, std::plus<SparseVector<double> >(), 0);
 #else
@@ -10,6 +10,11 @@
 #include <string>
 #include <iostream>
 #include <sstream>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 
 namespace scitbx {
 
@@ -861,6 +866,207 @@ namespace lbfgs {
         n, dx, SizeType(0), SizeType(1), dy, SizeType(0), SizeType(1));
     }
 
+    /* The kernels of the two-loop recursion work on a range [b, e) of
+       the vectors, so that long vectors can be split between threads,
+       and return up to two partial sums.  They keep four independent
+       sums, which lets the compiler vectorize the loops.
+       HistoryType is the type of the stored correction pairs.
+     */
+
+    /* y += a * x (if Axpy), then sums[0] = z . y (if Dot).  Fusing the
+       update of the work vector with the next dot product saves one pass
+       over it per correction pair.
+     */
+    template <typename FloatType, typename HistoryType, typename SizeType,
+              bool Axpy, bool Dot>
+    struct axpy_dot_kernel
+    {
+      FloatType a;
+      const HistoryType* x;
+      FloatType* y;
+      const HistoryType* z;
+
+      void operator()(SizeType b, SizeType e, FloatType* sums) const
+      {
+        FloatType s[4] = { 0, 0, 0, 0 };
+        SizeType i = b;
+        for (; i + 4 <= e; i += 4) {
+          for (int j = 0; j < 4; j++) {
+            if (Axpy) y[i+j] += a * x[i+j];
+            if (Dot) s[j] += z[i+j] * y[i+j];
+          }
+        }
+        for (; i < e; i++) {
+          if (Axpy) y[i] += a * x[i];
+          if (Dot) s[0] += z[i] * y[i];
+        }
+        sums[0] = (s[0] + s[1]) + (s[2] + s[3]);
+        sums[1] = 0;
+      }
+    };
+
+    /* Stores the correction pair of the last step, s = stp * d and
+       y = g - g_old, and returns s . y and y . y as they were stored.
+     */
+    template <typename FloatType, typename HistoryType, typename SizeType>
+    struct correction_kernel
+    {
+      FloatType stp;
+      const FloatType* d;
+      const FloatType* g;
+      const FloatType* g_old;
+      HistoryType* s;
+      HistoryType* y;
+
+      void operator()(SizeType b, SizeType e, FloatType* sums) const
+      {
+        FloatType ys = 0, yy = 0;
+        for (SizeType i = b; i < e; i++) {
+          s[i] = HistoryType(stp * d[i]);
+          y[i] = HistoryType(g[i] - g_old[i]);
+          ys += FloatType(s[i]) * FloatType(y[i]);
+          yy += FloatType(y[i]) * FloatType(y[i]);
+        }
+        sums[0] = ys;
+        sums[1] = yy;
+      }
+    };
+
+    /* A fixed set of threads that run the ranges of a kernel.  The
+       threads are started once and then wait for work, so that the
+       several kernels run in every iteration do not each pay for
+       starting and joining threads.  run() executes task(0) on the
+       calling thread and task(1), ..., task(k - 1) on the others.
+     */
+    class kernel_threads
+    {
+      public:
+        explicit kernel_threads(unsigned size)
+        : size_(size), task_(0), active_(0), pending_(0), generation_(0),
+          stop_(false)
+        {
+          for (unsigned t = 1; t < size_; t++) {
+            threads_.create_thread(worker(this, t));
+          }
+        }
+
+        ~kernel_threads()
+        {
+          {
+            boost::mutex::scoped_lock lock(mutex_);
+            stop_ = true;
+            start_.notify_all();
+          }
+          threads_.join_all();
+        }
+
+        unsigned size() const { return size_; }
+
+        void run(unsigned k, const boost::function<void(unsigned)>& task)
+        {
+          boost::mutex::scoped_lock run_lock(run_mutex_);
+          {
+            boost::mutex::scoped_lock lock(mutex_);
+            task_ = &task;
+            active_ = k;
+            pending_ = k - 1;
+            generation_++;
+            start_.notify_all();
+          }
+          task(0);
+          boost::mutex::scoped_lock lock(mutex_);
+          while (pending_) done_.wait(lock);
+        }
+
+      private:
+        struct worker
+        {
+          worker(kernel_threads* p, unsigned t) : pool(p), thread_id(t) {}
+          void operator()() { pool->work(thread_id); }
+          kernel_threads* pool;
+          unsigned thread_id;
+        };
+
+        void work(unsigned t)
+        {
+          unsigned long seen = 0;
+          for (;;) {
+            const boost::function<void(unsigned)>* task;
+            {
+              boost::mutex::scoped_lock lock(mutex_);
+              while (generation_ == seen && !stop_) start_.wait(lock);
+              if (stop_) return;
+              seen = generation_;
+              if (t >= active_) continue;
+              task = task_;
+            }
+            (*task)(t);
+            boost::mutex::scoped_lock lock(mutex_);
+            if (--pending_ == 0) done_.notify_one();
+          }
+        }
+
+        const unsigned size_;
+        const boost::function<void(unsigned)>* task_;
+        unsigned active_;
+        unsigned pending_;
+        unsigned long generation_;
+        bool stop_;
+        boost::mutex run_mutex_;  // one run() at a time
+        boost::mutex mutex_;
+        boost::condition_variable start_;
+        boost::condition_variable done_;
+        boost::thread_group threads_;
+    };
+
+    // runs range t of k equal ranges of [0, n)
+    template <typename FloatType, typename SizeType, typename Kernel>
+    struct kernel_range
+    {
+      kernel_range(const Kernel& kernel_, SizeType n_, unsigned k_,
+                   FloatType* partial_)
+        : kernel(kernel_), n(n_), k(k_), partial(partial_) {}
+      void operator()(unsigned t) const
+      {
+        kernel(n * t / k, n * (t + 1) / k, partial + 2 * t);
+      }
+      const Kernel& kernel;
+      const SizeType n;
+      const unsigned k;
+      FloatType* partial;
+    };
+
+    /* Runs kernel on [0, n), split into equal ranges for up to
+       threads->size() threads (all on this thread if threads is
+       NULL).  Ranges are never shorter than 64k elements, below which
+       handing them to another thread costs more than it saves.  The
+       partial sums are added in a fixed order, so the results only
+       depend on the number of threads.
+     */
+    template <typename FloatType, typename SizeType, typename Kernel>
+    void run_kernel(
+      SizeType n,
+      kernel_threads* threads,
+      const Kernel& kernel,
+      FloatType* sums)
+    {
+      const SizeType min_range = 1 << 16;
+      unsigned k = threads ? threads->size() : 1;
+      if (k > n / min_range) k = n / min_range;
+      if (k <= 1) {
+        kernel(SizeType(0), n, sums);
+        return;
+      }
+      std::vector<FloatType> partial(2 * k);
+      threads->run(k, kernel_range<FloatType, SizeType, Kernel>(
+        kernel, n, k, &partial[0]));
+      sums[0] = sums[1] = FloatType(0);
+      for (unsigned t = 0; t < k; t++) {
+        sums[0] += partial[2 * t];
+        sums[1] += partial[2 * t + 1];
+      }
+    }
+
   } // namespace detail
 
   //! Interface to the LBFGS %minimizer.
@@ -924,7 +1130,7 @@ namespace lbfgs {
       : n_(0), m_(0), maxfev_(0),
         gtol_(0), xtol_(0),
         stpmin_(0), stpmax_(0),
-        ispt(0), iypt(0)
+        float_history_(false), threads_(1)
       {}
 
       //! Constructor.
@@ -970,6 +1176,15 @@ namespace lbfgs {
             unless the exponent is too large for the machine being used,
             or unless the problem is extremely badly scaled (in which
             case the exponent should be increased).
+
+          @param float_history If true, the <code>m</code> correction
+            pairs are stored in single precision, which halves the
+            memory they take and the time spent reading them. The
+            search direction and all sums are still computed in
+            <code>FloatType</code>.
+
+          @param threads Number of threads used for the vector
+            operations of the update when <code>n</code> is large.
        */
       explicit
       minimizer(
@@ -979,14 +1194,16 @@ namespace lbfgs {
         FloatType gtol = FloatType(0.9),
         FloatType xtol = FloatType(1.e-16),
         FloatType stpmin = FloatType(1.e-20),
-        FloatType stpmax = FloatType(1.e20))
+        FloatType stpmax = FloatType(1.e20),
+        bool float_history = false,
+        unsigned threads = 1)
         : n_(n), m_(m), maxfev_(maxfev),
           gtol_(gtol), xtol_(xtol),
           stpmin_(stpmin), stpmax_(stpmax),
+          float_history_(float_history), threads_(threads),
           iflag_(0), requests_f_and_g_(false), requests_diag_(false),
           iter_(0), nfun_(0), stp_(0),
-          stp1(0), ftol(0.0001), ys(0), point(0), npt(0),
-          ispt(n+2*m), iypt((n+2*m)+n*m),
+          stp1(0), ftol(0.0001), ys(0), yy(0), point(0),
           info(0), bound(0), nfev(0)
       {
         if (n_ == 0) {
@@ -1010,7 +1227,16 @@ namespace lbfgs {
         if (stpmax_ < stpmin) {
           throw error_improper_input_parameter("stpmax < stpmin");
         }
-        w_.resize(n_*(2*m_+1)+2*m_);
+        if (threads_ == 0) {
+          throw error_improper_input_parameter("threads = 0.");
+        }
+        if (threads_ > 1) {
+          kernel_threads_.reset(new detail::kernel_threads(threads_));
+        }
+        w_.resize(n_+2*m_);
+        d_.resize(n_);
+        if (float_history_) float_history_array_.resize(2*m_*n_);
+        else history_array_.resize(2*m_*n_);
         scratch_array_.resize(n_);
       }
 
@@ -1020,6 +1246,12 @@ namespace lbfgs {
       //! Number of corrections kept (as passed to the constructor).
       SizeType m() const { return m_; }
 
+      //! Whether corrections are kept in single precision.
+      bool float_history() const { return float_history_; }
+
+      //! Number of threads used by the update (as passed to the constructor).
+      unsigned threads() const { return threads_; }
+
       /*! \brief Maximum number of evaluations of the objective function
           per line search (as passed to the constructor).
        */
@@ -1153,11 +1385,27 @@ namespace lbfgs {
         return generic_run(x, f, g, true, diag);
       }
 
+      //! Marks the start of a state written by serialize().
+      /*! The states of the first version had no header and started with
+          n instead.
+       */
+      static const unsigned state_magic = 0x5342464cu;  // "LFBS"
+      //! Version of the state layout; deserialize() rejects other versions.
+      /*! Version 2 added the float history flag, yy and the diagonal
+          d, and replaced npt and the single work array by separate
+          history and scratch arrays.
+       */
+      static const unsigned state_version = 2;
+
       void serialize(std::ostream* out) const {
+        const unsigned magic = state_magic, version = state_version;
+        out->write((const char*)&magic, sizeof(magic));
+        out->write((const char*)&version, sizeof(version));
         out->write((const char*)&n_, sizeof(n_)); // sanity check
         out->write((const char*)&m_, sizeof(m_)); // sanity check
         SizeType fs = sizeof(FloatType);
         out->write((const char*)&fs, sizeof(fs)); // sanity check
+        out->write((const char*)&float_history_, sizeof(float_history_)); // sanity check
 
         mcsrch_instance.serialize(out);
         out->write((const char*)&iflag_, sizeof(iflag_));
@@ -1169,23 +1417,59 @@ namespace lbfgs {
         out->write((const char*)&stp1, sizeof(stp1));
         out->write((const char*)&ftol, sizeof(ftol));
         out->write((const char*)&ys, sizeof(ys));
+        out->write((const char*)&yy, sizeof(yy));
         out->write((const char*)&point, sizeof(point));
-        out->write((const char*)&npt, sizeof(npt));
         out->write((const char*)&info, sizeof(info));
         out->write((const char*)&bound, sizeof(bound));
         out->write((const char*)&nfev, sizeof(nfev));
         out->write((const char*)&w_[0], sizeof(FloatType) * w_.size());
+        out->write((const char*)&d_[0], sizeof(FloatType) * d_.size());
+        if (float_history_)
+          out->write((const char*)&float_history_array_[0], sizeof(float) * float_history_array_.size());
+        else
+          out->write((const char*)&history_array_[0], sizeof(FloatType) * history_array_.size());
         out->write((const char*)&scratch_array_[0], sizeof(FloatType) * scratch_array_.size());
       }
 
       void deserialize(std::istream* in) {
+        unsigned magic = 0, version = 0;
+        in->read((char*)&magic, sizeof(magic));
+        in->read((char*)&version, sizeof(version));
+        if (!*in || magic != state_magic)
+          throw error_improper_input_data(
+            "optimizer state was written by an older version of the"
+            " optimizer, which stored it in another layout; remove the"
+            " state file to restart the optimization.");
+        if (version != state_version)
+          throw error_improper_input_data(
+            "optimizer state has version " + error::itoa(version)
+            + ", expected " + error::itoa(state_version) + ".");
         SizeType n, m, fs;
+        bool fh;
         in->read((char*)&n, sizeof(n));
         in->read((char*)&m, sizeof(m));
         in->read((char*)&fs, sizeof(fs));
-        assert(n == n_);
-        assert(m == m_);
-        assert(fs == sizeof(FloatType));
+        in->read((char*)&fh, sizeof(fh));
+        if (!*in)
+          throw error_improper_input_data("optimizer state is truncated.");
+        if (n != n_)
+          throw error_improper_input_data(
+            "optimizer state has n = " + error::itoa(n)
+            + ", expected " + error::itoa(n_) + ".");
+        if (m != m_)
+          throw error_improper_input_data(
+            "optimizer state has m = " + error::itoa(m)
+            + ", expected " + error::itoa(m_) + ".");
+        if (fs != sizeof(FloatType))
+          throw error_improper_input_data(
+            "optimizer state was written with "
+            + error::itoa(fs) + "-byte floating point numbers, expected "
+            + error::itoa(sizeof(FloatType)) + ".");
+        if (fh != float_history_)
+          throw error_improper_input_data(
+            std::string("optimizer state was written ")
+            + (fh ? "with" : "without")
+            + " single precision history; rerun with the same setting.");
 
         mcsrch_instance.deserialize(in);
         in->read((char*)&iflag_, sizeof(iflag_));
@@ -1197,13 +1481,20 @@ namespace lbfgs {
         in->read((char*)&stp1, sizeof(stp1));
         in->read((char*)&ftol, sizeof(ftol));
         in->read((char*)&ys, sizeof(ys));
+        in->read((char*)&yy, sizeof(yy));
         in->read((char*)&point, sizeof(point));
-        in->read((char*)&npt, sizeof(npt));
         in->read((char*)&info, sizeof(info));
         in->read((char*)&bound, sizeof(bound));
         in->read((char*)&nfev, sizeof(nfev));
         in->read((char*)&w_[0], sizeof(FloatType) * w_.size());
+        in->read((char*)&d_[0], sizeof(FloatType) * d_.size());
+        if (float_history_)
+          in->read((char*)&float_history_array_[0], sizeof(float) * float_history_array_.size());
+        else
+          in->read((char*)&history_array_[0], sizeof(FloatType) * history_array_.size());
         in->read((char*)&scratch_array_[0], sizeof(FloatType) * scratch_array_.size());
+        if (!*in)
+          throw error_improper_input_data("optimizer state is truncated.");
       }
 
     protected:
@@ -1220,6 +1511,52 @@ namespace lbfgs {
         bool diagco,
         const FloatType* diag);
 
+      /* Computes the search direction -H g from the correction pairs
+         in history (s pairs first, then y pairs) by the two-loop
+         recursion, with g negated in the first n elements of w_ on
+         entry and the direction there on return.
+       */
+      template <typename HistoryType>
+      void two_loop(const HistoryType* history, const FloatType* diag);
+
+      // stores the correction pair of the last step in slot point
+      template <typename HistoryType>
+      void save_correction(HistoryType* history, const FloatType* g);
+
+      // y += a * x, then returns z . y
+      template <typename HistoryType>
+      FloatType axpy_dot(
+        FloatType a, const HistoryType* x, FloatType* y,
+        const HistoryType* z) const
+      {
+        detail::axpy_dot_kernel<FloatType, HistoryType, SizeType, true, true>
+          k = { a, x, y, z };
+        FloatType sums[2];
+        detail::run_kernel(n_, kernel_threads_.get(), k, sums);
+        return sums[0];
+      }
+
+      // y += a * x
+      template <typename HistoryType>
+      void axpy(FloatType a, const HistoryType* x, FloatType* y) const
+      {
+        detail::axpy_dot_kernel<FloatType, HistoryType, SizeType, true, false>
+          k = { a, x, y, 0 };
+        FloatType sums[2];
+        detail::run_kernel(n_, kernel_threads_.get(), k, sums);
+      }
+
+      // returns z . y
+      template <typename HistoryType>
+      FloatType dot(const HistoryType* z, const FloatType* y) const
+      {
+        detail::axpy_dot_kernel<FloatType, HistoryType, SizeType, false, true>
+          k = { 0, 0, const_cast<FloatType*>(y), z };
+        FloatType sums[2];
+        detail::run_kernel(n_, kernel_threads_.get(), k, sums);
+        return sums[0];
+      }
+
       detail::mcsrch<FloatType, SizeType> mcsrch_instance;
       const SizeType n_;
       const SizeType m_;
@@ -1228,6 +1565,8 @@ namespace lbfgs {
       const FloatType xtol_;
       const FloatType stpmin_;
       const FloatType stpmax_;
+      const bool float_history_;
+      const unsigned threads_;
       int iflag_;
       bool requests_f_and_g_;
       bool requests_diag_;
@@ -1237,15 +1576,18 @@ namespace lbfgs {
       FloatType stp1;
       FloatType ftol;
       FloatType ys;
+      FloatType yy;
       SizeType point;
-      SizeType npt;
-      const SizeType ispt;
-      const SizeType iypt;
       int info;
       SizeType bound;
       SizeType nfev;
-      std::vector<FloatType> w_;
+      std::vector<FloatType> w_;  // work vector, rho, alpha
+      std::vector<FloatType> d_;  // search direction
+      std::vector<FloatType> history_array_;
+      std::vector<float> float_history_array_;  // if float_history_
       std::vector<FloatType> scratch_array_;
+      // started by the constructor if threads_ > 1, shared by copies
+      boost::shared_ptr<detail::kernel_threads> kernel_threads_;
   };
 
   template <typename FloatType, typename SizeType>
@@ -1277,7 +1619,7 @@ namespace lbfgs {
         diag = &(*(scratch_array_.begin()));
       }
       for (SizeType i = 0; i < n_; i++) {
-        w[ispt + i] = -g[i] * diag[i];
+        d_[i] = -g[i] * diag[i];
       }
       FloatType gnorm = std::sqrt(detail::ddot(n_, g, g));
       if (gnorm == FloatType(0)) return false;
@@ -1290,11 +1632,7 @@ namespace lbfgs {
       info = 0;
       if (iter_ != 1) {
         if (iter_ > m_) bound = m_;
-        ys = detail::ddot(
-          n_, w, iypt + npt, SizeType(1), w, ispt + npt, SizeType(1));
         if (!diagco) {
-          FloatType yy = detail::ddot(
-            n_, w, iypt + npt, SizeType(1), w, iypt + npt, SizeType(1));
           std::fill_n(scratch_array_.begin(), n_, ys / yy);
           diag = &(*(scratch_array_.begin()));
         }
@@ -1320,43 +1658,19 @@ namespace lbfgs {
         SizeType cp = point;
         if (point == 0) cp = m_;
         w[n_ + cp -1] = 1 / ys;
-        SizeType i;
-        for (i = 0; i < n_; i++) {
+        for (SizeType i = 0; i < n_; i++) {
           w[i] = -g[i];
         }
-        cp = point;
-        for (i = 0; i < bound; i++) {
-          if (cp == 0) cp = m_;
-          cp--;
-          FloatType sq = detail::ddot(
-            n_, w, ispt + cp * n_, SizeType(1), w, SizeType(0), SizeType(1));
-          SizeType inmc=n_+m_+cp;
-          SizeType iycn=iypt+cp*n_;
-          w[inmc] = w[n_ + cp] * sq;
-          detail::daxpy(n_, -w[inmc], w, iycn, w);
-        }
-        for (i = 0; i < n_; i++) {
-          w[i] *= diag[i];
-        }
-        for (i = 0; i < bound; i++) {
-          FloatType yr = detail::ddot(
-            n_, w, iypt + cp * n_, SizeType(1), w, SizeType(0), SizeType(1));
-          FloatType beta = w[n_ + cp] * yr;
-          SizeType inmc=n_+m_+cp;
-          beta = w[inmc] - beta;
-          SizeType iscn=ispt+cp*n_;
-          detail::daxpy(n_, beta, w, iscn, w);
-          cp++;
-          if (cp == m_) cp = 0;
-        }
-        std::copy(w, w+n_, w+(ispt + point * n_));
+        if (float_history_) two_loop(&float_history_array_[0], diag);
+        else two_loop(&history_array_[0], diag);
+        std::copy(w, w+n_, d_.begin());
       }
       stp_ = FloatType(1);
       if (iter_ == 1) stp_ = stp1;
       std::copy(g, g+n_, w);
     }
     mcsrch_instance.run(
-      gtol_, stpmin_, stpmax_, n_, x, f, g, w, ispt + point * n_,
+      gtol_, stpmin_, stpmax_, n_, x, f, g, &d_[0], SizeType(0),
       stp_, ftol, xtol_, maxfev_, info, nfev, &(*(scratch_array_.begin())));
     if (info == -1) {
       iflag_ = 1;
@@ -1367,16 +1681,70 @@ namespace lbfgs {
       throw error_internal_error(__FILE__, __LINE__);
     }
     nfun_ += nfev;
-    npt = point*n_;
-    for (SizeType i = 0; i < n_; i++) {
-      w[ispt + npt + i] = stp_ * w[ispt + npt + i];
-      w[iypt + npt + i] = g[i] - w[i];
-    }
+    if (float_history_) save_correction(&float_history_array_[0], g);
+    else save_correction(&history_array_[0], g);
     point++;
     if (point == m_) point = 0;
     return false;
   }
 
+  template <typename FloatType, typename SizeType>
+  template <typename HistoryType>
+  void minimizer<FloatType, SizeType>::two_loop(
+    const HistoryType* history,
+    const FloatType* diag)
+  {
+    FloatType* w = &(*(w_.begin()));
+    const HistoryType* s = history;
+    const HistoryType* y = history + m_ * n_;
+    SizeType cp = point;
+    if (cp == 0) cp = m_;
+    cp--;
+    FloatType sq = dot(s + cp * n_, w);
+    for (SizeType i = 0; i < bound; i++) {
+      SizeType inmc=n_+m_+cp;
+      w[inmc] = w[n_ + cp] * sq;
+      if (i + 1 == bound) {
+        axpy(-w[inmc], y + cp * n_, w);
+        break;
+      }
+      SizeType next = cp == 0 ? m_ - 1 : cp - 1;
+      sq = axpy_dot(-w[inmc], y + cp * n_, w, s + next * n_);
+      cp = next;
+    }
+    for (SizeType i = 0; i < n_; i++) {
+      w[i] *= diag[i];
+    }
+    FloatType yr = dot(y + cp * n_, w);
+    for (SizeType i = 0; i < bound; i++) {
+      FloatType beta = w[n_ + cp] * yr;
+      SizeType inmc=n_+m_+cp;
+      beta = w[inmc] - beta;
+      if (i + 1 == bound) {
+        axpy(beta, s + cp * n_, w);
+        break;
+      }
+      SizeType next = cp + 1 == m_ ? 0 : cp + 1;
+      yr = axpy_dot(beta, s + cp * n_, w, y + next * n_);
+      cp = next;
+    }
+  }
+
+  template <typename FloatType, typename SizeType>
+  template <typename HistoryType>
+  void minimizer<FloatType, SizeType>::save_correction(
+    HistoryType* history,
+    const FloatType* g)
+  {
+    detail::correction_kernel<FloatType, HistoryType, SizeType> k = {
+      stp_, &d_[0], g, &w_[0],
+      history + point * n_, history + (m_ + point) * n_ };
+    FloatType sums[2];
+    detail::run_kernel(n_, kernel_threads_.get(), k, sums);
+    ys = sums[0];
+    yy = sums[1];
+  }
+
   //! Traditional LBFGS convergence test.
   /*! This convergence test is equivalent to the test embedded
       in the <code>lbfgs.f</code> Fortran code. The test assumes that
@@ -1,6 +1,9 @@
 #include <cassert>
+#include <cstdlib>
 #include <iostream>
 #include <sstream>
+#include <vector>
+#include <sys/time.h>
 #include "lbfgs.h"
 #include "sparse_vector.h"
 #include "fdict.h"
@@ -72,6 +75,99 @@ double TestPersistentOptimizer() {
   return obj;
 }
 
+// states without the version header (written before it was added),
+// states of another version, truncated states and states written with
+// other settings must be rejected rather than misread
+bool TestStateVersion() {
+  cerr << "\nTESTING OPTIMIZER STATE VERSION\n";
+  double x[3] = { 8, 8, 8 };
+  double g[3] = { 72, 24, 22 };
+  scitbx::lbfgs::minimizer<double> opt(3);
+  opt.run(x, 389, g);
+  ostringstream os(ios::binary); opt.serialize(&os);
+  const string state = os.str();
+  string old_state = state.substr(2 * sizeof(unsigned));
+  string other_version = state;
+  other_version[sizeof(unsigned)] ^= 1;
+  const string truncated = state.substr(0, state.size() - 1);
+  const string bad[] = { old_state, other_version, truncated, state, state };
+  for (int i = 0; i < 5; ++i) {
+    // the last two are read with another float history setting and m
+    const bool fh = (i == 3);
+    scitbx::lbfgs::minimizer<double> opt2(3, i == 4 ? 4 : 5, 20, 0.9, 1e-16, 1e-20, 1e20, fh);
+    istringstream is(bad[i], ios::binary);
+    try {
+      opt2.deserialize(&is);
+      return false;
+    } catch (const scitbx::lbfgs::error& e) {
+      cerr << "  " << e.what() << endl;
+    }
+  }
+  scitbx::lbfgs::minimizer<double> opt2(3);
+  istringstream is(state, ios::binary);
+  opt2.deserialize(&is);
+  return opt2.iter() == opt.iter();
+}
+
+// f(x) = sum_i c_i (x_i - t_i)^2, badly scaled so that L-BFGS needs its
+// correction pairs; returns the objective and sets the gradient
+double Quadratic(const vector<double>& x, vector<double>* g) {
+  double obj = 0;
+  for (int i = 0; i < x.size(); ++i) {
+    const double c = 1 + (i % 7) * (i % 7);
+    const double d = x[i] - (i % 13) / 13.0;
+    obj += c * d * d;
+    (*g)[i] = 2 * c * d;
+  }
+  return obj;
+}
+
+// large enough for the vector operations to be split between threads
+double TestLargeOptimizer(bool float_history, unsigned threads) {
+  cerr << "\nTESTING OPTIMIZER WITH float_history=" << float_history << " threads=" << threads << endl;
+  const int n = 300000;
+  vector<double> x(n, 8.0), g(n);
+  scitbx::lbfgs::minimizer<double> opt(n, 5, 20, 0.9, 1e-16, 1e-20, 1e20, float_history, threads);
+  scitbx::lbfgs::traditional_convergence_test<double> converged(n);
+  double obj = 0;
+  do {
+    obj = Quadratic(x, &g);
+    opt.run(&x[0], obj, &g[0]);
+  } while (!converged(&x[0], &g[0]));
+  cerr << "   obj=" << obj << "\t" << opt << endl;
+  return obj;
+}
+
+static double Now() {
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// lbfgs_test benchmark [n] [m] [max_threads]: times the updates of the
+// minimizer (not the function evaluations) on a quadratic with n variables
+void Benchmark(int n, int m, unsigned max_threads) {
+  const int kITERATIONS = 20;
+  for (int fh = 0; fh < 2; ++fh) {
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+      vector<double> x(n, 8.0), g(n);
+      scitbx::lbfgs::minimizer<double> opt(n, m, 20, 0.9, 1e-16, 1e-20, 1e20, fh, threads);
+      double t = 0;
+      int updates = 0;
+      while (opt.iter() < kITERATIONS) {
+        const double obj = Quadratic(x, &g);
+        const double start = Now();
+        opt.run(&x[0], obj, &g[0]);
+        t += Now() - start;
+        ++updates;
+      }
+      cerr << "n=" << n << " m=" << m << " history=" << (fh ? "float" : "double")
+           << " threads=" << threads << ": " << (1000 * t / updates) << " ms/update ("
+           << updates << " updates)\n";
+    }
+  }
+}
+
 void TestSparseVector() {
   cerr << "Testing SparseVector<double> serialization.\n";
   int f1 = FD::Convert("Feature_1");
@@ -98,13 +194,29 @@ void TestSparseVector() {
   assert(g.size() == v.size());
 }
 
-int main() {
+int main(int argc, char** argv) {
+  if (argc > 1 && string(argv[1]) == "benchmark") {
+    Benchmark(argc > 2 ? atoi(argv[2]) : 10000000,
+              argc > 3 ? atoi(argv[3]) : 10,
+              argc > 4 ? atoi(argv[4]) : 4);
+    return 0;
+  }
   double o1 = TestOptimizer();
   double o2 = TestPersistentOptimizer();
   if (o1 != o2) {
     cerr << "OPTIMIZERS PERFORMED DIFFERENTLY!\n" << o1 << " vs. " << o2 << endl;
     return 1;
   }
+  if (!TestStateVersion()) {
+    cerr << "OPTIMIZER STATE VERSION NOT CHECKED!\n";
+    return 1;
+  }
+  if (TestLargeOptimizer(false, 1) > 1e-6 ||
+      TestLargeOptimizer(false, 4) > 1e-6 ||
+      TestLargeOptimizer(true, 4) > 1e-6) {
+    cerr << "LARGE OPTIMIZER DID NOT CONVERGE!\n";
+    return 1;
+  }
   TestSparseVector();
   cerr << "SUCCESS\n";
   return 0;
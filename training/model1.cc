@@ -1,5 +1,6 @@
 #include <iostream>
 #include <cmath>
+#include <algorithm>
 
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
@@ -8,8 +9,11 @@
 #include "stringlib.h"
 #include "filelib.h"
 #include "ttables.h"
+#include "mapped_ttable.h"
 #include "tdict.h"
+#include "dict.h"
 #include "em_utils.h"
+#include "parallel_for.h"
 
 namespace po = boost::program_options;
 using namespace std;
@@ -22,7 +26,10 @@ bool InitCommandLine(int argc, char** argv, po::variables_map* conf) {
         ("no_null_word,N","Do not generate from the null token")
         ("variational_bayes,v","Add a symmetric Dirichlet prior and infer VB estimate of weights")
         ("alpha,a", po::value<double>()->default_value(0.01), "Hyperparameter for optional Dirichlet prior")
-        ("no_add_viterbi,V","Do not add Viterbi alignment points (may generate a grammar where some training sentence pairs are unreachable)");
+        ("no_add_viterbi,V","Do not add Viterbi alignment points (may generate a grammar where some training sentence pairs are unreachable)")
+        ("compact,c","Keep the corpus in memory and store the translation table as a sparse matrix over the co-occurring word pairs (much faster on large corpora)")
+        ("threads,j",po::value<unsigned>()->default_value(1u),"Number of threads used for training with --compact")
+        ("binary_ttable,b",po::value<string>(),"Also write the translation table to this file in the binary format that is read with mmap (see utils/mapped_ttable.h)");
   po::options_description clo("Command line options");
   clo.add_options()
         ("config", po::value<string>(), "Configuration file")
@@ -46,6 +53,272 @@ bool InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   return true;
 }
 
+// Model 1 with the corpus held in memory and the translation table stored
+// as a compressed sparse row (CSR) matrix: the target words that co-occur
+// with source word e are cols_[row_[e]] ... cols_[row_[e+1]-1], sorted, and
+// their probabilities are kept in a flat array at the same positions.  The
+// E-step runs in parallel over contiguous shards of the corpus, each thread
+// collecting expected counts in its own array, and the M-step sums these
+// arrays and normalizes with each thread owning a range of rows, so no
+// locking is needed.
+class CompactModel1 {
+ public:
+  CompactModel1(bool use_null, WordID null, bool add_viterbi, unsigned threads) :
+      use_null_(use_null), kNULL_(null), add_viterbi_(add_viterbi), shards_(threads) {}
+
+  void ReadCorpus(const string& fname) {
+    ReadFile rf(fname);
+    istream& in = *rf.stream();
+    string line, ssrc, strg;
+    vector<WordID> src, trg;
+    int lc = 0;
+    start_.push_back(0);
+    while(getline(in, line)) {
+      ++lc;
+      if (lc % 50000 == 0) { cerr << '.'; }
+      if (lc % 2500000 == 0) { cerr << " [" << lc << "]\n" << flush; }
+      ParseTranslatorInput(line, &ssrc, &strg);
+      TD::ConvertSentence(ssrc, &src);
+      TD::ConvertSentence(strg, &trg);
+      if (src.size() == 0 || trg.size() == 0) {
+        cerr << "Error: " << lc << "\n" << line << endl;
+        assert(src.size() > 0);
+        assert(trg.size() > 0);
+      }
+      if (use_null_) words_.push_back(kNULL_);
+      words_.insert(words_.end(), src.begin(), src.end());
+      src_len_.push_back(src.size() + use_null_);
+      words_.insert(words_.end(), trg.begin(), trg.end());
+      start_.push_back(words_.size());
+    }
+    if (lc >= 50000) cerr << endl;
+    BuildIndex();
+    // an empty table gives every pair the same probability
+    prob_.resize(cols_.size(), 1e-9);
+    for (int t = 0; t < shards_.size(); ++t) {
+      shards_[t].begin = src_len_.size() * t / shards_.size();
+      shards_[t].end = src_len_.size() * (t + 1) / shards_.size();
+    }
+    cerr << "Corpus has " << src_len_.size() << " sentence pairs and "
+         << cols_.size() << " co-occurring word pairs\n";
+  }
+
+  // runs the E-step over the whole corpus; in the final iteration no counts
+  // are collected and only the Viterbi alignment links are recorded
+  void EStep(bool final_iteration, double* likelihood, double* denom) {
+    RunThreads(shards_.size(), EStepWorker(this, final_iteration));
+    *likelihood = 0;
+    *denom = 0;
+    for (int t = 0; t < shards_.size(); ++t) {
+      *likelihood += shards_[t].likelihood;
+      *denom += shards_[t].denom;
+    }
+  }
+
+  void Normalize(bool variational_bayes, double alpha) {
+    RunThreads(shards_.size(), MStepWorker(this, variational_bayes, alpha));
+  }
+
+  void WriteTTable(double beam_threshold, ostream* out, vector<MappedTTable::Entry>* binary) const {
+    for (WordID e = 0; e + 1 < row_.size(); ++e) {
+      if (row_[e] == row_[e + 1]) continue;
+      const string esym = TD::Convert(e);
+      double max_p = -1;
+      for (size_t c = row_[e]; c < row_[e + 1]; ++c)
+        if (prob_[c] > max_p) max_p = prob_[c];
+      const double threshold = max_p * beam_threshold;
+      for (size_t c = row_[e]; c < row_[e + 1]; ++c) {
+        if (prob_[c] > threshold || IsViterbi(c)) {
+          (*out) << esym << ' ' << TD::Convert(cols_[c]) << ' ' << log(prob_[c]) << endl;
+          if (binary) binary->push_back(MappedTTable::Entry(esym, TD::Convert(cols_[c]), log(prob_[c])));
+        }
+      }
+    }
+  }
+
+ private:
+  // the state of one thread
+  struct Shard {
+    Shard() : begin(), end(), likelihood(), denom() {}
+    size_t begin, end;          // sentence pairs of this shard
+    vector<double> counts;      // expected counts, parallel to cols_
+    vector<char> was_viterbi;   // parallel to cols_
+    double likelihood;
+    double denom;
+  };
+
+  struct EStepWorker {
+    EStepWorker(CompactModel1* m, bool f) : model(m), final_iteration(f) {}
+    void operator()(unsigned t) const { model->EStepShard(final_iteration, &model->shards_[t]); }
+    CompactModel1* model;
+    bool final_iteration;
+  };
+
+  struct MStepWorker {
+    MStepWorker(CompactModel1* m, bool vb, double a) : model(m), variational_bayes(vb), alpha(a) {}
+    void operator()(unsigned t) const { model->NormalizeRows(t, variational_bayes, alpha); }
+    CompactModel1* model;
+    bool variational_bayes;
+    double alpha;
+  };
+
+  static void SortUnique(vector<WordID>* v) {
+    sort(v->begin(), v->end());
+    v->erase(unique(v->begin(), v->end()), v->end());
+  }
+
+  // builds the CSR index one row at a time: the target words of all sentence
+  // pairs containing source word e are collected with a mark array, so each
+  // co-occurrence is looked at once and only the unique pairs are sorted
+  void BuildIndex() {
+    row_.assign(1, 0);
+    if (words_.empty()) return;
+    const WordID num_words = *max_element(words_.begin(), words_.end()) + 1;
+    // the sentence pairs each source word occurs in
+    vector<size_t> occ_start(num_words + 1);
+    vector<size_t> occ;
+    vector<size_t> last(num_words, src_len_.size());
+    for (size_t k = 0; k < src_len_.size(); ++k) {
+      for (size_t i = start_[k]; i < start_[k] + src_len_[k]; ++i)
+        if (last[words_[i]] != k) { last[words_[i]] = k; ++occ_start[words_[i] + 1]; }
+    }
+    for (WordID e = 0; e < num_words; ++e) {
+      occ_start[e + 1] += occ_start[e];
+      last[e] = src_len_.size();
+    }
+    occ.resize(occ_start.back());
+    vector<size_t> pos(occ_start.begin(), occ_start.end() - 1);
+    for (size_t k = 0; k < src_len_.size(); ++k) {
+      for (size_t i = start_[k]; i < start_[k] + src_len_[k]; ++i)
+        if (last[words_[i]] != k) { last[words_[i]] = k; occ[pos[words_[i]]++] = k; }
+    }
+
+    vector<WordID> mark(num_words, -1);
+    row_.resize(num_words + 1);
+    for (WordID e = 0; e < num_words; ++e) {
+      for (size_t o = occ_start[e]; o < occ_start[e + 1]; ++o) {
+        const size_t k = occ[o];
+        for (size_t j = start_[k] + src_len_[k]; j < start_[k + 1]; ++j) {
+          const WordID f = words_[j];
+          if (mark[f] != e) { mark[f] = e; cols_.push_back(f); }
+        }
+      }
+      sort(cols_.begin() + row_[e], cols_.end());
+      row_[e + 1] = cols_.size();
+    }
+  }
+
+  // first position in [b, e) that is not less than f, searching forward
+  // from b in exponentially growing steps
+  static const WordID* Gallop(const WordID* b, const WordID* e, WordID f) {
+    size_t step = 1;
+    while (b + step < e && b[step] < f) { b += step; step *= 2; }
+    return lower_bound(b, min(b + step + 1, e), f);
+  }
+
+  bool IsViterbi(size_t c) const {
+    for (int t = 0; t < shards_.size(); ++t)
+      if (!shards_[t].was_viterbi.empty() && shards_[t].was_viterbi[c]) return true;
+    return false;
+  }
+
+  void EStepShard(bool final_iteration, Shard* s) {
+    if (!final_iteration)
+      s->counts.resize(cols_.size());
+    else if (add_viterbi_)
+      s->was_viterbi.resize(cols_.size());
+    s->likelihood = 0;
+    s->denom = 0;
+    vector<double> probs;
+    vector<size_t> cells;
+    vector<WordID> utrg;
+    vector<int> upos;
+    for (size_t k = s->begin; k < s->end; ++k) {
+      const int slen = src_len_[k];
+      const WordID* src = &words_[start_[k]];
+      const WordID* trg = src + slen;
+      const int tlen = start_[k + 1] - start_[k] - slen;
+      const double src_logprob = -log(slen - use_null_ + 1);
+      s->denom += tlen;
+      // find the cells of all word pairs of the sentence, walking each row
+      // once with the sorted target words
+      utrg.assign(trg, trg + tlen);
+      SortUnique(&utrg);
+      const int nu = utrg.size();
+      upos.resize(tlen);
+      for (int j = 0; j < tlen; ++j)
+        upos[j] = lower_bound(utrg.begin(), utrg.end(), trg[j]) - utrg.begin();
+      cells.resize(slen * nu);
+      for (int i = 0; i < slen; ++i) {
+        const WordID* c = &cols_[0] + row_[src[i]];
+        const WordID* const end = &cols_[0] + row_[src[i] + 1];
+        for (int u = 0; u < nu; ++u) {
+          c = Gallop(c, end, utrg[u]);
+          cells[i * nu + u] = c - &cols_[0];
+        }
+      }
+      probs.resize(slen);
+      for (int j = 0; j < tlen; ++j) {
+        double sum = 0;
+        for (int i = 0; i < slen; ++i) {
+          probs[i] = prob_[cells[i * nu + upos[j]]];
+          sum += probs[i];
+        }
+        if (final_iteration) {
+          if (add_viterbi_) {
+            int max_i = 0;
+            for (int i = 1; i < slen; ++i)
+              if (probs[i] > probs[max_i]) max_i = i;
+            s->was_viterbi[cells[max_i * nu + upos[j]]] = 1;
+          }
+        } else {
+          const double inv_sum = 1.0 / sum;
+          for (int i = 0; i < slen; ++i)
+            s->counts[cells[i * nu + upos[j]]] += probs[i] * inv_sum;
+        }
+        s->likelihood += log(sum) + src_logprob;
+      }
+    }
+  }
+
+  // thread t normalizes the rows that start in the t-th slice of cols_,
+  // adding up (and clearing) the counts of all shards
+  void NormalizeRows(unsigned t, bool variational_bayes, double alpha) {
+    const int n = shards_.size();
+    const WordID b = lower_bound(row_.begin(), row_.end(), cols_.size() * t / n) - row_.begin();
+    const WordID e = lower_bound(row_.begin(), row_.end(), cols_.size() * (t + 1) / n) - row_.begin();
+    vector<double>& counts = shards_[0].counts;
+    for (WordID r = b; r < e && r + 1 < row_.size(); ++r) {
+      double tot = 0;
+      for (size_t c = row_[r]; c < row_[r + 1]; ++c) {
+        for (int u = 1; u < n; ++u) {
+          counts[c] += shards_[u].counts[c];
+          shards_[u].counts[c] = 0;
+        }
+        tot += counts[c] + (variational_bayes ? alpha : 0.0);
+      }
+      for (size_t c = row_[r]; c < row_[r + 1]; ++c) {
+        if (variational_bayes)
+          prob_[c] = exp(digamma(counts[c] + alpha) - digamma(tot));
+        else
+          prob_[c] = counts[c] / tot;
+        counts[c] = 0;
+      }
+    }
+  }
+
+  const bool use_null_;
+  const WordID kNULL_;
+  const bool add_viterbi_;
+  vector<WordID> words_;     // each sentence pair's source (after the null word) and target words
+  vector<size_t> start_;     // where each sentence pair starts in words_
+  vector<int> src_len_;      // length of the source side, including the null word
+  vector<size_t> row_;       // CSR row offsets, indexed by source word
+  vector<WordID> cols_;      // target words
+  vector<double> prob_;      // translation probabilities (VB estimates underflow a float)
+  vector<Shard> shards_;
+};
+
 int main(int argc, char** argv) {
   po::variables_map conf;
   if (!InitCommandLine(argc, argv, &conf)) return 1;
@@ -61,6 +334,36 @@ int main(int argc, char** argv) {
     cerr << "--alpha must be > 0\n";
     return 1;
   }
+  const unsigned threads = conf["threads"].as<unsigned>();
+  if (threads > 1) Dict::EnableLocking();
+  if (threads == 0) {
+    cerr << "--threads must be at least 1\n";
+    return 1;
+  }
+
+  const string binary_file = conf.count("binary_ttable") ? conf["binary_ttable"].as<string>() : "";
+  vector<MappedTTable::Entry> binary;
+
+  if (conf.count("compact")) {
+    CompactModel1 m1(use_null, kNULL, add_viterbi, threads);
+    m1.ReadCorpus(fname);
+    for (int iter = 0; iter < ITERATIONS; ++iter) {
+      const bool final_iteration = (iter == (ITERATIONS - 1));
+      cerr << "ITERATION " << (iter + 1) << (final_iteration ? " (FINAL)" : "") << endl;
+      double likelihood, denom;
+      m1.EStep(final_iteration, &likelihood, &denom);
+      const double base2_likelihood = likelihood / log(2);
+      cerr << "  log_e likelihood: " << likelihood << endl;
+      cerr << "  log_2 likelihood: " << base2_likelihood << endl;
+      cerr << "   cross entropy: " << (-base2_likelihood / denom) << endl;
+      cerr << "      perplexity: " << pow(2.0, -base2_likelihood / denom) << endl;
+      if (!final_iteration)
+        m1.Normalize(variational_bayes, alpha);
+    }
+    m1.WriteTTable(BEAM_THRESHOLD, &cout, binary_file.size() ? &binary : NULL);
+    if (binary_file.size()) MappedTTable::Write(binary, binary_file);
+    return 0;
+  }
 
   TTable tt;
   TTable::Word2Word2Double was_viterbi;
@@ -156,9 +459,12 @@ int main(int argc, char** argv) {
     for (TTable::Word2Double::const_iterator fi = cpd.begin(); fi != cpd.end(); ++fi) {
       if (fi->second > threshold || (vit.count(fi->first) > 0)) {
         cout << esym << ' ' << TD::Convert(fi->first) << ' ' << log(fi->second) << endl;
+        if (binary_file.size())
+          binary.push_back(MappedTTable::Entry(esym, TD::Convert(fi->first), log(fi->second)));
       }
     } 
   }
+  if (binary_file.size()) MappedTTable::Write(binary, binary_file);
   return 0;
 }
 
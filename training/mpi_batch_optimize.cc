@@ -3,6 +3,8 @@
 #include <vector>
 #include <cassert>
 #include <cmath>
+#include <fstream>
+#include <unistd.h>
 
 #include "config.h"
 #ifdef HAVE_MPI
@@ -17,6 +19,7 @@ namespace mpi = boost::mpi;
 
 #include "verbose.h"
 #include "hg.h"
+#include "hg_io.h"
 #include "prob.h"
 #include "inside_outside.h"
 #include "ff_register.h"
@@ -24,8 +27,11 @@ namespace mpi = boost::mpi;
 #include "filelib.h"
 #include "optimize.h"
 #include "fdict.h"
+#include "dict_snapshot.h"
 #include "weights.h"
 #include "sparse_vector.h"
+#include "sparse_reduce.h"
+#include "parallel_for.h"
 
 using namespace std;
 using boost::shared_ptr;
@@ -70,13 +76,19 @@ bool InitCommandLine(int argc, char** argv, po::variables_map* conf) {
         ("output_weights,o",po::value<string>()->default_value("-"),"Output feature weights file")
         ("optimization_method,m", po::value<string>()->default_value("lbfgs"), "Optimization method (sgd, lbfgs, rprop)")
 	("correction_buffers,M", po::value<int>()->default_value(10), "Number of gradients for LBFGS to maintain in memory")
+        ("float_history", "Keep the LBFGS gradients in single precision, which halves their memory")
         ("gaussian_prior,p","Use a Gaussian prior on the weights")
         ("means,u", po::value<string>(), "File containing the means for Gaussian prior")
-        ("sigma_squared", po::value<double>()->default_value(1.0), "Sigma squared term for spherical Gaussian prior");
+        ("sigma_squared", po::value<double>()->default_value(1.0), "Sigma squared term for spherical Gaussian prior")
+        ("cache_forests,c", "Keep the forests from the first iteration in memory and only reweight them in later iterations (requires stateless features and no pruning)")
+        ("forest_cache_dir,C", po::value<string>(), "Like --cache_forests, but keep the forests in this directory instead of in memory")
+        ("threads,j", po::value<unsigned>()->default_value(1u), "Number of threads decoding the training instances (each with its own decoder; they share the grammars and language models, but the remote LM can't be used), reweighting cached forests, and running the LBFGS update")
+        ("reduce_max_density", po::value<double>()->default_value(0.66), "Send the gradient between processes as a dense array once more than this fraction of its entries are nonzero (sparse id/value pairs are sent below it)");
   po::options_description clo("Command line options");
   clo.add_options()
         ("config", po::value<string>(), "Configuration file")
         ("help,h", "Print this help message and exit");
+  AddDictionarySnapshotOption(&clo);
   po::options_description dconfig_options, dcmdline_options;
   dconfig_options.add(opts);
   dcmdline_options.add(opts).add(clo);
@@ -96,6 +108,14 @@ bool InitCommandLine(int argc, char** argv, po::variables_map* conf) {
     cerr << "Cannot specify both --training_data and --sharded_input\n";
     return false;
   }
+  if (conf->count("cache_forests") && conf->count("forest_cache_dir")) {
+    cerr << "Cannot specify both --cache_forests and --forest_cache_dir\n";
+    return false;
+  }
+  if ((*conf)["threads"].as<unsigned>() == 0) {
+    cerr << "--threads must be at least 1\n";
+    return false;
+  }
   return true;
 }
 
@@ -114,46 +134,101 @@ void ReadTrainingCorpus(const string& fname, int rank, int size, vector<string>*
 
 static const double kMINUS_EPSILON = -1e-6;
 
+// the forests of one training instance, kept after the first iteration
+struct CachedForests {
+  CachedForests() : complete(false) {}
+  Hypergraph model;  // translation forest
+  Hypergraph ref;    // reference-constrained forest
+  bool complete;     // false if decoding or alignment failed
+};
+
 struct TrainingObserver : public DecoderObserver {
+  TrainingObserver() : cache() {}
+
   void Reset() {
     acc_grad.clear();
     acc_obj = 0;
     total_complete = 0;
   } 
 
+  // adds the gradient and objective accumulated by another observer
+  void Add(const TrainingObserver& o) {
+    acc_grad += o.acc_grad;
+    acc_obj += o.acc_obj;
+    total_complete += o.total_complete;
+  }
+
   void SetLocalGradientAndObjective(vector<double>* g, double* o) const {
     *o = acc_obj;
     for (SparseVector<prob_t>::const_iterator it = acc_grad.begin(); it != acc_grad.end(); ++it)
       (*g)[it->first] = it->second;
   }
 
-  virtual void NotifyDecodingStart(const SentenceMetadata& smeta) {
+  void GetLocalGradientAndObjective(SparseVector<double>* g, double* o) const {
+    *o = acc_obj;
+    g->clear();
+    for (SparseVector<prob_t>::const_iterator it = acc_grad.begin(); it != acc_grad.end(); ++it)
+      g->set_value(it->first, it->second);
+  }
+
+  virtual void NotifyDecodingStart(const SentenceMetadata& /* smeta */) {
     cur_model_exp.clear();
     cur_obj = 0;
     state = 1;
   }
 
   // compute model expectations, denominator of objective
-  virtual void NotifyTranslationForest(const SentenceMetadata& smeta, Hypergraph* hg) {
+  virtual void NotifyTranslationForest(const SentenceMetadata& /* smeta */, Hypergraph* hg) {
     assert(state == 1);
     state = 2;
+    if (cache) cache->model = *hg;
+    ModelExpectations(*hg);
+  }
+
+  // compute "empirical" expectations, numerator of objective
+  virtual void NotifyAlignmentForest(const SentenceMetadata& /* smeta */, Hypergraph* hg) {
+    assert(state == 2);
+    state = 3;
+    if (cache) {
+      cache->ref = *hg;
+      cache->complete = true;
+    }
+    ReferenceExpectations(*hg);
+  }
+
+  virtual void NotifyDecodingComplete(const SentenceMetadata& /* smeta */) {
+    if (state == 3) {
+      ++total_complete;
+    } else {
+    }
+  }
+
+  // same as decoding, but with forests kept from an earlier iteration
+  void ProcessCachedForests(const vector<double>& weights, CachedForests* f) {
+    if (!f->complete) return;
+    f->model.Reweight(weights);
+    f->ref.Reweight(weights);
+    cur_model_exp.clear();
+    ModelExpectations(f->model);
+    ReferenceExpectations(f->ref);
+    ++total_complete;
+  }
+
+  void ModelExpectations(const Hypergraph& hg) {
     const prob_t z = InsideOutside<prob_t,
                                    EdgeProb,
                                    SparseVector<prob_t>,
-                                   EdgeFeaturesAndProbWeightFunction>(*hg, &cur_model_exp);
+                                   EdgeFeaturesAndProbWeightFunction>(hg, &cur_model_exp);
     cur_obj = log(z);
     cur_model_exp /= z;
   }
 
-  // compute "empirical" expectations, numerator of objective
-  virtual void NotifyAlignmentForest(const SentenceMetadata& smeta, Hypergraph* hg) {
-    assert(state == 2);
-    state = 3;
+  void ReferenceExpectations(const Hypergraph& hg) {
     SparseVector<prob_t> ref_exp;
     const prob_t ref_z = InsideOutside<prob_t,
                                        EdgeProb,
                                        SparseVector<prob_t>,
-                                       EdgeFeaturesAndProbWeightFunction>(*hg, &ref_exp);
+                                       EdgeFeaturesAndProbWeightFunction>(hg, &ref_exp);
     ref_exp /= ref_z;
 
     double log_ref_z;
@@ -178,13 +253,7 @@ struct TrainingObserver : public DecoderObserver {
     acc_obj += (cur_obj - log_ref_z);
   }
 
-  virtual void NotifyDecodingComplete(const SentenceMetadata& smeta) {
-    if (state == 3) {
-      ++total_complete;
-    } else {
-    }
-  }
-
+  CachedForests* cache;  // if non-NULL, decoded forests are saved here
   int total_complete;
   SparseVector<prob_t> cur_model_exp;
   SparseVector<prob_t> acc_grad;
@@ -193,6 +262,108 @@ struct TrainingObserver : public DecoderObserver {
   int state;
 };
 
+static string CacheFile(const string& dir, int rank, int i) {
+  ostringstream os;
+  os << dir << "/forests." << rank << '.' << i;
+  return os.str();
+}
+
+// keeps the cached forests of a training instance on disk
+static void WriteCachedForests(const string& dir, int rank, int i, const CachedForests& f) {
+  const string fname = CacheFile(dir, rank, i);
+  if (!f.complete) {
+    unlink(fname.c_str());  // in case it was left by an earlier run
+    return;
+  }
+  ofstream out(fname.c_str(), ios::binary);
+  if (!HypergraphIO::WriteToBinary(f.model, &out) || !HypergraphIO::WriteToBinary(f.ref, &out)) {
+    cerr << "Failed to write " << fname << endl;
+    exit(1);
+  }
+}
+
+static void ReadCachedForests(const string& dir, int rank, int i, CachedForests* f) {
+  const string fname = CacheFile(dir, rank, i);
+  ifstream in(fname.c_str(), ios::binary);
+  f->complete = in.is_open();
+  if (!f->complete) return;  // decoding failed in the first iteration
+  if (!HypergraphIO::ReadFromBinary(&in, &f->model) || !HypergraphIO::ReadFromBinary(&in, &f->ref)) {
+    cerr << "Failed to read " << fname << endl;
+    exit(1);
+  }
+}
+
+// decodes every num_threads-th training instance, starting with the
+// thread's index, with the thread's own decoder and observer, and keeps the
+// forests if they are cached
+struct DecodeWorker {
+  DecodeWorker(const vector<string>& c, const vector<shared_ptr<Decoder> >& d,
+               vector<CachedForests>* f, const string& dir, int r, vector<TrainingObserver>* obs) :
+    corpus(c), decoders(d), cache(f), cache_dir(dir), rank(r), observers(obs) {}
+  void operator()(unsigned t) const {
+    TrainingObserver* observer = &(*observers)[t];
+    for (int i = t; i < corpus.size(); i += decoders.size()) {
+      CachedForests on_disk;
+      if (cache->size()) observer->cache = &(*cache)[i];
+      else if (cache_dir.size()) observer->cache = &on_disk;
+      decoders[t]->Decode(corpus[i], observer);
+      if (cache_dir.size()) WriteCachedForests(cache_dir, rank, i, on_disk);
+    }
+    observer->cache = NULL;
+  }
+  const vector<string>& corpus;
+  const vector<shared_ptr<Decoder> >& decoders;
+  vector<CachedForests>* cache;  // empty unless the forests are kept in memory
+  const string& cache_dir;
+  const int rank;
+  vector<TrainingObserver>* observers;
+};
+
+// decodes all training instances with one thread per decoder, each with a
+// private observer; the results are then added to the first observer
+void DecodeCorpus(const vector<string>& corpus, const vector<shared_ptr<Decoder> >& decoders,
+                  vector<CachedForests>* cache, const string& cache_dir, int rank,
+                  vector<TrainingObserver>* observers) {
+  RunThreads(decoders.size(), DecodeWorker(corpus, decoders, cache, cache_dir, rank, observers));
+  for (unsigned t = 1; t < decoders.size(); ++t)
+    (*observers)[0].Add((*observers)[t]);
+}
+
+// reweights every num_threads-th cached training instance, starting with
+// the thread's index, and accumulates the expectations in its own observer.
+// Reweighting and inside-outside only read the shared weights, so no
+// locking is needed.
+struct CachedForestWorker {
+  CachedForestWorker(const vector<double>& w, vector<CachedForests>* c, const string& d, int r,
+                     int num_instances, vector<TrainingObserver>* obs) :
+    weights(w), cache(c), cache_dir(d), rank(r), size(num_instances), observers(obs) {}
+  void operator()(unsigned t) const {
+    CachedForests on_disk;
+    for (int i = t; i < size; i += observers->size()) {
+      CachedForests* f = &on_disk;
+      if (cache->size()) f = &(*cache)[i]; else ReadCachedForests(cache_dir, rank, i, f);
+      (*observers)[t].ProcessCachedForests(weights, f);
+    }
+  }
+  const vector<double>& weights;
+  vector<CachedForests>* cache;  // empty if the forests are on disk
+  const string& cache_dir;
+  const int rank;
+  const int size;
+  vector<TrainingObserver>* observers;
+};
+
+// processes the cached forests of all training instances with num_threads
+// threads, each with a private observer; the results are then added to the
+// first observer, so threads never write to shared state
+void ProcessCachedForests(const vector<double>& weights, vector<CachedForests>* cache,
+                          const string& cache_dir, int rank, int num_instances,
+                          vector<TrainingObserver>* observers) {
+  RunThreads(observers->size(), CachedForestWorker(weights, cache, cache_dir, rank, num_instances, observers));
+  for (unsigned t = 1; t < observers->size(); ++t)
+    (*observers)[0].Add((*observers)[t]);
+}
+
 void ReadConfig(const string& ini, vector<string>* out) {
   ReadFile rf(ini);
   istream& in = *rf.stream();
@@ -235,6 +406,7 @@ int main(int argc, char** argv) {
 
   po::variables_map conf;
   if (!InitCommandLine(argc, argv, &conf)) return 1;
+  LoadDictionarySnapshots(conf);
 
   string shard_dir;
   if (conf.count("sharded_input")) {
@@ -272,11 +444,19 @@ int main(int argc, char** argv) {
     g << "grammar=" << shard_dir << "/grammar." << rank << "_of_" << size << ".gz";
     cdec_ini.push_back(g.str());
   }
-  istringstream ini;
-  StoreConfig(cdec_ini, &ini);
+  // one decoder per thread; decoders read from the same configuration
+  // share their grammars and LMs
+  const unsigned num_threads = conf["threads"].as<unsigned>();
+  if (num_threads > 1) Dict::EnableLocking();
+  vector<shared_ptr<Decoder> > decoders(num_threads);
   if (rank == 0) cerr << "Loading grammar...\n";
-  Decoder* decoder = new Decoder(&ini);
-  if (decoder->GetConf()["input"].as<string>() != "-") {
+  for (unsigned t = 0; t < num_threads; ++t) {
+    istringstream ini;
+    StoreConfig(cdec_ini, &ini);
+    decoders[t].reset(new Decoder(&ini));
+  }
+  const Decoder& decoder = *decoders[0];
+  if (decoder.GetConf()["input"].as<string>() != "-") {
     cerr << "cdec.ini must not set an input file\n";
     return 1;
   }
@@ -305,7 +485,8 @@ int main(int argc, char** argv) {
     if (omethod == "rprop")
       o.reset(new RPropOptimizer(num_feats));  // TODO add configuration
     else
-      o.reset(new LBFGSOptimizer(num_feats, conf["correction_buffers"].as<int>()));
+      o.reset(new LBFGSOptimizer(num_feats, conf["correction_buffers"].as<int>(),
+                                 conf.count("float_history"), num_threads));
     cerr << "Optimizer: " << o->Name() << endl;
   }
   double objective = 0;
@@ -317,7 +498,6 @@ int main(int argc, char** argv) {
     lambdas.resize(num_feats, 0.0);
   }
   vector<double> gradient(num_feats, 0.0);
-  vector<double> rcv_grad(num_feats, 0.0);
   bool converged = false;
 
   vector<string> corpus;
@@ -331,9 +511,31 @@ int main(int argc, char** argv) {
   }
   assert(corpus.size() > 0);
 
-  TrainingObserver observer;
+  const bool cache_in_memory = conf.count("cache_forests");
+  const string cache_dir = conf.count("forest_cache_dir") ? conf["forest_cache_dir"].as<string>() : "";
+  if ((cache_in_memory || cache_dir.size()) && !decoder.ReweightableForests()) {
+    cerr << "Forests can only be cached when all features are stateless and no pruning is done\n";
+    return 1;
+  }
+  if (cache_dir.size() && !DirectoryExists(cache_dir)) {
+    cerr << "Can't find forest cache directory: " << cache_dir << endl;
+    return 1;
+  }
+  vector<CachedForests> cache;
+  if (cache_in_memory) cache.resize(corpus.size());
+  bool have_cache = false;
+
+#ifdef HAVE_MPI
+  SparseVectorReducer reducer(world, conf["reduce_max_density"].as<double>());
+  SparseVector<double> local_grad;
+#endif
+
+  // one observer per thread; their results are added to the first one
+  vector<TrainingObserver> observers(num_threads);
+  TrainingObserver& observer = observers[0];
   while (!converged) {
-    observer.Reset();
+    for (unsigned t = 0; t < num_threads; ++t)
+      observers[t].Reset();
 #ifdef HAVE_MPI
     mpi::timer timer;
     world.barrier();
@@ -341,20 +543,25 @@ int main(int argc, char** argv) {
     if (rank == 0) {
       cerr << "Starting decoding... (~" << corpus.size() << " sentences / proc)\n";
     }
-    decoder->SetWeights(lambdas);
-    for (int i = 0; i < corpus.size(); ++i)
-      decoder->Decode(corpus[i], &observer);
+    if (have_cache) {
+      ProcessCachedForests(lambdas, &cache, cache_dir, rank, corpus.size(), &observers);
+    } else {
+      for (unsigned t = 0; t < num_threads; ++t)
+        decoders[t]->SetWeights(lambdas);
+      DecodeCorpus(corpus, decoders, &cache, cache_dir, rank, &observers);
+      have_cache = cache_in_memory || cache_dir.size();
+    }
     cerr << "  process " << rank << '/' << size << " done\n";
-    fill(gradient.begin(), gradient.end(), 0);
-    fill(rcv_grad.begin(), rcv_grad.end(), 0);
-    observer.SetLocalGradientAndObjective(&gradient, &objective);
-
-    double to = 0;
 #ifdef HAVE_MPI
-    mpi::reduce(world, &gradient[0], gradient.size(), &rcv_grad[0], plus<double>(), 0);
+    double to = 0;
+    observer.GetLocalGradientAndObjective(&local_grad, &objective);
+    reducer.ResetBytesSent();
+    reducer.Reduce(local_grad, &gradient);
     mpi::reduce(world, objective, to, plus<double>(), 0);
-    swap(gradient, rcv_grad);
     objective = to;
+#else
+    fill(gradient.begin(), gradient.end(), 0);
+    observer.SetLocalGradientAndObjective(&gradient, &objective);
 #endif
 
     if (rank == 0) {  // run optimizer only on rank=0 node
@@ -403,9 +610,14 @@ int main(int argc, char** argv) {
     }  // rank == 0
     int cint = converged;
 #ifdef HAVE_MPI
-    mpi::broadcast(world, &lambdas[0], lambdas.size(), 0);
+    reducer.Broadcast(&lambdas);
     mpi::broadcast(world, cint, 0);
-    if (rank == 0) { cerr << "  ELAPSED TIME THIS ITERATION=" << timer.elapsed() << endl; }
+    size_t bytes = 0;
+    mpi::reduce(world, reducer.BytesSent(), bytes, plus<size_t>(), 0);
+    if (rank == 0) {
+      cerr << "  BYTES SENT THIS ITERATION=" << bytes << " (dense=" << 2 * reducer.DenseBytes(num_feats) << ")\n";
+      cerr << "  ELAPSED TIME THIS ITERATION=" << timer.elapsed() << endl;
+    }
 #endif
     converged = cint;
   }
@@ -5,6 +5,7 @@
 #include <cassert>
 #include <cmath>
 #include <tr1/memory>
+#include <sys/time.h>
 
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
@@ -18,9 +19,13 @@
 #include "filelib.h"
 #include "online_optimizer.h"
 #include "fdict.h"
+#include "dict.h"
+#include "dict_snapshot.h"
 #include "weights.h"
 #include "sparse_vector.h"
+#include "sparse_reduce.h"
 #include "sampler.h"
+#include "parallel_for.h"
 
 #ifdef HAVE_MPI
 #include <boost/mpi/timer.hpp>
@@ -72,11 +77,14 @@ bool InitCommandLine(int argc, char** argv, po::variables_map* conf) {
         ("random_seed,S", po::value<uint32_t>(), "Random seed (if not specified, /dev/random will be used)")
         ("eta_0,e", po::value<double>()->default_value(0.2), "Initial learning rate for SGD (eta_0)")
         ("L1,1","Use L1 regularization")
+        ("reduce_max_density", po::value<double>()->default_value(0.66), "Send the gradient between processes as a dense array once more than this fraction of its entries are nonzero (sparse id/value pairs are sent below it)")
+        ("threads,j", po::value<unsigned>()->default_value(0u), "If nonzero, run this many threads, each with its own decoder, that decode minibatches and update the shared weights asynchronously (Hogwild SGD); requires a single process")
         ("regularization_strength,C", po::value<double>()->default_value(1.0), "Regularization strength (C)");
   po::options_description clo("Command line options");
   clo.add_options()
         ("config", po::value<string>(), "Configuration file")
         ("help,h", "Print this help message and exit");
+  AddDictionarySnapshotOption(&clo);
   po::options_description dconfig_options, dcmdline_options;
   dconfig_options.add(opts);
   dcmdline_options.add(opts).add(clo);
@@ -133,7 +141,7 @@ struct TrainingObserver : public DecoderObserver {
   }
 
   // compute model expectations, denominator of objective
-  virtual void NotifyTranslationForest(const SentenceMetadata& smeta, Hypergraph* hg) {
+  virtual void NotifyTranslationForest(const SentenceMetadata& /* smeta */, Hypergraph* hg) {
     assert(state == 1);
     state = 2;
     const prob_t z = InsideOutside<prob_t,
@@ -145,7 +153,7 @@ struct TrainingObserver : public DecoderObserver {
   }
 
   // compute "empirical" expectations, numerator of objective
-  virtual void NotifyAlignmentForest(const SentenceMetadata& smeta, Hypergraph* hg) {
+  virtual void NotifyAlignmentForest(const SentenceMetadata& /* smeta */, Hypergraph* hg) {
     assert(state == 2);
     state = 3;
     SparseVector<prob_t> ref_exp;
@@ -198,14 +206,6 @@ struct TrainingObserver : public DecoderObserver {
   int state;
 };
 
-#ifdef HAVE_MPI
-namespace boost { namespace mpi {
-  template<>
-  struct is_commutative<std::plus<SparseVector<double> >, SparseVector<double> > 
-    : mpl::true_ { };
-} } // end namespace boost::mpi
-#endif
-
 bool LoadAgenda(const string& file, vector<pair<string, int> >* a) {
   ReadFile rf(file);
   istream& in = *rf.stream();
@@ -232,6 +232,49 @@ bool LoadAgenda(const string& file, vector<pair<string, int> >* a) {
   return true;
 }
 
+static double Now() {
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// each thread decodes minibatches of randomly chosen training instances with
+// its own decoder and sends their gradients to the optimizer shared by all
+// threads
+struct HogwildWorker {
+  HogwildWorker(const vector<int>& iters, unsigned mb, const vector<uint32_t>& s,
+                const vector<string>& c, const vector<int>& i,
+                const vector<std::tr1::shared_ptr<Decoder> >& d, HogwildCumulativeL1OnlineOptimizer* o) :
+    iterations(iters), minibatch_size(mb), seeds(s), corpus(c), ids(i), decoders(d), optimizer(o) {}
+  void operator()(unsigned t) const {
+    Decoder* decoder = decoders[t].get();
+    MT19937 rng(seeds[t]);
+    TrainingObserver observer;
+    vector<double> lambdas;
+    SparseVector<double> g;
+    for (int iter = 0; iter < iterations[t]; ++iter) {
+      optimizer->GetWeights(&lambdas);
+      decoder->SetWeights(lambdas);
+      observer.Reset();
+      for (unsigned i = 0; i < minibatch_size; ++i) {
+        const int ei = corpus.size() * rng.next();
+        decoder->SetId(ids[ei]);
+        decoder->Decode(corpus[ei], &observer);
+      }
+      observer.GetGradient(&g);
+      g /= minibatch_size;
+      optimizer->UpdateWeights(g);
+    }
+  }
+  const vector<int>& iterations;  // per thread
+  const unsigned minibatch_size;
+  const vector<uint32_t>& seeds;  // per thread
+  const vector<string>& corpus;
+  const vector<int>& ids;
+  const vector<std::tr1::shared_ptr<Decoder> >& decoders;
+  HogwildCumulativeL1OnlineOptimizer* optimizer;
+};
+
 int main(int argc, char** argv) {
 #ifdef HAVE_MPI
   mpi::environment env(argc, argv);
@@ -249,6 +292,7 @@ int main(int argc, char** argv) {
   po::variables_map conf;
   if (!InitCommandLine(argc, argv, &conf))
     return 1;
+  LoadDictionarySnapshots(conf);
 
   // load initial weights
   Weights weights;
@@ -275,6 +319,7 @@ int main(int argc, char** argv) {
   assert(corpus.size() > 0);
 
   std::tr1::shared_ptr<OnlineOptimizer> o;
+  std::tr1::shared_ptr<HogwildCumulativeL1OnlineOptimizer> hogwild;
   std::tr1::shared_ptr<LearningRateSchedule> lr;
 
   const unsigned size_per_proc = conf["minibatch_size_per_proc"].as<unsigned>();
@@ -282,6 +327,15 @@ int main(int argc, char** argv) {
     cerr << "Minibatch size must be smaller than corpus size!\n";
     return 1;
   }
+  const unsigned num_threads = conf["threads"].as<unsigned>();
+  if (num_threads > 0 && size > 1) {
+    cerr << "--threads cannot be used with more than one process\n";
+    return 1;
+  }
+  if (num_threads > 1) {
+    SetSilent(true);  // the decoders' output would interleave
+    Dict::EnableLocking();
+  }
 
   size_t total_corpus_size = 0;
 #ifdef HAVE_MPI
@@ -299,7 +353,10 @@ int main(int argc, char** argv) {
     const string omethod = conf["optimization_method"].as<string>();
     if (omethod == "sgd") {
       const double C = conf["regularization_strength"].as<double>();
-      o.reset(new CumulativeL1OnlineOptimizer(lr, total_corpus_size, C, frozen_fids));
+      if (num_threads)
+        hogwild.reset(new HogwildCumulativeL1OnlineOptimizer(lr, total_corpus_size, C, frozen_fids));
+      else
+        o.reset(new CumulativeL1OnlineOptimizer(lr, total_corpus_size, C, frozen_fids));
     } else {
       assert(!"fail");
     }
@@ -322,6 +379,10 @@ int main(int argc, char** argv) {
   if (rank == 0)
     cerr << "Loaded agenda defining " << agenda.size() << " training epochs\n";
 
+#ifdef HAVE_MPI
+  SparseVectorReducer reducer(world, conf["reduce_max_density"].as<double>());
+#endif
+
   vector<double> lambdas;
   for (int ai = 0; ai < agenda.size(); ++ai) {
     const string& cur_config = agenda[ai].first;
@@ -330,6 +391,55 @@ int main(int argc, char** argv) {
       cerr << "STARTING TRAINING EPOCH " << (ai+1) << ". CONFIG=" << cur_config << endl;
     // load cdec.ini and set up decoder
     ReadFile ini_rf(cur_config);
+
+    if (num_threads) {
+      vector<std::tr1::shared_ptr<Decoder> > decoders(1, std::tr1::shared_ptr<Decoder>(new Decoder(ini_rf.stream())));
+      for (unsigned t = 1; t < num_threads; ++t) {
+        ReadFile thread_ini_rf(cur_config);
+        decoders.push_back(std::tr1::shared_ptr<Decoder>(new Decoder(thread_ini_rf.stream())));
+      }
+      weights.InitFromVector(x);
+      weights.InitVector(&lambdas);
+      hogwild->SetWeights(lambdas);
+      // each agenda entry restarts its learning rate schedule, as below; the
+      // penalties were applied to x at the end of the previous entry
+      hogwild->ResetEpoch();
+
+      for (int iter = 0; iter < max_iteration; ) {
+        const int n = min<int>(write_weights_every_ith, max_iteration - iter);
+        const double start = Now();
+        vector<int> iters(num_threads);
+        vector<uint32_t> seeds(num_threads);
+        for (unsigned t = 0; t < num_threads; ++t) {
+          iters[t] = n / num_threads + (t < n % num_threads);
+          seeds[t] = 1 + static_cast<uint32_t>(rng->next() * 4000000000.0);
+        }
+        RunThreads(num_threads, HogwildWorker(iters, size_per_proc, seeds, corpus, ids, decoders, hogwild.get()));
+        const double elapsed = Now() - start;
+        iter += n;
+        titer += n;
+        hogwild->ApplyPenalties();
+        hogwild->GetWeights(&lambdas);
+        SanityCheck(lambdas);
+        ShowLargestFeatures(lambdas);
+        cerr << "  " << n * size_per_proc << " sentences in " << elapsed << " seconds with "
+             << num_threads << " threads: " << (n * size_per_proc / elapsed) << " sentences/sec\n";
+        string fname = "weights.cur.gz";
+        if (iter % write_weights_every_ith == 0) {
+          ostringstream o; o << "weights.epoch_" << (ai+1) << '.' << iter << ".gz";
+          fname = o.str();
+        }
+        if (iter == max_iteration && ((ai+1)==agenda.size())) { fname = "weights.final.gz"; }
+        ostringstream vv;
+        vv << "total iter=" << titer << " (of current config iter=" << iter << ")  minibatch=" << size_per_proc << " sentences x " << num_threads << " threads.   num_feats=" << FD::NumFeats() << "   passes_thru_data=" << (titer * size_per_proc / static_cast<double>(corpus.size())) << "   eta=" << lr->eta(titer);
+        const string svv = vv.str();
+        cerr << svv << endl;
+        weights.InitFromVector(lambdas);
+        weights.WriteToFile(fname, true, &svv);
+      }
+      weights.InitSparseVector(&x);
+      continue;
+    }
     Decoder decoder(ini_rf.stream());
 
     if (rank == 0)
@@ -372,7 +482,8 @@ int main(int argc, char** argv) {
       SparseVector<double> local_grad, g;
       observer.GetGradient(&local_grad);
 #ifdef HAVE_MPI
-      reduce(world, local_grad, g, std::plus<SparseVector<double> >(), 0);
+      reducer.ResetBytesSent();
+      reducer.Reduce(local_grad, &g);
 #else
       g.swap(local_grad);
 #endif
@@ -382,10 +493,15 @@ int main(int argc, char** argv) {
         o->UpdateWeights(g, FD::NumFeats(), &x);
       }
 #ifdef HAVE_MPI
-      broadcast(world, x, 0);
+      reducer.Broadcast(&x);
       broadcast(world, converged, 0);
+      size_t bytes = 0;
+      reduce(world, reducer.BytesSent(), bytes, std::plus<size_t>(), 0);
       world.barrier();
-      if (rank == 0) { cerr << "  ELAPSED TIME THIS ITERATION=" << timer.elapsed() << endl; }
+      if (rank == 0) {
+        cerr << "  BYTES SENT THIS ITERATION=" << bytes << " (dense=" << 2 * reducer.DenseBytes(FD::NumFeats()) << ")\n";
+        cerr << "  ELAPSED TIME THIS ITERATION=" << timer.elapsed() << endl;
+      }
 #endif
     }
   }
@@ -1,5 +1,7 @@
 #include <iostream>
+#include <map>
 #include <vector>
+#include <cstring>
 #include <cassert>
 #include <cmath>
 
@@ -8,8 +10,11 @@
 
 #include "filelib.h"
 #include "fdict.h"
+#include "dict_snapshot.h"
 #include "weights.h"
 #include "sparse_vector.h"
+#include "sparse_vector_stream.h"
+#include "mapped_sparse_vector.h"
 #include "em_utils.h"
 
 using namespace std;
@@ -19,23 +24,27 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   po::options_description opts("Configuration options");
   opts.add_options()
         ("optimization_method,m", po::value<string>()->default_value("em"), "Optimization method (em, vb)")
-        ("input_format,f",po::value<string>()->default_value("b64"),"Encoding of the input (b64 or text)");
+        ("input_format,f",po::value<string>()->default_value("b64"),"Encoding of the input and output (b64, binary or text), or mapped: read the expectations from binary sparse vector files (such as those written by feature_expectations --output) given on the command line, without mr_em_map_adapter, and write b64");
   po::options_description clo("Command line options");
   clo.add_options()
+        ("input", po::value<vector<string> >(), "Binary sparse vector files (with --input_format mapped)")
         ("config", po::value<string>(), "Configuration file")
         ("help,h", "Print this help message and exit");
+  AddDictionarySnapshotOption(&clo);
   po::options_description dconfig_options, dcmdline_options;
   dconfig_options.add(opts);
   dcmdline_options.add(opts).add(clo);
+  po::positional_options_description p;
+  p.add("input", -1);
   
-  po::store(parse_command_line(argc, argv, dcmdline_options), *conf);
+  po::store(po::command_line_parser(argc, argv).options(dcmdline_options).positional(p).run(), *conf);
   if (conf->count("config")) {
     ifstream config((*conf)["config"].as<string>().c_str());
     po::store(po::parse_config_file(config, dconfig_options), *conf);
   }
   po::notify(*conf);
 
-  if (conf->count("help")) {
+  if (conf->count("help") || ((*conf)["input_format"].as<string>() == "mapped") != conf->count("input")) {
     cerr << dcmdline_options << endl;
     exit(1);
   }
@@ -83,11 +92,56 @@ void Maximize(const bool use_vb,
 #endif
 }
 
+void WriteParameters(const string& key,
+                     const SparseVector<double>& params,
+                     const bool use_b64,
+                     SparseVectorWriter* writer) {
+  if (writer) {
+    writer->Write(key, 0.0, params);
+    return;
+  }
+  cout << key << '\t';
+  if (use_b64)
+    B64::Encode(0.0, params, &cout);
+  else
+    cout << params;
+  cout << endl;
+}
+
+// the E-step over expectation files: sums the mapped value arrays of all
+// files, grouped by conditioning variable, without converting them to b64
+// or text first
+void AccumulateMapped(const vector<string>& files,
+                      map<string, SparseVector<double> >* counts,
+                      double* logprob) {
+  for (int f = 0; f < files.size(); ++f) {
+    const MappedSparseVector v(files[f]);
+    *logprob += v.objective();
+    // names are sorted, so the events of one variable are mostly adjacent
+    const char* key = "";
+    size_t key_len = 0;
+    SparseVector<double>* acc = NULL;
+    for (size_t i = 0; i < v.size(); ++i) {
+      const char* name = v.name(i);
+      const size_t len = ConditioningVariableLength(name);
+      if (!acc || len != key_len || memcmp(name, key, len) != 0) {
+        key = name;
+        key_len = len;
+        acc = &(*counts)[string(name, len)];
+      }
+      acc->add_value(FD::Convert(name), v.value(i));
+    }
+  }
+}
+
 int main(int argc, char** argv) {
   po::variables_map conf;
   InitCommandLine(argc, argv, &conf);
+  LoadDictionarySnapshots(conf);
 
   const bool use_b64 = conf["input_format"].as<string>() == "b64";
+  const bool use_binary = conf["input_format"].as<string>() == "binary";
+  const bool use_mapped = conf["input_format"].as<string>() == "mapped";
   const bool use_vb = conf["optimization_method"].as<string>() == "vb";
   const double alpha = 1e-09;
   if (use_vb)
@@ -98,6 +152,41 @@ int main(int argc, char** argv) {
   string cur_key = "";
   SparseVector<double> acc;
   double logprob = 0;
+  if (use_mapped) {
+    // keys in sorted order, as the merged map output would have them
+    map<string, SparseVector<double> > counts;
+    AccumulateMapped(conf["input"].as<vector<string> >(), &counts, &logprob);
+    for (map<string, SparseVector<double> >::iterator it = counts.begin(); it != counts.end(); ++it) {
+      Maximize(use_vb, alpha, it->second.size(), &it->second);
+      WriteParameters(it->first, it->second, true, NULL);
+    }
+    cerr << "LOGPROB: " << logprob << endl;
+    return 0;
+  }
+  if (use_binary) {
+    SparseVectorReader reader(&cin);
+    SparseVectorWriter writer(&cout);
+    string key;
+    double obj;
+    SparseVector<double> g;
+    while (reader.Read(&key, &obj, &g)) {
+      if (key != cur_key) {
+        if (cur_key.size() > 0) {
+          Maximize(use_vb, alpha, acc.size(), &acc);
+          WriteParameters(cur_key, acc, use_b64, &writer);
+          acc.clear();
+        }
+        cur_key = key;
+      }
+      logprob += obj;
+      acc += g;
+    }
+    Maximize(use_vb, alpha, acc.size(), &acc);
+    WriteParameters(cur_key, acc, use_b64, &writer);
+    cout << flush;
+    cerr << "LOGPROB: " << logprob << endl;
+    return 0;
+  }
   while(cin) {
     string line;
     getline(cin, line);
@@ -113,12 +202,7 @@ int main(int argc, char** argv) {
         // TODO shouldn't be num_active, should be total number
         // of events
         Maximize(use_vb, alpha, acc.size(), &acc);
-        cout << cur_key << '\t';
-        if (use_b64)
-          B64::Encode(0.0, acc, &cout);
-        else
-          cout << acc;
-        cout << endl;
+        WriteParameters(cur_key, acc, use_b64, NULL);
         acc.clear();
       }
       cur_key = key;
@@ -160,12 +244,8 @@ int main(int argc, char** argv) {
   // TODO shouldn't be num_active, should be total number
   // of events
   Maximize(use_vb, alpha, acc.size(), &acc);
-  cout << cur_key << '\t';
-  if (use_b64)
-    B64::Encode(0.0, acc, &cout);
-  else
-    cout << acc;
-  cout << endl << flush;
+  WriteParameters(cur_key, acc, use_b64, NULL);
+  cout << flush;
 
   cerr << "LOGPROB: " << logprob << endl;
 
@@ -9,7 +9,11 @@
 #include "boost/tuple/tuple.hpp"
 
 #include "fdict.h"
+#include "dict_snapshot.h"
 #include "sparse_vector.h"
+#include "mapped_sparse_vector.h"
+#include "sparse_vector_stream.h"
+#include "em_utils.h"
 
 using namespace std;
 namespace po = boost::program_options;
@@ -23,23 +27,28 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   po::options_description opts("Configuration options");
   opts.add_options()
         ("buffer_size,b", po::value<int>()->default_value(1), "Buffer size (in # of counts) before emitting counts")
-        ("format,f",po::value<string>()->default_value("b64"), "Encoding of the input (b64 or text)");
+        ("format,f",po::value<string>()->default_value("b64"), "Encoding of the input (b64 or text on STDIN, or binary sparse vector files such as those written by feature_expectations --output)")
+        ("output_format,F",po::value<string>()->default_value("b64"), "Encoding of the output (b64 lines, or binary: a sparse vector stream sorted by key that mr_merge_reduce can merge)");
   po::options_description clo("Command line options");
   clo.add_options()
+        ("input", po::value<vector<string> >(), "Binary sparse vector files (with --format binary)")
         ("config", po::value<string>(), "Configuration file")
         ("help,h", "Print this help message and exit");
+  AddDictionarySnapshotOption(&clo);
   po::options_description dconfig_options, dcmdline_options;
   dconfig_options.add(opts);
   dcmdline_options.add(opts).add(clo);
+  po::positional_options_description p;
+  p.add("input", -1);
   
-  po::store(parse_command_line(argc, argv, dcmdline_options), *conf);
+  po::store(po::command_line_parser(argc, argv).options(dcmdline_options).positional(p).run(), *conf);
   if (conf->count("config")) {
     ifstream config((*conf)["config"].as<string>().c_str());
     po::store(po::parse_config_file(config, dconfig_options), *conf);
   }
   po::notify(*conf);
 
-  if (conf->count("help")) {
+  if (conf->count("help") || ((*conf)["format"].as<string>() == "binary") != conf->count("input")) {
     cerr << dcmdline_options << endl;
     exit(1);
   }
@@ -63,22 +72,22 @@ struct EventMapper {
 struct LexAlignEventMapper : public EventMapper {
  protected:
   virtual int GetConditioningVariable(int fid) const {
-    const string& str = FD::Convert(fid);
-    size_t pos = str.rfind("_");
-    if (pos == string::npos || pos == 0 || pos >= str.size() - 1) {
-      cerr << "Bad feature for EM adapter: " << str << endl;
-      abort();
-    }
-    return FD::Convert(str.substr(0, pos));
+    const char* str = FD::Convert(fid);
+    return FD::Convert(string(str, ConditioningVariableLength(str)));
   }
 };
 
 int main(int argc, char** argv) {
   po::variables_map conf;
   InitCommandLine(argc, argv, &conf);
+  LoadDictionarySnapshots(conf);
 
   const bool use_b64 = conf["format"].as<string>() == "b64";
+  const bool use_binary = conf["format"].as<string>() == "binary";
+  vector<string> files;
+  if (use_binary) files = conf["input"].as<vector<string> >();
   const int buffer_size = conf["buffer_size"].as<int>();
+  const bool binary_output = conf["output_format"].as<string>() == "binary";
 
   const string s_obj = "**OBJ**";
   // 0<TAB>**OBJ**=12.2;Feat1=2.3;Feat2=-0.2;
@@ -87,43 +96,50 @@ int main(int argc, char** argv) {
   EventMapper* event_mapper = new LexAlignEventMapper;
   map<int, SparseVector<double> > counts;
   size_t total = 0;
-  while(cin) {
-    string line;
-    getline(cin, line);
-    if (line.empty()) continue;
-    int feat;
-    double val;
-    size_t i = line.find("\t");
-    assert(i != string::npos);
-    ++i;
+  size_t next_file = 0;
+  while(use_binary ? next_file < files.size() : !cin.fail()) {
     SparseVector<double> g;
     double obj = 0;
-    if (use_b64) {
-      if (!B64::Decode(&obj, &g, &line[i], line.size() - i)) {
-        cerr << "B64 decoder returned error, skipping!\n";
-        continue;
-      }
-    } else {       // text encoding - your counts will not be accurate!
-      while (i < line.size()) {
-        size_t start = i;
-        while (line[i] != '=' && i < line.size()) ++i;
-        if (i == line.size()) { cerr << "FORMAT ERROR\n"; break; }
-        string fname = line.substr(start, i - start);
-        if (fname == s_obj) {
-          feat = -1;
-        } else {
-          feat = FD::Convert(line.substr(start, i - start));
+    if (use_binary) {
+      const MappedSparseVector v(files[next_file++]);
+      v.AddTo(&g);
+      obj = v.objective();
+    } else {
+      string line;
+      getline(cin, line);
+      if (line.empty()) continue;
+      int feat;
+      double val;
+      size_t i = line.find("\t");
+      assert(i != string::npos);
+      ++i;
+      if (use_b64) {
+        if (!B64::Decode(&obj, &g, &line[i], line.size() - i)) {
+          cerr << "B64 decoder returned error, skipping!\n";
+          continue;
         }
-        ++i;
-        start = i;
-        while (line[i] != ';' && i < line.size()) ++i;
-        if (i - start == 0) continue;
-        val = atof(line.substr(start, i - start).c_str());
-        ++i;
-        if (feat == -1) {
-          obj = val;
-        } else {
-          g.set_value(feat, val);
+      } else {       // text encoding - your counts will not be accurate!
+        while (i < line.size()) {
+          size_t start = i;
+          while (line[i] != '=' && i < line.size()) ++i;
+          if (i == line.size()) { cerr << "FORMAT ERROR\n"; break; }
+          string fname = line.substr(start, i - start);
+          if (fname == s_obj) {
+            feat = -1;
+          } else {
+            feat = FD::Convert(line.substr(start, i - start));
+          }
+          ++i;
+          start = i;
+          while (line[i] != ';' && i < line.size()) ++i;
+          if (i - start == 0) continue;
+          val = atof(line.substr(start, i - start).c_str());
+          ++i;
+          if (feat == -1) {
+            obj = val;
+          } else {
+            g.set_value(feat, val);
+          }
         }
       }
     }
@@ -137,12 +153,12 @@ int main(int argc, char** argv) {
       delta = cond_counts.size() - delta;
       total += delta;
     }
-    if (total > buffer_size) {
+    if (!binary_output && total > buffer_size) {
       for (map<int, SparseVector<double> >::iterator it = counts.begin();
            it != counts.end(); ++it) {
         const SparseVector<double>& cc = it->second;
         cout << FD::Convert(it->first) << '\t';
-        if (use_b64) {
+        if (use_b64 || use_binary) {
           B64::Encode(0.0, cc, &cout);
         } else {
           abort();
@@ -155,6 +171,17 @@ int main(int argc, char** argv) {
     }
   }
 
+  if (binary_output) {
+    // keys must be written in sorted order for the merge
+    map<string, int> keys;
+    for (map<int, SparseVector<double> >::iterator it = counts.begin();
+         it != counts.end(); ++it)
+      keys[FD::Convert(it->first)] = it->first;
+    SparseVectorWriter writer(&cout);
+    for (map<string, int>::iterator it = keys.begin(); it != keys.end(); ++it)
+      writer.Write(it->first, 0.0, counts[it->second]);
+    cout << flush;
+  }
   return 0;
 }
 
@@ -0,0 +1,130 @@
+#include <iostream>
+#include <fstream>
+#include <queue>
+#include <vector>
+#include <cstdlib>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/program_options.hpp>
+#include <boost/program_options/variables_map.hpp>
+
+#include "filelib.h"
+#include "sparse_vector.h"
+#include "sparse_vector_stream.h"
+
+using namespace std;
+using boost::shared_ptr;
+namespace po = boost::program_options;
+
+// merges binary sparse vector streams whose records are sorted by key (such
+// as those written by mr_em_map_adapter --output_format binary), summing the
+// vectors and objectives of records with the same key.  The output is
+// sorted by key, so merges can be nested.
+
+void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
+  po::options_description opts("Configuration options");
+  opts.add_options()
+        ("output_format,F",po::value<string>()->default_value("binary"), "Encoding of the output (binary or b64)");
+  po::options_description clo("Command line options");
+  clo.add_options()
+        ("input", po::value<vector<string> >(), "Binary sparse vector streams to merge")
+        ("config", po::value<string>(), "Configuration file")
+        ("help,h", "Print this help message and exit");
+  po::options_description dconfig_options, dcmdline_options;
+  dconfig_options.add(opts);
+  dcmdline_options.add(opts).add(clo);
+  po::positional_options_description p;
+  p.add("input", -1);
+
+  po::store(po::command_line_parser(argc, argv).options(dcmdline_options).positional(p).run(), *conf);
+  if (conf->count("config")) {
+    ifstream config((*conf)["config"].as<string>().c_str());
+    po::store(po::parse_config_file(config, dconfig_options), *conf);
+  }
+  po::notify(*conf);
+
+  if (conf->count("help") || !conf->count("input")) {
+    cerr << "Usage: mr_merge_reduce [options] stream1 [stream2 ...]\n";
+    cerr << dcmdline_options << endl;
+    exit(1);
+  }
+  const string& format = (*conf)["output_format"].as<string>();
+  if (format != "binary" && format != "b64") {
+    cerr << "--output_format must be binary or b64, not " << format << endl;
+    exit(1);
+  }
+}
+
+struct Input {
+  explicit Input(const string& file) : rf(file), reader(rf.stream()), file_(file) {}
+  bool Next() {
+    const string prev = key;
+    if (!reader.Read(&key, &obj, &vec)) return false;
+    if (key < prev) {
+      cerr << file_ << " is not sorted by key: " << key << " follows " << prev << endl;
+      abort();
+    }
+    return true;
+  }
+  ReadFile rf;
+  SparseVectorReader reader;
+  string key;
+  double obj;
+  SparseVector<double> vec;
+ private:
+  const string file_;
+};
+
+// orders the inputs in a priority queue by their current key, smallest first
+struct KeyGreater {
+  explicit KeyGreater(const vector<shared_ptr<Input> >& in) : in_(in) {}
+  bool operator()(int a, int b) const { return in_[a]->key > in_[b]->key; }
+  const vector<shared_ptr<Input> >& in_;
+};
+
+int main(int argc, char** argv) {
+  po::variables_map conf;
+  InitCommandLine(argc, argv, &conf);
+  const vector<string> files = conf["input"].as<vector<string> >();
+  const bool use_b64 = conf["output_format"].as<string>() == "b64";
+
+  vector<shared_ptr<Input> > in(files.size());
+  KeyGreater cmp(in);
+  priority_queue<int, vector<int>, KeyGreater> q(cmp);
+  for (int i = 0; i < files.size(); ++i) {
+    in[i].reset(new Input(files[i]));
+    if (in[i]->Next()) q.push(i);
+  }
+
+  boost::scoped_ptr<SparseVectorWriter> writer(use_b64 ? NULL : new SparseVectorWriter(&cout));
+  string key;
+  double obj;
+  SparseVector<double> acc;
+  int records = 0, merged = 0;
+  while (!q.empty()) {
+    key = in[q.top()]->key;
+    obj = 0;
+    acc.clear();
+    // take the records with this key from every input
+    while (!q.empty() && in[q.top()]->key == key) {
+      const int i = q.top();
+      q.pop();
+      obj += in[i]->obj;
+      acc += in[i]->vec;
+      ++records;
+      if (in[i]->Next()) q.push(i);
+    }
+    if (writer) {
+      writer->Write(key, obj, acc);
+    } else {
+      cout << key << '\t';
+      B64::Encode(obj, acc, &cout);
+      cout << endl;
+    }
+    ++merged;
+  }
+  cout << flush;
+  cerr << "Merged " << records << " records from " << files.size() << " streams into " << merged << " keys\n";
+  return 0;
+}
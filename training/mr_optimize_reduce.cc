@@ -11,8 +11,11 @@
 
 #include "optimize.h"
 #include "fdict.h"
+#include "dict_snapshot.h"
 #include "weights.h"
 #include "sparse_vector.h"
+#include "sparse_vector_stream.h"
+#include "mapped_sparse_vector.h"
 
 using namespace std;
 using boost::shared_ptr;
@@ -54,7 +57,7 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
         ("output_weights,o",po::value<string>()->default_value("-"),"Output feature weights file")
         ("optimization_method,m", po::value<string>()->default_value("lbfgs"), "Optimization method (sgd, lbfgs, rprop)")
         ("state,s",po::value<string>(),"Read (and write if output_state is not set) optimizer state from this state file. In the first iteration, the file should not exist.")
-        ("input_format,f",po::value<string>()->default_value("b64"),"Encoding of the input (b64 or text)")
+        ("input_format,f",po::value<string>()->default_value("b64"),"Encoding of the input (b64, binary or text), or mapped: read the gradients from binary sparse vector files given on the command line")
         ("output_state,S", po::value<string>(), "Output state file (optional override)")
 	("correction_buffers,M", po::value<int>()->default_value(10), "Number of gradients for LBFGS to maintain in memory")
         ("eta,e", po::value<double>()->default_value(0.1), "Learning rate for SGD (eta)")
@@ -63,30 +66,60 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
         ("sigma_squared", po::value<double>()->default_value(1.0), "Sigma squared term for spherical Gaussian prior");
   po::options_description clo("Command line options");
   clo.add_options()
+        ("input", po::value<vector<string> >(), "Binary sparse vector files (with --input_format mapped)")
         ("config", po::value<string>(), "Configuration file")
         ("help,h", "Print this help message and exit");
+  AddDictionarySnapshotOption(&clo);
   po::options_description dconfig_options, dcmdline_options;
   dconfig_options.add(opts);
   dcmdline_options.add(opts).add(clo);
+  po::positional_options_description p;
+  p.add("input", -1);
   
-  po::store(parse_command_line(argc, argv, dcmdline_options), *conf);
+  po::store(po::command_line_parser(argc, argv).options(dcmdline_options).positional(p).run(), *conf);
   if (conf->count("config")) {
     ifstream config((*conf)["config"].as<string>().c_str());
     po::store(po::parse_config_file(config, dconfig_options), *conf);
   }
   po::notify(*conf);
 
-  if (conf->count("help") || !conf->count("input_weights") || !conf->count("state")) {
+  if (conf->count("help") || !conf->count("input_weights") || !conf->count("state") ||
+      ((*conf)["input_format"].as<string>() == "mapped") != conf->count("input")) {
     cerr << dcmdline_options << endl;
     exit(1);
   }
 }
 
+void AccumulateGradient(const SparseVector<double>& g, vector<double>* gradient) {
+  for (SparseVector<double>::const_iterator it = g.begin(); it != g.end(); ++it) {
+    if (it->first >= gradient->size()) {
+      cerr << "Unexpected feature in gradient: " << FD::Convert(it->first) << endl;
+      abort();
+    }
+    (*gradient)[it->first] -= it->second;
+  }
+}
+
+// subtracts the mapped values of v from the gradient
+void AccumulateGradient(const MappedSparseVector& v, vector<double>* gradient) {
+  for (size_t i = 0; i < v.size(); ++i) {
+    const int fid = FD::Convert(v.name(i));
+    if (fid >= gradient->size()) {
+      cerr << "Unexpected feature in gradient: " << v.name(i) << endl;
+      abort();
+    }
+    (*gradient)[fid] -= v.value(i);
+  }
+}
+
 int main(int argc, char** argv) {
   po::variables_map conf;
   InitCommandLine(argc, argv, &conf);
+  LoadDictionarySnapshots(conf);
 
   const bool use_b64 = conf["input_format"].as<string>() == "b64";
+  const bool use_binary = conf["input_format"].as<string>() == "binary";
+  const bool use_mapped = conf["input_format"].as<string>() == "mapped";
 
   Weights weights;
   weights.InitFromFile(conf["input_weights"].as<string>());
@@ -118,9 +151,14 @@ int main(int argc, char** argv) {
   string state_file = conf["state"].as<string>();
   {
     ifstream in(state_file.c_str(), ios::binary);
-    if (in)
-      o->Load(&in);
-    else
+    if (in) {
+      try {
+        o->Load(&in);
+      } catch (const std::exception& e) {
+        cerr << state_file << ": " << e.what() << endl;
+        return 1;
+      }
+    } else
       cerr << "No state file found, assuming ITERATION 1\n";
   }
 
@@ -132,7 +170,27 @@ int main(int argc, char** argv) {
   // 0<TAB>**OBJ**=1.1;Feat1=1.0;
   int total_lines = 0;  // TODO - this should be a count of the
                         // training instances!!
-  while(cin) {
+  if (use_binary) {
+    SparseVectorReader reader(&cin);
+    string key;
+    double obj;
+    SparseVector<double> g;
+    while (reader.Read(&key, &obj, &g)) {
+      ++total_lines;
+      objective += obj;
+      AccumulateGradient(g, &gradient);
+    }
+  }
+  if (use_mapped) {
+    const vector<string> files = conf["input"].as<vector<string> >();
+    for (int f = 0; f < files.size(); ++f) {
+      const MappedSparseVector v(files[f]);
+      ++total_lines;
+      objective += v.objective();
+      AccumulateGradient(v, &gradient);
+    }
+  }
+  while(!use_binary && !use_mapped && cin) {
     string line;
     getline(cin, line);
     if (line.empty()) continue;
@@ -154,14 +212,7 @@ int main(int argc, char** argv) {
         exit(99);
       }
       objective += obj;
-      const SparseVector<double>& cg = g;
-      for (SparseVector<double>::const_iterator it = cg.begin(); it != cg.end(); ++it) {
-        if (it->first >= num_feats) {
-	  cerr << "Unexpected feature in gradient: " << FD::Convert(it->first) << endl;
-	  abort();
-        }
-        gradient[it->first] -= it->second;
-      }
+      AccumulateGradient(g, &gradient);
     } else {       // text encoding - your gradients will not be accurate!
       while (i < line.size()) {
         size_t start = i;
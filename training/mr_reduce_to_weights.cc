@@ -8,8 +8,10 @@
 
 #include "filelib.h"
 #include "fdict.h"
+#include "dict_snapshot.h"
 #include "weights.h"
 #include "sparse_vector.h"
+#include "sparse_vector_stream.h"
 
 using namespace std;
 namespace po = boost::program_options;
@@ -17,13 +19,14 @@ namespace po = boost::program_options;
 void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   po::options_description opts("Configuration options");
   opts.add_options()
-        ("input_format,f",po::value<string>()->default_value("b64"),"Encoding of the input (b64 or text)")
+        ("input_format,f",po::value<string>()->default_value("b64"),"Encoding of the input (b64, binary or text)")
         ("input,i",po::value<string>()->default_value("-"),"Read file from")
         ("output,o",po::value<string>()->default_value("-"),"Write weights to");
   po::options_description clo("Command line options");
   clo.add_options()
         ("config", po::value<string>(), "Configuration file")
         ("help,h", "Print this help message and exit");
+  AddDictionarySnapshotOption(&clo);
   po::options_description dconfig_options, dcmdline_options;
   dconfig_options.add(opts);
   dcmdline_options.add(opts).add(clo);
@@ -51,8 +54,10 @@ void WriteWeights(const SparseVector<double>& weights, ostream* out) {
 int main(int argc, char** argv) {
   po::variables_map conf;
   InitCommandLine(argc, argv, &conf);
+  LoadDictionarySnapshots(conf);
 
   const bool use_b64 = conf["input_format"].as<string>() == "b64";
+  const bool use_binary = conf["input_format"].as<string>() == "binary";
 
   const string s_obj = "**OBJ**";
   // E-step
@@ -62,6 +67,15 @@ int main(int argc, char** argv) {
   WriteFile wf(conf["output"].as<string>());
   ostream* out = wf.stream();
   out->precision(17);
+  if (use_binary) {
+    SparseVectorReader reader(in);
+    string key;
+    double obj;
+    SparseVector<double> g;
+    while (reader.Read(&key, &obj, &g))
+      WriteWeights(g, out);
+    return 0;
+  }
   while(*in) {
     string line;
     getline(*in, line);
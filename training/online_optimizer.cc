@@ -1,5 +1,7 @@
 #include "online_optimizer.h"
 
+#include <algorithm>
+
 LearningRateSchedule::~LearningRateSchedule() {}
 
 double StandardLearningRate::eta(int k) const {
@@ -14,3 +16,82 @@ OnlineOptimizer::~OnlineOptimizer() {}
 
 void OnlineOptimizer::ResetEpochImpl() {}
 
+
+HogwildCumulativeL1OnlineOptimizer::HogwildCumulativeL1OnlineOptimizer(
+    const std::tr1::shared_ptr<LearningRateSchedule>& s,
+    size_t training_instances, double C, const std::vector<int>& frozen) :
+    N_(training_instances), schedule_(s), C_(C), frozen_ids_(frozen.begin(), frozen.end()),
+    num_feats_(0), k_(0) {
+  for (int b = 0; b < kNUM_BLOCKS; ++b)
+    blocks_[b] = NULL;
+}
+
+HogwildCumulativeL1OnlineOptimizer::~HogwildCumulativeL1OnlineOptimizer() {
+  for (int b = 0; b < kNUM_BLOCKS; ++b)
+    delete[] blocks_[b].load();
+}
+
+void HogwildCumulativeL1OnlineOptimizer::ResetEpoch() {
+  k_ = 0;
+  u_.store(0);
+  for (int i = 0; i < num_feats_; ++i)
+    feature(i).q.store(0);
+}
+
+void HogwildCumulativeL1OnlineOptimizer::SetWeights(const std::vector<double>& weights) {
+  Grow(weights.size());
+  for (int i = 0; i < weights.size(); ++i)
+    feature(i).w.store(weights[i]);
+}
+
+void HogwildCumulativeL1OnlineOptimizer::Grow(int num_feats) {
+  if (num_feats <= num_feats_) return;
+  const int last = 31 - __builtin_clz((num_feats - 1) / kFIRST_BLOCK + 1);
+  assert(last < kNUM_BLOCKS);
+  for (int b = 0; b <= last; ++b) {
+    if (blocks_[b].load(boost::memory_order_acquire)) continue;
+    const int begin = kFIRST_BLOCK * ((1 << b) - 1);
+    const int size = kFIRST_BLOCK << b;
+    Feature* block = new Feature[size];
+    for (std::set<int>::const_iterator it = frozen_ids_.lower_bound(begin);
+         it != frozen_ids_.end() && *it < begin + size; ++it)
+      block[*it - begin].frozen = true;
+    Feature* expected = NULL;
+    // another thread may have allocated it first
+    if (!blocks_[b].compare_exchange_strong(expected, block, boost::memory_order_acq_rel))
+      delete[] block;
+  }
+  int cur = num_feats_;
+  while (cur < num_feats && !num_feats_.compare_exchange_weak(cur, num_feats)) {}
+}
+
+void HogwildCumulativeL1OnlineOptimizer::ApplyPenalties() {
+  const double u = u_.load();
+  for (int i = 1; i < num_feats_; ++i) {
+    Feature& f = feature(i);
+    if (!f.frozen) ApplyPenalty(&f, u);
+  }
+}
+
+void HogwildCumulativeL1OnlineOptimizer::GetWeights(std::vector<double>* weights) const {
+  const int n = num_feats_;
+  weights->resize(n);
+  for (int i = 0; i < n; ++i)
+    (*weights)[i] = feature(i).w.load();
+}
+
+void HogwildCumulativeL1OnlineOptimizer::UpdateWeights(const SparseVector<double>& approx_g) {
+  int num_feats = 0;
+  for (SparseVector<double>::const_iterator it = approx_g.begin(); it != approx_g.end(); ++it)
+    num_feats = std::max(num_feats, it->first + 1);
+  Grow(num_feats);
+  const double eta = schedule_->eta(++k_);
+  const double u = u_.add(eta * C_ / N_);
+  for (SparseVector<double>::const_iterator it = approx_g.begin();
+       it != approx_g.end(); ++it) {
+    Feature& f = feature(it->first);
+    if (f.frozen) continue;
+    f.w.add(eta * it->second);
+    ApplyPenalty(&f, u);
+  }
+}
@@ -4,7 +4,9 @@
 #include <tr1/memory>
 #include <set>
 #include <string>
+#include <vector>
 #include <cmath>
+#include <boost/atomic.hpp>
 #include "sparse_vector.h"
 
 struct LearningRateSchedule {
@@ -126,4 +128,111 @@ class CumulativeL1OnlineOptimizer : public OnlineOptimizer {
   SparseVector<double> q_;
 };
 
+// a double that several threads can read and add to without locking.  It
+// can be copied (a copy reads the current value), so it can be kept in a
+// std::vector, but resizing the vector is not thread safe.
+class AtomicDouble {
+ public:
+  AtomicDouble(double v = 0.0) : v_(v) {}
+  AtomicDouble(const AtomicDouble& other) : v_(other.load()) {}
+  AtomicDouble& operator=(const AtomicDouble& other) { store(other.load()); return *this; }
+
+  double load() const { return v_.load(boost::memory_order_relaxed); }
+  void store(double v) { v_.store(v, boost::memory_order_relaxed); }
+  // replaces the value with desired if it is still expected; otherwise sets
+  // expected to the current value and returns false
+  bool compare_exchange(double& expected, double desired) {
+    return v_.compare_exchange_weak(expected, desired, boost::memory_order_relaxed);
+  }
+  // returns the new value
+  double add(double d) {
+    double cur = load();
+    while (!compare_exchange(cur, cur + d)) {}
+    return cur + d;
+  }
+
+ private:
+  boost::atomic<double> v_;
+};
+
+// CumulativeL1OnlineOptimizer for several threads that update one dense
+// weight vector without any lock (Niu et al., NIPS 2011, "Hogwild!").  The
+// step count k and the total penalty u are atomics, and every weight and
+// the penalty q already applied to it are changed with atomic
+// compare-and-swap, so threads never lose an update, but they may read a
+// weight vector that is partly older than another thread's update.
+// Features are penalized when they occur in a gradient (as in Tsuruoka et
+// al.), and ApplyPenalties catches up on the rest.
+//
+// The optimizer holds the weights, in blocks that are never moved (like
+// the words of a Dict), so the threads may keep decoding (and adding
+// features to FD) while others update: a gradient with a new feature
+// allocates the missing blocks and publishes them with compare-and-swap.
+class HogwildCumulativeL1OnlineOptimizer {
+ public:
+  HogwildCumulativeL1OnlineOptimizer(const std::tr1::shared_ptr<LearningRateSchedule>& s,
+                                     size_t training_instances, double C,
+                                     const std::vector<int>& frozen);
+  ~HogwildCumulativeL1OnlineOptimizer();
+
+  // the following are not thread safe
+
+  // call ApplyPenalties first, since this also forgets q
+  void ResetEpoch();
+  void SetWeights(const std::vector<double>& weights);
+  // applies the outstanding penalty to every feature
+  void ApplyPenalties();
+
+  // the following may be called by several threads at once
+
+  void GetWeights(std::vector<double>* weights) const;
+  void UpdateWeights(const SparseVector<double>& approx_g);
+
+ private:
+  HogwildCumulativeL1OnlineOptimizer(const HogwildCumulativeL1OnlineOptimizer&);
+  void operator=(const HogwildCumulativeL1OnlineOptimizer&);
+
+  struct Feature {
+    Feature() : frozen() {}
+    AtomicDouble w;
+    AtomicDouble q;  // the penalty already applied to w
+    bool frozen;
+  };
+
+  // feature i is in block 31 - clz(i / kFIRST_BLOCK + 1), whose size is
+  // kFIRST_BLOCK << b
+  static const int kFIRST_BLOCK = 1 << 14;
+  static const int kNUM_BLOCKS = 17;  // room for 2^31 - 2^14 features
+  Feature& feature(int i) const {
+    const int b = 31 - __builtin_clz(i / kFIRST_BLOCK + 1);
+    return blocks_[b].load(boost::memory_order_acquire)[i - kFIRST_BLOCK * ((1 << b) - 1)];
+  }
+  // makes room for num_feats features
+  void Grow(int num_feats);
+
+  void ApplyPenalty(Feature* f, double u) {
+    double z = f->w.load();
+    double w;
+    do {
+      const double q = f->q.load();
+      if (z > 0.0)
+        w = std::max(0.0, z - (u + q));
+      else if (z < 0.0)
+        w = std::min(0.0, z + (u - q));
+      else
+        return;
+    } while (!f->w.compare_exchange(z, w));
+    f->q.add(w - z);
+  }
+
+  const double N_;
+  std::tr1::shared_ptr<LearningRateSchedule> schedule_;
+  const double C_;
+  const std::set<int> frozen_ids_;
+  mutable boost::atomic<Feature*> blocks_[kNUM_BLOCKS];
+  boost::atomic<int> num_feats_;  // stored after the blocks holding them
+  boost::atomic<int> k_;
+  AtomicDouble u_;
+};
+
 #endif
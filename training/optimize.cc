@@ -81,8 +81,9 @@ string LBFGSOptimizer::Name() const {
   return "LBFGSOptimizer";
 }
 
-LBFGSOptimizer::LBFGSOptimizer(int num_feats, int memory_buffers) :
-  opt_(num_feats, memory_buffers) {}
+LBFGSOptimizer::LBFGSOptimizer(int num_feats, int memory_buffers,
+                               bool float_history, unsigned threads) :
+  opt_(num_feats, memory_buffers, 20, 0.9, 1e-16, 1e-20, 1e20, float_history, threads) {}
 
 void LBFGSOptimizer::SaveImpl(ostream* out) const {
   opt_.serialize(out);
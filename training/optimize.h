@@ -78,7 +78,10 @@ class RPropOptimizer : public BatchOptimizer {
 
 class LBFGSOptimizer : public BatchOptimizer {
  public:
-  explicit LBFGSOptimizer(int num_vars, int memory_buffers = 10);
+  // float_history halves the memory taken by the memory_buffers correction
+  // pairs; threads are used for the vector operations of each update
+  explicit LBFGSOptimizer(int num_vars, int memory_buffers = 10,
+                          bool float_history = false, unsigned threads = 1);
   std::string Name() const;
   void SaveImpl(std::ostream* out) const;
   void LoadImpl(std::istream* in);
@@ -1,4 +1,5 @@
 #include <cassert>
+#include <cmath>
 #include <iostream>
 #include <sstream>
 #include <boost/program_options/variables_map.hpp>
@@ -6,6 +7,7 @@
 #include "online_optimizer.h"
 #include "sparse_vector.h"
 #include "fdict.h"
+#include "parallel_for.h"
 
 using namespace std;
 
@@ -108,11 +110,48 @@ void TestOnline() {
   assert(r->eta(10) < r->eta(1));
 }
 
+// each thread sends 250 gradients, with features spread over several
+// blocks of the optimizer's weights
+struct HogwildUpdates {
+  explicit HogwildUpdates(HogwildCumulativeL1OnlineOptimizer* o) : opt(o) {}
+  void operator()(unsigned t) const {
+    SparseVector<double> g;
+    for (int i = 1; i < 200000; i += 997) g.set_value(i, 1.0);
+    g.set_value(200000 + t, 1.0);
+    for (int k = 0; k < 250; ++k) opt->UpdateWeights(g);
+  }
+  HogwildCumulativeL1OnlineOptimizer* opt;
+};
+
+void TestHogwild() {
+  const size_t N = 20;
+  shared_ptr<LearningRateSchedule> r(new StandardLearningRate(N, 0.2));
+  // without a penalty every update is kept, in whichever order they happen
+  HogwildCumulativeL1OnlineOptimizer opt(r, N, 0.0, std::vector<int>(1, 998));
+  opt.SetWeights(std::vector<double>(10, 1.0));
+  RunThreads(4, HogwildUpdates(&opt));
+  opt.ApplyPenalties();
+  double sum = 0;
+  for (int k = 1; k <= 1000; ++k) sum += r->eta(k);
+  vector<double> w;
+  opt.GetWeights(&w);
+  assert(w.size() == 200004);
+  assert(w[0] == 1.0);
+  assert(fabs(w[1] - (1.0 + sum)) < 1e-9);
+  assert(w[2] == 1.0);
+  assert(w[998] == 0.0);  // frozen
+  assert(fabs(w[199401] - sum) < 1e-9);
+  // each step size went to one thread's feature
+  assert(fabs(w[200000] + w[200001] + w[200002] + w[200003] - sum) < 1e-9);
+  assert(w[199999] == 0.0);
+}
+
 int main() {
   int n = 3;
   TestOptimizerVariants<LBFGSOptimizer>(n);
   TestOptimizerVariants<RPropOptimizer>(n);
   TestOnline();
+  TestHogwild();
   return 0;
 }
 
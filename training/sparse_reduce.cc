@@ -0,0 +1,245 @@
+#include "sparse_reduce.h"
+
+#include <algorithm>
+#include <cassert>
+
+using namespace std;
+
+void SparseSum::FromSparseVector(const SparseVector<double>& v) {
+  pairs_.clear();
+  for (SparseVector<double>::const_iterator it = v.begin(); it != v.end(); ++it)
+    if (it->second) pairs_.push_back(make_pair(it->first, it->second));
+  sort(pairs_.begin(), pairs_.end());
+  is_dense = false;
+  dense.clear();
+  ids.resize(pairs_.size());
+  vals.resize(pairs_.size());
+  for (int i = 0; i < pairs_.size(); ++i) {
+    ids[i] = pairs_[i].first;
+    vals[i] = pairs_[i].second;
+  }
+  dim = pairs_.empty() ? 0 : pairs_.back().first + 1;
+  CheckDensity();
+}
+
+void SparseSum::FromVector(const vector<double>& v) {
+  dim = v.size();
+  ids.clear();
+  vals.clear();
+  dense.clear();
+  is_dense = false;
+  for (int i = 0; i < v.size(); ++i) {
+    if (v[i]) {
+      ids.push_back(i);
+      vals.push_back(v[i]);
+    }
+  }
+  CheckDensity();
+}
+
+void SparseSum::ToVector(vector<double>* v) const {
+  if (v->size() < dim) v->resize(dim);
+  fill(v->begin(), v->end(), 0.0);
+  if (is_dense) {
+    copy(dense.begin(), dense.end(), v->begin());
+  } else {
+    for (int i = 0; i < ids.size(); ++i)
+      (*v)[ids[i]] = vals[i];
+  }
+}
+
+void SparseSum::ToSparseVector(SparseVector<double>* v) const {
+  v->clear();
+  if (is_dense) {
+    for (int i = 0; i < dense.size(); ++i)
+      if (dense[i]) v->set_value(i, dense[i]);
+  } else {
+    for (int i = 0; i < ids.size(); ++i)
+      v->set_value(ids[i], vals[i]);
+  }
+}
+
+void SparseSum::CheckDensity() {
+  if (is_dense || ids.size() <= max_density * dim) return;
+  dense.assign(dim, 0.0);
+  for (int i = 0; i < ids.size(); ++i)
+    dense[ids[i]] = vals[i];
+  ids.clear();
+  vals.clear();
+  is_dense = true;
+}
+
+void SparseSum::Add(const SparseSum& o) {
+  if (o.is_dense || is_dense) {
+    if (!is_dense) {
+      dim = max(dim, o.dim);
+      CheckDensity();
+      if (!is_dense) {  // o is dense, this sum is sparse
+        SparseSum t = o;
+        t.Add(*this);
+        is_dense = true;
+        dim = t.dim;
+        ids.swap(t.ids);
+        vals.swap(t.vals);
+        dense.swap(t.dense);
+        return;
+      }
+    }
+    if (dense.size() < o.dim) dense.resize(o.dim);
+    dim = dense.size();
+    if (o.is_dense) {
+      for (int i = 0; i < o.dense.size(); ++i)
+        dense[i] += o.dense[i];
+    } else {
+      for (int i = 0; i < o.ids.size(); ++i)
+        dense[o.ids[i]] += o.vals[i];
+    }
+    return;
+  }
+  // merge the sorted id lists
+  merged_ids_.clear();
+  merged_vals_.clear();
+  int i = 0, j = 0;
+  while (i < ids.size() || j < o.ids.size()) {
+    if (j == o.ids.size() || (i < ids.size() && ids[i] < o.ids[j])) {
+      merged_ids_.push_back(ids[i]);
+      merged_vals_.push_back(vals[i++]);
+    } else if (i == ids.size() || o.ids[j] < ids[i]) {
+      merged_ids_.push_back(o.ids[j]);
+      merged_vals_.push_back(o.vals[j++]);
+    } else {
+      merged_ids_.push_back(ids[i]);
+      merged_vals_.push_back(vals[i++] + o.vals[j++]);
+    }
+  }
+  ids.swap(merged_ids_);
+  vals.swap(merged_vals_);
+  dim = max(dim, o.dim);
+  CheckDensity();
+}
+
+void SparseSum::GetHeader(int* header) const {
+  header[0] = is_dense ? -1 : static_cast<int>(ids.size());
+  header[1] = dim;
+}
+
+void SparseSum::SetHeader(const int* header) {
+  is_dense = header[0] < 0;
+  dim = header[1];
+  if (is_dense) {
+    ids.clear();
+    vals.clear();
+    dense.resize(dim);
+  } else {
+    dense.clear();
+    ids.resize(header[0]);
+    vals.resize(header[0]);
+  }
+}
+
+#ifdef HAVE_MPI
+
+namespace mpi = boost::mpi;
+
+namespace {
+const int kTAG = 4711;
+}
+
+SparseVectorReducer::SparseVectorReducer(const mpi::communicator& world, double max_density) :
+    world_(world), max_density_(max_density), bytes_sent_(), received_(max_density) {}
+
+void SparseVectorReducer::Send(int dest, const SparseSum& b) {
+  int header[2];
+  b.GetHeader(header);
+  world_.send(dest, kTAG, header, 2);
+  bytes_sent_ += sizeof(header);
+  if (b.is_dense) {
+    if (b.dim) world_.send(dest, kTAG, &b.dense[0], b.dim);
+    bytes_sent_ += b.dim * sizeof(double);
+  } else if (b.ids.size()) {
+    world_.send(dest, kTAG, &b.ids[0], b.ids.size());
+    world_.send(dest, kTAG, &b.vals[0], b.vals.size());
+    bytes_sent_ += b.ids.size() * (sizeof(int) + sizeof(double));
+  }
+}
+
+void SparseVectorReducer::Receive(int src, SparseSum* b) {
+  int header[2];
+  world_.recv(src, kTAG, header, 2);
+  b->SetHeader(header);
+  if (b->is_dense) {
+    if (b->dim) world_.recv(src, kTAG, &b->dense[0], b->dim);
+  } else if (header[0]) {
+    world_.recv(src, kTAG, &b->ids[0], header[0]);
+    world_.recv(src, kTAG, &b->vals[0], header[0]);
+  }
+}
+
+// binomial tree: in round k, every process whose rank has bit k set (and no
+// lower bits) sends its partial sum to the process 2^k below it
+void SparseVectorReducer::ReduceSum(SparseSum* b) {
+  const int rank = world_.rank();
+  for (int mask = 1; mask < world_.size(); mask <<= 1) {
+    if (rank & mask) {
+      Send(rank - mask, *b);
+      return;
+    }
+    if (rank + mask < world_.size()) {
+      Receive(rank + mask, &received_);
+      b->Add(received_);
+    }
+  }
+}
+
+void SparseVectorReducer::BroadcastSum(SparseSum* b) {
+  const bool is_root = world_.rank() == 0;
+  int header[2];
+  b->GetHeader(header);
+  mpi::broadcast(world_, header, 2, 0);
+  size_t bytes = sizeof(header);
+  if (!is_root) b->SetHeader(header);
+  if (b->is_dense) {
+    if (b->dim) mpi::broadcast(world_, &b->dense[0], b->dim, 0);
+    bytes += b->dim * sizeof(double);
+  } else {
+    if (header[0]) {
+      mpi::broadcast(world_, &b->ids[0], header[0], 0);
+      mpi::broadcast(world_, &b->vals[0], header[0], 0);
+    }
+    bytes += header[0] * (sizeof(int) + sizeof(double));
+  }
+  if (is_root) bytes_sent_ += bytes * (world_.size() - 1);
+}
+
+void SparseVectorReducer::Reduce(const SparseVector<double>& v, vector<double>* sum) {
+  SparseSum b(max_density_);
+  b.FromSparseVector(v);
+  ReduceSum(&b);
+  if (world_.rank() == 0) b.ToVector(sum);
+}
+
+void SparseVectorReducer::Reduce(const SparseVector<double>& v, SparseVector<double>* sum) {
+  SparseSum b(max_density_);
+  b.FromSparseVector(v);
+  ReduceSum(&b);
+  if (world_.rank() == 0) b.ToSparseVector(sum);
+}
+
+void SparseVectorReducer::Broadcast(vector<double>* v) {
+  SparseSum b(max_density_);
+  if (world_.rank() == 0) b.FromVector(*v);
+  BroadcastSum(&b);
+  if (world_.rank() != 0) {
+    v->clear();
+    b.ToVector(v);
+  }
+}
+
+void SparseVectorReducer::Broadcast(SparseVector<double>* v) {
+  SparseSum b(max_density_);
+  if (world_.rank() == 0) b.FromSparseVector(*v);
+  BroadcastSum(&b);
+  if (world_.rank() != 0) b.ToSparseVector(v);
+}
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef _SPARSE_REDUCE_H_
+#define _SPARSE_REDUCE_H_
+
+#include "config.h"
+
+#include <vector>
+#ifdef HAVE_MPI
+#include <boost/mpi.hpp>
+#endif
+
+#include "sparse_vector.h"
+
+// A partial sum of feature vectors, either as arrays of feature ids (in
+// increasing order) and values or as a dense array.  Once more than
+// max_density of its entries are nonzero, it switches to the dense array
+// (with 4 byte ids and 8 byte values, the sparse form stops paying off at a
+// density of 2/3).
+struct SparseSum {
+  explicit SparseSum(double d) : max_density(d), is_dense(false), dim() {}
+
+  void FromSparseVector(const SparseVector<double>& v);
+  void FromVector(const std::vector<double>& v);
+  // the dense vector is zero filled and grown if needed
+  void ToVector(std::vector<double>* v) const;
+  void ToSparseVector(SparseVector<double>* v) const;
+  // switches to the dense array if the sum is too dense
+  void CheckDensity();
+  void Add(const SparseSum& o);
+
+  // A message is a header of two ints, the number of nonzeros (or -1 if the
+  // vector is dense) and the dimension, followed by the ids and values or
+  // the dense array.  SetHeader sizes the arrays to receive them.
+  void GetHeader(int* header) const;
+  void SetHeader(const int* header);
+
+  double max_density;
+  bool is_dense;
+  int dim;  // one more than the largest feature id
+  std::vector<int> ids;
+  std::vector<double> vals;
+  std::vector<double> dense;
+
+ private:
+  std::vector<std::pair<int, double> > pairs_;
+  std::vector<int> merged_ids_;
+  std::vector<double> merged_vals_;
+};
+
+#ifdef HAVE_MPI
+
+// Sums (and broadcasts) feature vectors across MPI processes without
+// sending the zeros.  Vectors travel as SparseSums, and partial sums are
+// merged up a binomial tree towards rank 0.
+class SparseVectorReducer {
+ public:
+  SparseVectorReducer(const boost::mpi::communicator& world, double max_density);
+
+  // sets sum to the sum of v over all processes on rank 0 (other ranks are
+  // left unchanged).  The dense sum is zero filled and grown if needed.
+  void Reduce(const SparseVector<double>& v, std::vector<double>* sum);
+  void Reduce(const SparseVector<double>& v, SparseVector<double>* sum);
+
+  // copies v from rank 0 to all other processes
+  void Broadcast(std::vector<double>* v);
+  void Broadcast(SparseVector<double>* v);
+
+  // bytes sent by this process since the last call to ResetBytesSent().  A
+  // broadcast is counted at the root as one copy per receiving process.
+  size_t BytesSent() const { return bytes_sent_; }
+  void ResetBytesSent() { bytes_sent_ = 0; }
+
+  // bytes sent by all processes together for a dense reduce or broadcast of
+  // a vector with dim entries
+  size_t DenseBytes(int dim) const {
+    return static_cast<size_t>(world_.size() - 1) * dim * sizeof(double);
+  }
+
+ private:
+  void Send(int dest, const SparseSum& b);
+  void Receive(int src, SparseSum* b);
+  void ReduceSum(SparseSum* b);
+  void BroadcastSum(SparseSum* b);
+
+  const boost::mpi::communicator& world_;
+  const double max_density_;
+  size_t bytes_sent_;
+  SparseSum received_;
+};
+
+#endif
+#endif
@@ -0,0 +1,148 @@
+#include "sparse_reduce.h"
+
+#include <gtest/gtest.h>
+#include <vector>
+
+using namespace std;
+
+static SparseVector<double> Vec(int n, const int* ids, const double* vals) {
+  SparseVector<double> v;
+  for (int i = 0; i < n; ++i) v.set_value(ids[i], vals[i]);
+  return v;
+}
+
+TEST(SparseSumTest, FromSparseVector) {
+  const int ids[] = { 7, 2, 4 };
+  const double vals[] = { 1.5, -2, 0 };
+  SparseSum s(0.9);
+  s.FromSparseVector(Vec(3, ids, vals));
+  // zeros are dropped and the ids sorted
+  EXPECT_FALSE(s.is_dense);
+  EXPECT_EQ(8, s.dim);
+  ASSERT_EQ(2, s.ids.size());
+  EXPECT_EQ(2, s.ids[0]);
+  EXPECT_EQ(7, s.ids[1]);
+  EXPECT_EQ(-2, s.vals[0]);
+  EXPECT_EQ(1.5, s.vals[1]);
+}
+
+TEST(SparseSumTest, AddSparse) {
+  const int ids1[] = { 1, 5 };
+  const double vals1[] = { 1, 2 };
+  const int ids2[] = { 2, 5, 11 };
+  const double vals2[] = { 3, 4, 5 };
+  SparseSum a(0.9), b(0.9);
+  a.FromSparseVector(Vec(2, ids1, vals1));
+  b.FromSparseVector(Vec(3, ids2, vals2));
+  a.Add(b);
+  EXPECT_FALSE(a.is_dense);
+  EXPECT_EQ(12, a.dim);
+  const int ids[] = { 1, 2, 5, 11 };
+  const double vals[] = { 1, 3, 6, 5 };
+  ASSERT_EQ(4, a.ids.size());
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(ids[i], a.ids[i]);
+    EXPECT_EQ(vals[i], a.vals[i]);
+  }
+}
+
+TEST(SparseSumTest, AddSparseAndDenseOfOtherDims) {
+  vector<double> d(3);
+  d[0] = 1; d[1] = 2; d[2] = 3;
+  const int ids[] = { 7 };
+  const double vals[] = { 5 };
+  vector<double> expected(8);
+  expected[0] = 1; expected[1] = 2; expected[2] = 3; expected[7] = 5;
+  for (int dense_first = 0; dense_first < 2; ++dense_first) {
+    SparseSum dense(0.5), sparse(0.5);
+    dense.FromVector(d);
+    sparse.FromSparseVector(Vec(1, ids, vals));
+    ASSERT_TRUE(dense.is_dense);
+    ASSERT_FALSE(sparse.is_dense);
+    SparseSum& sum = dense_first ? dense : sparse;
+    sum.Add(dense_first ? sparse : dense);
+    EXPECT_TRUE(sum.is_dense);
+    EXPECT_EQ(8, sum.dim);
+    vector<double> v;
+    sum.ToVector(&v);
+    EXPECT_EQ(expected, v);
+  }
+}
+
+TEST(SparseSumTest, CrossesDensityThreshold) {
+  const int ids1[] = { 0, 9 };
+  const double vals1[] = { 1, 1 };
+  const int ids2[] = { 1, 2, 3, 9 };
+  const double vals2[] = { 2, 3, 4, 1 };
+  SparseSum a(0.5), b(0.5);
+  a.FromSparseVector(Vec(2, ids1, vals1));
+  b.FromSparseVector(Vec(4, ids2, vals2));
+  EXPECT_FALSE(a.is_dense);
+  EXPECT_FALSE(b.is_dense);
+  a.Add(b);  // 5 of 10 entries are nonzero
+  EXPECT_FALSE(a.is_dense);
+  const int ids3[] = { 5 };
+  const double vals3[] = { 6 };
+  b.FromSparseVector(Vec(1, ids3, vals3));
+  a.Add(b);  // 6 of 10
+  EXPECT_TRUE(a.is_dense);
+  EXPECT_TRUE(a.ids.empty());
+  ASSERT_EQ(10, a.dense.size());
+  const double expected[] = { 1, 2, 3, 4, 0, 6, 0, 0, 0, 2 };
+  for (int i = 0; i < 10; ++i) EXPECT_EQ(expected[i], a.dense[i]);
+  SparseVector<double> v;
+  a.ToSparseVector(&v);
+  EXPECT_EQ(6, v.size());
+  EXPECT_EQ(2, v.value(9));
+}
+
+// copies a sum field by field as the reducer sends it
+static void SendAndReceive(const SparseSum& from, SparseSum* to) {
+  int header[2];
+  from.GetHeader(header);
+  to->SetHeader(header);
+  if (from.is_dense) {
+    ASSERT_EQ(from.dense.size(), to->dense.size());
+    copy(from.dense.begin(), from.dense.end(), to->dense.begin());
+  } else {
+    ASSERT_EQ(from.ids.size(), to->ids.size());
+    ASSERT_EQ(from.vals.size(), to->vals.size());
+    copy(from.ids.begin(), from.ids.end(), to->ids.begin());
+    copy(from.vals.begin(), from.vals.end(), to->vals.begin());
+  }
+}
+
+TEST(SparseSumTest, WireFormat) {
+  const int ids[] = { 3, 100, 42 };
+  const double vals[] = { 0.25, -1e10, 7 };
+  const SparseVector<double> v = Vec(3, ids, vals);
+  vector<double> d(4, 1.0);
+  d[2] = 0;
+  SparseSum sparse(0.5), dense(0.5), empty(0.5);
+  sparse.FromSparseVector(v);
+  dense.FromVector(d);
+  empty.FromSparseVector(SparseVector<double>());
+  ASSERT_FALSE(sparse.is_dense);
+  ASSERT_TRUE(dense.is_dense);
+  const SparseSum* sums[] = { &sparse, &dense, &empty };
+  for (int i = 0; i < 3; ++i) {
+    // the receiving sum starts out in the other representation
+    SparseSum r(0.5);
+    if (sums[i]->is_dense) r.FromSparseVector(v); else r.FromVector(d);
+    SendAndReceive(*sums[i], &r);
+    EXPECT_EQ(sums[i]->is_dense, r.is_dense);
+    EXPECT_EQ(sums[i]->dim, r.dim);
+    SparseVector<double> sent, received;
+    sums[i]->ToSparseVector(&sent);
+    r.ToSparseVector(&received);
+    EXPECT_TRUE(sent == received);
+    vector<double> dv;
+    r.ToVector(&dv);
+    EXPECT_EQ(r.dim, dv.size());
+  }
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
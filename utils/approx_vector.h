@@ -0,0 +1,63 @@
+#ifndef _APPROX_VECTOR_H_
+#define _APPROX_VECTOR_H_
+
+// Hashing and comparison of feature vectors that treat values as equal
+// when they agree after rounding away the low 32 bits of their mantissas,
+// so that a hypothesis whose features were printed as text and read back
+// matches the one that was never converted.  Neither depends on the
+// (unspecified) iteration order of SparseVector, and absent features equal
+// features whose value rounds to 0.
+
+#include <boost/functional/hash.hpp>
+
+#include "sparse_vector.h"
+
+struct ApproxVectorHasher {
+  static const size_t MASK = 0xFFFFFFFFull;
+  union UType {
+    double f;
+    size_t i;
+  };
+  static inline double round(const double x) {
+    UType t;
+    t.f = x;
+    size_t r = t.i & MASK;
+    if ((r << 1) > MASK)
+      t.i += MASK - r + 1;
+    else
+      t.i &= ~MASK;
+    return t.f;
+  }
+  size_t operator()(const SparseVector<double>& x) const {
+    size_t h = 0x573915839;
+    size_t fh = 0;
+    for (SparseVector<double>::const_iterator it = x.begin(); it != x.end(); ++it) {
+      UType t;
+      t.f = round(it->second);
+      if (t.f) {
+        size_t y = boost::hash_value(it->first);
+        boost::hash_combine(y, t.i);
+        fh += y;
+      }
+    }
+    boost::hash_combine(h, fh);
+    return h;
+  }
+};
+
+struct ApproxVectorEquals {
+  bool operator()(const SparseVector<double>& a, const SparseVector<double>& b) const {
+    return Contains(a, b) && Contains(b, a);
+  }
+
+ private:
+  // true if every feature of a has the same rounded value in b
+  static bool Contains(const SparseVector<double>& a, const SparseVector<double>& b) {
+    for (SparseVector<double>::const_iterator it = a.begin(); it != a.end(); ++it)
+      if (ApproxVectorHasher::round(it->second) != ApproxVectorHasher::round(b.value(it->first)))
+        return false;
+    return true;
+  }
+};
+
+#endif
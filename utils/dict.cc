@@ -1,7 +1,11 @@
 #include "dict.h"
 
+#include <cstdlib>
+#include <iostream>
 #include <string>
 #include <vector>
+#include <boost/thread/mutex.hpp>
+
 
 void TokenizeStringSeparator(
           const std::string& str,
@@ -22,6 +26,75 @@ void TokenizeStringSeparator(
 
 void Dict::AsVector(const WordID& id, std::vector<std::string>* results) const {
   results->clear();
-  TokenizeStringSeparator(Convert(id), " ||| ", results);
+  TokenizeStringSeparator(CString(id), " ||| ", results);
+}
+
+
+bool Dict::locking_ = false;
+
+WordID Dict::Convert(const std::string& word, bool frozen) {
+  if (snapshot_) {
+    const WordID id = FindInSnapshot(word);
+    if (id) return id;
+  }
+  // single-threaded programs don't pay for the lock
+  boost::unique_lock<boost::mutex> lock(mutex_, boost::defer_lock);
+  if (locking_) lock.lock();
+  Map::iterator i = d_.find(word);
+  if (i != d_.end())
+    return i->second;
+  if (frozen)
+    return 0;
+  const int n = size_;
+  const int b = 31 - __builtin_clz(n / kFIRST_BLOCK + 1);
+  if (!blocks_[b]) blocks_[b] = new std::string[kFIRST_BLOCK << b];
+  blocks_[b][n - kFIRST_BLOCK * ((1 << b) - 1)] = word;
+  size_ = n + 1;
+  const WordID id = max();
+  d_[word] = id;
+  return id;
+}
+
+WordID Dict::FindInSnapshot(const std::string& word) const {
+  return snapshot_->Find(word);
 }
 
+void Dict::LoadSnapshot(const std::string& file) {
+  if (snapshot_ && snapshot_->file() == file) return;
+  boost::shared_ptr<DictSnapshot> snapshot(new DictSnapshot(file));
+  const int n = max();
+  if (num_snapshot_ > 0 || n > snapshot->size()) {
+    std::cerr << file << ": dictionary already has " << n << " words, the snapshot has " << snapshot->size() << std::endl;
+    abort();
+  }
+  for (WordID id = 1; id <= n; ++id) {
+    const std::string& word = StoredWord(id);
+    if (snapshot->Find(word) != id) {
+      std::cerr << file << ": snapshot does not give '" << word << "' its id " << id << std::endl;
+      abort();
+    }
+  }
+  num_prefix_ = size_;
+  d_.clear();
+  snapshot_ = snapshot;
+  num_snapshot_ = snapshot->size();
+}
+
+void Dict::WriteSnapshot(const std::string& file) const {
+  std::vector<std::string> words(max());
+  for (WordID id = 1; id <= max(); ++id)
+    words[id - 1] = CString(id);
+  DictSnapshot::Write(words, file);
+}
+
+void Dict::clear() {
+  for (int b = 0; b < kNUM_BLOCKS; ++b) {
+    delete[] blocks_[b];
+    blocks_[b] = NULL;
+  }
+  size_ = 0;
+  d_.clear();
+  snapshot_.reset();
+  num_snapshot_ = 0;
+  num_prefix_ = 0;
+}
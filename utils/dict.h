@@ -2,24 +2,40 @@
 #define DICT_H_
 
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 
+#include <map>
 #include <string>
 #include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
 #include "hash.h"
 #include "wordid.h"
+#include "dict_snapshot.h"
 
+// Words may be added and looked up on several threads at once once a
+// program that starts threads has called EnableLocking: then Convert(word)
+// takes a lock.  CString(id) never needs one since the strings of words
+// never move.  LoadSnapshot and clear must not run concurrently with other
+// calls.
 class Dict {
  typedef
  HASH_MAP<std::string, WordID, boost::hash<std::string> > Map;
  public:
-  Dict() : b0_("<bad0>") {
+  Dict() : b0_("<bad0>"), num_snapshot_(), num_prefix_(), size_(0) {
     HASH_MAP_EMPTY(d_,"<bad1>");
-    words_.reserve(1000);
+    std::fill(blocks_, blocks_ + kNUM_BLOCKS, static_cast<std::string*>(NULL));
   }
+  ~Dict() { clear(); }
 
-  inline int max() const { return words_.size(); }
+  // makes Convert(word) safe to call from several threads in all
+  // dictionaries; call it before starting the threads
+  static void EnableLocking() { locking_ = true; }
+
+  inline int max() const { return num_snapshot_ + size_ - num_prefix_; }
 
   static bool is_ws(char x) {
     return (x == ' ' || x == '\t');
@@ -45,18 +61,7 @@ class Dict {
       out->push_back(Convert(line.substr(last, cur - last)));
   }
 
-  inline WordID Convert(const std::string& word, bool frozen = false) {
-    Map::iterator i = d_.find(word);
-    if (i == d_.end()) {
-      if (frozen)
-        return 0;
-      words_.push_back(word);
-      d_[word] = words_.size();
-      return words_.size();
-    } else {
-      return i->second;
-    }
-  }
+  WordID Convert(const std::string& word, bool frozen = false);
 
   inline WordID Convert(const std::vector<std::string>& words, bool frozen = false)
   { return Convert(toString(words), frozen); }
@@ -71,20 +76,60 @@ class Dict {
     return word;
   }
 
-  inline const std::string& Convert(const WordID& id) const {
-    if (id == 0) return b0_;
-    assert(id <= (int)words_.size());
-    return words_[id-1];
+  // the word, which points into the mapped file for the words of a snapshot
+  inline const char* CString(const WordID& id) const {
+    if (id > num_prefix_ && id <= num_snapshot_)
+      return snapshot_->Word(id);
+    return StoredWord(id).c_str();
   }
 
   void AsVector(const WordID& id, std::vector<std::string>* results) const;
 
-  void clear() { words_.clear(); d_.clear(); }
+  // Maps a DictSnapshot file so that its words get ids 1 ... #words, and
+  // words added later get the following ids.  The words already in the
+  // dictionary must be the first words of the snapshot (which is the case
+  // when it was written by the same program); aborts otherwise.
+  void LoadSnapshot(const std::string& file);
+  // writes all words to a DictSnapshot file
+  void WriteSnapshot(const std::string& file) const;
+
+  void clear();
 
  private:
+  Dict(const Dict&);
+  void operator=(const Dict&);
+
+  // words are stored in blocks of kFIRST_BLOCK, 2 * kFIRST_BLOCK, 4 *
+  // kFIRST_BLOCK ... strings, which are never reallocated
+  static const int kFIRST_BLOCK = 1024;
+  static const int kNUM_BLOCKS = 22;
+
+  const std::string& Word(int i) const {
+    const int b = 31 - __builtin_clz(i / kFIRST_BLOCK + 1);
+    return blocks_[b][i - kFIRST_BLOCK * ((1 << b) - 1)];
+  }
+  // a word that is not in the snapshot
+  const std::string& StoredWord(const WordID& id) const {
+    if (id == 0) return b0_;
+    if (id <= num_prefix_) return Word(id - 1);
+    assert(id <= max());
+    return Word(id - num_snapshot_ + num_prefix_ - 1);
+  }
+  WordID FindInSnapshot(const std::string& word) const;
+
   const std::string b0_;
-  std::vector<std::string> words_;
+  boost::shared_ptr<DictSnapshot> snapshot_;
+  int num_snapshot_;
+  // the words that were in the dictionary before the snapshot was loaded
+  // are the first num_prefix_ stored words, the words after the snapshot
+  // follow them
+  int num_prefix_;
+  // read without the lock by max(), so stored after the word it counts
+  boost::atomic<int> size_;
+  std::string* blocks_[kNUM_BLOCKS];
   Map d_;
+  boost::mutex mutex_;  // taken to look up and add words if locking_
+  static bool locking_;
 };
 
 #endif
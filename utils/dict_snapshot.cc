@@ -0,0 +1,184 @@
+#include "dict_snapshot.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "murmur_hash.h"
+#include "fdict.h"
+#include "tdict.h"
+
+using namespace std;
+
+namespace {
+
+const char kMAGIC[] = "CDECDIC1";
+const size_t kMAGIC_SIZE = MappedFile::kMAGIC_SIZE;
+const size_t kHEADER_SIZE = kMAGIC_SIZE + 5 * sizeof(uint64_t);
+const unsigned kWORDS_PER_BUCKET = 4;
+const double kLOAD_FACTOR = 0.9;
+// displacements tried for one bucket before the build starts over with
+// another seed
+const uint32_t kMAX_DISPLACEMENT = 1 << 24;
+
+struct Hashes {
+  uint64_t bucket;
+  uint64_t f1, f2;
+};
+
+// the slot of a word is (f1 + d0 * f2 + d1) mod #slots for the
+// displacement d = d0 * #slots + d1 of its bucket
+inline Hashes HashWord(const char* word, size_t len, uint64_t seed,
+                       uint64_t num_buckets, uint64_t num_slots) {
+  const uint64_t h1 = MurmurHash64(word, len, static_cast<unsigned>(seed));
+  const uint64_t h2 = MurmurHash64(word, len, static_cast<unsigned>(seed) + 0x9e3779b9U);
+  Hashes h;
+  h.bucket = h1 % num_buckets;
+  h.f1 = h2 % num_slots;
+  h.f2 = (h2 >> 32) % num_slots;
+  return h;
+}
+
+inline uint64_t Slot(const Hashes& h, uint32_t d, uint64_t num_slots) {
+  return (h.f1 + (d / num_slots) * h.f2 + d % num_slots) % num_slots;
+}
+
+struct BucketSizeGreater {
+  explicit BucketSizeGreater(const vector<vector<uint32_t> >& b) : buckets(b) {}
+  bool operator()(uint32_t a, uint32_t b) const {
+    return buckets[a].size() > buckets[b].size();
+  }
+  const vector<vector<uint32_t> >& buckets;
+};
+
+// finds displacements for all buckets, or returns false if some bucket
+// has none (so that the caller can try another seed)
+bool Displace(const vector<Hashes>& hashes, uint64_t num_buckets, uint64_t num_slots,
+              vector<uint32_t>* displacement, vector<uint32_t>* slot) {
+  vector<vector<uint32_t> > buckets(num_buckets);
+  for (uint32_t i = 0; i < hashes.size(); ++i)
+    buckets[hashes[i].bucket].push_back(i);
+  vector<uint32_t> order(num_buckets);
+  for (uint32_t i = 0; i < num_buckets; ++i) order[i] = i;
+  // place the largest buckets while the table is still empty
+  stable_sort(order.begin(), order.end(), BucketSizeGreater(buckets));
+
+  displacement->assign(num_buckets, 0);
+  slot->assign(num_slots, 0);
+  vector<uint64_t> pos;
+  for (uint32_t o = 0; o < order.size(); ++o) {
+    const vector<uint32_t>& bucket = buckets[order[o]];
+    if (bucket.empty()) break;
+    uint32_t d = 0;
+    for (; d < kMAX_DISPLACEMENT; ++d) {
+      pos.clear();
+      bool ok = true;
+      for (int i = 0; ok && i < bucket.size(); ++i) {
+        const uint64_t s = Slot(hashes[bucket[i]], d, num_slots);
+        ok = (*slot)[s] == 0 && find(pos.begin(), pos.end(), s) == pos.end();
+        pos.push_back(s);
+      }
+      if (ok) break;
+    }
+    if (d == kMAX_DISPLACEMENT) return false;
+    (*displacement)[order[o]] = d;
+    for (int i = 0; i < bucket.size(); ++i)
+      (*slot)[pos[i]] = bucket[i] + 1;
+  }
+  return true;
+}
+
+template <typename T>
+void WriteArray(const vector<T>& v, ostream* out) {
+  if (!v.empty()) out->write(reinterpret_cast<const char*>(&v[0]), v.size() * sizeof(T));
+}
+
+}
+
+DictSnapshot::DictSnapshot(const string& file) :
+    file_(file, kMAGIC, kHEADER_SIZE, "dictionary snapshot") {
+  const char* p = file_.data();
+  uint64_t header[5];
+  memcpy(header, p + kMAGIC_SIZE, sizeof(header));
+  num_words_ = header[0];
+  num_buckets_ = header[1];
+  num_slots_ = header[2];
+  seed_ = header[3];
+  const uint64_t word_bytes = header[4];
+  // the uint32 arrays come after the uint64 ones, so the layout needs no padding
+  file_.CheckSize(kHEADER_SIZE + (num_words_ + 1) * sizeof(uint64_t) +
+                  (num_buckets_ + num_slots_) * sizeof(uint32_t) + word_bytes);
+  if (num_buckets_ == 0 || num_slots_ == 0) file_.Corrupt("header");
+  p += kHEADER_SIZE;
+  word_start_ = reinterpret_cast<const uint64_t*>(p);
+  p += (num_words_ + 1) * sizeof(uint64_t);
+  displacement_ = reinterpret_cast<const uint32_t*>(p);
+  p += num_buckets_ * sizeof(uint32_t);
+  slot_ = reinterpret_cast<const uint32_t*>(p);
+  p += num_slots_ * sizeof(uint32_t);
+  words_ = p;
+  // the arrays are as long as the vocabulary, so they are checked here
+  file_.CheckStrings(word_start_, num_words_, words_, word_bytes, "word_start");
+  for (uint64_t i = 0; i < num_slots_; ++i)
+    if (slot_[i] > num_words_) file_.Corrupt("slot");
+}
+
+DictSnapshot::~DictSnapshot() {}
+
+WordID DictSnapshot::Find(const char* word, size_t len) const {
+  const Hashes h = HashWord(word, len, seed_, num_buckets_, num_slots_);
+  const WordID id = slot_[Slot(h, displacement_[h.bucket], num_slots_)];
+  if (id == 0 || Length(id) != len || memcmp(Word(id), word, len) != 0) return 0;
+  return id;
+}
+
+void DictSnapshot::Write(const vector<string>& words, const string& file) {
+  const uint64_t num_buckets = words.size() / kWORDS_PER_BUCKET + 1;
+  const uint64_t num_slots = static_cast<uint64_t>(words.size() / kLOAD_FACTOR) + 1;
+  vector<uint32_t> displacement, slot;
+  vector<Hashes> hashes(words.size());
+  uint64_t seed = 0;
+  for (;; ++seed) {
+    for (int i = 0; i < words.size(); ++i)
+      hashes[i] = HashWord(words[i].data(), words[i].size(), seed, num_buckets, num_slots);
+    if (Displace(hashes, num_buckets, num_slots, &displacement, &slot)) break;
+    if (seed == 100) {
+      // this only happens if a word occurs twice
+      cerr << file << ": failed to build a perfect hash, are the words distinct?\n";
+      abort();
+    }
+  }
+  vector<uint64_t> word_start(1, 0);
+  for (int i = 0; i < words.size(); ++i)
+    word_start.push_back(word_start.back() + words[i].size() + 1);
+
+  ofstream out(file.c_str(), ios::binary);
+  const uint64_t header[5] = { words.size(), num_buckets, num_slots, seed, word_start.back() };
+  out.write(kMAGIC, kMAGIC_SIZE);
+  out.write(reinterpret_cast<const char*>(header), sizeof(header));
+  WriteArray(word_start, &out);
+  WriteArray(displacement, &out);
+  WriteArray(slot, &out);
+  for (int i = 0; i < words.size(); ++i)
+    out.write(words[i].c_str(), words[i].size() + 1);
+  if (!out) {
+    cerr << "Failed to write " << file << endl;
+    abort();
+  }
+}
+
+bool DictSnapshot::IsDictSnapshot(const string& file) {
+  return MappedFile::FileHasMagic(file, kMAGIC);
+}
+
+void LoadDictionarySnapshots(const string& prefix) {
+  FD::LoadSnapshot(prefix + ".fd");
+  TD::LoadSnapshot(prefix + ".td");
+}
+
+void WriteDictionarySnapshots(const string& prefix) {
+  FD::WriteSnapshot(prefix + ".fd");
+  TD::WriteSnapshot(prefix + ".td");
+}
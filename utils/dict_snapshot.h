@@ -0,0 +1,89 @@
+#ifndef _DICT_SNAPSHOT_H_
+#define _DICT_SNAPSHOT_H_
+
+// A read-only copy of the words of a Dict (for example the feature names
+// in FD once it is frozen) stored in a binary file that is mapped into
+// memory.  Loading does no per-word work, and a Dict that loads the file
+// assigns every word the id it had in the process that wrote it, so all
+// tools that load the same snapshot share ids.
+//
+// Words are found with a minimal-collision perfect hash ("hash, displace"):
+// each word hashes to a bucket, and the bucket's displacement picks the
+// slot of every word in it so that no two words share a slot.  A lookup is
+// two hashes and one string comparison, and allocates nothing.
+//
+// File layout (native byte order, every array aligned to its type):
+//   "CDECDIC1" uint64(#words) uint64(#buckets) uint64(#slots) uint64(seed)
+//              uint64(#bytes of words)
+//   uint64 word_start[#words + 1]  offset of word i+1 in the word area
+//   uint32 displacement[#buckets]
+//   uint32 slot[#slots]            id of the word in each slot, 0 if empty
+//   char   words[#bytes]           the words in id order, each terminated
+//                                  by a 0
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <boost/program_options.hpp>
+#include <boost/program_options/variables_map.hpp>
+
+#include "wordid.h"
+#include "mapped_file.h"
+
+class DictSnapshot {
+ public:
+  // maps file into memory; aborts if it is not a dictionary snapshot
+  explicit DictSnapshot(const std::string& file);
+  ~DictSnapshot();
+
+  // the id (1 ... size()) of word, or 0 if it is not in the snapshot
+  WordID Find(const char* word, size_t len) const;
+  WordID Find(const std::string& word) const { return Find(word.data(), word.size()); }
+
+  const char* Word(WordID id) const { return words_ + word_start_[id - 1]; }
+  size_t Length(WordID id) const { return word_start_[id] - word_start_[id - 1] - 1; }
+  size_t size() const { return num_words_; }
+  const std::string& file() const { return file_.file(); }
+
+  // writes words, which must be distinct, so that word i gets id i+1
+  static void Write(const std::vector<std::string>& words, const std::string& file);
+
+  // true if file starts with the magic number of a snapshot
+  static bool IsDictSnapshot(const std::string& file);
+
+ private:
+  DictSnapshot(const DictSnapshot&);
+  void operator=(const DictSnapshot&);
+
+  const MappedFile file_;
+  uint64_t num_words_;
+  uint64_t num_buckets_;
+  uint64_t num_slots_;
+  uint64_t seed_;
+  const uint64_t* word_start_;
+  const uint32_t* displacement_;
+  const uint32_t* slot_;
+  const char* words_;
+};
+
+// Tools load the snapshots FILE.fd and FILE.td into FD and TD before they
+// read weights, grammars or feature vectors (the --dictionary_snapshot
+// option), so that all processes of a job share ids.  Loading the files
+// that are already loaded does nothing.
+void LoadDictionarySnapshots(const std::string& prefix);
+
+// adds the --dictionary_snapshot option to opts
+inline void AddDictionarySnapshotOption(boost::program_options::options_description* opts) {
+  opts->add_options()
+        ("dictionary_snapshot", boost::program_options::value<std::string>(), "Load the feature and word dictionaries from the snapshots FILE.fd and FILE.td (written by cdec --write_dictionary_snapshot) so that all processes share ids");
+}
+
+// loads the snapshots named by --dictionary_snapshot, if it was given
+inline void LoadDictionarySnapshots(const boost::program_options::variables_map& conf) {
+  if (conf.count("dictionary_snapshot"))
+    LoadDictionarySnapshots(conf["dictionary_snapshot"].as<std::string>());
+}
+// writes FD and TD to FILE.fd and FILE.td
+void WriteDictionarySnapshots(const std::string& prefix);
+
+#endif
@@ -1,10 +1,15 @@
 #include "dict.h"
 
 #include "fdict.h"
+#include "dict_snapshot.h"
+#include "temp_file_test.h"
 
+#include <cstring>
 #include <iostream>
+#include <sstream>
 #include <gtest/gtest.h>
 #include <cassert>
+#include <boost/thread/thread.hpp>
 
 using namespace std;
 
@@ -24,14 +29,51 @@ TEST_F(DTest, Convert) {
   WordID c = d.Convert(x);
   EXPECT_NE(a, b);
   EXPECT_EQ(a, c);
-  EXPECT_EQ(d.Convert(a), "foo");
-  EXPECT_EQ(d.Convert(b), "bar");
+  EXPECT_STREQ("foo", d.CString(a));
+  EXPECT_STREQ("bar", d.CString(b));
+}
+
+// converts the words word0 ... word9999, starting at a different word on
+// each thread, and then their ids back to strings
+struct ConvertWorker {
+  ConvertWorker(Dict* d, int start, vector<WordID>* ids) : d_(d), start_(start), ids_(ids) {}
+  void operator()() {
+    ids_->resize(10000);
+    for (int k = 0; k < 10000; ++k) {
+      const int i = (start_ + k) % 10000;
+      ostringstream os;
+      os << "word" << i;
+      (*ids_)[i] = d_->Convert(os.str());
+      if (d_->CString((*ids_)[i]) != os.str()) (*ids_)[i] = -1;
+    }
+  }
+  Dict* d_;
+  int start_;
+  vector<WordID>* ids_;
+};
+
+TEST_F(DTest, ConcurrentConvert) {
+  Dict::EnableLocking();
+  Dict d;
+  vector<vector<WordID> > ids(4);
+  boost::thread_group threads;
+  for (int t = 0; t < ids.size(); ++t)
+    threads.create_thread(ConvertWorker(&d, t * 2500, &ids[t]));
+  threads.join_all();
+  EXPECT_EQ(10000, d.max());
+  for (int i = 0; i < 10000; ++i) {
+    ostringstream os;
+    os << "word" << i;
+    EXPECT_EQ(os.str(), d.CString(ids[0][i]));
+    for (int t = 1; t < ids.size(); ++t)
+      EXPECT_EQ(ids[0][i], ids[t][i]);
+  }
 }
 
 TEST_F(DTest, FDictTest) {
   int fid = FD::Convert("First");
   EXPECT_GT(fid, 0);
-  EXPECT_EQ(FD::Convert(fid), "First");
+  EXPECT_STREQ("First", FD::Convert(fid));
   string x = FD::Escape("=");
   cerr << x << endl;
   EXPECT_NE(x, "=");
@@ -40,6 +82,40 @@ TEST_F(DTest, FDictTest) {
   EXPECT_NE(x, ";");
 }
 
+class DictSnapshotTest : public TempFileTest {};
+
+TEST_F(DictSnapshotTest, Snapshot) {
+  Dict d;
+  for (int i = 0; i < 10000; ++i) {
+    ostringstream os;
+    os << "word" << i;
+    d.Convert(os.str());
+  }
+  d.WriteSnapshot(file_);
+  EXPECT_TRUE(DictSnapshot::IsDictSnapshot(file_));
+
+  Dict e;
+  const WordID w0 = e.Convert("word0");
+  const char* word0 = e.CString(w0);
+  e.LoadSnapshot(file_);
+  EXPECT_EQ(10000, e.max());
+  EXPECT_EQ(w0, e.Convert("word0"));
+  EXPECT_EQ(word0, e.CString(w0));
+  for (WordID id = 1; id <= d.max(); ++id) {
+    EXPECT_EQ(id, e.Convert(d.CString(id), true));
+    EXPECT_STREQ(d.CString(id), e.CString(id));
+    // the words after the prefix are not copied out of the mapped table
+    if (id > 2) {
+      EXPECT_EQ(e.CString(id - 1) + strlen(d.CString(id - 1)) + 1, e.CString(id));
+    }
+  }
+  EXPECT_EQ(0, e.Convert("foo", true));
+  const WordID foo = e.Convert("foo");
+  EXPECT_EQ(10001, foo);
+  EXPECT_STREQ("foo", e.CString(foo));
+  EXPECT_EQ(foo, e.Convert("foo"));
+}
+
 int main(int argc, char** argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
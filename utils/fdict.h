@@ -17,8 +17,17 @@ struct FD {
   static inline WordID Convert(const std::string& s) {
     return dict_.Convert(s, frozen_);
   }
-  static inline const std::string& Convert(const WordID& w) {
-    return dict_.Convert(w);
+  // like TD::Convert, points into the snapshot for its features
+  static inline const char* Convert(const WordID& w) {
+    return dict_.CString(w);
+  }
+  // a snapshot written by WriteSnapshot (usually of a frozen FD) gives all
+  // processes that load it the same feature ids; see Dict::LoadSnapshot
+  static void LoadSnapshot(const std::string& file) {
+    dict_.LoadSnapshot(file);
+  }
+  static void WriteSnapshot(const std::string& file) {
+    dict_.WriteSnapshot(file);
   }
   static std::string Convert(WordID const *i,WordID const* e);
   static std::string Convert(std::vector<WordID> const& v);
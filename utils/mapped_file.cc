@@ -0,0 +1,81 @@
+#include "mapped_file.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+MappedFile::MappedFile(const string& file) : file_(file), data_(NULL), size_() {
+  Map();
+}
+
+MappedFile::MappedFile(const string& file, const char* magic, size_t header_size, const char* what) :
+    file_(file), data_(NULL), size_() {
+  Map();
+  if (size_ < header_size || !HasMagic(magic)) {
+    cerr << file_ << " is not a " << what << endl;
+    abort();
+  }
+}
+
+MappedFile::~MappedFile() {
+  if (data_) munmap(const_cast<char*>(data_), size_);
+}
+
+void MappedFile::Map() {
+  const int fd = open(file_.c_str(), O_RDONLY);
+  if (fd < 0) {
+    perror(file_.c_str());
+    abort();
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    perror(file_.c_str());
+    abort();
+  }
+  size_ = st.st_size;
+  if (size_ > 0) {
+    void* m = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) {
+      perror(file_.c_str());
+      abort();
+    }
+    data_ = static_cast<const char*>(m);
+  }
+  close(fd);
+}
+
+bool MappedFile::HasMagic(const char* magic) const {
+  return size_ >= kMAGIC_SIZE && memcmp(data_, magic, kMAGIC_SIZE) == 0;
+}
+
+void MappedFile::CheckSize(uint64_t expected) const {
+  if (size_ != expected) {
+    cerr << file_ << ": expected " << expected << " bytes, found " << size_ << endl;
+    abort();
+  }
+}
+
+void MappedFile::CheckStrings(const uint64_t* start, uint64_t n, const char* area, uint64_t bytes, const char* name) const {
+  CheckOffsets(start, n, bytes, true, name);
+  for (uint64_t i = 1; i <= n; ++i)
+    if (area[start[i] - 1] != 0) Corrupt(name);
+}
+
+void MappedFile::Corrupt(const char* name) const {
+  cerr << file_ << ": corrupt file, bad " << name << endl;
+  abort();
+}
+
+bool MappedFile::FileHasMagic(const string& file, const char* magic) {
+  ifstream in(file.c_str(), ios::binary);
+  char buf[kMAGIC_SIZE];
+  return in.read(buf, kMAGIC_SIZE) && memcmp(buf, magic, kMAGIC_SIZE) == 0;
+}
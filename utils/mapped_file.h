@@ -0,0 +1,72 @@
+#ifndef _MAPPED_FILE_H_
+#define _MAPPED_FILE_H_
+
+// A read-only file mapped into memory, for the binary formats that are used
+// in place (translation tables, dictionary snapshots, sparse vectors, phrase
+// tables, suffix array indexes).  Each format starts with an 8-byte magic
+// number followed by a header of counts; the reader checks that the file
+// has the size the counts imply, and then the offset arrays, whose entries
+// point into the other arrays, with CheckOffsets (when it maps the file) or
+// CheckRange (when it reads an entry).  All failures abort with a message
+// naming the file.
+
+#include <string>
+#include <stdint.h>
+
+class MappedFile {
+ public:
+  static const size_t kMAGIC_SIZE = 8;
+
+  // maps file into memory (an empty file maps to no data); aborts if it
+  // cannot be opened or mapped
+  explicit MappedFile(const std::string& file);
+  // ... and also unless it starts with magic and is at least header_size
+  // bytes long, where what names the format in the message
+  MappedFile(const std::string& file, const char* magic, size_t header_size, const char* what);
+  ~MappedFile();
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+  const std::string& file() const { return file_; }
+
+  bool HasMagic(const char* magic) const;
+
+  // aborts unless the file is exactly expected bytes long
+  void CheckSize(uint64_t expected) const;
+
+  // aborts unless start[0] ... start[n] rise from 0 to end (strictly if
+  // each entry must be non-empty)
+  template <typename T>
+  void CheckOffsets(const T* start, uint64_t n, uint64_t end, bool strict, const char* name) const {
+    if (start[0] != 0 || start[n] != end) Corrupt(name);
+    for (uint64_t i = 0; i < n; ++i)
+      if (start[i + 1] < start[i] || (strict && start[i + 1] == start[i])) Corrupt(name);
+  }
+  // aborts unless the n strings starting at start[0] ... start[n-1] fill
+  // the area of bytes bytes and each ends with a 0
+  void CheckStrings(const uint64_t* start, uint64_t n, const char* area, uint64_t bytes, const char* name) const;
+
+  // aborts unless begin <= end <= size: the range of entries that an offset
+  // array gives for one item, checked where it is read
+  void CheckRange(uint64_t begin, uint64_t end, uint64_t size, const char* name) const {
+    if (begin > end || end > size) Corrupt(name);
+  }
+
+  // aborts, reporting the array name as corrupt
+  void Corrupt(const char* name) const;
+
+  // true if file can be read and starts with magic
+  static bool FileHasMagic(const std::string& file, const char* magic);
+
+ private:
+  MappedFile(const MappedFile&);
+  void operator=(const MappedFile&);
+
+  void Map();
+
+  const std::string file_;
+  const char* data_;
+  size_t size_;
+};
+
+#endif
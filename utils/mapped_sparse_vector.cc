@@ -0,0 +1,83 @@
+#include "mapped_sparse_vector.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "fdict.h"
+
+using namespace std;
+
+namespace {
+
+const char kMAGIC[] = "CDECSPV1";
+const size_t kMAGIC_SIZE = MappedFile::kMAGIC_SIZE;
+const size_t kHEADER_SIZE = kMAGIC_SIZE + 2 * sizeof(uint64_t) + sizeof(double);
+
+struct NameLess {
+  bool operator()(const pair<const char*, double>& a, const pair<const char*, double>& b) const {
+    return strcmp(a.first, b.first) < 0;
+  }
+};
+
+}
+
+MappedSparseVector::MappedSparseVector(const string& file) :
+    file_(file, kMAGIC, kHEADER_SIZE, "binary sparse vector") {
+  const char* p = file_.data();
+  uint64_t header[2];
+  memcpy(header, p + kMAGIC_SIZE, sizeof(header));
+  memcpy(&objective_, p + kMAGIC_SIZE + sizeof(header), sizeof(double));
+  size_ = header[0];
+  file_.CheckSize(kHEADER_SIZE + size_ * sizeof(double) + (size_ + 1) * sizeof(uint64_t) + header[1]);
+  p += kHEADER_SIZE;
+  values_ = reinterpret_cast<const double*>(p);
+  p += size_ * sizeof(double);
+  name_start_ = reinterpret_cast<const uint64_t*>(p);
+  p += (size_ + 1) * sizeof(uint64_t);
+  names_ = p;
+  file_.CheckStrings(name_start_, size_, names_, header[1], "name_start");
+}
+
+MappedSparseVector::~MappedSparseVector() {}
+
+void MappedSparseVector::AddTo(SparseVector<double>* v) const {
+  for (size_t i = 0; i < size_; ++i)
+    v->add_value(FD::Convert(name(i)), values_[i]);
+}
+
+void MappedSparseVector::Write(double objective, const SparseVector<double>& v, const string& file) {
+  vector<pair<const char*, double> > entries;
+  entries.reserve(v.size());
+  for (SparseVector<double>::const_iterator it = v.begin(); it != v.end(); ++it)
+    entries.push_back(make_pair(FD::Convert(it->first), it->second));
+  sort(entries.begin(), entries.end(), NameLess());
+  vector<double> values(entries.size());
+  vector<uint64_t> name_start(1, 0);
+  for (int i = 0; i < entries.size(); ++i) {
+    values[i] = entries[i].second;
+    name_start.push_back(name_start.back() + strlen(entries[i].first) + 1);
+  }
+
+  ofstream out(file.c_str(), ios::binary);
+  const uint64_t header[2] = { entries.size(), name_start.back() };
+  out.write(kMAGIC, kMAGIC_SIZE);
+  out.write(reinterpret_cast<const char*>(header), sizeof(header));
+  out.write(reinterpret_cast<const char*>(&objective), sizeof(objective));
+  if (!values.empty())
+    out.write(reinterpret_cast<const char*>(&values[0]), values.size() * sizeof(double));
+  out.write(reinterpret_cast<const char*>(&name_start[0]), name_start.size() * sizeof(uint64_t));
+  for (int i = 0; i < entries.size(); ++i)
+    out.write(entries[i].first, name_start[i + 1] - name_start[i]);
+  if (!out) {
+    cerr << "Failed to write " << file << endl;
+    abort();
+  }
+}
+
+bool MappedSparseVector::IsBinarySparseVector(const string& file) {
+  return MappedFile::FileHasMagic(file, kMAGIC);
+}
@@ -0,0 +1,53 @@
+#ifndef _MAPPED_SPARSE_VECTOR_H_
+#define _MAPPED_SPARSE_VECTOR_H_
+
+// A sparse vector of feature values (and an objective) stored in a binary
+// file that is mapped into memory, e.g. the expectations computed over one
+// shard of a corpus.  Unlike B64::Encode, which has to be decoded value by
+// value, readers use the arrays in the file directly.  Features are stored
+// by name, since feature ids differ between processes.
+//
+// File layout (native byte order, every array aligned to its type):
+//   "CDECSPV1" uint64(#entries) uint64(#bytes of names) double(objective)
+//   double value[#entries]
+//   uint64 name_start[#entries + 1]   offset of each name in the name area
+//   char   names[#bytes]              0-terminated and sorted by strcmp
+
+#include <string>
+#include <stdint.h>
+
+#include "sparse_vector.h"
+#include "mapped_file.h"
+
+class MappedSparseVector {
+ public:
+  // maps file into memory; aborts if it is not a binary sparse vector
+  explicit MappedSparseVector(const std::string& file);
+  ~MappedSparseVector();
+
+  size_t size() const { return size_; }
+  double objective() const { return objective_; }
+  const char* name(size_t i) const { return names_ + name_start_[i]; }
+  double value(size_t i) const { return values_[i]; }
+
+  // adds the values to v
+  void AddTo(SparseVector<double>* v) const;
+
+  static void Write(double objective, const SparseVector<double>& v, const std::string& file);
+
+  // true if file starts with the magic number of a binary sparse vector
+  static bool IsBinarySparseVector(const std::string& file);
+
+ private:
+  MappedSparseVector(const MappedSparseVector&);
+  void operator=(const MappedSparseVector&);
+
+  const MappedFile file_;
+  size_t size_;
+  double objective_;
+  const double* values_;
+  const uint64_t* name_start_;
+  const char* names_;
+};
+
+#endif
@@ -0,0 +1,69 @@
+#include <cfloat>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <gtest/gtest.h>
+#include "mapped_sparse_vector.h"
+#include "fdict.h"
+#include "temp_file_test.h"
+
+using namespace std;
+
+class MappedSparseVectorTest : public TempFileTest {};
+
+TEST_F(MappedSparseVectorTest, RoundTrip) {
+  SparseVector<double> v;
+  v.set_value(FD::Convert("MSV_Zeta"), -2.5);
+  v.set_value(FD::Convert("MSV_Alpha"), DBL_MAX);
+  v.set_value(FD::Convert("MSV_Zero"), 0);
+  v.set_value(FD::Convert("MSV_Mid"), 1e-300);
+  MappedSparseVector::Write(-123.75, v, file_);
+
+  MappedSparseVector m(file_);
+  EXPECT_EQ(4, m.size());
+  EXPECT_EQ(-123.75, m.objective());
+  // names are sorted
+  for (size_t i = 1; i < m.size(); ++i)
+    EXPECT_LT(strcmp(m.name(i - 1), m.name(i)), 0);
+  EXPECT_STREQ("MSV_Alpha", m.name(0));
+  EXPECT_EQ(DBL_MAX, m.value(0));
+  for (size_t i = 0; i < m.size(); ++i)
+    EXPECT_EQ(v.value(FD::Convert(m.name(i))), m.value(i)) << m.name(i);
+
+  SparseVector<double> sum;
+  sum.set_value(FD::Convert("MSV_Zeta"), 1);
+  sum.set_value(FD::Convert("MSV_Other"), 3);
+  m.AddTo(&sum);
+  EXPECT_EQ(-1.5, sum.value(FD::Convert("MSV_Zeta")));
+  EXPECT_EQ(3, sum.value(FD::Convert("MSV_Other")));
+  EXPECT_EQ(DBL_MAX, sum.value(FD::Convert("MSV_Alpha")));
+  EXPECT_EQ(1e-300, sum.value(FD::Convert("MSV_Mid")));
+}
+
+TEST_F(MappedSparseVectorTest, Empty) {
+  MappedSparseVector::Write(0.5, SparseVector<double>(), file_);
+  MappedSparseVector m(file_);
+  EXPECT_EQ(0, m.size());
+  EXPECT_EQ(0.5, m.objective());
+  SparseVector<double> sum;
+  m.AddTo(&sum);
+  EXPECT_TRUE(sum.empty());
+}
+
+TEST_F(MappedSparseVectorTest, IsBinary) {
+  MappedSparseVector::Write(0, SparseVector<double>(), file_);
+  EXPECT_TRUE(MappedSparseVector::IsBinarySparseVector(file_));
+  suffixes_.push_back(".txt");
+  const string text = file_ + ".txt";
+  {
+    ofstream out(text.c_str());
+    out << "0\tfeature=1\n";
+  }
+  EXPECT_FALSE(MappedSparseVector::IsBinarySparseVector(text));
+  EXPECT_FALSE(MappedSparseVector::IsBinarySparseVector("no_such_file"));
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,157 @@
+#include "mapped_ttable.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "tdict.h"
+
+using namespace std;
+
+namespace {
+
+const char kMAGIC[] = "CDECTTB1";
+const size_t kMAGIC_SIZE = MappedFile::kMAGIC_SIZE;
+const size_t kHEADER_SIZE = kMAGIC_SIZE + 3 * sizeof(uint64_t);
+const int kUNKNOWN = -2;  // TD id not looked up yet
+
+struct StrLess {
+  bool operator()(const string* a, const string* b) const { return *a < *b; }
+};
+
+template <typename T>
+void WriteArray(const vector<T>& v, ostream* out) {
+  if (!v.empty()) out->write(reinterpret_cast<const char*>(&v[0]), v.size() * sizeof(T));
+}
+
+}
+
+MappedTTable::MappedTTable(const string& file) :
+    file_(file, kMAGIC, kHEADER_SIZE, "binary translation table") {
+  const char* p = file_.data();
+  uint64_t header[3];
+  memcpy(header, p + kMAGIC_SIZE, sizeof(header));
+  num_words_ = header[0];
+  num_entries_ = header[1];
+  const uint64_t word_bytes = header[2];
+  file_.CheckSize(kHEADER_SIZE + 2 * (num_words_ + 1) * sizeof(uint64_t) +
+                  num_entries_ * (sizeof(uint32_t) + sizeof(float)) + word_bytes);
+  p += kHEADER_SIZE;
+  word_start_ = reinterpret_cast<const uint64_t*>(p);
+  p += (num_words_ + 1) * sizeof(uint64_t);
+  row_ = reinterpret_cast<const uint64_t*>(p);
+  p += (num_words_ + 1) * sizeof(uint64_t);
+  trg_ = reinterpret_cast<const uint32_t*>(p);
+  p += num_entries_ * sizeof(uint32_t);
+  log_prob_ = reinterpret_cast<const float*>(p);
+  p += num_entries_ * sizeof(float);
+  words_ = p;
+  // both arrays are as long as the vocabulary, so they are checked here
+  file_.CheckStrings(word_start_, num_words_, words_, word_bytes, "word_start");
+  file_.CheckOffsets(row_, num_words_, num_entries_, false, "row");
+}
+
+MappedTTable::~MappedTTable() {}
+
+int MappedTTable::Find(const char* word) const {
+  int lo = 0, hi = num_words_;
+  while (lo < hi) {
+    const int mid = lo + (hi - lo) / 2;
+    const int c = strcmp(words_ + word_start_[mid], word);
+    if (c == 0) return mid;
+    if (c < 0) lo = mid + 1; else hi = mid;
+  }
+  return -1;
+}
+
+int MappedTTable::Local(WordID w) const {
+  if (w < 0) return -1;
+  if (w >= local_.size()) local_.resize(w + 1, kUNKNOWN);
+  int& l = local_[w];
+  if (l == kUNKNOWN) l = Find(TD::Convert(w));
+  return l;
+}
+
+int64_t MappedTTable::FindEntry(WordID e, WordID f) const {
+  const int le = Local(e);
+  if (le < 0) return -1;
+  const int lf = Local(f);
+  if (lf < 0) return -1;
+  const uint32_t* b = trg_ + row_[le];
+  const uint32_t* end = trg_ + row_[le + 1];
+  const uint32_t* it = lower_bound(b, end, static_cast<uint32_t>(lf));
+  if (it == end || *it != lf) return -1;
+  return it - trg_;
+}
+
+float MappedTTable::LogProb(WordID e, WordID f, float floor) const {
+  const int64_t i = FindEntry(e, f);
+  return i < 0 ? floor : log_prob_[i];
+}
+
+bool MappedTTable::Contains(WordID e, WordID f) const {
+  return FindEntry(e, f) >= 0;
+}
+
+void MappedTTable::Write(const vector<Entry>& entries, const string& file) {
+  // number the words in sorted order
+  vector<const string*> words;
+  words.reserve(entries.size() * 2);
+  for (int i = 0; i < entries.size(); ++i) {
+    words.push_back(&entries[i].src);
+    words.push_back(&entries[i].trg);
+  }
+  sort(words.begin(), words.end(), StrLess());
+  vector<const string*>::iterator wend = words.begin();
+  for (vector<const string*>::iterator it = words.begin(); it != words.end(); ++it)
+    if (wend == words.begin() || **(wend - 1) != **it) *wend++ = *it;
+  words.erase(wend, words.end());
+  vector<uint64_t> word_start(1, 0);
+  for (int i = 0; i < words.size(); ++i)
+    word_start.push_back(word_start.back() + words[i]->size() + 1);
+
+  vector<pair<pair<uint32_t, uint32_t>, float> > pairs(entries.size());
+  for (int i = 0; i < entries.size(); ++i) {
+    const uint32_t e = lower_bound(words.begin(), words.end(), &entries[i].src, StrLess()) - words.begin();
+    const uint32_t f = lower_bound(words.begin(), words.end(), &entries[i].trg, StrLess()) - words.begin();
+    pairs[i] = make_pair(make_pair(e, f), entries[i].log_prob);
+  }
+  sort(pairs.begin(), pairs.end());
+  vector<uint64_t> row(words.size() + 1, 0);
+  vector<uint32_t> trg(pairs.size());
+  vector<float> log_prob(pairs.size());
+  for (int i = 0; i < pairs.size(); ++i) {
+    if (i > 0 && pairs[i].first == pairs[i - 1].first) {
+      cerr << file << ": duplicate entry " << *words[pairs[i].first.first] << ' '
+           << *words[pairs[i].first.second] << endl;
+      abort();
+    }
+    ++row[pairs[i].first.first + 1];
+    trg[i] = pairs[i].first.second;
+    log_prob[i] = pairs[i].second;
+  }
+  for (int i = 0; i < words.size(); ++i)
+    row[i + 1] += row[i];
+
+  ofstream out(file.c_str(), ios::binary);
+  const uint64_t header[3] = { words.size(), pairs.size(), word_start.back() };
+  out.write(kMAGIC, kMAGIC_SIZE);
+  out.write(reinterpret_cast<const char*>(header), sizeof(header));
+  WriteArray(word_start, &out);
+  WriteArray(row, &out);
+  WriteArray(trg, &out);
+  WriteArray(log_prob, &out);
+  for (int i = 0; i < words.size(); ++i)
+    out.write(words[i]->c_str(), words[i]->size() + 1);
+  if (!out) {
+    cerr << "Failed to write " << file << endl;
+    abort();
+  }
+}
+
+bool MappedTTable::IsBinaryTTable(const string& file) {
+  return MappedFile::FileHasMagic(file, kMAGIC);
+}
@@ -0,0 +1,73 @@
+#ifndef _MAPPED_TTABLE_H_
+#define _MAPPED_TTABLE_H_
+
+// A read-only lexical translation table t(f|e), such as the one estimated by
+// model1, stored in a binary file that is mapped into memory.  Loading does
+// no per-entry or per-word work, so even multi-GB tables open instantly and
+// are shared between processes through the page cache.
+//
+// File layout (native byte order, every array aligned to its type):
+//   "CDECTTB1" uint64(#words) uint64(#entries) uint64(#bytes of words)
+//   uint64 word_start[#words + 1]  offset of each word in the word area
+//   uint64 row[#words + 1]         the entries of source word e are
+//                                  row[e] ... row[e+1]-1
+//   uint32 trg[#entries]           target word of each entry, sorted by id
+//                                  within a row
+//   float  log_prob[#entries]      log t(f|e)
+//   char   words[#bytes]           the words, sorted by strcmp and each
+//                                  terminated by a 0
+// Words are numbered by their position in the sorted word list, so the row
+// of a source word is found directly from its number.  TD ids are mapped to
+// these numbers on first use by binary search in the word list.
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "wordid.h"
+#include "mapped_file.h"
+
+class MappedTTable {
+ public:
+  struct Entry {
+    Entry() : log_prob() {}
+    Entry(const std::string& e, const std::string& f, float lp) : src(e), trg(f), log_prob(lp) {}
+    std::string src;
+    std::string trg;
+    float log_prob;
+  };
+
+  // maps file into memory; aborts if it is not a binary translation table
+  explicit MappedTTable(const std::string& file);
+  ~MappedTTable();
+
+  // log t(f|e), or floor if the pair is not in the table
+  float LogProb(WordID e, WordID f, float floor) const;
+  bool Contains(WordID e, WordID f) const;
+
+  size_t NumWords() const { return num_words_; }
+  size_t size() const { return num_entries_; }
+
+  // writes the entries (in any order, each pair at most once) to file
+  static void Write(const std::vector<Entry>& entries, const std::string& file);
+
+  // true if file starts with the magic number of a binary table
+  static bool IsBinaryTTable(const std::string& file);
+
+ private:
+  int Local(WordID w) const;
+  int Find(const char* word) const;
+  int64_t FindEntry(WordID e, WordID f) const;
+
+  const MappedFile file_;
+  uint64_t num_words_;
+  uint64_t num_entries_;
+  const uint64_t* word_start_;
+  const uint64_t* row_;
+  const uint32_t* trg_;
+  const float* log_prob_;
+  const char* words_;
+  mutable std::vector<int> local_;  // TD id -> word number, -1 if not in the table
+};
+
+#endif
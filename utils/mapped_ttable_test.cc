@@ -0,0 +1,69 @@
+#include <fstream>
+#include <vector>
+#include <stdint.h>
+#include <gtest/gtest.h>
+#include "mapped_ttable.h"
+#include "tdict.h"
+#include "temp_file_test.h"
+
+using namespace std;
+
+class MappedTTableTest : public TempFileTest {
+ protected:
+  virtual void SetUp() {
+    ASSERT_NO_FATAL_FAILURE(TempFileTest::SetUp());
+    vector<MappedTTable::Entry> entries;
+    entries.push_back(MappedTTable::Entry("maison", "house", -0.1f));
+    entries.push_back(MappedTTable::Entry("la", "the", -0.2f));
+    entries.push_back(MappedTTable::Entry("<eps>", "the", -1.5f));
+    entries.push_back(MappedTTable::Entry("maison", "home", -2.5f));
+    entries.push_back(MappedTTable::Entry("la", "it", -3.0f));
+    MappedTTable::Write(entries, file_);
+  }
+};
+
+TEST_F(MappedTTableTest, Lookup) {
+  // words the table has not seen yet get TD ids before it is loaded
+  const WordID blue = TD::Convert("bleue");
+  MappedTTable tt(file_);
+  EXPECT_EQ(7, tt.NumWords());
+  EXPECT_EQ(5, tt.size());
+  EXPECT_FLOAT_EQ(-0.1f, tt.LogProb(TD::Convert("maison"), TD::Convert("house"), -100));
+  EXPECT_FLOAT_EQ(-2.5f, tt.LogProb(TD::Convert("maison"), TD::Convert("home"), -100));
+  EXPECT_FLOAT_EQ(-0.2f, tt.LogProb(TD::Convert("la"), TD::Convert("the"), -100));
+  EXPECT_FLOAT_EQ(-3.0f, tt.LogProb(TD::Convert("la"), TD::Convert("it"), -100));
+  EXPECT_FLOAT_EQ(-1.5f, tt.LogProb(TD::Convert("<eps>"), TD::Convert("the"), -100));
+  EXPECT_TRUE(tt.Contains(TD::Convert("la"), TD::Convert("the")));
+  EXPECT_FALSE(tt.Contains(TD::Convert("the"), TD::Convert("la")));
+  EXPECT_FALSE(tt.Contains(TD::Convert("la"), TD::Convert("house")));
+  EXPECT_FALSE(tt.Contains(blue, TD::Convert("blue")));
+  EXPECT_FLOAT_EQ(-100, tt.LogProb(TD::Convert("maison"), blue, -100));
+}
+
+TEST_F(MappedTTableTest, CorruptOffsets) {
+  // point the end of the last row past the entries
+  {
+    fstream f(file_.c_str(), ios::in | ios::out | ios::binary);
+    const uint64_t bad = 6;
+    f.seekp(8 + 3 * sizeof(uint64_t) + (8 + 7) * sizeof(uint64_t));  // row[7]
+    f.write(reinterpret_cast<const char*>(&bad), sizeof(bad));
+  }
+  EXPECT_DEATH(MappedTTable tt(file_), "bad row");
+}
+
+TEST_F(MappedTTableTest, IsBinary) {
+  EXPECT_TRUE(MappedTTable::IsBinaryTTable(file_));
+  suffixes_.push_back(".txt");
+  const string text = file_ + ".txt";
+  {
+    ofstream out(text.c_str());
+    out << "maison house -0.1\n";
+  }
+  EXPECT_FALSE(MappedTTable::IsBinaryTTable(text));
+  EXPECT_FALSE(MappedTTable::IsBinaryTTable("no_such_file"));
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
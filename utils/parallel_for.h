@@ -0,0 +1,57 @@
+#ifndef _PARALLEL_FOR_H_
+#define _PARALLEL_FOR_H_
+
+// Runs a function object on several threads and waits for them.
+//
+//   RunThreads(n, f)              calls f(t) for t = 0 ... n-1
+//   ParallelFor(n, begin, end, f) calls f(i, t) for every i in [begin, end),
+//                                 where t < n is the calling thread's index;
+//                                 each thread takes the next i from a shared
+//                                 counter, so uneven items balance out
+//
+// f(0) runs on the calling thread, so n == 1 starts no threads.  The calls
+// share one f (it is not copied), so operator() is const and f points to
+// any state the threads write.
+
+#include <boost/atomic.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace parallel_for_detail {
+
+template <class F>
+struct ThreadCall {
+  ThreadCall(const F* f, unsigned t) : f_(f), t_(t) {}
+  void operator()() const { (*f_)(t_); }
+  const F* f_;
+  unsigned t_;
+};
+
+template <class F>
+struct NextIndex {
+  NextIndex(const F* f, int begin, int end) : f_(f), next_(begin), end_(end) {}
+  void operator()(unsigned t) const {
+    for (int i = next_++; i < end_; i = next_++)
+      (*f_)(i, t);
+  }
+  const F* f_;
+  mutable boost::atomic<int> next_;
+  const int end_;
+};
+
+}  // namespace parallel_for_detail
+
+template <class F>
+void RunThreads(unsigned n, const F& f) {
+  boost::thread_group threads;
+  for (unsigned t = 1; t < n; ++t)
+    threads.create_thread(parallel_for_detail::ThreadCall<F>(&f, t));
+  f(0);
+  threads.join_all();
+}
+
+template <class F>
+void ParallelFor(unsigned n, int begin, int end, const F& f) {
+  RunThreads(n, parallel_for_detail::NextIndex<F>(&f, begin, end));
+}
+
+#endif
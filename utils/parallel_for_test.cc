@@ -0,0 +1,49 @@
+#include "parallel_for.h"
+
+#include <vector>
+#include <gtest/gtest.h>
+
+using namespace std;
+
+// records which thread made each call
+struct RecordThread {
+  explicit RecordThread(vector<int>* c) : calls(c) {}
+  void operator()(unsigned t) const { ++(*calls)[t]; }
+  void operator()(int i, unsigned t) const { (*calls)[i] = t; }
+  vector<int>* calls;
+};
+
+TEST(ParallelForTest, RunThreads) {
+  for (unsigned n = 1; n <= 4; ++n) {
+    vector<int> calls(n);
+    RunThreads(n, RecordThread(&calls));
+    for (unsigned t = 0; t < n; ++t)
+      EXPECT_EQ(1, calls[t]);
+  }
+}
+
+TEST(ParallelForTest, EveryIndexOnce) {
+  for (unsigned n = 1; n <= 4; ++n) {
+    vector<int> threads(1000, -1);
+    ParallelFor(n, 10, 990, RecordThread(&threads));
+    for (int i = 0; i < 1000; ++i) {
+      if (i < 10 || i >= 990) {
+        EXPECT_EQ(-1, threads[i]);
+      } else {
+        EXPECT_LE(0, threads[i]);
+        EXPECT_GT(n, threads[i]);
+      }
+    }
+  }
+}
+
+TEST(ParallelForTest, EmptyRange) {
+  vector<int> threads(1, -1);
+  ParallelFor(3, 5, 5, RecordThread(&threads));
+  EXPECT_EQ(-1, threads[0]);
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
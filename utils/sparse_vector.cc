@@ -21,7 +21,7 @@ void Encode(double objective, const SparseVector<double>& v, ostream* out) {
   tot_size += sizeof(unsigned char) * num_feats; // lengths of feature names;
   typedef SparseVector<double>::const_iterator const_iterator;
   for (const_iterator it = v.begin(); it != v.end(); ++it)
-    tot_size += FD::Convert(it->first).size();   // feature names;
+    tot_size += strlen(FD::Convert(it->first));  // feature names;
   tot_size += sizeof(double) * num_feats;        // gradient
   const size_t off_magic = tot_size;
   tot_size += 4;                                 // magic
@@ -34,10 +34,11 @@ void Encode(double objective, const SparseVector<double>& v, ostream* out) {
   char* cur = &data[off_data];
   assert(cur - data == off_data);
   for (const_iterator it = v.begin(); it != v.end(); ++it) {
-    const string& fname = FD::Convert(it->first);
-    *cur++ = static_cast<char>(fname.size());   // name len
-    memcpy(cur, &fname[0], fname.size());
-    cur += fname.size();
+    const char* fname = FD::Convert(it->first);
+    const size_t len = strlen(fname);
+    *cur++ = static_cast<char>(len);             // name len
+    memcpy(cur, fname, len);
+    cur += len;
     *reinterpret_cast<double*>(cur) = it->second;
     cur += sizeof(double);
   }
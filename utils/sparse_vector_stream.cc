@@ -0,0 +1,146 @@
+#include "sparse_vector_stream.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "fdict.h"
+#include "varint.h"
+
+using namespace std;
+
+namespace {
+
+const char kMAGIC[] = "CDECSVS1";
+const size_t kMAGIC_SIZE = 8;
+const size_t kNAMES = 0;
+const size_t kVECTOR = 1;
+
+}
+
+SparseVectorWriter::SparseVectorWriter(ostream* out) : out_(out), bytes_(), num_local_() {
+  WriteBytes(kMAGIC, kMAGIC_SIZE);
+}
+
+void SparseVectorWriter::WriteVarint(size_t x) {
+  bytes_ += ::WriteVarint(x, out_);
+}
+
+void SparseVectorWriter::WriteBytes(const void* p, size_t n) {
+  out_->write(static_cast<const char*>(p), n);
+  bytes_ += n;
+}
+
+void SparseVectorWriter::Write(const string& key, double objective, const SparseVector<double>& v) {
+  // number the new features and write their names first
+  int first_new = num_local_;
+  buf_.clear();
+  for (SparseVector<double>::const_iterator it = v.begin(); it != v.end(); ++it) {
+    if (it->first >= local_.size()) local_.resize(it->first + 1, -1);
+    int& l = local_[it->first];
+    if (l < 0) l = num_local_++;
+    buf_.push_back(make_pair(l, it->second));
+  }
+  if (num_local_ > first_new) {
+    vector<int> fids(num_local_ - first_new);
+    for (SparseVector<double>::const_iterator it = v.begin(); it != v.end(); ++it)
+      if (local_[it->first] >= first_new) fids[local_[it->first] - first_new] = it->first;
+    WriteVarint(kNAMES);
+    WriteVarint(fids.size());
+    for (int i = 0; i < fids.size(); ++i) {
+      const char* name = FD::Convert(fids[i]);
+      const size_t len = strlen(name);
+      WriteVarint(len);
+      WriteBytes(name, len);
+    }
+  }
+  sort(buf_.begin(), buf_.end());
+  WriteVarint(kVECTOR);
+  WriteVarint(key.size());
+  WriteBytes(key.data(), key.size());
+  WriteBytes(&objective, sizeof(objective));
+  WriteVarint(buf_.size());
+  int prev = 0;
+  for (int i = 0; i < buf_.size(); ++i) {
+    WriteVarint(buf_[i].first - prev);
+    prev = buf_[i].first;
+  }
+  for (int i = 0; i < buf_.size(); ++i)
+    WriteBytes(&buf_[i].second, sizeof(double));
+}
+
+SparseVectorReader::SparseVectorReader(istream* in) : in_(in) {
+  char magic[kMAGIC_SIZE];
+  if (!in_->read(magic, kMAGIC_SIZE) || memcmp(magic, kMAGIC, kMAGIC_SIZE) != 0) {
+    cerr << "Input is not a binary sparse vector stream\n";
+    abort();
+  }
+}
+
+bool SparseVectorReader::ReadVarint(size_t* x) {
+  const int r = ::ReadVarint(in_, x);
+  if (r < 0) {
+    cerr << "Malformed binary sparse vector stream\n";
+    abort();
+  }
+  return r > 0;
+}
+
+void SparseVectorReader::ReadBytes(void* p, size_t n) {
+  if (!in_->read(static_cast<char*>(p), n)) {
+    cerr << "Truncated binary sparse vector stream\n";
+    abort();
+  }
+}
+
+void SparseVectorReader::ReadRequiredVarint(size_t* x) {
+  if (!ReadVarint(x)) {
+    cerr << "Truncated binary sparse vector stream\n";
+    abort();
+  }
+}
+
+bool SparseVectorReader::Read(string* key, double* objective, SparseVector<double>* v) {
+  size_t tag;
+  while (true) {
+    if (!ReadVarint(&tag)) return false;
+    if (tag != kNAMES) break;
+    size_t n, len;
+    string name;
+    ReadRequiredVarint(&n);
+    for (size_t i = 0; i < n; ++i) {
+      ReadRequiredVarint(&len);
+      name.resize(len);
+      if (len) ReadBytes(&name[0], len);
+      fids_.push_back(FD::Convert(name));
+    }
+  }
+  if (tag != kVECTOR) {
+    cerr << "Unknown block in binary sparse vector stream: " << tag << endl;
+    abort();
+  }
+  size_t len, n;
+  ReadRequiredVarint(&len);
+  key->resize(len);
+  if (len) ReadBytes(&(*key)[0], len);
+  ReadBytes(objective, sizeof(double));
+  ReadRequiredVarint(&n);
+  ids_.resize(n);
+  size_t id = 0, delta;
+  for (size_t i = 0; i < n; ++i) {
+    ReadRequiredVarint(&delta);
+    id += delta;
+    if (id >= fids_.size()) {
+      cerr << "Undefined feature " << id << " in binary sparse vector stream\n";
+      abort();
+    }
+    ids_[i] = fids_[id];
+  }
+  values_.resize(n);
+  if (n) ReadBytes(&values_[0], n * sizeof(double));
+  v->clear();
+  for (size_t i = 0; i < n; ++i)
+    v->set_value(ids_[i], values_[i]);
+  return true;
+}
@@ -0,0 +1,62 @@
+#ifndef _SPARSE_VECTOR_STREAM_H_
+#define _SPARSE_VECTOR_STREAM_H_
+
+// A compact binary encoding of a stream of keyed sparse vectors (and
+// objectives) for the map-reduce tools, replacing one B64::Encode string
+// per line.  Feature names are written once per stream, the first time a
+// feature occurs, and records refer to them by their number in the stream.
+// Readers convert each name with FD once instead of once per record.
+//
+//   stream     := "CDECSVS1" block*
+//   block      := varint(0) varint(#names) (varint(len) bytes)*
+//                   adds names with the next stream feature numbers
+//              |  varint(1) varint(len) key-bytes double(objective)
+//                 varint(#values) varint(delta)* double(value)*
+//                   one vector; the feature numbers are sorted and each
+//                   is stored as the difference to the previous one
+// Varints are those of varint.h; doubles are in native byte order.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <utility>
+
+#include "sparse_vector.h"
+
+class SparseVectorWriter {
+ public:
+  explicit SparseVectorWriter(std::ostream* out);
+  void Write(const std::string& key, double objective, const SparseVector<double>& v);
+  // number of bytes written so far
+  size_t BytesWritten() const { return bytes_; }
+
+ private:
+  void WriteVarint(size_t x);
+  void WriteBytes(const void* p, size_t n);
+
+  std::ostream* out_;
+  size_t bytes_;
+  std::vector<int> local_;  // FD id -> stream feature number, -1 if unseen
+  int num_local_;
+  std::vector<std::pair<int, double> > buf_;
+};
+
+class SparseVectorReader {
+ public:
+  explicit SparseVectorReader(std::istream* in);
+  // returns false at the end of the stream; aborts on a malformed stream
+  bool Read(std::string* key, double* objective, SparseVector<double>* v);
+
+ private:
+  // false at the end of the stream
+  bool ReadVarint(size_t* x);
+  void ReadRequiredVarint(size_t* x);
+  void ReadBytes(void* p, size_t n);
+
+  std::istream* in_;
+  std::vector<int> fids_;  // stream feature number -> FD id
+  std::vector<int> ids_;
+  std::vector<double> values_;
+};
+
+#endif
@@ -0,0 +1,81 @@
+#include <cfloat>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include "sparse_vector_stream.h"
+#include "fdict.h"
+
+using namespace std;
+
+class SparseVectorStreamTest : public testing::Test {
+ protected:
+  static void ExpectEqual(const SparseVector<double>& expected, const SparseVector<double>& v) {
+    EXPECT_EQ(expected.size(), v.size());
+    for (SparseVector<double>::const_iterator it = expected.begin(); it != expected.end(); ++it)
+      EXPECT_EQ(it->second, v.value(it->first)) << FD::Convert(it->first);
+  }
+};
+
+TEST_F(SparseVectorStreamTest, RoundTrip) {
+  vector<string> keys;
+  vector<double> objectives;
+  vector<SparseVector<double> > vs(4);
+  keys.push_back("0");
+  objectives.push_back(-12.5);
+  vs[0].set_value(FD::Convert("SVS_Negative"), -3.25);
+  vs[0].set_value(FD::Convert("SVS_Zero"), 0.0);
+  vs[0].set_value(FD::Convert("SVS_Huge"), DBL_MAX);
+  // repeats the names of the first record and adds new ones
+  keys.push_back("a longer key");
+  objectives.push_back(1e300);
+  vs[1].set_value(FD::Convert("SVS_Huge"), -DBL_MAX);
+  vs[1].set_value(FD::Convert("SVS_Tiny"), DBL_MIN);
+  vs[1].set_value(FD::Convert("SVS_Negative"), -1e-300);
+  vs[1].set_value(FD::Convert("SVS_New"), 42);
+  // an empty record and an empty key
+  keys.push_back("");
+  objectives.push_back(0);
+  // only names that were written before
+  keys.push_back("3");
+  objectives.push_back(-0.0);
+  vs[3].set_value(FD::Convert("SVS_New"), 7);
+  vs[3].set_value(FD::Convert("SVS_Zero"), 1);
+
+  ostringstream out;
+  SparseVectorWriter writer(&out);
+  for (int i = 0; i < vs.size(); ++i)
+    writer.Write(keys[i], objectives[i], vs[i]);
+  EXPECT_EQ(out.str().size(), writer.BytesWritten());
+
+  istringstream in(out.str());
+  SparseVectorReader reader(&in);
+  string key;
+  double objective;
+  SparseVector<double> v;
+  for (int i = 0; i < vs.size(); ++i) {
+    ASSERT_TRUE(reader.Read(&key, &objective, &v));
+    EXPECT_EQ(keys[i], key);
+    EXPECT_EQ(objectives[i], objective);
+    ExpectEqual(vs[i], v);
+  }
+  EXPECT_FALSE(reader.Read(&key, &objective, &v));
+}
+
+TEST_F(SparseVectorStreamTest, NamesWrittenOnce) {
+  SparseVector<double> v;
+  v.set_value(FD::Convert("SVS_a_rather_long_feature_name_that_should_be_written_once"), 1);
+  ostringstream out;
+  SparseVectorWriter writer(&out);
+  writer.Write("k", 0, v);
+  const size_t first = writer.BytesWritten();
+  writer.Write("k", 0, v);
+  // the second record only refers to the name by its number: tag, key
+  // length, key, objective, #values, feature number and value
+  EXPECT_EQ(1 + 1 + 1 + sizeof(double) + 1 + 1 + sizeof(double), writer.BytesWritten() - first);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -22,7 +22,19 @@ WordID TD::Convert(char const* s) {
 }
 
 const char* TD::Convert(WordID w) {
-  return dict_.Convert(w).c_str();
+  return dict_.CString(w);
+}
+
+unsigned int TD::NumWords() {
+  return dict_.max();
+}
+
+void TD::LoadSnapshot(const std::string& file) {
+  dict_.LoadSnapshot(file);
+}
+
+void TD::WriteSnapshot(const std::string& file) {
+  dict_.WriteSnapshot(file);
 }
 
 void TD::GetWordIDs(const std::vector<std::string>& strings, std::vector<WordID>* ids) {
@@ -19,6 +19,9 @@ struct TD {
   static WordID Convert(const std::string& s);
   static WordID Convert(char const* s);
   static const char* Convert(WordID w);
+  // see Dict::LoadSnapshot
+  static void LoadSnapshot(const std::string& file);
+  static void WriteSnapshot(const std::string& file);
  private:
   static Dict dict_;
 };
@@ -0,0 +1,35 @@
+#ifndef _TEMP_FILE_TEST_H_
+#define _TEMP_FILE_TEST_H_
+
+// A gtest fixture for tests that write files: every test gets a new
+// temporary file, file_, and the files file_ + suffix for each suffix in
+// suffixes_, are removed with it when the test ends.  Fixtures that
+// override SetUp call TempFileTest::SetUp first.
+
+#include <gtest/gtest.h>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+class TempFileTest : public testing::Test {
+ protected:
+  virtual void SetUp() {
+    char file[] = "/tmp/cdec_test.XXXXXX";
+    const int fd = mkstemp(file);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    file_ = file;
+  }
+  virtual void TearDown() {
+    if (file_.empty()) return;
+    unlink(file_.c_str());
+    for (int i = 0; i < suffixes_.size(); ++i)
+      unlink((file_ + suffixes_[i]).c_str());
+  }
+
+  std::string file_;
+  std::vector<std::string> suffixes_;
+};
+
+#endif
@@ -2,6 +2,7 @@
 
 #include <iostream>
 #include "time.h" //cygwin needs
+#include <boost/thread/mutex.hpp>
 
 #include "verbose.h"
 
@@ -9,21 +10,32 @@ using namespace std;
 
 map<string, TimerInfo> Timer::stats;
 
-Timer::Timer(const string& timername) : start_t(clock()), cur(stats[timername]) {}
+namespace {
+// timers may run on several decoding threads
+boost::mutex stats_mutex;
+}
+
+TimerInfo& Timer::Info(const string& timername) {
+  boost::mutex::scoped_lock lock(stats_mutex);
+  return stats[timername];
+}
+
+Timer::Timer(const string& timername) : start_t(clock()), cur(Info(timername)) {}
 
 Timer::~Timer() {
-  ++cur.calls;
   const clock_t end_t = clock();
   const double elapsed = (end_t - start_t) / 1000000.0;
+  boost::mutex::scoped_lock lock(stats_mutex);
+  ++cur.calls;
   cur.total_time += elapsed;
 }
 
+// entries are reset rather than erased, since running timers refer to them
 void Timer::Summarize() {
-  if (!SILENT) {
-    for (map<string, TimerInfo>::iterator it = stats.begin(); it != stats.end(); ++it) {
+  boost::mutex::scoped_lock lock(stats_mutex);
+  for (map<string, TimerInfo>::iterator it = stats.begin(); it != stats.end(); ++it) {
+    if (!SILENT && it->second.calls)
       cerr << it->first << ": " << it->second.total_time << " secs (" << it->second.calls << " calls)\n";
-    }
+    it->second = TimerInfo();
   }
-  stats.clear();
 }
-
@@ -15,6 +15,7 @@ struct Timer {
   ~Timer();
   static void Summarize();
  private:
+  static TimerInfo& Info(const std::string& info);
   static std::map<std::string, TimerInfo> stats;
   clock_t start_t;
   TimerInfo& cur;
@@ -0,0 +1,37 @@
+#ifndef _VARINT_H_
+#define _VARINT_H_
+
+// Variable length unsigned integers for the binary streams of the training
+// and extraction tools: 7 bits per byte, least significant first, with the
+// high bit set on every byte but the last.
+
+#include <cstdio>
+#include <iostream>
+
+// writes x to out and returns the number of bytes written
+inline size_t WriteVarint(size_t x, std::ostream* out) {
+  char buf[10];
+  int n = 0;
+  while (x >= 0x80) {
+    buf[n++] = static_cast<char>((x & 0x7f) | 0x80);
+    x >>= 7;
+  }
+  buf[n++] = static_cast<char>(x);
+  out->write(buf, n);
+  return n;
+}
+
+// reads a varint into x; returns 1 if one was read, 0 if in was at its end,
+// and -1 if the varint is truncated or longer than 64 bits
+inline int ReadVarint(std::istream* in, size_t* x) {
+  *x = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    const int c = in->get();
+    if (c == EOF) return shift == 0 ? 0 : -1;
+    *x |= static_cast<size_t>(c & 0x7f) << shift;
+    if (!(c & 0x80)) return 1;
+  }
+  return -1;
+}
+
+#endif
@@ -2,24 +2,121 @@
 
 #include <vector>
 #include <sstream>
+#include <algorithm>
 #include <boost/shared_ptr.hpp>
 
 #include "aligner.h"
 #include "lattice.h"
 #include "viterbi_envelope.h"
 #include "error_surface.h"
+#include "hyp_pool.h"
 
 using boost::shared_ptr;
 using namespace std;
 
 const bool minimize_segments = true;    // if adjacent segments have equal scores, merge them
 
-void ComputeErrorSurface(const SentenceScorer& ss, const ViterbiEnvelope& ve, ErrorSurface* env, const ScoreType type, const Hypergraph& hg) {
+namespace {
+// turns a left-to-right sequence of envelope segments (and the translations
+// that are optimal on them) into an error surface
+struct ErrorSurfaceBuilder {
+  ErrorSurfaceBuilder(const SentenceScorer& s, size_t max_segments, ErrorSurface* e) :
+      ss(s), env(*e), j() {
+    env.resize(max_segments);
+  }
+
+  // score may be NULL, in which case trans is scored with ss
+  void Add(double x, vector<WordID>* trans, ScoreP score) {
+    // cerr << "Scoring: " << TD::GetString(*trans) << endl;
+    if (*trans == prev_trans) {
+      if (!minimize_segments) {
+        assert(prev_score); // if this fails, it means
+	                    // the decoder can generate null translations
+        ErrorSegment& out = env[j];
+        out.delta = prev_score->GetZero();
+        out.x = x;
+	++j;
+      }
+      // cerr << "Identical translation, skipping scoring\n";
+    } else {
+      if (!score) score = ss.ScoreCandidate(*trans);
+      // cerr << "score= " << score->ComputeScore() << "\n";
+      ScoreP cur_delta_p = score->GetZero();
+      Score* cur_delta = cur_delta_p.get();
+      // just record the score diffs
+      if (!prev_score)
+        prev_score = score->GetZero();
+
+      score->Subtract(*prev_score, cur_delta);
+      prev_trans.swap(*trans);
+      prev_score = score;
+      if ((!minimize_segments) || (!cur_delta->IsAdditiveIdentity())) {
+        ErrorSegment& out = env[j];
+        out.delta = cur_delta_p;
+        out.x = x;
+        ++j;
+      }
+    }
+  }
+
+  void Finish() {
+    // cerr << " Out segments: " << j << endl;
+    assert(j > 0);
+    env.resize(j);
+  }
+
+  const SentenceScorer& ss;
+  ErrorSurface& env;
+  int j;
   vector<WordID> prev_trans;
-  const vector<shared_ptr<Segment> >& ienv = ve.GetSortedSegs();
-  env->resize(ienv.size());
   ScoreP prev_score;
+};
+
+// a hypothesis' score along the search direction, m * x + b
+struct HypLine {
+  HypLine(double _m, double _b, int h) : x(kMinusInfinity), m(_m), b(_b), hyp(h) {}
+  double x;  // left end of the interval where this line is on the envelope
+  double m;
+  double b;
+  int hyp;   // >= 0: pool index, < 0: segment -hyp-1 of the forest's envelope
+};
+
+struct HypLineSlopeCompare {
+  bool operator()(const HypLine& a, const HypLine& b) const {
+    return a.m < b.m;
+  }
+};
+
+// upper envelope of a set of lines (cf. ViterbiEnvelope::Sort)
+void UpperEnvelope(vector<HypLine>* plines) {
+  vector<HypLine>& lines = *plines;
+  sort(lines.begin(), lines.end(), HypLineSlopeCompare());
+  const int k = lines.size();
   int j = 0;
+  for (int i = 0; i < k; ++i) {
+    HypLine l = lines[i];
+    l.x = kMinusInfinity;
+    if (0 < j) {
+      if (lines[j-1].m == l.m) {   // lines are parallel
+        if (l.b <= lines[j-1].b) continue;
+        --j;
+      }
+      while(0 < j) {
+        l.x = (l.b - lines[j-1].b) / (lines[j-1].m - l.m);
+        if (lines[j-1].x < l.x) break;
+        --j;
+      }
+      if (0 == j) l.x = kMinusInfinity;
+    }
+    lines[j++] = l;
+  }
+  lines.erase(lines.begin() + j, lines.end());
+}
+}
+
+void ComputeErrorSurface(const SentenceScorer& ss, const ViterbiEnvelope& ve, ErrorSurface* env, const ScoreType type, const Hypergraph& hg) {
+  const vector<shared_ptr<Segment> >& ienv = ve.GetSortedSegs();
+  ErrorSurfaceBuilder builder(ss, ienv.size(), env);
   for (int i = 0; i < ienv.size(); ++i) {
     const Segment& seg = *ienv[i];
     vector<WordID> trans;
@@ -48,40 +145,42 @@ void ComputeErrorSurface(const SentenceScorer& ss, const ViterbiEnvelope& ve, Er
     } else {
       seg.ConstructTranslation(&trans);
     }
-    // cerr << "Scoring: " << TD::GetString(trans) << endl;
-    if (trans == prev_trans) {
-      if (!minimize_segments) {
-        assert(prev_score); // if this fails, it means
-	                    // the decoder can generate null translations
-        ErrorSegment& out = (*env)[j];
-        out.delta = prev_score->GetZero();
-        out.x = seg.x;
-	++j;
-      }
-      // cerr << "Identical translation, skipping scoring\n";
-    } else {
-      ScoreP score = ss.ScoreCandidate(trans);
-      // cerr << "score= " << score->ComputeScore() << "\n";
-      ScoreP cur_delta_p = score->GetZero();
-      Score* cur_delta = cur_delta_p.get();
-      // just record the score diffs
-      if (!prev_score)
-        prev_score = score->GetZero();
-
-      score->Subtract(*prev_score, cur_delta);
-      prev_trans.swap(trans);
-      prev_score = score;
-      if ((!minimize_segments) || (!cur_delta->IsAdditiveIdentity())) {
-        ErrorSegment& out = (*env)[j];
-        out.delta = cur_delta_p;
-        out.x = seg.x;
-        ++j;
-      }
-    }
+    builder.Add(seg.x, &trans, ScoreP());
   }
   // cerr << " In segments: " << ienv.size() << endl;
-  // cerr << "Out segments: " << j << endl;
-  assert(j > 0);
-  env->resize(j);
+  builder.Finish();
 }
 
+void ComputeErrorSurface(const SentenceScorer& ss,
+                         const ViterbiEnvelope& ve,
+                         const HypothesisPool& pool,
+                         const SparseVector<double>& origin,
+                         const SparseVector<double>& direction,
+                         ErrorSurface* env) {
+  // every segment of the forest's envelope is a derivation whose score is
+  // linear along the whole search direction, so it can compete with the
+  // pooled hypotheses on the full real line
+  const vector<shared_ptr<Segment> >& ienv = ve.GetSortedSegs();
+  vector<HypLine> lines;
+  lines.reserve(ienv.size() + pool.size());
+  for (int i = 0; i < ienv.size(); ++i)
+    lines.push_back(HypLine(ienv[i]->m, ienv[i]->b, -i - 1));
+  for (int i = 0; i < pool.size(); ++i)
+    lines.push_back(HypLine(pool[i].features.dot(direction),
+                            pool[i].features.dot(origin), i));
+  UpperEnvelope(&lines);
+  ErrorSurfaceBuilder builder(ss, lines.size(), env);
+  for (int i = 0; i < lines.size(); ++i) {
+    const HypLine& l = lines[i];
+    vector<WordID> trans;
+    ScoreP score;
+    if (l.hyp < 0) {
+      ienv[-l.hyp - 1]->ConstructTranslation(&trans);
+    } else {
+      trans = pool[l.hyp].words;
+      score = pool[l.hyp].stats;
+    }
+    builder.Add(l.x, &trans, score);
+  }
+  builder.Finish();
+}
@@ -2,11 +2,24 @@
 #define _CES_H_
 
 #include "scorer.h"
+#include "sparse_vector.h"
 
 class ViterbiEnvelope;
 class Hypergraph;
 class ErrorSurface;
+class HypothesisPool;
 
 void ComputeErrorSurface(const SentenceScorer& ss, const ViterbiEnvelope& ve, ErrorSurface* es, const ScoreType type, const Hypergraph& hg);
 
+// the hypotheses of ve (the Viterbi envelope of a forest along direction,
+// starting at origin) compete with the hypotheses in pool, typically the
+// k-best lists of earlier iterations.  Stored sufficient statistics are used
+// instead of rescoring pooled hypotheses.  Not supported for AER.
+void ComputeErrorSurface(const SentenceScorer& ss,
+                         const ViterbiEnvelope& ve,
+                         const HypothesisPool& pool,
+                         const SparseVector<double>& origin,
+                         const SparseVector<double>& direction,
+                         ErrorSurface* es);
+
 #endif
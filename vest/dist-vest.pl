@@ -71,6 +71,7 @@ my $density_prune;
 my $usefork;
 my $pass_suffix = '';
 my $cpbin=1;
+my $pool_kbest=0;
 # Process command-line options
 Getopt::Long::Configure("no_auto_abbrev");
 if (GetOptions(
@@ -101,6 +102,7 @@ if (GetOptions(
         "n-oracle=i" => \$oraclen,
         "oracle-batch=i" => \$oracleb,
         "directions-args=s" => \$dirargs,
+        "pool-kbest=i" => \$pool_kbest,
 	"ref-files=s" => \$refFiles,
 	"metric=s" => \$metric,
 	"source-file=s" => \$srcFile,
@@ -211,6 +213,7 @@ if ($dryrun){
 	} else {
 		-e $dir || mkdir $dir;
 		mkdir "$dir/hgs";
+		mkdir "$dir/pool" if $pool_kbest;
         modbin("$dir/bin",\$LocalConfig,\$cdec,\$SCORER,\$MAPINPUT,\$MAPPER,\$REDUCER,\$parallelize,\$sentserver,\$sentclient,\$libcall) if $cpbin;
     mkdir "$dir/scripts";
         my $cmdfile="$dir/rerun-vest.sh";
@@ -336,7 +339,19 @@ while (1){
 		print STDERR "COMMAND:\n$cmd\n";
 		check_call($cmd);
 		check_call("mkdir -p $dir/splag.$im1");
-		$cmd="split -a 5 -l $lines_per_mapper $dir/agenda.$im1-$opt_iter $dir/splag.$im1/mapinput.";
+		if ($pool_kbest) {
+			# a pool has a single writer, so all the lines of a sentence go to
+			# the same mapper
+			my $agenda_lines = 0;
+			open F, "<$dir/agenda.$im1-$opt_iter" or die "Can't read agenda: $!";
+			while(<F>) { $agenda_lines++; }
+			close F;
+			my $sents_per_mapper = int($lines_per_mapper * $devSize / ($agenda_lines || 1));
+			$sents_per_mapper = 1 if $sents_per_mapper < 1;
+			$cmd="awk -v s=$sents_per_mapper -v p=$dir/splag.$im1/mapinput. '{ f = sprintf(\"%s%05d\", p, int(\$2 / s)); print > f }' $dir/agenda.$im1-$opt_iter";
+		} else {
+			$cmd="split -a 5 -l $lines_per_mapper $dir/agenda.$im1-$opt_iter $dir/splag.$im1/mapinput.";
+		}
 		print STDERR "COMMAND:\n$cmd\n";
 		check_call($cmd);
 		opendir(DIR, "$dir/splag.$im1") or die "Can't open directory: $!";
@@ -365,7 +380,8 @@ while (1){
 			$mapoutput =~ s/mapinput/mapoutput/;
 			push @mapoutputs, "$dir/splag.$im1/$mapoutput";
 			$o2i{"$dir/splag.$im1/$mapoutput"} = "$dir/splag.$im1/$shard";
-			my $script = "$MAPPER -s $srcFile -l $metric $refs_comma_sep < $dir/splag.$im1/$shard | sort -t \$'\\t' -k 1 > $dir/splag.$im1/$mapoutput";
+			my $poolargs = $pool_kbest ? "-P $dir/pool -k $pool_kbest" : "";
+			my $script = "$MAPPER -s $srcFile -l $metric $poolargs $refs_comma_sep < $dir/splag.$im1/$shard | sort -t \$'\\t' -k 1 > $dir/splag.$im1/$mapoutput";
 			if ($run_local) {
 				print STDERR "COMMAND:\n$script\n";
 				check_bash_call($script);
@@ -661,6 +677,13 @@ Options:
 		If the decoder is doing multi-pass decoding, the pass suffix "2",
 		"3", etc., is used to control what iteration of weights is set.
 
+	--pool-kbest <K>
+		Keep a pool of hypotheses for each dev sentence in the working
+		directory and add the K best translations of each forest to it, so
+		that the line searches also see the translations of earlier
+		iterations.  Each sentence is mapped by a single mapper.
+		[default=0, no pools]
+
 	--pmem <N>
 		Amount of physical memory requested for parallel decoding jobs.
 
@@ -7,6 +7,7 @@
 #include <boost/program_options/variables_map.hpp>
 
 #include "sampler.h"
+#include "dict_snapshot.h"
 #include "filelib.h"
 #include "weights.h"
 #include "line_optimizer.h"
@@ -111,6 +112,7 @@ struct oracle_directions {
       ("no_old_to_hope","don't emit the usual old -> hope oracle")
       ("decoder_translations",po::value<string>(&decoder_translations_file)->default_value(""),"one per line decoder 1best translations for computing document BLEU vs. sentences-seen-so-far BLEU")
       ;
+    AddDictionarySnapshotOption(opts);
   }
   void InitCommandLine(int argc, char *argv[], po::variables_map *conf) {
     po::options_description opts("Configuration options");
@@ -151,6 +153,7 @@ struct oracle_directions {
   int main(int argc, char *argv[]) {
     po::variables_map conf;
     InitCommandLine(argc,argv,&conf);
+    LoadDictionarySnapshots(conf);
     init_bleumodel();
     UseConf(conf);
     Run();
@@ -2,11 +2,15 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <set>
+#include <utility>
 
+#include <boost/scoped_ptr.hpp>
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
 
 #include "ces.h"
+#include "dict_snapshot.h"
 #include "filelib.h"
 #include "stringlib.h"
 #include "sparse_vector.h"
@@ -17,6 +21,8 @@
 #include "error_surface.h"
 #include "b64tools.h"
 #include "hg_io.h"
+#include "kbest.h"
+#include "hyp_pool.h"
 
 using namespace std;
 namespace po = boost::program_options;
@@ -28,7 +34,10 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
         ("source,s",po::value<string>(), "Source file (ignored, except for AER)")
         ("loss_function,l",po::value<string>()->default_value("ibm_bleu"), "Loss function being optimized")
         ("input,i",po::value<string>()->default_value("-"), "Input file to map (- is STDIN)")
+        ("hypothesis_pool,P",po::value<string>(), "Directory of binary hypothesis pools (pool.<sent_id>, as written by mr_pro_map -B) whose hypotheses compete with those in the forests")
+        ("kbest_size,k",po::value<unsigned>()->default_value(0u), "Append the k best translations of each forest (under the starting point weights) to its sentence's pool. A pool has a single writer, so all lines of a sentence must be mapped by the same process")
         ("help,h", "Help");
+  AddDictionarySnapshotOption(&opts);
   po::options_description dcmdline_options;
   dcmdline_options.add(opts);
   po::store(parse_command_line(argc, argv, dcmdline_options), *conf);
@@ -37,21 +46,51 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
     cerr << "Please specify one or more references using -r <REF.TXT>\n";
     flag = true;
   }
+  if (conf->count("hypothesis_pool") && ScoreTypeFromString((*conf)["loss_function"].as<string>()) == AER) {
+    cerr << "Hypothesis pools cannot be used with AER\n";
+    flag = true;
+  }
+  if ((*conf)["kbest_size"].as<unsigned>() > 0 && !conf->count("hypothesis_pool")) {
+    cerr << "--kbest_size requires --hypothesis_pool\n";
+    flag = true;
+  }
   if (flag || conf->count("help")) {
     cerr << dcmdline_options << endl;
     exit(1);
   }
 }
 
+// appends the k best translations of hg under weights that are not yet in
+// the pool, with their sufficient statistics
+void AppendKBest(const SparseVector<double>& weights, unsigned k, const SentenceScorer& ss,
+                 Hypergraph* hg, HypothesisPool* pool) {
+  hg->Reweight(weights);
+  KBest::KBestDerivations<vector<WordID>, ESentenceTraversal> kbest(*hg, k);
+  for (unsigned i = 0; i < k; ++i) {
+    const KBest::KBestDerivations<vector<WordID>, ESentenceTraversal>::Derivation* d =
+      kbest.LazyKthBest(hg->nodes_.size() - 1, i);
+    if (!d) break;
+    if (pool->Contains(d->yield, d->feature_values)) continue;
+    ScoreP stats = ss.ScoreCandidate(d->yield);
+    pool->Add(d->yield, d->feature_values, stats.get());
+  }
+}
+
 int main(int argc, char** argv) {
   po::variables_map conf;
   InitCommandLine(argc, argv, &conf);
+  LoadDictionarySnapshots(conf);
   const string loss_function = conf["loss_function"].as<string>();
   ScoreType type = ScoreTypeFromString(loss_function);
   DocScorer ds(type, conf["reference"].as<vector<string> >(), conf["source"].as<string>());
   cerr << "Loaded " << ds.size() << " references for scoring with " << loss_function << endl;
   Hypergraph hg;
   string last_file;
+  const string pool_dir = conf.count("hypothesis_pool") ? conf["hypothesis_pool"].as<string>() : "";
+  boost::scoped_ptr<HypothesisPool> pool;
+  int pool_sent_id = -1;
+  const unsigned kbest_size = conf["kbest_size"].as<unsigned>();
+  set<pair<int, string> > appended;  // sentences and starting points whose k-best is in the pool
   ReadFile in_read(conf["input"].as<string>());
   istream &in=*in_read.stream();
   while(in) {
@@ -76,7 +115,19 @@ int main(int argc, char** argv) {
     ViterbiEnvelopeWeightFunction wf(origin, axis);
     ViterbiEnvelope ve = Inside<ViterbiEnvelope, ViterbiEnvelopeWeightFunction>(hg, NULL, wf);
     ErrorSurface es;
-    ComputeErrorSurface(*ds[sent_id], ve, &es, type, hg);
+    if (pool_dir.size()) {
+      if (pool_sent_id != sent_id) {
+        pool_sent_id = sent_id;
+        ostringstream os;
+        os << pool_dir << "/pool." << sent_id;
+        pool.reset(new HypothesisPool(os.str(), type));
+      }
+      if (kbest_size && appended.insert(make_pair(sent_id, s_origin)).second)
+        AppendKBest(origin, kbest_size, *ds[sent_id], &hg, pool.get());
+      ComputeErrorSurface(*ds[sent_id], ve, *pool, origin, axis, &es);
+    } else {
+      ComputeErrorSurface(*ds[sent_id], ve, &es, type, hg);
+    }
     //cerr << "Viterbi envelope has " << ve.size() << " segments\n";
     // cerr << "Error surface has " << es.size() << " segments\n";
     string val;